@@ -0,0 +1,110 @@
+#!/usr/bin/env python3
+# Runs inpla once for a benchmark registered in meson.build,
+# and reports the wall time, interactions per second and peak RSS in JSON.
+#
+# usage: benchmark.py --name NAME --out-dir DIR [--heap-type T]
+#                     [--heap-alloc A] -- INPLA ARGS...
+#
+# The result is written into DIR/NAME.json (`/' in NAME is replaced by `_'),
+# and all results in DIR are merged into DIR/report.json.
+# Set INPLA_BENCH_REPEAT to take the best of several runs.
+
+import argparse
+import glob
+import json
+import os
+import platform
+import re
+import subprocess
+import sys
+import time
+
+INTERACTIONS = re.compile(r"\((\d+) interactions")
+
+
+def run_once(cmd):
+    start = time.perf_counter()
+    proc = subprocess.Popen(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    out = proc.stdout.read()
+    proc.stdout.close()
+    _, status, rusage = os.wait4(proc.pid, 0)
+    wall = time.perf_counter() - start
+    proc.returncode = os.waitstatus_to_exitcode(status)
+
+    out = out.decode(errors="replace")
+    m = INTERACTIONS.search(out)
+    # ru_maxrss is in kilobytes on Linux, but in bytes on macOS.
+    rss_kb = rusage.ru_maxrss
+    if sys.platform == "darwin":
+        rss_kb //= 1024
+    return proc.returncode, out, wall, int(m.group(1)) if m else None, rss_kb
+
+
+def merge_report(out_dir):
+    results = []
+    for fname in sorted(glob.glob(os.path.join(out_dir, "*.json"))):
+        if os.path.basename(fname) == "report.json":
+            continue
+        with open(fname) as fp:
+            results.append(json.load(fp))
+
+    tmp = os.path.join(out_dir, "report.json.%d" % os.getpid())
+    with open(tmp, "w") as fp:
+        json.dump({"benchmarks": results}, fp, indent=2)
+        fp.write("\n")
+    os.replace(tmp, os.path.join(out_dir, "report.json"))
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("--name", required=True)
+    ap.add_argument("--out-dir", required=True)
+    ap.add_argument("--heap-type", default="")
+    ap.add_argument("--heap-alloc", default="")
+    ap.add_argument("cmd", nargs=argparse.REMAINDER)
+    opts = ap.parse_args()
+
+    cmd = opts.cmd[1:] if opts.cmd[:1] == ["--"] else opts.cmd
+    if not cmd:
+        ap.error("no command to be benchmarked")
+
+    repeat = max(1, int(os.environ.get("INPLA_BENCH_REPEAT", "1")))
+    best = None
+    for _ in range(repeat):
+        rc, out, wall, interactions, rss_kb = run_once(cmd)
+        # Programs without `exit' finish with the exit code 255 at EOF,
+        # so a run succeeds when it puts the number of interactions.
+        if rc < 0 or interactions is None:
+            sys.stdout.write(out)
+            print("ERROR: `%s' failed (exit code %d)." % (" ".join(cmd), rc))
+            return 1
+        if best is None or wall < best[0]:
+            best = (wall, interactions, rss_kb)
+
+    wall, interactions, rss_kb = best
+    result = {
+        "name": opts.name,
+        "command": cmd,
+        "heap_type": opts.heap_type,
+        "heap_alloc": opts.heap_alloc,
+        "machine": platform.machine(),
+        "runs": repeat,
+        "wall_time_sec": round(wall, 6),
+        "interactions": interactions,
+        "interactions_per_sec": round(interactions / wall) if wall > 0 else None,
+        "peak_rss_kb": rss_kb,
+    }
+
+    os.makedirs(opts.out_dir, exist_ok=True)
+    fname = os.path.join(opts.out_dir, opts.name.replace("/", "_") + ".json")
+    with open(fname, "w") as fp:
+        json.dump(result, fp, indent=2)
+        fp.write("\n")
+    merge_report(opts.out_dir)
+
+    print(json.dumps(result))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,602 @@
+#include "aot.h"
+
+#include "cmenv.h"
+#include "id_table.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern void *CodeAddr[OP_NOP + 1];
+
+// FNV-1a hash of the arities, opcodes and operands of a rule.
+// Addresses in CodeAddr are not used because they differ between builds.
+unsigned long AOT_fingerprint(void **code, int n) {
+  unsigned long h = 14695981039346656037UL;
+
+#define AOT_HASH(w) h = (h ^ (unsigned long)(w)) * 1099511628211UL
+
+  AOT_HASH(code[0]);
+  AOT_HASH(code[1]);
+  for (int pc = 2; pc < n;) {
+    Code op = CmEnv_get_unfused_opcode(code[pc]);
+    int  size = CmEnv_get_VMCode_size(op);
+
+    AOT_HASH(op);
+    for (int i = 1; i < size && pc + i < n; i++) {
+      AOT_HASH(code[pc + i]);
+    }
+    pc += size;
+  }
+
+#undef AOT_HASH
+
+  return h;
+}
+
+// ------------------------------------------------------------
+// Translation into C
+// ------------------------------------------------------------
+
+static FILE *AOT_fp = NULL;
+static char *AOT_fname = NULL;
+
+// Rules written so far, for the table AOT_Rules.
+typedef struct {
+  int           idL, idR;
+  unsigned long fingerprint;
+} AOT_Entry;
+
+static AOT_Entry *AOT_entries = NULL;
+static int        AOT_entry_num = 0;
+static int        AOT_entry_size = 0;
+
+static void AOT_emit_close(void) {
+  fprintf(AOT_fp, "const AOT_Rule AOT_Rules[] = {\n");
+  for (int i = 0; i < AOT_entry_num; i++) {
+    fprintf(AOT_fp, "    {\"%s\", \"%s\", %luUL, aot_rule_%d},\n",
+            IdTable_get_name(AOT_entries[i].idL),
+            IdTable_get_name(AOT_entries[i].idR), AOT_entries[i].fingerprint,
+            i);
+  }
+  fprintf(AOT_fp, "    {NULL, NULL, 0, NULL},\n};\n");
+  fclose(AOT_fp);
+
+  printf("(%d rules are translated into `%s')\n", AOT_entry_num, AOT_fname);
+}
+
+// Opens `srcname' without `.in' and with `.c' for the output.
+int AOT_emit_open(char *srcname) {
+  size_t len = strlen(srcname);
+  if (len > 3 && !strcmp(srcname + len - 3, ".in")) {
+    len -= 3;
+  }
+
+  AOT_fname = malloc(len + 3);
+  if (AOT_fname == NULL) {
+    fprintf(stderr, "Error: AOT_emit_open() failed: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  snprintf(AOT_fname, len + 3, "%.*s.c", (int)len, srcname);
+
+  AOT_fp = fopen(AOT_fname, "w");
+  if (AOT_fp == NULL) {
+    printf("Error: The file `%s' cannot be opened.\n", AOT_fname);
+    return 0;
+  }
+
+  fprintf(AOT_fp,
+          "// Generated by `inpla --emit-c %s'.\n"
+          "// Build inpla with `-Daot_rules=<this file>' to execute the rules\n"
+          "// natively. The bytecodes of the rules are checked when defined,\n"
+          "// so changed rules are executed by the virtual machine.\n\n"
+          "#include \"aot.h\"\n"
+          "#include \"id_table.h\"\n"
+          "#include \"inpla.h\"\n\n",
+          srcname);
+
+  // The table of the rules is written when inpla exits.
+  atexit(AOT_emit_close);
+
+  return 1;
+}
+
+int AOT_is_emitting(void) { return AOT_fp != NULL; }
+
+// Returns 1 if all codes can be translated,
+// and marks jump targets in `is_label' and registers in `is_reg'.
+static int AOT_scan(void **code, int n, char *is_label, char *is_reg) {
+#define AOT_REG(k)                                                             \
+  do {                                                                         \
+    unsigned long r = (unsigned long)code[pc + (k)];                           \
+    if (r >= VM_REG_SIZE)                                                      \
+      return 0;                                                                \
+    is_reg[r] = 1;                                                             \
+  } while (0)
+#define AOT_LABEL(k)                                                           \
+  do {                                                                         \
+    long t = (pc + (k)) + (long)code[pc + (k)] + 1;                            \
+    if (t < 0 || t > n)                                                        \
+      return 0;                                                                \
+    is_label[t] = 1;                                                           \
+  } while (0)
+
+  for (int pc = 0; pc < n;) {
+    Code op = CmEnv_get_unfused_opcode(code[pc]);
+    int  size = CmEnv_get_VMCode_size(op);
+
+    if (pc + size > n) {
+      return 0;
+    }
+
+    switch (op) {
+    case OP_MKNAME:
+      AOT_REG(1);
+      break;
+
+    case OP_MKGNAME:
+    case OP_MKAGENT:
+    case OP_LOADI:
+      AOT_REG(2);
+      break;
+
+    case OP_PUSH:
+    case OP_MYPUSH:
+    case OP_LOAD:
+    case OP_LT_R0:
+    case OP_LE_R0:
+    case OP_EQ_R0:
+    case OP_NE_R0:
+      AOT_REG(1);
+      AOT_REG(2);
+      break;
+
+    case OP_PUSHI:
+    case OP_EQI_R0:
+      AOT_REG(1);
+      break;
+
+    case OP_LOADP_L:
+      AOT_REG(1);
+      is_reg[VM_OFFSET_ANNOTATE_L] = 1;
+      break;
+
+    case OP_LOADP_R:
+      AOT_REG(1);
+      is_reg[VM_OFFSET_ANNOTATE_R] = 1;
+      break;
+
+    case OP_LOOP_RREC:
+    case OP_LOOP_RREC1:
+    case OP_LOOP_RREC2:
+    case OP_LOOP_RREC_FREE_R:
+    case OP_LOOP_RREC1_FREE_R:
+    case OP_LOOP_RREC2_FREE_R: {
+      unsigned long arity = (op == OP_LOOP_RREC || op == OP_LOOP_RREC_FREE_R)
+                                ? (unsigned long)code[pc + 2]
+                            : (op == OP_LOOP_RREC1 || op == OP_LOOP_RREC1_FREE_R)
+                                ? 1
+                                : 2;
+      if (arity > MAX_PORT) {
+        return 0;
+      }
+      AOT_REG(1);
+      for (unsigned long i = 0; i < arity; i++) {
+        is_reg[VM_OFFSET_METAVAR_R(i)] = 1;
+      }
+      is_reg[VM_OFFSET_ANNOTATE_R] = 1;
+      is_label[0] = 1;
+      break;
+    }
+
+    case OP_LOADP:
+    case OP_ADDI:
+    case OP_SUBI:
+    case OP_EQI:
+      AOT_REG(1);
+      AOT_REG(3);
+      break;
+
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_MOD:
+    case OP_LT:
+    case OP_LE:
+    case OP_EQ:
+    case OP_NE:
+      AOT_REG(1);
+      AOT_REG(2);
+      AOT_REG(3);
+      break;
+
+    case OP_UNM:
+    case OP_INC:
+    case OP_DEC:
+    case OP_RAND:
+      AOT_REG(1);
+      AOT_REG(size - 1);
+      break;
+
+    case OP_JMPEQ0:
+    case OP_JMPNEQ0:
+      AOT_REG(1);
+      AOT_LABEL(2);
+      break;
+
+    case OP_JMPCNCT_CONS:
+      AOT_REG(1);
+      AOT_LABEL(2);
+      is_label[pc + size] = 1;
+      break;
+
+    case OP_JMPCNCT:
+      AOT_REG(1);
+      AOT_LABEL(3);
+      is_label[pc + size] = 1;
+      break;
+
+    case OP_JMPEQ0_R0:
+    case OP_JMP:
+      AOT_LABEL(1);
+      break;
+
+    case OP_RET_FREE_LR:
+      is_reg[VM_OFFSET_ANNOTATE_L] = 1;
+      is_reg[VM_OFFSET_ANNOTATE_R] = 1;
+      break;
+
+    case OP_RET_FREE_L:
+    case OP_CHID_L:
+      is_reg[VM_OFFSET_ANNOTATE_L] = 1;
+      break;
+
+    case OP_RET_FREE_R:
+    case OP_CHID_R:
+      is_reg[VM_OFFSET_ANNOTATE_R] = 1;
+      break;
+
+    case OP_LOOP:
+      is_label[0] = 1;
+      break;
+
+    case OP_RET:
+    case OP_NOP:
+      break;
+
+    default:
+      // CNCTGN, SUBSTGN are only for nets.
+      return 0;
+    }
+
+    pc += size;
+  }
+
+  return 1;
+
+#undef AOT_REG
+#undef AOT_LABEL
+}
+
+void AOT_emit_rule(int idL, int idR, void **rule, int rule_n) {
+  // The first two words are the arities of the rule agents.
+  void **code = &rule[2];
+  int    n = rule_n - 2;
+
+  char is_label[n + 1];
+  char is_reg[VM_REG_SIZE];
+  memset(is_label, 0, sizeof(is_label));
+  memset(is_reg, 0, sizeof(is_reg));
+
+  if (!AOT_scan(code, n, is_label, is_reg)) {
+    fprintf(AOT_fp, "// %s >< %s is left to the virtual machine.\n\n",
+            IdTable_get_name(idL), IdTable_get_name(idR));
+    return;
+  }
+
+  FILE *fp = AOT_fp;
+  fprintf(fp, "// %s >< %s\n", IdTable_get_name(idL), IdTable_get_name(idR));
+  fprintf(fp,
+          "static void *aot_rule_%d(VirtualMachine *restrict vm, "
+          "VALUE *restrict reg) {\n",
+          AOT_entry_num);
+  fprintf(fp, "  (void)vm;\n");
+  fprintf(fp, "  long r0 = 0;\n");
+  fprintf(fp, "  (void)r0;\n");
+  for (int i = 1; i < VM_REG_SIZE; i++) {
+    if (is_reg[i]) {
+      fprintf(fp, "  VALUE r%d = reg[%d];\n", i, i);
+    }
+  }
+  fprintf(fp, "\n");
+
+#define R(k) (unsigned long)code[pc + (k)]
+#define V(k) (long)code[pc + (k)]
+#define T(k) (int)((pc + (k)) + (long)code[pc + (k)] + 1)
+
+  for (int pc = 0; pc < n;) {
+    Code op = CmEnv_get_unfused_opcode(code[pc]);
+    int  size = CmEnv_get_VMCode_size(op);
+
+    if (is_label[pc]) {
+      fprintf(fp, "L%d:;\n", pc);
+    }
+
+    switch (op) {
+    case OP_MKNAME:
+      fprintf(fp, "  r%lu = make_Name(vm);\n", R(1));
+      break;
+
+    case OP_MKGNAME:
+      fprintf(fp,
+              "  r%lu = IdTable_get_heap(%lu);\n"
+              "  if (r%lu == VALUE_NULL) {\n"
+              "    r%lu = make_Name(vm);\n"
+              "    BASIC(r%lu)->id = %lu;\n"
+              "    IdTable_set_heap(%lu, r%lu);\n"
+              "  }\n",
+              R(2), R(1), R(2), R(2), R(2), R(1), R(1), R(2));
+      break;
+
+    case OP_MKAGENT:
+      fprintf(fp, "  r%lu = make_Agent(vm, %lu);\n", R(2), R(1));
+      break;
+
+    case OP_PUSH:
+      fprintf(fp, "  { PUSH(vm, r%lu, r%lu); }\n", R(1), R(2));
+      break;
+
+    case OP_PUSHI:
+      fprintf(fp, "  { PUSH(vm, r%lu, (VALUE)%ldL); }\n", R(1), V(2));
+      break;
+
+    case OP_MYPUSH:
+      fprintf(fp, "  { MYPUSH(vm, r%lu, r%lu); }\n", R(1), R(2));
+      break;
+
+    case OP_RET:
+      fprintf(fp, "  return NULL;\n");
+      break;
+
+    case OP_RET_FREE_LR:
+      fprintf(fp, "  free_Agent2(r%d, r%d);\n  return NULL;\n",
+              VM_OFFSET_ANNOTATE_L, VM_OFFSET_ANNOTATE_R);
+      break;
+
+    case OP_RET_FREE_L:
+      fprintf(fp, "  free_Agent(r%d);\n  return NULL;\n",
+              VM_OFFSET_ANNOTATE_L);
+      break;
+
+    case OP_RET_FREE_R:
+      fprintf(fp, "  free_Agent(r%d);\n  return NULL;\n",
+              VM_OFFSET_ANNOTATE_R);
+      break;
+
+    case OP_LOADI:
+      fprintf(fp, "  r%lu = (VALUE)%ldL;\n", R(2), V(1));
+      break;
+
+    case OP_LOAD:
+      fprintf(fp, "  r%lu = r%lu;\n", R(2), R(1));
+      break;
+
+    case OP_LOADP:
+      fprintf(fp, "  AGENT(r%lu)->port[%lu] = r%lu;\n", R(3), R(2), R(1));
+      break;
+
+    case OP_LOADP_L:
+    case OP_LOADP_R:
+      fprintf(fp, "  AGENT(r%d)->port[%lu] = r%lu;\n",
+              op == OP_LOADP_L ? VM_OFFSET_ANNOTATE_L : VM_OFFSET_ANNOTATE_R,
+              R(2), R(1));
+      break;
+
+    case OP_CHID_L:
+    case OP_CHID_R:
+      fprintf(fp, "  BASIC(r%d)->id = %lu;\n",
+              op == OP_CHID_L ? VM_OFFSET_ANNOTATE_L : VM_OFFSET_ANNOTATE_R,
+              R(1));
+      break;
+
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_MOD: {
+      const char *ope = op == OP_ADD   ? "+"
+                        : op == OP_SUB ? "-"
+                        : op == OP_MUL ? "*"
+                        : op == OP_DIV ? "/"
+                                       : "%";
+      fprintf(fp, "  r%lu = INT2FIX(FIX2INT(r%lu) %s FIX2INT(r%lu));\n", R(3),
+              R(1), ope, R(2));
+      break;
+    }
+
+    case OP_ADDI:
+    case OP_SUBI:
+      fprintf(fp, "  r%lu = INT2FIX(FIX2INT(r%lu) %s %ldL);\n", R(3), R(1),
+              op == OP_ADDI ? "+" : "-", V(2));
+      break;
+
+    case OP_LT:
+    case OP_LE:
+    case OP_EQ:
+    case OP_NE: {
+      const char *ope = op == OP_LT   ? "<"
+                        : op == OP_LE ? "<="
+                        : op == OP_EQ ? "=="
+                                      : "!=";
+      fprintf(fp, "  r%lu = INT2FIX((long)r%lu %s (long)r%lu);\n", R(3), R(1),
+              ope, R(2));
+      break;
+    }
+
+    case OP_EQI:
+      fprintf(fp, "  r%lu = INT2FIX((long)r%lu == %ldL);\n", R(3), R(1), V(2));
+      break;
+
+    case OP_UNM:
+    case OP_INC:
+    case OP_DEC:
+    case OP_RAND: {
+      const char *expr = op == OP_UNM   ? "-1 * FIX2INT(r%lu)"
+                         : op == OP_INC ? "FIX2INT(r%lu) + 1"
+                         : op == OP_DEC ? "FIX2INT(r%lu) - 1"
+                                        : "rand() %% FIX2INT(r%lu)";
+      fprintf(fp, "  r%lu = INT2FIX(", R(size - 1));
+      fprintf(fp, expr, R(1));
+      fprintf(fp, ");\n");
+      break;
+    }
+
+    case OP_LT_R0:
+    case OP_LE_R0:
+    case OP_EQ_R0:
+    case OP_NE_R0: {
+      const char *ope = op == OP_LT_R0   ? "<"
+                        : op == OP_LE_R0 ? "<="
+                        : op == OP_EQ_R0 ? "=="
+                                         : "!=";
+      fprintf(fp, "  r0 = ((long)r%lu %s (long)r%lu);\n", R(1), ope, R(2));
+      break;
+    }
+
+    case OP_EQI_R0:
+      fprintf(fp, "  r0 = ((long)r%lu == %ldL);\n", R(1), V(2));
+      break;
+
+    case OP_JMPEQ0:
+      fprintf(fp, "  if (!FIX2INT(r%lu))\n    goto L%d;\n", R(1), T(2));
+      break;
+
+    case OP_JMPNEQ0:
+      fprintf(fp, "  if (FIX2INT(r%lu))\n    goto L%d;\n", R(1), T(2));
+      break;
+
+    case OP_JMPEQ0_R0:
+      fprintf(fp, "  if (!r0)\n    goto L%d;\n", T(1));
+      break;
+
+    case OP_JMP:
+      fprintf(fp, "  goto L%d;\n", T(1));
+      break;
+
+    case OP_JMPCNCT_CONS:
+    case OP_JMPCNCT:
+      // Names connected to the register are followed as exec_code does.
+      // The multi-threaded version does not jump for ID_CONS
+      // because other threads may be sleeping.
+      if (op == OP_JMPCNCT_CONS) {
+        fprintf(fp, "#ifndef THREAD\n");
+      }
+      fprintf(fp,
+              "  if (!IS_FIXNUM(r%lu)) {\n"
+              "    while (IS_NAMEID(BASIC(r%lu)->id)) {\n"
+              "      if (NAME(r%lu)->port == VALUE_NULL)\n"
+              "        goto L%d;\n"
+              "      VALUE next = NAME(r%lu)->port;\n"
+              "      free_Name(r%lu);\n"
+              "      r%lu = next;\n"
+              "    }\n"
+              "    if (BASIC(r%lu)->id == %lu)\n"
+              "      goto L%d;\n"
+              "  }\n",
+              R(1), R(1), R(1), pc + size, R(1), R(1), R(1), R(1),
+              op == OP_JMPCNCT ? R(2) : (unsigned long)ID_CONS,
+              op == OP_JMPCNCT ? T(3) : T(2));
+      if (op == OP_JMPCNCT_CONS) {
+        fprintf(fp, "#endif\n");
+      }
+      break;
+
+    case OP_LOOP:
+      fprintf(fp, "  goto L0;\n");
+      break;
+
+    case OP_LOOP_RREC_FREE_R:
+    case OP_LOOP_RREC1_FREE_R:
+    case OP_LOOP_RREC2_FREE_R:
+      fprintf(fp, "  free_Agent(r%d);\n", VM_OFFSET_ANNOTATE_R);
+      // fall through
+
+    case OP_LOOP_RREC:
+    case OP_LOOP_RREC1:
+    case OP_LOOP_RREC2: {
+      unsigned long arity = (op == OP_LOOP_RREC || op == OP_LOOP_RREC_FREE_R)
+                                ? R(2)
+                            : (op == OP_LOOP_RREC1 || op == OP_LOOP_RREC1_FREE_R)
+                                ? 1
+                                : 2;
+      // The agent is kept in `a1' since the register may be a metavariable.
+      fprintf(fp, "  {\n    VALUE a1 = r%lu;\n", R(1));
+      for (unsigned long i = 0; i < arity; i++) {
+        fprintf(fp, "    r%d = AGENT(a1)->port[%lu];\n",
+                (int)VM_OFFSET_METAVAR_R(i), i);
+      }
+      fprintf(fp, "    r%d = a1;\n  }\n  goto L0;\n", VM_OFFSET_ANNOTATE_R);
+      break;
+    }
+
+    default:
+      break;
+    }
+
+    pc += size;
+  }
+
+  if (is_label[n]) {
+    fprintf(fp, "L%d:;\n", n);
+  }
+  fprintf(fp, "  return NULL;\n}\n\n");
+
+#undef R
+#undef V
+#undef T
+
+  if (AOT_entry_num == AOT_entry_size) {
+    AOT_entry_size = AOT_entry_size * 2 + 16;
+    AOT_entries = realloc(AOT_entries, sizeof(AOT_Entry) * AOT_entry_size);
+    if (AOT_entries == NULL) {
+      fprintf(stderr, "Error: AOT_emit_rule() failed: %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  }
+  AOT_entries[AOT_entry_num].idL = idL;
+  AOT_entries[AOT_entry_num].idR = idR;
+  AOT_entries[AOT_entry_num].fingerprint = AOT_fingerprint(rule, rule_n);
+  AOT_entry_num++;
+}
+
+// ------------------------------------------------------------
+// Execution of translated rules
+// ------------------------------------------------------------
+
+#ifdef AOT_RULES
+// Replaces the rule code with a call of the translated function
+// when its bytecodes are the same as those when translated.
+// Returns the new number of the codes.
+// The buffer `*code' is enlarged when it is shorter than the call.
+int AOT_install(int idL, int idR, void ***code, int n) {
+  unsigned long fingerprint = AOT_fingerprint(*code, n);
+  char         *nameL = IdTable_get_name(idL);
+  char         *nameR = IdTable_get_name(idR);
+
+  for (int i = 0; AOT_Rules[i].nameL != NULL; i++) {
+    if (AOT_Rules[i].fingerprint == fingerprint &&
+        !strcmp(AOT_Rules[i].nameL, nameL) &&
+        !strcmp(AOT_Rules[i].nameR, nameR)) {
+      if (n < 4) {
+        *code = CmEnv_realloc_VMCode(*code, 4);
+      }
+      (*code)[2] = CodeAddr[OP_NATIVE];
+      (*code)[3] = (void *)AOT_Rules[i].func;
+      return 4;
+    }
+  }
+  return n;
+}
+#endif
@@ -0,0 +1,40 @@
+#ifndef INPLA_AOT_H
+#define INPLA_AOT_H
+
+#include <stdio.h>
+
+#include "vm.h"
+
+// ------------------------------------------------------------
+// Ahead-of-time compilation of rules into C
+// ------------------------------------------------------------
+//
+// `inpla --emit-c prog.in' translates the bytecodes of each rule
+// into a C function, and writes these into `prog.c'.
+// When inpla is built with the file (meson option `aot_rules'),
+// the rules are executed by these native functions
+// instead of the virtual machine.
+
+typedef void *(*AOT_Func)(VirtualMachine *restrict vm, VALUE *restrict reg);
+
+typedef struct {
+  const char   *nameL, *nameR;
+  unsigned long fingerprint; // of the bytecodes that the function implements
+  AOT_Func      func;
+} AOT_Rule;
+
+unsigned long AOT_fingerprint(void **code, int n);
+
+// For the translation: --emit-c
+int  AOT_emit_open(char *srcname);
+int  AOT_is_emitting(void);
+void AOT_emit_rule(int idL, int idR, void **code, int n);
+
+#ifdef AOT_RULES
+// Terminated by an entry whose nameL is NULL.
+extern const AOT_Rule AOT_Rules[];
+
+int AOT_install(int idL, int idR, void ***code, int n);
+#endif
+
+#endif // INPLA_AOT_H
@@ -91,36 +91,68 @@ void recordVal(SymbolTable *table, char *name, long val) {
   }
 }
 
-static Ast *AstHeap;
-static int NextPtr_AstHeap;
+// AST nodes are taken from blocks of AST_HEAP_BLOCK_SIZE nodes,
+// and a new block is linked when they run up.
+typedef struct AstBlock {
+  struct AstBlock *next;
+  Ast              node[AST_HEAP_BLOCK_SIZE];
+} AstBlock;
+
+static AstBlock *AstHeap;         // the first block
+static AstBlock *AstHeap_current; // the block being used
+static int       NextPtr_AstHeap;
+
+// The last cells of lists built by ast_addLast, so that they are appended
+// without walking the lists. The entries are invalid after ast_heapReInit.
+#define AST_LAST_CACHE_SIZE 64
+static struct {
+  Ast *list, *last;
+} AstLastCache[AST_LAST_CACHE_SIZE];
+
+static AstBlock *ast_newBlock(void) {
+  AstBlock *block = malloc(sizeof(AstBlock));
+  if (block == NULL) {
+    printf("Malloc error [AstHeap]\n");
+    exit(-1);
+  }
+  block->next = NULL;
+  return block;
+}
 
 void ast_heapInit(void) {
 
   NextPtr_AstHeap = 0;
-  AstHeap = malloc(sizeof(Ast) * MAX_AST_HEAP);
-  if (AstHeap == NULL) {
-    printf("Malloc error [AstHeap]\n");
-    exit(-1);
-  }
+  AstHeap = AstHeap_current = ast_newBlock();
 
   SymTable_init(&SymTable);
   SymTable_init(&ConstTable);
 }
 
-void ast_heapReInit(void) { NextPtr_AstHeap = 0; }
+void ast_heapReInit(void) {
+  // Blocks taken for a large net are returned.
+  AstBlock *block = AstHeap->next;
+  while (block != NULL) {
+    AstBlock *next = block->next;
+    free(block);
+    block = next;
+  }
+  AstHeap->next = NULL;
+  AstHeap_current = AstHeap;
+  NextPtr_AstHeap = 0;
 
-static Ast *ast_myalloc(void) {
-  Ast *ptr;
+  for (int i = 0; i < AST_LAST_CACHE_SIZE; i++) {
+    AstLastCache[i].list = NULL;
+  }
+}
 
-  if (NextPtr_AstHeap < MAX_AST_HEAP) {
-    ptr = &AstHeap[NextPtr_AstHeap];
-    NextPtr_AstHeap++;
-  } else {
-    printf("Error: All memory for AST was run out.\n");
-    exit(-1);
+static Ast *ast_myalloc(void) {
+  if (NextPtr_AstHeap == AST_HEAP_BLOCK_SIZE) {
+    AstHeap_current->next = ast_newBlock();
+    AstHeap_current = AstHeap_current->next;
+    NextPtr_AstHeap = 0;
   }
 
-  return ptr;
+  return &AstHeap_current->node[NextPtr_AstHeap++];
 }
 
 Ast *ast_makeSymbol(char *name) {
@@ -236,10 +268,19 @@ Ast *ast_addLast(Ast *l, Ast *p) {
 
   if (l == NULL)
     return ast_makeAST(AST_LIST, p, NULL);
-  q = l;
+
+  int h = ((unsigned long)l / sizeof(Ast)) % AST_LAST_CACHE_SIZE;
+  if (AstLastCache[h].list == l && AstLastCache[h].last->right == NULL) {
+    q = AstLastCache[h].last;
+  } else {
+    q = l;
+  }
   while (q->right != NULL)
     q = q->right;
   q->right = ast_makeAST(AST_LIST, p, NULL);
+
+  AstLastCache[h].list = l;
+  AstLastCache[h].last = q->right;
   return l;
 }
 
@@ -273,6 +314,7 @@ void ast_puts(Ast *p) {
       "CNCT_TRO_INT",
       "CNCT_TRO_CONS",
       "CNCT_TRO",
+      "CNCT_TRO_RULE",
       "RULE",
       "BODY",
       "IF",
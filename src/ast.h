@@ -11,6 +11,7 @@ typedef enum {
   // clang-format off
   AST_SYM = 0, AST_NAME, AST_INTVAR, AST_AGENT,
   AST_CNCT, AST_CNCT_TCO_INTVAR, AST_CNCT_TCO_CONS, AST_CNCT_TCO,
+  AST_CNCT_TCO_RULE,
   AST_RULE, AST_BODY, AST_IF, AST_THEN_ELSE,
 
   // this is for ASTLIST
@@ -1,41 +1,21 @@
 #ifndef INPLA_CAS_SPINLOCK_H
 #define INPLA_CAS_SPINLOCK_H
 
-#include <unistd.h>
-
-// #define CAS_LOCK_USLEEP 4
-#define CAS_LOCK_USLEEP 200
-
-
-
-#define USE_UNLIKELY
-#ifdef USE_UNLIKELY
-#include "unlikely.h"
-static inline void lock(volatile int *aexclusion) {
-  if (likely(__sync_lock_test_and_set(aexclusion, 1) == 0)) {
-      return; 
-  }
-
-  while (__sync_lock_test_and_set(aexclusion, 1)) {
-    while (*aexclusion) {
-      usleep(CAS_LOCK_USLEEP);
-    }
-  }
-}
-
+#include <sched.h>
+
+// Idle threads wait for equations by spinning with cpu_relax for -Xspin
+// times and calling sched_yield for -Xyield times, and then park on the
+// condition variable of Sleep_lock (see EQStack_Idle_wait in inpla.c).
+// No spinlock is used, since the parking keeps the Sleep_lock protocol.
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield" ::: "memory");
 #else
-
-static inline void lock(volatile int *aexclusion) {
-  while (__sync_lock_test_and_set(aexclusion, 1))
-    while (*aexclusion)
-      usleep(CAS_LOCK_USLEEP);
-}
-
+  __asm__ __volatile__("" ::: "memory");
 #endif
-
-
-static inline void unlock(volatile int *aexclusion) {
-  __sync_lock_release(aexclusion);
 }
 
-#endif // INPLA_CAS_SPINLOCK_H
\ No newline at end of file
+#endif // INPLA_CAS_SPINLOCK_H
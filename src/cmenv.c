@@ -15,473 +15,1063 @@ CmEnvironment CmEnv = {
     .put_warning_for_cnct_property = 1, // with warning
     .put_compiled_codes = 0,            // without outputting codes
     .tco = 0,                           // without tail call opt.
+    .inline_rules = 0,                  // without inlining of rules
 };
 
-int CmEnv_Optimise_VMCode_CopyPropagation(int target_imcode_addr) {
-
-  struct IMCode_tag *imcode;
-  int                load_from, load_to;
-
-  load_from = IMCode[target_imcode_addr].operand1;
-  load_to = IMCode[target_imcode_addr].operand2;
+#ifdef OPTIMISE_SUPERINSTRUCTION
+// Pairs to be fused into superinstructions.
+// They are chosen by static frequencies of adjacent instructions
+// in the compiled rules of sample/ and comparison/Inpla/src/.
+// The comments show the number of the occurrences.
+static const struct {
+  Code        first, second, fused;
+  const char *name;
+} SuperInstTable[] = {
+    // 620
+    {OP_LOADP, OP_LOADP, OP_LOADP_LOADP, "loadp_loadp"},
+    // 422
+    {OP_MKAGENT, OP_LOADP, OP_MKAGENT_LOADP, "mkagent_loadp"},
+    // 412
+    {OP_LOADP, OP_PUSH, OP_LOADP_PUSH, "loadp_push"},
+    // 352
+    {OP_MKNAME, OP_LOADP, OP_MKNAME_LOADP, "mkname_loadp"},
+    // 336
+    {OP_PUSH, OP_RET_FREE_LR, OP_PUSH_RET_FREE_LR, "push_ret_free_lr"},
+    // 46
+    {OP_LOADP_L, OP_PUSH, OP_LOADP_L_PUSH, "loadp_l_push"},
+    // 35
+    {OP_LOADP_R, OP_PUSH, OP_LOADP_R_PUSH, "loadp_r_push"},
+    // 15
+    {OP_LE_R0, OP_JMPEQ0_R0, OP_LE_R0_JMPEQ0_R0, "le_r0_jmpeq0_r0"},
+    // 13
+    {OP_LT_R0, OP_JMPEQ0_R0, OP_LT_R0_JMPEQ0_R0, "lt_r0_jmpeq0_r0"},
+    // 2
+    {OP_EQ_R0, OP_JMPEQ0_R0, OP_EQ_R0_JMPEQ0_R0, "eq_r0_jmpeq0_r0"},
+    // 5
+    {OP_EQI_R0, OP_JMPEQ0_R0, OP_EQI_R0_JMPEQ0_R0, "eqi_r0_jmpeq0_r0"},
+    // 0
+    {OP_NE_R0, OP_JMPEQ0_R0, OP_NE_R0_JMPEQ0_R0, "ne_r0_jmpeq0_r0"},
+};
 
-  // When the given line is: LOAD src1 src1
-  if (load_from == load_to &&
-      IMCode[target_imcode_addr].opcode == OP_LOAD) {
-    IMCode[target_imcode_addr].opcode = OP_DEAD_CODE;
-    return 1;
-  }
+#  define SUPERINST_NUM                                                        \
+    ((int)(sizeof(SuperInstTable) / sizeof(SuperInstTable[0])))
+#endif
 
-  // ------------------------------------------------------------
-  // This part was commented out at v0.10.5
-  // Even if LOAD_META reg_n reg_n occurs, the varn could be preserved
-  // to another reg_n during the execusion, so it must not be DEAD_CODE here.
-  // ------------------------------------------------------------
-  /*
-  // When the given line is: LOAD_META src1 src1
-  if ((load_from == load_to) &&
-      (IMCode[target_imcode_addr].opcode == OP_LOAD_META)) {
-    IMCode[target_imcode_addr].opcode = OP_DEAD_CODE;
-    return 1;
+// Returns the opcode of `addr' in CodeAddr, or OP_NOP for unknown ones.
+Code CmEnv_get_opcode(void *addr) {
+  for (int i = 0; i < OP_NOP; i++) {
+    if (CodeAddr[i] == addr) {
+      return i;
+    }
   }
-  */
-
-  for (int line_num = target_imcode_addr + 1; line_num < IMCode_n; line_num++) {
-    imcode = &IMCode[line_num];
+  return OP_NOP;
+}
 
-    if (imcode->opcode == OP_BEGIN_BLOCK) {
-      // This optimisation will last until OP_BEGIN_BLOCK
-      return 0;
+// Returns the opcode of `addr' regarding superinstructions as their first
+// codes, which determine the operands.
+Code CmEnv_get_unfused_opcode(void *addr) {
+  Code op = CmEnv_get_opcode(addr);
+#ifdef OPTIMISE_SUPERINSTRUCTION
+  for (int i = 0; i < SUPERINST_NUM; i++) {
+    if (SuperInstTable[i].fused == op) {
+      return SuperInstTable[i].first;
     }
-    //    if ((CmEnv.is_in_jmpcnctBlock) &&
-    //	(imcode->opcode == OP_BEGIN_JMPCNCT_BLOCK)) {
-    //      // This optimisation will last until OP_BEGIN_JMPCNCT_BLOCK
-    //      return 0;
-    //    }
-
-    switch (imcode->opcode) {
+  }
+#endif
+  return op;
+}
 
-    case OP_MKNAME:
-    case OP_MKGNAME:
-    case OP_MKAGENT:
+// Returns the number of words of an instruction including its operands.
+int CmEnv_get_VMCode_size(Code op) {
+#ifdef OPTIMISE_SUPERINSTRUCTION
+  // Superinstructions have the operands of their first codes.
+  for (int i = 0; i < SUPERINST_NUM; i++) {
+    if (SuperInstTable[i].fused == op) {
+      op = SuperInstTable[i].first;
       break;
+    }
+  }
+#endif
 
-    case OP_LOADP:
-      // LOADP src port dest
-      if (imcode->operand1 == load_to) {
-        imcode->operand1 = load_from;
-        IMCode[target_imcode_addr].opcode = OP_DEAD_CODE;
-        return 1;
-      }
-      break;
+  switch (op) {
+  case OP_RET:
+  case OP_RET_FREE_LR:
+  case OP_RET_FREE_L:
+  case OP_RET_FREE_R:
+  case OP_LOOP:
+  case OP_NOP:
+    return 1;
 
-    case OP_LOADP_L:
-    case OP_LOADP_R:
-      // LOADP_L src port
-      if (imcode->operand1 == load_to) {
-        imcode->operand1 = load_from;
-        IMCode[target_imcode_addr].opcode = OP_DEAD_CODE;
-        return 1;
-      }
-      break;
+  case OP_MKNAME:
+  case OP_CHID_L:
+  case OP_CHID_R:
+  case OP_JMPEQ0_R0:
+  case OP_JMP:
+  case OP_NATIVE:
+  case OP_LOOP_RREC1:
+  case OP_LOOP_RREC2:
+  case OP_LOOP_RREC1_FREE_R:
+  case OP_LOOP_RREC2_FREE_R:
+    return 2;
+
+  case OP_UNM:
+  case OP_INC:
+  case OP_DEC:
+  case OP_RAND:
+#if !defined(OPTIMISE_TWO_ADDRESS) || !defined(OPTIMISE_TWO_ADDRESS_UNARY)
+    return 3;
+#else
+    return 2;
+#endif
 
-    case OP_PUSH:
-    case OP_MYPUSH:
-      if (imcode->operand1 == load_to) {
-        imcode->operand1 = load_from;
-        IMCode[target_imcode_addr].opcode = OP_DEAD_CODE;
-        return 1;
-      }
-      if (imcode->operand2 == load_to) {
-        imcode->operand2 = load_from;
-        IMCode[target_imcode_addr].opcode = OP_DEAD_CODE;
-        return 1;
-      }
-      break;
+  case OP_LOADP:
+  case OP_ADD:
+  case OP_SUB:
+  case OP_ADDI:
+  case OP_SUBI:
+  case OP_MUL:
+  case OP_DIV:
+  case OP_MOD:
+  case OP_LT:
+  case OP_LE:
+  case OP_EQ:
+  case OP_EQI:
+  case OP_NE:
+  case OP_JMPCNCT:
+  case OP_JMPCNCT_RULE:
+    return 4;
+
+  default:
+    // MKGNAME, MKAGENT, PUSH, PUSHI, MYPUSH, LOADI, LOAD, LOADP_L, LOADP_R,
+    // LT_R0, LE_R0, EQ_R0, EQI_R0, NE_R0, JMPEQ0, JMPNEQ0, JMPCNCT_CONS,
+    // LOOP_RREC, LOOP_RREC_FREE_R, TAILCALL, TAILCALL_FREE_R, CNCTGN, SUBSTGN
+    return 3;
+  }
+}
 
-    case OP_JMPEQ0:
-    case OP_JMPNEQ0:
-    case OP_JMPCNCT_CONS:
-    case OP_JMPCNCT:
-    case OP_PUSHI:
-      if (imcode->operand1 == load_to) {
-        imcode->operand1 = load_from;
-        IMCode[target_imcode_addr].opcode = OP_DEAD_CODE;
-        return 1;
-      }
-      break;
+#ifdef OPTIMISE_SUPERINSTRUCTION
+// Returns the name of the superinstruction at `addr' with its first code,
+// or NULL if it is not a superinstruction.
+const char *CmEnv_get_superinst(void *addr, Code *first) {
+  for (int i = 0; i < SUPERINST_NUM; i++) {
+    if (CodeAddr[SuperInstTable[i].fused] == addr) {
+      *first = SuperInstTable[i].first;
+      return SuperInstTable[i].name;
+    }
+  }
+  return NULL;
+}
 
-    case OP_MUL:
-    case OP_DIV:
-    case OP_MOD:
-    case OP_LT:
-    case OP_LE:
-    case OP_EQ:
-    case OP_NE:
-    case OP_ADD:
-    case OP_SUB:
-      // op src1 src2 dest
-      if (imcode->operand1 == load_to) {
-        imcode->operand1 = load_from;
-        IMCode[target_imcode_addr].opcode = OP_DEAD_CODE;
-        return 1;
-      }
-      if (imcode->operand2 == load_to) {
-        imcode->operand2 = load_from;
-        IMCode[target_imcode_addr].opcode = OP_DEAD_CODE;
-        return 1;
+// Replaces the first opcodes of frequent pairs with superinstructions.
+// The code size and the second opcodes are unchanged,
+// so no jump offset has to be recalculated.
+static void CmEnv_fuse_VMCode(void **code, int n) {
+  int pc = 0;
+  while (pc < n) {
+    Code op = CmEnv_get_opcode(code[pc]);
+    int  size = CmEnv_get_VMCode_size(op);
+
+    if (pc + size < n) {
+      Code next = CmEnv_get_opcode(code[pc + size]);
+
+      for (int i = 0; i < SUPERINST_NUM; i++) {
+        if (SuperInstTable[i].first == op && SuperInstTable[i].second == next) {
+          code[pc] = CodeAddr[SuperInstTable[i].fused];
+
+          // The second is not fused with the next any more.
+          size += CmEnv_get_VMCode_size(next);
+          break;
+        }
       }
-      break;
+    }
 
-    case OP_ADDI:
-    case OP_SUBI:
-    case OP_EQI:
-      // op src1 $2 dest
-      if (imcode->operand1 == load_to) {
-        imcode->operand1 = load_from;
-        IMCode[target_imcode_addr].opcode = OP_DEAD_CODE;
-        return 1;
-      }
-      break;
+    pc += size;
+  }
+}
+#endif
 
-    case OP_LT_R0:
-    case OP_LE_R0:
-    case OP_EQ_R0:
-    case OP_NE_R0:
-      // op src1 src2
-      if (imcode->operand1 == load_to) {
-        imcode->operand1 = load_from;
-        IMCode[target_imcode_addr].opcode = OP_DEAD_CODE;
-        return 1;
-      }
-      if (imcode->operand2 == load_to) {
-        imcode->operand2 = load_from;
-        IMCode[target_imcode_addr].opcode = OP_DEAD_CODE;
-        return 1;
-      }
-      break;
+// Returns the number of words that are enough for VM codes of IMCode.
+int CmEnv_get_VMCode_bound(void) {
+  int byte = 0;
 
-    case OP_EQI_R0:
-      // op src1 $2
-      if (imcode->operand1 == load_to) {
-        imcode->operand1 = load_from;
-        IMCode[target_imcode_addr].opcode = OP_DEAD_CODE;
-        return 1;
-      }
+  for (int i = 0; i < IMCode_n; i++) {
+    switch (IMCode[i].opcode) {
+    case OP_LABEL:
+    case OP_DEAD_CODE:
+    case OP_BEGIN_BLOCK:
+    case OP_BEGIN_JMPCNCT_BLOCK:
       break;
 
     case OP_UNM:
-    case OP_RAND:
     case OP_INC:
     case OP_DEC:
-      // op src dest
-      if (imcode->operand1 == load_to) {
-        imcode->operand1 = load_from;
-        IMCode[target_imcode_addr].opcode = OP_DEAD_CODE;
-        return 1;
-      }
+    case OP_RAND:
+      // They may be preceded by LOAD for two-address codes.
+      byte += CmEnv_get_VMCode_size(OP_LOAD);
+      byte += CmEnv_get_VMCode_size(IMCode[i].opcode);
       break;
+
+    default:
+      byte += CmEnv_get_VMCode_size(IMCode[i].opcode);
     }
   }
 
+  return byte;
+}
+
+// Resizes the buffer of VM codes to the given number of words.
+void **CmEnv_realloc_VMCode(void **code, int byte) {
+  void **new_code = realloc(code, sizeof(void *) * (byte > 0 ? byte : 1));
+  if (new_code == NULL) {
+    printf("[VMCode]Malloc error\n");
+    exit(-1);
+  }
+  return new_code;
+}
+
+#ifdef OPTIMISE_IMCODE
+// ------------------------------------------------------------
+// Register allocation by the linear scan
+// ------------------------------------------------------------
+// Local variables of IMCode are assigned to registers as follows:
+//   1. They are renamed block by block (OP_BEGIN_BLOCK),
+//      because every block numbers them from VM_OFFSET_LOCALVAR again.
+//   2. Their live ranges are computed by the backward liveness analysis.
+//      The instruction at line i reads registers at 2i and writes at 2i+1,
+//      so a register read last can be written by the same instruction.
+//      Registers for metavariables and annotations are fixed ones,
+//      and their live ranges are kept with holes.
+//   3. The live ranges are scanned in the order of their starts,
+//      and each takes the lowest register that is free during the range.
+//      A variable given by LOAD takes the register of the source,
+//      and one given to LOAD_META takes the metavariable register if possible,
+//      so that the LOAD is removed (coalescing).
+//
+// Jumps in IMCode are forward ones, except for OP_LOOP and so on,
+// which go to the beginning of the rule with the fixed registers.
+
+// Register operands of an IMCode: ones to be read, and one to be written.
+typedef struct {
+  long *use[3]; // with room for `def' to be appended
+  int   use_num;
+  long *def;
+} IMCodeRegs;
+
+static void CmEnv_get_IMCode_regs(struct IMCode_tag *imcode, IMCodeRegs *regs) {
+  *regs = (IMCodeRegs){.use_num = 0, .def = NULL};
+
+  switch (imcode->opcode) {
+  case OP_MKNAME:
+    // op dest
+    regs->def = &imcode->operand1;
+    break;
+
+  case OP_MKGNAME:
+  case OP_MKAGENT:
+  case OP_LOADI:
+  case OP_LOADI_SHARED:
+    // op $1 dest
+    regs->def = &imcode->operand2;
+    break;
+
+  case OP_LOAD:
+  case OP_LOAD_META:
+  case OP_UNM:
+  case OP_INC:
+  case OP_DEC:
+  case OP_RAND:
+    // op src dest
+    regs->use[regs->use_num++] = &imcode->operand1;
+    regs->def = &imcode->operand2;
+    break;
+
+  case OP_LOADP:
+    // LOADP src port dest, where the agent in `dest' is read.
+    regs->use[regs->use_num++] = &imcode->operand1;
+    regs->use[regs->use_num++] = &imcode->operand3;
+    break;
+
+  case OP_PUSH:
+  case OP_MYPUSH:
+  case OP_CNCTGN:
+  case OP_SUBSTGN:
+  case OP_LT_R0:
+  case OP_LE_R0:
+  case OP_EQ_R0:
+  case OP_NE_R0:
+    // op src1 src2
+    regs->use[regs->use_num++] = &imcode->operand1;
+    regs->use[regs->use_num++] = &imcode->operand2;
+    break;
+
+  case OP_ADD:
+  case OP_SUB:
+  case OP_MUL:
+  case OP_DIV:
+  case OP_MOD:
+  case OP_LT:
+  case OP_LE:
+  case OP_EQ:
+  case OP_NE:
+    // op src1 src2 dest
+    regs->use[regs->use_num++] = &imcode->operand1;
+    regs->use[regs->use_num++] = &imcode->operand2;
+    regs->def = &imcode->operand3;
+    break;
+
+  case OP_ADDI:
+  case OP_SUBI:
+  case OP_EQI:
+    // op src1 $2 dest
+    regs->use[regs->use_num++] = &imcode->operand1;
+    regs->def = &imcode->operand3;
+    break;
+
+  case OP_PUSHI:
+  case OP_EQI_R0:
+  case OP_LOADP_L:
+  case OP_LOADP_R:
+  case OP_JMPEQ0:
+  case OP_JMPNEQ0:
+  case OP_LOOP_RREC:
+  case OP_LOOP_RREC1:
+  case OP_LOOP_RREC2:
+  case OP_LOOP_RREC_FREE_R:
+  case OP_LOOP_RREC1_FREE_R:
+  case OP_LOOP_RREC2_FREE_R:
+  case OP_TAILCALL:
+  case OP_TAILCALL_FREE_R:
+    // op src ...
+    regs->use[regs->use_num++] = &imcode->operand1;
+    break;
+
+  case OP_JMPCNCT_CONS:
+  case OP_JMPCNCT:
+  case OP_JMPCNCT_RULE:
+    // The register is updated by following the names.
+    regs->use[regs->use_num++] = &imcode->operand1;
+    regs->def = &imcode->operand1;
+    break;
+  }
+}
+
+// Returns 1 if the fixed register `reg' is read by the opcode implicitly.
+static int CmEnv_IMCode_reads_fixed_reg(int opcode, int reg) {
+  switch (opcode) {
+  case OP_LOOP:
+  case OP_LOOP_RREC:
+  case OP_LOOP_RREC1:
+  case OP_LOOP_RREC2:
+  case OP_LOOP_RREC_FREE_R:
+  case OP_LOOP_RREC1_FREE_R:
+  case OP_LOOP_RREC2_FREE_R:
+  case OP_TAILCALL:
+  case OP_TAILCALL_FREE_R:
+    // A rule is executed with all of them.
+    return reg != VM_OFFSET_R0;
+
+  case OP_RET_FREE_LR:
+    return reg == VM_OFFSET_ANNOTATE_L || reg == VM_OFFSET_ANNOTATE_R;
+
+  case OP_RET_FREE_L:
+  case OP_CHID_L:
+  case OP_LOADP_L:
+    return reg == VM_OFFSET_ANNOTATE_L;
+
+  case OP_RET_FREE_R:
+  case OP_CHID_R:
+  case OP_LOADP_R:
+    return reg == VM_OFFSET_ANNOTATE_R;
+  }
+
   return 0;
 }
 
-#define MAX_LABEL     50
-#define MAX_BACKPATCH MAX_LABEL * 2
-int CmEnv_generate_VMCode(void **code) {
-  int                addr = 0;
-  struct IMCode_tag *imcode;
+// Returns the label that the opcode jumps to, or -1.
+static long CmEnv_IMCode_get_jump_label(struct IMCode_tag *imcode) {
+  switch (imcode->opcode) {
+  case OP_JMP:
+  case OP_JMPEQ0_R0:
+    return imcode->operand1;
+
+  case OP_JMPEQ0:
+  case OP_JMPNEQ0:
+  case OP_JMPCNCT_CONS:
+    return imcode->operand2;
+
+  case OP_JMPCNCT:
+  case OP_JMPCNCT_RULE:
+    return imcode->operand3;
+  }
 
-  int label_table[MAX_LABEL];
-  int backpatch_num = 0;
-  int backpatch_table[MAX_BACKPATCH];
+  return -1;
+}
 
-#ifdef OPTIMISE_IMCODE
-  CmEnv_clear_register_assignment_table_all();
-#endif
+// Returns 1 if the next line is not executed after the opcode.
+static int CmEnv_IMCode_is_terminator(int opcode) {
+  switch (opcode) {
+  case OP_RET:
+  case OP_RET_FREE_L:
+  case OP_RET_FREE_R:
+  case OP_RET_FREE_LR:
+  case OP_LOOP:
+  case OP_LOOP_RREC:
+  case OP_LOOP_RREC1:
+  case OP_LOOP_RREC2:
+  case OP_LOOP_RREC_FREE_R:
+  case OP_LOOP_RREC1_FREE_R:
+  case OP_LOOP_RREC2_FREE_R:
+  case OP_TAILCALL:
+  case OP_TAILCALL_FREE_R:
+  case OP_JMP:
+    return 1;
+  }
 
-  for (int line_num = 0; line_num < IMCode_n; line_num++) {
-    imcode = &IMCode[line_num];
+  return 0;
+}
 
-    // DEBUG
-    //    printf("%d\n", line_num);
-    //    VMCode_puts(code, addr);
+// Returns 1 if the opcode updates the register with the same value.
+static int CmEnv_IMCode_is_shortcut(int opcode) {
+  return opcode == OP_JMPCNCT_CONS || opcode == OP_JMPCNCT ||
+         opcode == OP_JMPCNCT_RULE;
+}
 
-#ifdef OPTIMISE_IMCODE
-    // optimisation
-    // Copy Propagation for OP_LOAD reg1, reg2 --> [reg2/reg1].
-    // When it is success, the code is applied Dead Code Elimination to.
-    if (imcode->opcode == OP_LOAD) {
-      if (CmEnv_Optimise_VMCode_CopyPropagation(line_num)) {
-        continue;
+#  define REGALLOC_WORD_BITS (8 * sizeof(unsigned long))
+#  define REGALLOC_IS_LIVE(set, v)                                             \
+    ((set)[(v) / REGALLOC_WORD_BITS] & (1UL << ((v) % REGALLOC_WORD_BITS)))
+#  define REGALLOC_SET_LIVE(set, v)                                            \
+    ((set)[(v) / REGALLOC_WORD_BITS] |= (1UL << ((v) % REGALLOC_WORD_BITS)))
+#  define REGALLOC_CLEAR_LIVE(set, v)                                          \
+    ((set)[(v) / REGALLOC_WORD_BITS] &= ~(1UL << ((v) % REGALLOC_WORD_BITS)))
+
+// State of the register allocation.
+// Variables less than VM_OFFSET_LOCALVAR are the fixed registers.
+static struct {
+  int var_num; // the number of variables, including the fixed registers
+  int words;   // the number of words for a set of variables
+
+  // for local variables
+  int *start, *end; // the live range [start, end]
+  int *def_num;     // the number of lines that write it, also for fixed ones
+  int *def_line;    // the line that writes it
+  int *hint;        // the register that it is given to by LOAD_META, or -1
+  int *reg;         // the assigned register
+
+  // for the fixed registers
+  int *fixed_range[VM_OFFSET_LOCALVAR]; // pairs of start and end
+  int  fixed_range_num[VM_OFFSET_LOCALVAR];
+  int  fixed_range_size[VM_OFFSET_LOCALVAR];
+
+  int *open_end; // the end of the range being scanned backward
+  int *users;    // the number of live ranges holding each register
+} RegAlloc;
+
+static void *CmEnv_regalloc_malloc(size_t size) {
+  void *p = malloc(size > 0 ? size : 1);
+  if (p == NULL) {
+    printf("[RegAlloc]Malloc error\n");
+    exit(-1);
+  }
+  return p;
+}
+
+// Renames local variables so that ones in different blocks are distinct.
+// Returns the number of local variables.
+static int CmEnv_rename_localvars(void) {
+  long max = VM_OFFSET_LOCALVAR;
+  for (int i = 0; i < IMCode_n; i++) {
+    IMCodeRegs regs;
+    CmEnv_get_IMCode_regs(&IMCode[i], &regs);
+    for (int k = 0; k < regs.use_num; k++) {
+      if (*regs.use[k] > max) {
+        max = *regs.use[k];
       }
     }
-    if (imcode->opcode == OP_LOAD_META) {
-      if (CmEnv_Optimise_VMCode_CopyPropagation(line_num)) {
-        continue;
+    if (regs.def != NULL && *regs.def > max) {
+      max = *regs.def;
+    }
+  }
+
+  int *map = CmEnv_regalloc_malloc(sizeof(int) * (max + 1));
+  for (long v = VM_OFFSET_LOCALVAR; v <= max; v++) {
+    map[v] = -1;
+  }
+
+  int num = 0;
+  for (int i = 0; i < IMCode_n; i++) {
+    if (IMCode[i].opcode == OP_BEGIN_BLOCK) {
+      for (long v = VM_OFFSET_LOCALVAR; v <= max; v++) {
+        map[v] = -1;
       }
+      continue;
     }
-    if (imcode->opcode == OP_LOADI) {
-      if (CmEnv_Optimise_VMCode_CopyPropagation_LOADI(line_num)) {
+
+    IMCodeRegs regs;
+    CmEnv_get_IMCode_regs(&IMCode[i], &regs);
+    if (regs.def != NULL &&
+        (regs.use_num == 0 || regs.def != regs.use[0])) {
+      regs.use[regs.use_num++] = regs.def;
+    }
+
+    for (int k = 0; k < regs.use_num; k++) {
+      long v = *regs.use[k];
+      if (v < VM_OFFSET_LOCALVAR) {
         continue;
       }
+      if (map[v] == -1) {
+        map[v] = VM_OFFSET_LOCALVAR + num++;
+      }
+      *regs.use[k] = map[v];
     }
-#endif
+  }
 
-    switch (imcode->opcode) {
-    case OP_MKNAME: {
-      //      printf("OP_MKNAME var%d\n", imcode->operand1);
-      long dest = imcode->operand1;
+  free(map);
+  return num;
+}
 
-#ifdef OPTIMISE_IMCODE
-      dest = CmEnv_get_newreg(dest);
-#endif
+// The variable `v' becomes live backward from the position `pos'.
+static void CmEnv_regalloc_open(unsigned long *live, int v, int pos) {
+  REGALLOC_SET_LIVE(live, v);
+  RegAlloc.open_end[v] = pos;
+}
 
-      code[addr++] = CodeAddr[imcode->opcode];
-      code[addr++] = (void *)(unsigned long)dest;
-      break;
-    }
-    case OP_MKGNAME: {
-      //      printf("OP_MKGNAME sym:%d var%d (as `%s')\n",
-      //	     imcode->operand1, imcode->operand2,
-      //	     CmEnv.bind[imcode->operand1].name);
-      long dest = imcode->operand2;
+// The variable `v' is not live before the position `pos'.
+static void CmEnv_regalloc_close(unsigned long *live, int v, int pos) {
+  REGALLOC_CLEAR_LIVE(live, v);
+  int end = RegAlloc.open_end[v];
 
-#ifdef OPTIMISE_IMCODE
-      dest = CmEnv_get_newreg(dest);
-#endif
+  if (v >= VM_OFFSET_LOCALVAR) {
+    if (pos < RegAlloc.start[v]) {
+      RegAlloc.start[v] = pos;
+    }
+    if (end > RegAlloc.end[v]) {
+      RegAlloc.end[v] = end;
+    }
+    return;
+  }
 
-      code[addr++] = CodeAddr[imcode->opcode];
-      code[addr++] = (void *)(unsigned long)imcode->operand1;
-      code[addr++] = (void *)(unsigned long)dest;
+  int *num = &RegAlloc.fixed_range_num[v];
+  int *size = &RegAlloc.fixed_range_size[v];
+  if (*num == *size) {
+    *size = (*size == 0) ? 8 : *size * 2;
+    RegAlloc.fixed_range[v] =
+        realloc(RegAlloc.fixed_range[v], sizeof(int) * 2 * *size);
+    if (RegAlloc.fixed_range[v] == NULL) {
+      printf("[RegAlloc]Malloc error\n");
+      exit(-1);
+    }
+  }
+  RegAlloc.fixed_range[v][2 * *num] = pos;
+  RegAlloc.fixed_range[v][2 * *num + 1] = end;
+  (*num)++;
+}
 
-      break;
+// Makes `live' be `next', where variables leaving are live from `pos'+1,
+// and ones coming are live until `pos'.
+static void CmEnv_regalloc_move_live(unsigned long *live, unsigned long *next,
+                                     int pos) {
+  for (int w = 0; w < RegAlloc.words; w++) {
+    unsigned long diff = live[w] ^ next[w];
+    while (diff != 0) {
+      int v = w * REGALLOC_WORD_BITS + __builtin_ctzl(diff);
+      diff &= diff - 1;
+
+      if (REGALLOC_IS_LIVE(live, v)) {
+        CmEnv_regalloc_close(live, v, pos + 1);
+      } else {
+        CmEnv_regalloc_open(live, v, pos);
+      }
     }
+  }
+}
 
-    case OP_MKAGENT: {
-      //      printf("OP_MKAGENT id var%d:%d\n",
-      //	     imcode->operand1, imcode->operand2);
-      long dest = imcode->operand2;
+// Computes live ranges by scanning IMCode backward.
+// Dead LOADs are turned into OP_DEAD_CODE.
+static void CmEnv_compute_live_ranges(void) {
+  int            words = RegAlloc.words;
+  unsigned long *live = calloc(words, sizeof(unsigned long));
+  unsigned long *next = calloc(words, sizeof(unsigned long));
+  unsigned long *label_live = calloc((size_t)words * (CmEnv.label + 1),
+                                     sizeof(unsigned long));
+  if (live == NULL || next == NULL || label_live == NULL) {
+    printf("[RegAlloc]Malloc error\n");
+    exit(-1);
+  }
 
-#ifdef OPTIMISE_IMCODE
-      dest = CmEnv_get_newreg(dest);
-#endif
+  for (int i = IMCode_n - 1; i >= 0; i--) {
+    struct IMCode_tag *imcode = &IMCode[i];
+    int                use = 2 * i, def = 2 * i + 1;
 
-      code[addr++] = CodeAddr[imcode->opcode];
-      code[addr++] = (void *)(unsigned long)imcode->operand1;
-      code[addr++] = (void *)(unsigned long)dest;
-      break;
+    if (imcode->opcode == OP_DEAD_CODE) {
+      continue;
     }
 
-    case OP_LOAD: {
-      // OP_LOAD src1 dest
-      long src1 = imcode->operand1;
-      long dest = imcode->operand2;
+    // Variables live after the line
+    long label = CmEnv_IMCode_get_jump_label(imcode);
+    if (CmEnv_IMCode_is_terminator(imcode->opcode) || label != -1) {
+      if (CmEnv_IMCode_is_terminator(imcode->opcode)) {
+        memset(next, 0, sizeof(unsigned long) * words);
+      } else {
+        memcpy(next, live, sizeof(unsigned long) * words);
+      }
+      if (label != -1) {
+        for (int w = 0; w < words; w++) {
+          next[w] |= label_live[label * words + w];
+        }
+      }
+      CmEnv_regalloc_move_live(live, next, def);
+    }
 
-#ifdef OPTIMISE_IMCODE
-      src1 = CmEnv_using_reg(src1);
-      if (!CmEnv_Optimise_check_occurence_in_block(imcode->operand1, line_num))
-        CmEnv_free_reg(src1);
+    if (imcode->opcode == OP_LABEL) {
+      memcpy(&label_live[imcode->operand1 * words], live,
+             sizeof(unsigned long) * words);
+      continue;
+    }
 
-      dest = CmEnv_get_newreg(dest);
+    IMCodeRegs regs;
+    CmEnv_get_IMCode_regs(imcode, &regs);
 
-      if (src1 == dest) {
+    if (regs.def != NULL) {
+      int v = *regs.def;
+
+      if (!REGALLOC_IS_LIVE(live, v) && v >= VM_OFFSET_LOCALVAR &&
+          (imcode->opcode == OP_LOAD || imcode->opcode == OP_LOADI ||
+           imcode->opcode == OP_LOADI_SHARED)) {
+        // Dead code elimination
         imcode->opcode = OP_DEAD_CODE;
-        break;
+        continue;
       }
-#endif
 
-      code[addr++] = CodeAddr[imcode->opcode];
-      code[addr++] = (void *)(unsigned long)src1;
-      code[addr++] = (void *)(unsigned long)dest;
-      break;
-    }
+      if (!REGALLOC_IS_LIVE(live, v)) {
+        CmEnv_regalloc_open(live, v, def);
+      }
+      CmEnv_regalloc_close(live, v, def);
 
-    case OP_LOAD_META: {
-      // OP_LOAD_META src1 dest
-      // the dest is used as it is
-      long src1 = imcode->operand1;
-      long dest = imcode->operand2;
+      if (!CmEnv_IMCode_is_shortcut(imcode->opcode)) {
+        RegAlloc.def_num[v]++;
+        RegAlloc.def_line[v] = i;
+      }
+    }
 
-#ifdef OPTIMISE_IMCODE
-      src1 = CmEnv_using_reg(src1);
-      if (!CmEnv_Optimise_check_occurence_in_block(imcode->operand1, line_num))
-        CmEnv_free_reg(src1);
+    for (int k = 0; k < regs.use_num; k++) {
+      int v = *regs.use[k];
+      if (!REGALLOC_IS_LIVE(live, v)) {
+        CmEnv_regalloc_open(live, v, use);
+      }
+      if (imcode->opcode == OP_LOAD_META && v >= VM_OFFSET_LOCALVAR &&
+          *regs.def < VM_OFFSET_LOCALVAR) {
+        RegAlloc.hint[v] = *regs.def;
+      }
+    }
 
-      //      dest = CmEnv_get_newreg(dest);
+    for (int reg = 0; reg < VM_OFFSET_LOCALVAR; reg++) {
+      if (CmEnv_IMCode_reads_fixed_reg(imcode->opcode, reg) &&
+          !REGALLOC_IS_LIVE(live, reg)) {
+        CmEnv_regalloc_open(live, reg, use);
+      }
+    }
+  }
 
-#  ifdef OPTIMISE_TWO_ADDRESS
-      CmEnv_assign_reg(dest, dest);
-#  endif
+  // Variables live at the beginning
+  memset(next, 0, sizeof(unsigned long) * words);
+  CmEnv_regalloc_move_live(live, next, -1);
 
-      if (src1 == dest) {
-        imcode->opcode = OP_DEAD_CODE;
-        break;
-      }
+  free(live);
+  free(next);
+  free(label_live);
+}
 
-#endif
+// Returns 1 if the fixed register `reg' is live within [start, end].
+static int CmEnv_fixed_reg_is_live(int reg, int start, int end) {
+  for (int k = 0; k < RegAlloc.fixed_range_num[reg]; k++) {
+    if (RegAlloc.fixed_range[reg][2 * k] <= end &&
+        start <= RegAlloc.fixed_range[reg][2 * k + 1]) {
+      return 1;
+    }
+  }
+  return 0;
+}
 
-      code[addr++] = CodeAddr[OP_LOAD];
-      code[addr++] = (void *)(unsigned long)src1;
-      code[addr++] = (void *)(unsigned long)dest;
-      break;
+// Returns 1 if the fixed register `reg' is written in lines [from, to].
+static int CmEnv_fixed_reg_is_written(int reg, int from, int to) {
+  if (RegAlloc.def_num[reg] == 0) {
+    return 0;
+  }
+  for (int i = from; i <= to && i < IMCode_n; i++) {
+    IMCodeRegs regs;
+    CmEnv_get_IMCode_regs(&IMCode[i], &regs);
+    if (regs.def != NULL && *regs.def == reg &&
+        !CmEnv_IMCode_is_shortcut(IMCode[i].opcode)) {
+      return 1;
     }
+  }
+  return 0;
+}
 
-    case OP_LOADP: {
-      // OP_LOADP src1 port dest
-      long src1 = imcode->operand1;
-      long port = imcode->operand2;
-      long dest = imcode->operand3;
+// Returns 1 if the register can be assigned to the local variable `v'.
+static int CmEnv_reg_is_free_for(int reg, int v) {
+  if (reg == VM_OFFSET_R0 || RegAlloc.users[reg] > 0) {
+    return 0;
+  }
+  if (reg < VM_OFFSET_LOCALVAR &&
+      CmEnv_fixed_reg_is_live(reg, RegAlloc.start[v], RegAlloc.end[v])) {
+    return 0;
+  }
+  return 1;
+}
 
-#ifdef OPTIMISE_IMCODE
-      src1 = CmEnv_using_reg(src1);
-      if (!CmEnv_Optimise_check_occurence_in_block(imcode->operand1, line_num))
-        CmEnv_free_reg(src1);
+// Returns the register of the source of the LOAD that writes `v' if it can
+// be shared, or -1. They have the same value while both are live.
+static int CmEnv_reg_of_copy_source(int v) {
+  if (RegAlloc.def_num[v] != 1) {
+    return -1;
+  }
 
-      dest = CmEnv_using_reg(dest);
-#endif
+  struct IMCode_tag *imcode = &IMCode[RegAlloc.def_line[v]];
+  int                src = imcode->operand1;
 
-      code[addr++] = CodeAddr[imcode->opcode];
-      code[addr++] = (void *)(unsigned long)src1;
-      code[addr++] = (void *)(unsigned long)port;
-      code[addr++] = (void *)(unsigned long)dest;
-      break;
+#  if defined(OPTIMISE_TWO_ADDRESS) && defined(OPTIMISE_TWO_ADDRESS_UNARY)
+  if (imcode->opcode == OP_UNM || imcode->opcode == OP_INC ||
+      imcode->opcode == OP_DEC || imcode->opcode == OP_RAND) {
+    // The register is updated in place if the source is not used anymore.
+    int reg = RegAlloc.reg[src];
+    return (src >= VM_OFFSET_LOCALVAR && CmEnv_reg_is_free_for(reg, v)) ? reg
+                                                                        : -1;
+  }
+#  endif
+
+  if (imcode->opcode != OP_LOAD) {
+    return -1;
+  }
+
+  if (src < VM_OFFSET_LOCALVAR) {
+    // It is shared unless the source is written while `v' is live.
+    if (src == VM_OFFSET_R0 ||
+        CmEnv_fixed_reg_is_written(src, RegAlloc.def_line[v] + 1,
+                                   RegAlloc.end[v] / 2)) {
+      return -1;
     }
+    return src;
+  }
 
-    case OP_LOADP_L:
-    case OP_LOADP_R: {
-      // OP_LOADP_L src port
-      long src1 = imcode->operand1;
-      long port = imcode->operand2;
+  int reg = RegAlloc.reg[src];
+  if (RegAlloc.end[src] < RegAlloc.start[v]) {
+    // The source is dead, so the register may be taken by another one.
+    return CmEnv_reg_is_free_for(reg, v) ? reg : -1;
+  }
+  if (RegAlloc.def_num[src] != 1 ||
+      (reg < VM_OFFSET_LOCALVAR &&
+       CmEnv_fixed_reg_is_live(reg, RegAlloc.start[v], RegAlloc.end[v]))) {
+    return -1;
+  }
+  return reg;
+}
 
-#ifdef OPTIMISE_IMCODE
-      src1 = CmEnv_using_reg(src1);
-      if (!CmEnv_Optimise_check_occurence_in_block(imcode->operand1, line_num))
-        CmEnv_free_reg(src1);
-      //      dest = CmEnv_using_reg(dest);
-#endif
+static int CmEnv_compare_start(const void *a, const void *b) {
+  return RegAlloc.start[*(const int *)a] - RegAlloc.start[*(const int *)b];
+}
 
-      code[addr++] = CodeAddr[imcode->opcode];
-      code[addr++] = (void *)(unsigned long)src1;
-      code[addr++] = (void *)(unsigned long)port;
+// Min-heaps of local variables ordered by `key', or registers when it is NULL.
+#  define REGALLOC_HEAP_KEY(key, x) (((key) != NULL) ? (key)[x] : (x))
+
+static void CmEnv_regalloc_heap_push(int *heap, int *num, int x,
+                                     const int *key) {
+  int i = (*num)++;
+  while (i > 0 &&
+         REGALLOC_HEAP_KEY(key, heap[(i - 1) / 2]) > REGALLOC_HEAP_KEY(key, x)) {
+    heap[i] = heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  heap[i] = x;
+}
+
+static int CmEnv_regalloc_heap_pop(int *heap, int *num, const int *key) {
+  int top = heap[0];
+  int last = heap[--(*num)];
+  int i = 0;
+  while (2 * i + 1 < *num) {
+    int c = 2 * i + 1;
+    if (c + 1 < *num &&
+        REGALLOC_HEAP_KEY(key, heap[c + 1]) < REGALLOC_HEAP_KEY(key, heap[c])) {
+      c++;
+    }
+    if (REGALLOC_HEAP_KEY(key, last) <= REGALLOC_HEAP_KEY(key, heap[c])) {
       break;
     }
+    heap[i] = heap[c];
+    i = c;
+  }
+  heap[i] = last;
+  return top;
+}
 
-    case OP_CHID_L:
-    case OP_CHID_R: {
-      // OP_CHID_L id
-      code[addr++] = CodeAddr[imcode->opcode];
-      code[addr++] = (void *)(unsigned long)imcode->operand1;
-      break;
+// Assigns registers to local variables in the order of the starts.
+// Returns the number of registers used.
+static int CmEnv_scan_live_ranges(int localvar_num) {
+  int *order = CmEnv_regalloc_malloc(sizeof(int) * localvar_num);
+  int  order_num = 0;
+  for (int v = VM_OFFSET_LOCALVAR; v < RegAlloc.var_num; v++) {
+    if (RegAlloc.start[v] <= RegAlloc.end[v]) {
+      order[order_num++] = v;
+    }
+  }
+  qsort(order, order_num, sizeof(int), CmEnv_compare_start);
+
+  // Active live ranges ordered by their ends, and registers for local
+  // variables that became free. The latter may have stale entries
+  // of registers taken again as copy sources, which are skipped.
+  int *active = CmEnv_regalloc_malloc(sizeof(int) * localvar_num);
+  int  active_num = 0;
+  int *free_regs = CmEnv_regalloc_malloc(sizeof(int) * localvar_num);
+  int  free_num = 0;
+  int  reg_num = VM_OFFSET_LOCALVAR;
+
+  for (int k = 0; k < order_num; k++) {
+    int v = order[k];
+
+    // Expire ranges that end before `v'
+    while (active_num > 0 && RegAlloc.end[active[0]] < RegAlloc.start[v]) {
+      int reg =
+          RegAlloc.reg[CmEnv_regalloc_heap_pop(active, &active_num,
+                                               RegAlloc.end)];
+      if (--RegAlloc.users[reg] == 0 && reg >= VM_OFFSET_LOCALVAR) {
+        CmEnv_regalloc_heap_push(free_regs, &free_num, reg, NULL);
+      }
     }
 
-    case OP_LOADI: {
-      // OP_LOADI int1 dest
-      long dest = imcode->operand2;
+    int reg = CmEnv_reg_of_copy_source(v);
+    if (reg == -1 && RegAlloc.hint[v] != -1 &&
+        CmEnv_reg_is_free_for(RegAlloc.hint[v], v)) {
+      reg = RegAlloc.hint[v];
+    }
+    if (reg == -1) {
+      // The lowest free one
+      reg = 1;
+      while (reg < VM_OFFSET_LOCALVAR && !CmEnv_reg_is_free_for(reg, v)) {
+        reg++;
+      }
+      while (reg == VM_OFFSET_LOCALVAR && free_num > 0 &&
+             RegAlloc.users[free_regs[0]] > 0) {
+        CmEnv_regalloc_heap_pop(free_regs, &free_num, NULL);
+      }
+      if (reg == VM_OFFSET_LOCALVAR) {
+        reg = (free_num > 0) ? CmEnv_regalloc_heap_pop(free_regs, &free_num,
+                                                       NULL)
+                             : reg_num;
+      }
+    }
 
-#ifdef OPTIMISE_IMCODE
-      dest = CmEnv_get_newreg(dest);
-#endif
+    RegAlloc.reg[v] = reg;
+    RegAlloc.users[reg]++;
+    if (reg + 1 > reg_num) {
+      reg_num = reg + 1;
+    }
 
-      code[addr++] = CodeAddr[imcode->opcode];
-      code[addr++] = (void *)INT2FIX(imcode->operand1);
-      code[addr++] = (void *)(unsigned long)dest;
+    CmEnv_regalloc_heap_push(active, &active_num, v, RegAlloc.end);
+  }
 
-      break;
+  free(order);
+  free(active);
+  free(free_regs);
+  return reg_num;
+}
+
+// Replaces local variables in IMCode with registers.
+static void CmEnv_allocate_registers(void) {
+  int localvar_num = CmEnv_rename_localvars();
+  int var_num = VM_OFFSET_LOCALVAR + localvar_num;
+
+  RegAlloc.var_num = var_num;
+  RegAlloc.words = (var_num + REGALLOC_WORD_BITS - 1) / REGALLOC_WORD_BITS;
+
+  int *table = CmEnv_regalloc_malloc(sizeof(int) * var_num * 7);
+  RegAlloc.start = &table[0];
+  RegAlloc.end = &table[var_num];
+  RegAlloc.def_num = &table[var_num * 2];
+  RegAlloc.def_line = &table[var_num * 3];
+  RegAlloc.hint = &table[var_num * 4];
+  RegAlloc.reg = &table[var_num * 5];
+  RegAlloc.open_end = &table[var_num * 6];
+  for (int v = 0; v < var_num; v++) {
+    RegAlloc.start[v] = IMCode_n * 2;
+    RegAlloc.end[v] = -1;
+    RegAlloc.def_num[v] = 0;
+    RegAlloc.def_line[v] = -1;
+    RegAlloc.hint[v] = -1;
+    RegAlloc.reg[v] = v;
+  }
+  RegAlloc.users = calloc(var_num + 1, sizeof(int));
+  if (RegAlloc.users == NULL) {
+    printf("[RegAlloc]Malloc error\n");
+    exit(-1);
+  }
+  for (int reg = 0; reg < VM_OFFSET_LOCALVAR; reg++) {
+    RegAlloc.fixed_range_num[reg] = 0;
+  }
+
+  CmEnv_compute_live_ranges();
+  VM_Reg_Reserve(CmEnv_scan_live_ranges(localvar_num));
+
+  for (int i = 0; i < IMCode_n; i++) {
+    IMCodeRegs regs;
+    CmEnv_get_IMCode_regs(&IMCode[i], &regs);
+    if (regs.def != NULL &&
+        (regs.use_num == 0 || regs.def != regs.use[0])) {
+      regs.use[regs.use_num++] = regs.def;
     }
+    for (int k = 0; k < regs.use_num; k++) {
+      *regs.use[k] = RegAlloc.reg[*regs.use[k]];
+    }
+  }
 
-    case OP_LOADI_SHARED: {
-      // OP_LOADI int1 dest
-      long dest = imcode->operand2;
+  free(table);
+  free(RegAlloc.users);
+}
+
+// Rewrites IMCode with immediate values and R0 before the allocation.
+static void CmEnv_Optimise_IMCode(void) {
+  for (int line_num = 0; line_num < IMCode_n; line_num++) {
+    struct IMCode_tag *imcode = &IMCode[line_num];
+
+    if (imcode->opcode == OP_LOADI) {
+      CmEnv_Optimise_VMCode_CopyPropagation_LOADI(line_num);
+
+    } else if (imcode->opcode == OP_EQI_R0 && imcode->operand2 == 0 &&
+               line_num + 1 < IMCode_n &&
+               IMCode[line_num + 1].opcode == OP_JMPEQ0_R0) {
+      // OP_EQI_Ro reg1 $0
+      // OP_JMPEQ0_R0 pc
+      // ==>
+      // DEAD_CODE
+      // OP_JMPNEQ reg1 pc
+      IMCode[line_num + 1].opcode = OP_JMPNEQ0;
+      IMCode[line_num + 1].operand2 = IMCode[line_num + 1].operand1;
+      IMCode[line_num + 1].operand1 = imcode->operand1;
+      imcode->opcode = OP_DEAD_CODE;
+    }
+  }
+}
+#endif
+
+int CmEnv_generate_VMCode(void **code) {
+  int                addr = 0;
+  struct IMCode_tag *imcode;
+
+  // Labels are numbered from 0 to CmEnv.label-1,
+  // and every jump is at most one line of IMCode.
+  int *label_table = malloc(sizeof(int) * (CmEnv.label + 1));
+  int  backpatch_num = 0;
+  int *backpatch_table = malloc(sizeof(int) * (IMCode_n + 1));
+  if (label_table == NULL || backpatch_table == NULL) {
+    printf("[VMCode]Malloc error\n");
+    exit(-1);
+  }
 
 #ifdef OPTIMISE_IMCODE
-      //      dest = CmEnv_get_newreg(dest);
-      {
-        dest = CmEnv_using_reg_with_nothing_info(dest);
-        if (dest == -1) {
-          dest = CmEnv_get_newreg(imcode->operand2);
-        }
-      }
+  CmEnv_Optimise_IMCode();
+  CmEnv_allocate_registers();
 #endif
 
-      code[addr++] = CodeAddr[OP_LOADI];
-      code[addr++] = (void *)INT2FIX(imcode->operand1);
-      code[addr++] = (void *)(unsigned long)dest;
+  for (int line_num = 0; line_num < IMCode_n; line_num++) {
+    imcode = &IMCode[line_num];
+
+    // DEBUG
+    //    printf("%d\n", line_num);
+    //    VMCode_puts(code, addr);
 
+    switch (imcode->opcode) {
+    case OP_MKNAME:
+      //      printf("OP_MKNAME var%d\n", imcode->operand1);
+      code[addr++] = CodeAddr[imcode->opcode];
+      code[addr++] = (void *)(unsigned long)imcode->operand1;
       break;
-    }
 
-      // OP_LOADI_META を入れよう
-      // META ではなく、KEEP_REG とか、OPT を遠ざける意味としよう。
-      // TODO: and と or の LABEL分岐による結果導出 loadi $1 reg1, load $0 reg1
-      // の reg1 を同じものに割り当てたい。だから、この KEEP_REG を使いたい
+    case OP_MKGNAME:
+    case OP_MKAGENT:
+      // OP_MKAGENT id dest
+      code[addr++] = CodeAddr[imcode->opcode];
+      code[addr++] = (void *)(unsigned long)imcode->operand1;
+      code[addr++] = (void *)(unsigned long)imcode->operand2;
+      break;
 
-    case OP_PUSH:
-    case OP_MYPUSH: {
-      //      printf("OP_PUSH var%d var%d\n",
-      //	     imcode->operand1, imcode->operand2);
-      long src1 = imcode->operand1;
-      long src2 = imcode->operand2;
+    case OP_LOAD:
+    case OP_LOAD_META:
+      // OP_LOAD src1 dest
+      if (imcode->operand1 == imcode->operand2) {
+        // Coalesced by the register allocation
+        imcode->opcode = OP_DEAD_CODE;
+        break;
+      }
 
-#ifdef OPTIMISE_IMCODE
-      src1 = CmEnv_using_reg(src1);
-      if (!CmEnv_Optimise_check_occurence_in_block(imcode->operand1,
-                                                   line_num) &&
-          imcode->operand1 != imcode->operand2)
-        CmEnv_free_reg(src1);
-
-      src2 = CmEnv_using_reg(src2);
-      if (!CmEnv_Optimise_check_occurence_in_block(imcode->operand2,
-                                                   line_num) &&
-          imcode->operand1 != imcode->operand2)
-        CmEnv_free_reg(src2);
-
-      /*
-      src1 = CmEnv_using_reg(src1);
-      if (imcode->operand1 != imcode->operand2)
-        CmEnv_free_reg(src1);
-
-      src2 = CmEnv_using_reg(src2);
-      CmEnv_free_reg(src2);
-      */
+      code[addr++] = CodeAddr[OP_LOAD];
+      code[addr++] = (void *)(unsigned long)imcode->operand1;
+      code[addr++] = (void *)(unsigned long)imcode->operand2;
+      break;
 
-#endif
+    case OP_LOADP:
+    case OP_ADDI:
+    case OP_SUBI:
+      // OP_LOADP src1 port dest
+      code[addr++] = CodeAddr[imcode->opcode];
+      code[addr++] = (void *)(unsigned long)imcode->operand1;
+      code[addr++] = (void *)(unsigned long)imcode->operand2;
+      code[addr++] = (void *)(unsigned long)imcode->operand3;
+      break;
 
+    case OP_LOADP_L:
+    case OP_LOADP_R:
+    case OP_PUSH:
+    case OP_MYPUSH:
+    case OP_LT_R0:
+    case OP_LE_R0:
+    case OP_EQ_R0:
+    case OP_NE_R0:
+    case OP_CNCTGN:
+    case OP_SUBSTGN:
+      // OP_PUSH src1 src2
       code[addr++] = CodeAddr[imcode->opcode];
-      code[addr++] = (void *)(unsigned long)src1;
-      code[addr++] = (void *)(unsigned long)src2;
+      code[addr++] = (void *)(unsigned long)imcode->operand1;
+      code[addr++] = (void *)(unsigned long)imcode->operand2;
+      break;
 
+    case OP_CHID_L:
+    case OP_CHID_R:
+    case OP_LOOP_RREC1:
+    case OP_LOOP_RREC2:
+    case OP_LOOP_RREC1_FREE_R:
+    case OP_LOOP_RREC2_FREE_R:
+      // OP_CHID_L id
+      code[addr++] = CodeAddr[imcode->opcode];
+      code[addr++] = (void *)(unsigned long)imcode->operand1;
       break;
-    }
+
+    case OP_LOADI:
+    case OP_LOADI_SHARED:
+      // OP_LOADI int1 dest
+      code[addr++] = CodeAddr[OP_LOADI];
+      code[addr++] = (void *)(uintptr_t)INT2FIX(imcode->operand1);
+      code[addr++] = (void *)(unsigned long)imcode->operand2;
+      break;
+
     case OP_JMPEQ0:
     case OP_JMPNEQ0:
-    case OP_JMPCNCT_CONS: {
+    case OP_JMPCNCT_CONS:
       // OP_JMPEQ0 reg label
-      long src1 = imcode->operand1;
-
-#ifdef OPTIMISE_IMCODE
-      src1 = CmEnv_using_reg(src1);
-      if (!CmEnv_Optimise_check_occurence_in_block(imcode->operand1, line_num))
-        CmEnv_free_reg(src1);
-#endif
-
       code[addr++] = CodeAddr[imcode->opcode];
-      code[addr++] = (void *)(unsigned long)src1;
+      code[addr++] = (void *)(unsigned long)imcode->operand1;
       // for label
       backpatch_table[backpatch_num++] = addr;
       code[addr++] = (void *)(unsigned long)imcode->operand2;
       break;
-    }
 
-    case OP_JMPEQ0_R0: {
+    case OP_JMPEQ0_R0:
+    case OP_JMP:
       code[addr++] = CodeAddr[imcode->opcode];
 
       // for label
       backpatch_table[backpatch_num++] = addr;
       code[addr++] = (void *)(unsigned long)imcode->operand1;
       break;
-    }
 
     case OP_ADD:
     case OP_SUB:
@@ -491,187 +1081,50 @@ int CmEnv_generate_VMCode(void **code) {
     case OP_LT:
     case OP_LE:
     case OP_EQ:
-    case OP_NE: {
+    case OP_NE:
       // op src1 src2 dest
-      long src1 = imcode->operand1;
-      long src2 = imcode->operand2;
-      long dest = imcode->operand3;
-
-#ifdef OPTIMISE_IMCODE
-      src1 = CmEnv_using_reg(src1);
-      if (!CmEnv_Optimise_check_occurence_in_block(imcode->operand1,
-                                                   line_num) &&
-          imcode->operand1 != imcode->operand2)
-        CmEnv_free_reg(src1);
-
-      src2 = CmEnv_using_reg(src2);
-      if (!CmEnv_Optimise_check_occurence_in_block(imcode->operand2, line_num))
-        CmEnv_free_reg(src2);
-
-      dest = CmEnv_get_newreg(dest);
-#endif
-
-      code[addr++] = CodeAddr[imcode->opcode];
-      code[addr++] = (void *)(unsigned long)src1;
-      code[addr++] = (void *)(unsigned long)src2;
-      code[addr++] = (void *)(unsigned long)dest;
-
-      break;
-    }
-
-    case OP_ADDI:
-    case OP_SUBI: {
-      // op src1 $2 dest
-      long src1 = imcode->operand1;
-      long dest = imcode->operand3;
-
-#ifdef OPTIMISE_IMCODE
-      src1 = CmEnv_using_reg(src1);
-      if (!CmEnv_Optimise_check_occurence_in_block(imcode->operand1, line_num))
-        CmEnv_free_reg(src1);
-
-      dest = CmEnv_get_newreg(dest);
-#endif
-
       code[addr++] = CodeAddr[imcode->opcode];
-      code[addr++] = (void *)(unsigned long)src1;
+      code[addr++] = (void *)(unsigned long)imcode->operand1;
       code[addr++] = (void *)(unsigned long)imcode->operand2;
-      code[addr++] = (void *)(unsigned long)dest;
-
+      code[addr++] = (void *)(unsigned long)imcode->operand3;
       break;
-    }
 
-    case OP_EQI: {
+    case OP_EQI:
       // op src1 int2fix($2) dest
-      long src1 = imcode->operand1;
-      long dest = imcode->operand3;
-
-#ifdef OPTIMISE_IMCODE
-      src1 = CmEnv_using_reg(src1);
-      if (!CmEnv_Optimise_check_occurence_in_block(imcode->operand1, line_num))
-        CmEnv_free_reg(src1);
-
-      dest = CmEnv_get_newreg(dest);
-#endif
-
       code[addr++] = CodeAddr[imcode->opcode];
-      code[addr++] = (void *)(unsigned long)src1;
-      code[addr++] = (void *)INT2FIX(imcode->operand2);
-      code[addr++] = (void *)(unsigned long)dest;
-
-      break;
-    }
-
-    case OP_LT_R0:
-    case OP_LE_R0:
-    case OP_EQ_R0:
-    case OP_NE_R0: {
-      // op src1 src2
-      long src1 = imcode->operand1;
-      long src2 = imcode->operand2;
-
-#ifdef OPTIMISE_IMCODE
-      src1 = CmEnv_using_reg(src1);
-      if (!CmEnv_Optimise_check_occurence_in_block(imcode->operand1,
-                                                   line_num) &&
-          imcode->operand1 != imcode->operand2)
-        CmEnv_free_reg(src1);
-
-      src2 = CmEnv_using_reg(src2);
-      if (!CmEnv_Optimise_check_occurence_in_block(imcode->operand2, line_num))
-        CmEnv_free_reg(src2);
-#endif
-
-      code[addr++] = CodeAddr[imcode->opcode];
-      code[addr++] = (void *)(unsigned long)src1;
-      code[addr++] = (void *)(unsigned long)src2;
+      code[addr++] = (void *)(unsigned long)imcode->operand1;
+      code[addr++] = (void *)(uintptr_t)INT2FIX(imcode->operand2);
+      code[addr++] = (void *)(unsigned long)imcode->operand3;
       break;
-    }
 
-    case OP_EQI_R0: {
+    case OP_EQI_R0:
+    case OP_PUSHI:
       // op src1 int2
-
-#ifdef OPTIMISE_IMCODE
-      if (imcode->operand2 == 0 &&
-          IMCode[line_num + 1].opcode == OP_JMPEQ0_R0) {
-        // OP_EQI_Ro reg1 $0
-        // OP_JMPEQ0_R0 pc
-        // ==>
-        // DEAD_CODE
-        // OP_JMPNEQ reg1 pc
-        IMCode[line_num + 1].opcode = OP_JMPNEQ0;
-        IMCode[line_num + 1].operand2 = IMCode[line_num + 1].operand1;
-        IMCode[line_num + 1].operand1 = imcode->operand1;
-        imcode->opcode = OP_DEAD_CODE;
-        break;
-      }
-#endif
-
-      long src1 = imcode->operand1;
-
-#ifdef OPTIMISE_IMCODE
-      src1 = CmEnv_using_reg(src1);
-      if (!CmEnv_Optimise_check_occurence_in_block(imcode->operand1, line_num))
-        CmEnv_free_reg(src1);
-#endif
-
       code[addr++] = CodeAddr[imcode->opcode];
-      code[addr++] = (void *)(unsigned long)src1;
-      code[addr++] = (void *)INT2FIX(imcode->operand2);
+      code[addr++] = (void *)(unsigned long)imcode->operand1;
+      code[addr++] = (void *)(uintptr_t)INT2FIX(imcode->operand2);
       break;
-    }
 
     case OP_UNM:
     case OP_INC:
     case OP_DEC:
-    case OP_RAND: {
+    case OP_RAND:
       // op src dest
-      long src1 = imcode->operand1;
-      long dest = imcode->operand2;
-
-#ifdef OPTIMISE_IMCODE
-      src1 = CmEnv_using_reg(src1);
-      if (!CmEnv_Optimise_check_occurence_in_block(imcode->operand1, line_num))
-        CmEnv_free_reg(src1);
-
-#  if !defined(OPTIMISE_TWO_ADDRESS) || !defined(OPTIMISE_TWO_ADDRESS_UNARY)
-      dest = CmEnv_get_newreg(dest);
-#  else
-      int new_reg = CmEnv_assign_reg(dest, src1);
-      if (new_reg > 0) {
+#if defined(OPTIMISE_TWO_ADDRESS) && defined(OPTIMISE_TWO_ADDRESS_UNARY)
+      // op dest, after the source is loaded into the dest
+      if (imcode->operand1 != imcode->operand2) {
         code[addr++] = CodeAddr[OP_LOAD];
-        code[addr++] = (void *)(unsigned long)src1;
-        code[addr++] = (void *)(unsigned long)new_reg;
+        code[addr++] = (void *)(unsigned long)imcode->operand1;
+        code[addr++] = (void *)(unsigned long)imcode->operand2;
       }
-#  endif
-
-#endif
-
       code[addr++] = CodeAddr[imcode->opcode];
-      code[addr++] = (void *)(unsigned long)src1;
-#if !defined(OPTIMISE_TWO_ADDRESS) || !defined(OPTIMISE_TWO_ADDRESS_UNARY)
-      code[addr++] = (void *)(unsigned long)dest;
-#endif
-      break;
-    }
-
-    case OP_PUSHI: {
-      // OP src1 int2
-      long src1 = imcode->operand1;
-
-#ifdef OPTIMISE_IMCODE
-      src1 = CmEnv_using_reg(src1);
-      if (!CmEnv_Optimise_check_occurence_in_block(imcode->operand1, line_num))
-        CmEnv_free_reg(src1);
+      code[addr++] = (void *)(unsigned long)imcode->operand2;
+#else
+      code[addr++] = CodeAddr[imcode->opcode];
+      code[addr++] = (void *)(unsigned long)imcode->operand1;
+      code[addr++] = (void *)(unsigned long)imcode->operand2;
 #endif
-
-      code[addr++] = CodeAddr[imcode->opcode];
-      code[addr++] = (void *)(unsigned long)src1;
-      // int
-      code[addr++] = (void *)INT2FIX(imcode->operand2);
-
       break;
-    }
 
     case OP_RET:
     case OP_RET_FREE_L:
@@ -682,122 +1135,35 @@ int CmEnv_generate_VMCode(void **code) {
       code[addr++] = CodeAddr[imcode->opcode];
       break;
 
-    case OP_LOOP_RREC1:
-    case OP_LOOP_RREC2:
-    case OP_LOOP_RREC1_FREE_R:
-    case OP_LOOP_RREC2_FREE_R: {
-      //      printf("OP_LOOP_RREC1 var%d\n",
-      //	     imcode->operand1);
-      long src1 = imcode->operand1;
-
-#ifdef OPTIMISE_IMCODE
-      src1 = CmEnv_using_reg(src1);
-      if (!CmEnv_Optimise_check_occurence_in_block(imcode->operand1, line_num))
-        CmEnv_free_reg(src1);
-#endif
-
-      code[addr++] = CodeAddr[imcode->opcode];
-      code[addr++] = (void *)(unsigned long)src1;
-      break;
-    }
-
     case OP_LOOP_RREC:
-    case OP_LOOP_RREC_FREE_R: {
+    case OP_LOOP_RREC_FREE_R:
+    case OP_TAILCALL:
+    case OP_TAILCALL_FREE_R:
       //      printf("OP_LOOP_RREC1 var%d $%d\n",
       //	     imcode->operand1, imcode->operand2);
-      long src1 = imcode->operand1;
-
-#ifdef OPTIMISE_IMCODE
-      src1 = CmEnv_using_reg(src1);
-      if (!CmEnv_Optimise_check_occurence_in_block(imcode->operand1, line_num))
-        CmEnv_free_reg(src1);
-#endif
-
       code[addr++] = CodeAddr[imcode->opcode];
-      code[addr++] = (void *)(unsigned long)src1;
+      code[addr++] = (void *)(unsigned long)imcode->operand1;
       code[addr++] = (void *)(unsigned long)imcode->operand2;
       break;
-    }
 
-    case OP_JMPCNCT: {
+    case OP_JMPCNCT:
+    case OP_JMPCNCT_RULE:
       // OP_JMPCNCT var id label
-      //      printf("OP_JMPCNCT var%d id%d $%d\n",
-      //	     imcode->operand1, imcode->operand2, imcode->operand3);
-      long src1 = imcode->operand1;
-
-#ifdef OPTIMISE_IMCODE
-      src1 = CmEnv_using_reg(src1);
-      if (!CmEnv_Optimise_check_occurence_in_block(imcode->operand1, line_num))
-        CmEnv_free_reg(src1);
-#endif
-
       code[addr++] = CodeAddr[imcode->opcode];
-      code[addr++] = (void *)(unsigned long)src1;
+      code[addr++] = (void *)(unsigned long)imcode->operand1;
       // int
       code[addr++] = (void *)(unsigned long)imcode->operand2;
       // for label
       backpatch_table[backpatch_num++] = addr;
       code[addr++] = (void *)(unsigned long)imcode->operand3;
       break;
-    }
-
-    case OP_JMP:
-      //      printf("OP_JMP $%d\n",
-      //	     imcode->operand1);
-      code[addr++] = CodeAddr[imcode->opcode];
-
-      backpatch_table[backpatch_num++] = addr;
-      code[addr++] = (void *)(unsigned long)imcode->operand1;
-      break;
-
-    case OP_CNCTGN:
-    case OP_SUBSTGN: {
-      //      printf("OP_CNCTGN var%d $%d\n",
-      //	     imcode->operand1, imcode->operand2);
-      long src1 = imcode->operand1;
-      long src2 = imcode->operand2;
-
-#ifdef OPTIMISE_IMCODE
-      src1 = CmEnv_using_reg(src1);
-      if (!CmEnv_Optimise_check_occurence_in_block(imcode->operand1,
-                                                   line_num) &&
-          imcode->operand1 != imcode->operand2)
-        CmEnv_free_reg(src1);
-
-      src2 = CmEnv_using_reg(src2);
-      if (!CmEnv_Optimise_check_occurence_in_block(imcode->operand2, line_num))
-        CmEnv_free_reg(src2);
-#endif
-
-      code[addr++] = CodeAddr[imcode->opcode];
-      code[addr++] = (void *)(unsigned long)src1;
-      code[addr++] = (void *)(unsigned long)src2;
-      break;
-    }
 
     case OP_DEAD_CODE:
-      break;
-
     case OP_BEGIN_BLOCK:
-#ifdef OPTIMISE_IMCODE
-      CmEnv_clear_register_assignment_table_all();
-#endif
-      break;
-
-#ifdef OPTIMISE_TWO_ADDRESS
     case OP_BEGIN_JMPCNCT_BLOCK:
-      //      CmEnv_clear_jmpcnctBlock_assignment_table_all();
-
-      CmEnv_stack_assignment_table();
-      CmEnv.is_in_jmpcnctBlock = 1;
       break;
-#endif
 
     case OP_LABEL:
-      if (imcode->operand1 > MAX_LABEL) {
-        printf("Critical Error: Label number overfllow.");
-        exit(-1);
-      }
       label_table[imcode->operand1] = addr;
       break;
 
@@ -815,21 +1181,14 @@ int CmEnv_generate_VMCode(void **code) {
     code[hole_addr] =
         (void *)(unsigned long)(label_table[jmp_label] - (hole_addr + 1));
   }
+  free(label_table);
+  free(backpatch_table);
 
-  return addr;
-}
-
-void CmEnv_clear_register_assignment_table_all(void) {
-  for (int i = 0; i < VM_OFFSET_LOCALVAR; i++) {
-    CmEnv.tmpRegState[i] = i; // occupied already
-  }
-  for (int i = VM_OFFSET_LOCALVAR; i < VM_REG_SIZE; i++) {
-    CmEnv.tmpRegState[i] = -1; // free
-  }
-
-#ifdef OPTIMISE_TWO_ADDRESS
-  CmEnv_clear_jmpcnctBlock_assignment_table_all();
+#ifdef OPTIMISE_SUPERINSTRUCTION
+  CmEnv_fuse_VMCode(code, addr);
 #endif
+
+  return addr;
 }
 
 void CmEnv_clear_localnamePtr(void) { CmEnv.localNamePtr = VM_OFFSET_LOCALVAR; }
@@ -839,8 +1198,8 @@ void CmEnv_clear_bind(int preserve_idx) {
     CmEnv.bind[i].refnum = 0;
   }
 
-  // after that, clear everything
-  for (int i = preserve_idx + 1; i < MAX_NBIND; i++) {
+  // after that, clear everything that has been used
+  for (int i = preserve_idx + 1; i < CmEnv.bindPtr; i++) {
     CmEnv.bind[i].name = NULL;
     CmEnv.bind[i].refnum = 0;
     CmEnv.bind[i].reg = 0;
@@ -853,20 +1212,6 @@ void CmEnv_clear_bind(int preserve_idx) {
   CmEnv.count_compilation_errors = 0;
 }
 
-#ifdef OPTIMISE_TWO_ADDRESS
-void CmEnv_clear_jmpcnctBlock_assignment_table_all(void) {
-  for (int i = 0; i < VM_REG_SIZE; i++) {
-    CmEnv.jmpcnctBlockRegState[i] = -1;
-  }
-  CmEnv.is_in_jmpcnctBlock = 0;
-}
-void CmEnv_stack_assignment_table(void) {
-  for (int i = 0; i < VM_REG_SIZE; i++) {
-    CmEnv.jmpcnctBlockRegState[i] = CmEnv.tmpRegState[i];
-  }
-}
-#endif
-
 void CmEnv_clear_all(void) {
   // clear all the information of names.
   CmEnv_clear_bind(-1);
@@ -885,9 +1230,6 @@ void CmEnv_clear_all(void) {
   // reset the index of labels;
   CmEnv.label = 0;
 
-  // reset the register assignment table
-  CmEnv_clear_register_assignment_table_all();
-
   // reset the number of compilation erros
   CmEnv.count_compilation_errors = 0;
 }
@@ -914,79 +1256,49 @@ void CmEnv_clear_keeping_rule_properties(void) {
   */
 }
 int CmEnv_get_newlabel(void) { return CmEnv.label++; }
-int CmEnv_set_symbol_as_name(char *name) {
-  // return: a regnum for the given name.
 
-  int result;
-
-  if (name != NULL) {
-    CmEnv.bind[CmEnv.bindPtr].name = name;
-    CmEnv.bind[CmEnv.bindPtr].reg = CmEnv.localNamePtr;
-    CmEnv.bind[CmEnv.bindPtr].refnum = 0;
-    CmEnv.bind[CmEnv.bindPtr].type = NB_NAME;
-
-    CmEnv.bindPtr++;
-    if (CmEnv.bindPtr > MAX_NBIND) {
-      puts("SYSTEM ERROR: CmEnv.bindPtr exceeded MAX_NBIND.");
+// Returns the entry for a new name, enlarging the table if needed.
+static NameBind *CmEnv_new_bind(char *name, int reg, NB_TYPE type) {
+  if (CmEnv.bindPtr >= CmEnv.bindSize) {
+    int size = (CmEnv.bindSize == 0) ? MAX_PORT * 2 + 100 : CmEnv.bindSize * 2;
+    NameBind *bind = realloc(CmEnv.bind, sizeof(NameBind) * size);
+    if (bind == NULL) {
+      printf("[CmEnv]Malloc error\n");
       exit(-1);
     }
+    CmEnv.bind = bind;
+    CmEnv.bindSize = size;
+  }
 
-    result = CmEnv.localNamePtr;
-    CmEnv.localNamePtr++;
-    /*
-    if (CmEnv.localNamePtr > VM_REG_SIZE) {
-      puts("SYSTEM ERROR: CmEnv.localNamePtr exceeded VM_REG_SIZE.");
-      exit(-1);
-    }
-    */
+  NameBind *at = &CmEnv.bind[CmEnv.bindPtr++];
+  at->name = name;
+  at->reg = reg;
+  at->refnum = 0;
+  at->type = type;
+  return at;
+}
+
+int CmEnv_set_symbol_as_name(char *name) {
+  // return: a regnum for the given name.
 
-    return result;
+  if (name != NULL) {
+    return CmEnv_new_bind(name, CmEnv_newvar(), NB_NAME)->reg;
   }
   return -1;
 }
 void CmEnv_set_symbol_as_meta(char *name, int reg, NB_TYPE type) {
 
   if (name != NULL) {
-    CmEnv.bind[CmEnv.bindPtr].name = name;
-    CmEnv.bind[CmEnv.bindPtr].reg = reg;
-    CmEnv.bind[CmEnv.bindPtr].refnum = 0;
-    CmEnv.bind[CmEnv.bindPtr].type = type;
+    CmEnv_new_bind(name, reg, type);
 
     // update the last index for metanames
-    CmEnv.bindPtr_metanames = CmEnv.bindPtr;
-
-    CmEnv.bindPtr++;
-    if (CmEnv.bindPtr > MAX_NBIND) {
-      puts("SYSTEM ERROR: CmEnv.bindPtr exceeded MAX_NBIND.");
-      exit(-1);
-    }
+    CmEnv.bindPtr_metanames = CmEnv.bindPtr - 1;
   }
 }
 int CmEnv_set_as_INTVAR(char *name) {
-  int result;
 
   if (name != NULL) {
-    CmEnv.bind[CmEnv.bindPtr].name = name;
-    CmEnv.bind[CmEnv.bindPtr].reg = CmEnv.localNamePtr;
-    CmEnv.bind[CmEnv.bindPtr].refnum = 0;
-    CmEnv.bind[CmEnv.bindPtr].type = NB_INTVAR;
-    result = CmEnv.localNamePtr;
-
-    CmEnv.bindPtr++;
-    if (CmEnv.bindPtr > MAX_NBIND) {
-      puts("SYSTEM ERROR: CmEnv.bindPtr exceeded MAX_NBIND.");
-      exit(-1);
-    }
-
-    CmEnv.localNamePtr++;
-    /*
-    if (CmEnv.localNamePtr > VM_REG_SIZE) {
-      puts("SYSTEM ERROR: CmEnv.localNamePtr exceeded VM_REG_SIZE.");
-      exit(-1);
-    }
-    */
-
-    return result;
+    return CmEnv_new_bind(name, CmEnv_newvar(), NB_INTVAR)->reg;
   }
   return -1;
 }
@@ -1027,12 +1339,11 @@ int CmEnv_newvar(void) {
   int result;
   result = CmEnv.localNamePtr;
   CmEnv.localNamePtr++;
-  /*
-  if (CmEnv.localNamePtr > VM_REG_SIZE) {
-    puts("SYSTEM ERROR: CmEnv.localNamePtr exceeded VM_REG_SIZE.");
-    exit(-1);
-  }
-  */
+
+#ifndef OPTIMISE_IMCODE
+  // Local variables are used as registers as they are.
+  VM_Reg_Reserve(CmEnv.localNamePtr);
+#endif
   return result;
 }
 int CmEnv_check_linearity_in_rule(void) {
@@ -1107,233 +1418,9 @@ void CmEnv_retrieve_MKGNAME(void) {
     }
   }
 }
-int CmEnv_using_reg_with_nothing_info(int localvar) {
-#ifndef OPTIMISE_TWO_ADDRESS
-  for (int i = 0; i < VM_REG_SIZE; i++) {
-    if (CmEnv.tmpRegState[i] == localvar) {
-      return i;
-    }
-  }
-  return -1; // nothing
-#else
-
-  // For two address
-
-  if (CmEnv.is_in_jmpcnctBlock) {
-    for (int i = 0; i < VM_REG_SIZE; i++) {
-      if (CmEnv.jmpcnctBlockRegState[i] == localvar) {
-        return i;
-      }
-    }
-  } else {
-    for (int i = 0; i < VM_REG_SIZE; i++) {
-      if (CmEnv.tmpRegState[i] == localvar) {
-        return i;
-      }
-    }
-  }
-  return -1; // nothing
-#endif
-}
-int CmEnv_using_reg(int localvar) {
-#ifndef OPTIMISE_TWO_ADDRESS
-  int retval = CmEnv_using_reg_with_nothing_info(localvar);
-  if (retval != -1) {
-    return retval;
-  }
-  printf("ERROR[CmEnv_using_reg]: No register assigned to var%d\n", localvar);
-  exit(1);
-#else
-
-  // For two address
-  int retval = CmEnv_using_reg_with_nothing_info(localvar);
-  if (retval != -1) {
-    return retval;
-  }
-  printf("ERROR[CmEnv_using_reg]: No register assigned to var%d\n", localvar);
-  printf("is_in_jmpcnctBlock:%d\n", CmEnv.is_in_jmpcnctBlock);
-  exit(1);
-#endif
-}
-int CmEnv_get_newreg(int localvar) {
-#ifndef OPTIMISE_TWO_ADDRESS
-  //  for (int i=VM_OFFSET_LOCALVAR; i<VM_REG_SIZE; i++) {
-  for (int i = 1; i < VM_REG_SIZE; i++) {
-    if (CmEnv.tmpRegState[i] == -1) {
-      CmEnv.tmpRegState[i] = localvar;
-      return i;
-    }
-  }
-#else
-
-  // for two address
-  if (CmEnv.is_in_jmpcnctBlock) {
-    for (int i = 0; i < VM_REG_SIZE; i++) {
-      if (CmEnv.jmpcnctBlockRegState[i] == -1) {
-        CmEnv.jmpcnctBlockRegState[i] = localvar;
-        return i;
-      }
-    }
-  } else {
-    for (int i = 1; i < VM_REG_SIZE; i++) {
-      if (CmEnv.tmpRegState[i] == -1) {
-        CmEnv.tmpRegState[i] = localvar;
-        return i;
-      }
-    }
-  }
-
-#endif
-
-  printf("ERROR[CmEnv_get_newreg]: All registers run up.\n");
-  exit(1);
-}
-void CmEnv_free_reg(int reg) {
-#ifndef OPTIMISE_TWO_ADDRESS
-  if (reg >= VM_OFFSET_LOCALVAR)
-    CmEnv.tmpRegState[reg] = -1;
-#else
-
-  // for two address
-
-  if (CmEnv.is_in_jmpcnctBlock) {
-    CmEnv.jmpcnctBlockRegState[reg] = -1;
-    return;
-  } else {
-    // if (reg >= VM_OFFSET_LOCALVAR)  // removed this comment out for v0.8.2-2
-    //                            // so, regs for meta variables are not freed.
-    if (reg >= VM_OFFSET_LOCALVAR)
-      CmEnv.tmpRegState[reg] = -1;
-  }
-#endif
-}
-int CmEnv_Optimise_check_occurence_in_block(int localvar,
-                                            int target_imcode_addr) {
-  struct IMCode_tag *imcode;
-
-  for (int i = target_imcode_addr + 1; i < IMCode_n; i++) {
-    imcode = &IMCode[i];
-
-    if (imcode->opcode == OP_BEGIN_BLOCK) {
-      // This optimisation will last until OP_BEGIN_BLOCK occurs
-      return 0;
-    }
-
-#ifdef OPTIMISE_TWO_ADDRESS
-    if (CmEnv.is_in_jmpcnctBlock &&
-        imcode->opcode == OP_BEGIN_JMPCNCT_BLOCK) {
-      // This optimisation will last until OP_BEGIN_JMPCNCT_BLOCK occurs
-      return 0;
-    }
-#endif
-
-    switch (imcode->opcode) {
-    case OP_LOAD_META:
-      // LOAD_META src dest
-      // If `localvar' occurs as `dest', it should not be freed.
-      if (imcode->operand2 == localvar) {
-        return 1;
-      }
-
-    case OP_LOAD:
-    case OP_LOADI:
-      // OP src1 dest
-      if (imcode->operand1 == localvar) {
-        return 1;
-      }
-      break;
-
-    case OP_LOADP:
-      // OP src1 port dest
-      if (imcode->operand1 == localvar) {
-        return 1;
-      }
-      break;
-
-    case OP_LOADP_L:
-    case OP_LOADP_R:
-      // OP src1 port
-      if (imcode->operand1 == localvar) {
-        return 1;
-      }
-      break;
-
-    case OP_MKNAME:
-    case OP_MKGNAME:
-    case OP_MKAGENT:
-      break;
-
-    case OP_PUSH:
-    case OP_MYPUSH:
-      if (imcode->operand1 == localvar) {
-        return 1;
-      }
-      if (imcode->operand2 == localvar) {
-        return 1;
-      }
-      break;
-
-    case OP_JMPEQ0:
-    case OP_JMPNEQ0:
-    case OP_JMPCNCT_CONS:
-    case OP_JMPCNCT:
-    case OP_PUSHI:
-      if (imcode->operand1 == localvar) {
-        return 1;
-      }
-      break;
-
-    case OP_MUL:
-    case OP_DIV:
-    case OP_MOD:
-    case OP_LT:
-    case OP_LE:
-    case OP_EQ:
-    case OP_NE:
-    case OP_ADD:
-    case OP_SUB:
-      // OP src1 src2 dest
-      if (imcode->operand1 == localvar) {
-        return 1;
-      }
-      if (imcode->operand2 == localvar) {
-        return 1;
-      }
-      break;
-
-    case OP_ADDI:
-    case OP_SUBI:
-    case OP_EQI:
-      // OP src1 $2 dest
-      if (imcode->operand1 == localvar) {
-        return 1;
-      }
-      break;
-
-    case OP_LT_R0:
-    case OP_LE_R0:
-    case OP_EQ_R0:
-    case OP_NE_R0:
-      // OP src1 src2
-      if (imcode->operand1 == localvar) {
-        return 1;
-      }
-      if (imcode->operand2 == localvar) {
-        return 1;
-      }
-      break;
-
-    case OP_EQI_R0:
-      // OP src1
-      if (imcode->operand1 == localvar) {
-        return 1;
-      }
-      break;
-    }
-  }
-
-  return 0;
-}
+// Folds the integer of `LOADI $i var' into the first instruction reading var.
+// The LOADI is left to the dead code elimination of the register allocation,
+// because var may be read again after that.
 int CmEnv_Optimise_VMCode_CopyPropagation_LOADI(int target_imcode_addr) {
 
   struct IMCode_tag *imcode;
@@ -1365,13 +1452,11 @@ int CmEnv_Optimise_VMCode_CopyPropagation_LOADI(int target_imcode_addr) {
         imcode->opcode = OP_PUSHI;
         imcode->operand1 = imcode->operand2;
         imcode->operand2 = load_i;
-        IMCode[target_imcode_addr].opcode = OP_DEAD_CODE;
         return 1;
       }
       if (imcode->operand2 == load_to) {
         imcode->opcode = OP_PUSHI;
         imcode->operand2 = load_i;
-        IMCode[target_imcode_addr].opcode = OP_DEAD_CODE;
         return 1;
       }
       break;
@@ -1389,7 +1474,6 @@ int CmEnv_Optimise_VMCode_CopyPropagation_LOADI(int target_imcode_addr) {
           imcode->operand1 = imcode->operand2;
           imcode->operand2 = load_i;
         }
-        IMCode[target_imcode_addr].opcode = OP_DEAD_CODE;
         return 1;
       }
       if (imcode->operand2 == load_to) {
@@ -1401,7 +1485,6 @@ int CmEnv_Optimise_VMCode_CopyPropagation_LOADI(int target_imcode_addr) {
           imcode->opcode = OP_ADDI;
           imcode->operand2 = load_i;
         }
-        IMCode[target_imcode_addr].opcode = OP_DEAD_CODE;
         return 1;
       }
       break;
@@ -1417,7 +1500,6 @@ int CmEnv_Optimise_VMCode_CopyPropagation_LOADI(int target_imcode_addr) {
           imcode->opcode = OP_SUBI;
           imcode->operand2 = load_i;
         }
-        IMCode[target_imcode_addr].opcode = OP_DEAD_CODE;
         return 1;
       }
       break;
@@ -1433,7 +1515,6 @@ int CmEnv_Optimise_VMCode_CopyPropagation_LOADI(int target_imcode_addr) {
         }
         imcode->operand1 = imcode->operand2;
         imcode->operand2 = load_i;
-        IMCode[target_imcode_addr].opcode = OP_DEAD_CODE;
         return 1;
       }
       if (imcode->operand2 == load_to) {
@@ -1443,50 +1524,29 @@ int CmEnv_Optimise_VMCode_CopyPropagation_LOADI(int target_imcode_addr) {
           imcode->opcode = OP_EQI_R0;
         }
         imcode->operand2 = load_i;
-        IMCode[target_imcode_addr].opcode = OP_DEAD_CODE;
         return 1;
       }
       break;
+
+#ifdef OPTIMISE_IMCODE
+    default: {
+      // The LOADI is kept for other instructions reading the value,
+      // so the search stops there.
+      IMCodeRegs regs;
+      CmEnv_get_IMCode_regs(imcode, &regs);
+      for (int k = 0; k < regs.use_num; k++) {
+        if (*regs.use[k] == load_to) {
+          return 0;
+        }
+      }
+    }
+#endif
     }
   }
 
   return 0;
 }
 
-#ifdef OPTIMISE_TWO_ADDRESS
-int CmEnv_assign_reg(int localvar, int reg) {
-  // Enforce assignment of localvar to reg.
-  // [Return values]
-  //   When the reg has been already used,
-  //     this function returns a new reg.
-  //   Otherwise it returns -1.
-
-  int *tmpRegState;
-
-  if (CmEnv.is_in_jmpcnctBlock) {
-    tmpRegState = CmEnv.jmpcnctBlockRegState;
-  } else {
-    tmpRegState = CmEnv.tmpRegState;
-  }
-
-  if (tmpRegState[reg] == localvar) {
-    return -1;
-  }
-
-  if (tmpRegState[reg] < 0) {
-    tmpRegState[reg] = localvar;
-    return -1;
-  }
-
-  int orig_var = tmpRegState[reg];
-
-  tmpRegState[reg] = localvar;
-
-  int new_reg = CmEnv_get_newreg(orig_var);
-  return new_reg;
-}
-#endif
-
 void CmEnv_copy_VMCode(const int byte, void **source, void **target) {
   for (int i = 0; i < byte; i++) {
     target[i] = source[i];
@@ -12,9 +12,6 @@ typedef enum {
   NB_WILDCARD,
 } NB_TYPE;
 
-// NBIND 数は meta数(MAX_PORT*2) + 一つの rule（や eqlist） における
-// 最大name出現数(100)
-#define MAX_NBIND MAX_PORT * 2 + 100
 typedef struct {
   char *name;
   int   reg;
@@ -28,10 +25,11 @@ typedef struct {
 typedef struct {
 
   // Management table for local and global names
-  NameBind bind[MAX_NBIND];
-  int      bindPtr;           // its index
-  int      bindPtr_metanames; // The max index that stores info of meta names
-                              // (default: -1)
+  NameBind *bind;              // enlarged when names run out
+  int       bindSize;          // its size
+  int       bindPtr;           // its index
+  int       bindPtr_metanames; // The max index that stores info of meta names
+                               // (default: -1)
 
   // Index for local and global names in Regs
   int localNamePtr; // It starts from VM_OFFSET_LOCALVAR
@@ -43,14 +41,7 @@ typedef struct {
   int annotateL, annotateR;   // `Annotation properties' such as (*L) (*R) (int)
 
   // for compilation to VMCode
-  int label;                    // labels
-  int tmpRegState[VM_REG_SIZE]; // register assignments
-                                // store localvar numbers. -1 is no assignment.
-
-#ifdef OPTIMISE_TWO_ADDRESS
-  int jmpcnctBlockRegState[VM_REG_SIZE];
-  int is_in_jmpcnctBlock;
-#endif
+  int label; // labels
 
   // the amount of compilation error
   int count_compilation_errors;
@@ -65,6 +56,9 @@ typedef struct {
   // flag: tail-call-optimisation
   int tco;
 
+  // flag: inlining of active pairs known at compile time
+  int inline_rules;
+
 } CmEnvironment;
 
 // Annotation states
@@ -76,22 +70,24 @@ typedef struct {
 
 extern CmEnvironment CmEnv;
 
-void CmEnv_copy_VMCode(int byte, void **source, void **target);
-int  CmEnv_generate_VMCode(void **code);
+void   CmEnv_copy_VMCode(int byte, void **source, void **target);
+void **CmEnv_realloc_VMCode(void **code, int byte);
+int    CmEnv_get_VMCode_bound(void);
+int    CmEnv_generate_VMCode(void **code);
+Code CmEnv_get_opcode(void *addr);
+Code CmEnv_get_unfused_opcode(void *addr);
+int  CmEnv_get_VMCode_size(Code op);
+
+#ifdef OPTIMISE_SUPERINSTRUCTION
+const char *CmEnv_get_superinst(void *addr, Code *first);
+#endif
 
-void CmEnv_clear_register_assignment_table_all(void);
 void CmEnv_clear_localnamePtr(void);
 void CmEnv_clear_bind(int preserve_idx);
 void CmEnv_clear_all(void);
 void CmEnv_clear_keeping_rule_properties(void);
 
-#ifdef OPTIMISE_TWO_ADDRESS
-void CmEnv_clear_jmpcnctBlock_assignment_table_all(void);
-void CmEnv_stack_assignment_table(void);
-#endif
-
 int CmEnv_get_newlabel(void);
-int CmEnv_get_newreg(int localvar);
 int CmEnv_gettype_forname(char *key, NB_TYPE *type);
 
 int  CmEnv_set_symbol_as_name(char *name);
@@ -104,21 +100,8 @@ int CmEnv_newvar(void);
 int CmEnv_check_linearity_in_rule(void);
 int CmEnv_check_name_reference_times(void);
 
-int CmEnv_using_reg_with_nothing_info(int localvar);
-int CmEnv_using_reg(int localvar);
-
 void CmEnv_retrieve_MKGNAME(void);
 
-void CmEnv_free_reg(int reg);
-
-#ifdef OPTIMISE_TWO_ADDRESS
-int CmEnv_assign_reg(int localvar, int reg);
-#endif
-
-int CmEnv_Optimise_VMCode_CopyPropagation(int target_imcode_addr);
-int CmEnv_Optimise_VMCode_CopyPropagation_LOADI(int target_imcode_addr);
-int CmEnv_Optimise_check_occurence_in_block(int localvar,
-                                            int target_imcode_addr);
 int CmEnv_Optimise_VMCode_CopyPropagation_LOADI(int target_imcode_addr);
 
 #endif // INPLA_CMENV_H
@@ -20,38 +20,24 @@
 // ------------------------------------------------
 // AST Heap
 // ------------------------------------------------
-// MAX_AST_HEAP defines the heap size of AST.
-// Increase this value if the parser runs out of heap space.
+// AST_HEAP_BLOCK_SIZE defines the number of AST nodes allocated at a time.
+// The heap grows by the blocks, and shrinks to one block after each net.
 // Default: 100000
-#define MAX_AST_HEAP 100000
+#define AST_HEAP_BLOCK_SIZE 100000
 
 // Optional counters (uncomment to enable)
 // #define COUNT_CNCT    // count of execution of JMP_CNCT
 // #define COUNT_MKAGENT // count of execution of mkagent
 
 // ------------------------------------------------
-// Heaps
+// Streaming execution of nets: -fstream-nets
 // ------------------------------------------------
-// MAX_VMCODE_SEQUENCE defines the maximum number of VM codes
-// for each rule. This value limits the code size stored in the RuleTable.
-// Default: 1024.
-#define MAX_VMCODE_SEQUENCE 1024
-
-// MAX_EXEC_VMCODE_SEQUENCE defines the maximum number of VM codes
-// for the top-level execution.
-// This buffer is dynamically allocated at the start of the top-level execution
-// and de-allocated immediately after the compilation and execution finish.
-// Default: 1000000.
-#define MAX_EXEC_VMCODE_SEQUENCE 1000000
-
-// ------------------------------------------------
-// IMCode Sequence
-// ------------------------------------------------
-// MAX_IMCODE_SEQUENCE defines the maximum line number of intermediate codes.
-// This buffer is statically allocated.
-// Increase this value if the compiler runs out of heap space.
-// Default: 1024.
-#define MAX_IMCODE_SEQUENCE 1024
+// Equations of a net are compiled and executed chunk by chunk.
+// STREAM_CHUNK_IMCODE defines the number of IMCode lines
+// after which a chunk is closed at the next boundary of equations
+// that no name crosses.
+// Default: 4096
+#define STREAM_CHUNK_IMCODE 4096
 
 // ------------------------------------------------
 // Enable Inpla Built-in Agent Operations
@@ -94,24 +80,64 @@
 #  endif
 #endif
 
+// For the flexibly expandable ring buffer, cells can be managed by a free list
+// instead of scanning hoops for a free cell. Freed cells are chained and
+// reused in O(1), and never-used cells are taken by a bump pointer.
+// #define HEAP_FREELIST
+
+// Agents having at most two ports, such as S, Cons, Nil and Dup, can be
+// stored in small cells of their own hoops instead of MAX_PORT-wide cells.
+// This reduces memory and cache footprint on list-heavy programs.
+// #define AGENT_SIZE_CLASS
+
 #ifdef FLEX_EXPANDABLE_HEAP
 // The maximum limitation for heap expansion.
 // This helps prevent segmentation faults caused by out-of-memory.
 // Adjust this value according to your environment.
 #define MAX_HOOP_SIZE 50000000
+
+// Hoops are taken from anonymous mmap. Their pages are zero-filled when they
+// are touched first, and zero means a free cell in this heap, so hoops are
+// ready without writing all cells. Large hoops may also use huge pages
+// (see the execution option -Xhuge).
+// Comment out this to use malloc for hoops.
+#define HOOP_MMAP
+
+#  ifdef THREAD
+// A cell freed by a thread other than the owner VM of its heap is pushed
+// onto the remote-free list of the owner, instead of being marked free in
+// the hoop of the other thread directly. The owner drains the list in
+// batches when it runs out of cells or becomes idle.
+// Comment out this to free cells directly in any hoop.
+#    define REMOTE_FREE
+#  endif
+
+// References to cells can be stored in 32 bits as offsets in one region
+// of 4GB reserved for all hoops, instead of 64-bit pointers. This halves
+// ports, registers and equations, but fixnums are limited to 31 bits.
+// It is enabled by the meson option compressed_refs.
+// #define COMPRESSED_REFS
+#endif
+
+#ifdef COMPRESSED_REFS
+#  if !defined(FLEX_EXPANDABLE_HEAP) || !defined(HOOP_MMAP)
+#    error "COMPRESSED_REFS is available only with FLEX_EXPANDABLE_HEAP and HOOP_MMAP."
+#  endif
 #endif
 
 // ------------------------------------------------
 // Rule Table Implementation
 // ------------------------------------------------
-// There are two implementations available for the rule table:
+// There are three implementations available for the rule table:
 //
-//   - Hashed linear table (DEFAULT)
-//   - Simple array table
+//   - Two-level direct table with a code arena (DEFAULT)
+//   - Hashed linear table   (RULETABLE_HASHED)
+//   - Simple array table    (RULETABLE_SIMPLE)
 //
-// To use the default hashed table,
-// leave the following RULETABLE_SIMPLE definition commented out.
+// To use the default direct table,
+// leave the following definitions commented out.
 
+// #define RULETABLE_HASHED
 // #define RULETABLE_SIMPLE
 
 // ------------------------------------------------
@@ -121,8 +147,10 @@
 //
 // Optimisation of the intermediate codes
 //
-//   - Minimise register assignments to improve cache locality.
-//   - Perform copy propagation and dead code elimination for LOAD instructions.
+//   - Allocate registers by linear scan over live ranges of local variables,
+//     so that few registers are used, improving cache locality.
+//   - Coalesce LOAD sources and destinations, eliminating the copies,
+//     and remove dead LOAD instructions.
 //   - Use Reg0 as a special register to store comparison results.
 //   - Apply peephole rewrites for specific instruction patterns.
 //     For instance, `SUBI src $1 dest' becomes `DEC src dest'.
@@ -142,6 +170,12 @@
 
 #endif
 
+// Superinstructions
+//
+//   - Fuse frequent pairs of virtual machine codes, such as LOADP+LOADP
+//     and LT_R0+JMPEQ0_R0, so that one dispatch is saved for each pair.
+#define OPTIMISE_SUPERINSTRUCTION
+
 // ------------------------------------------------
 // For developers
 // ------------------------------------------------
@@ -173,5 +207,9 @@
 // Count the amount of interactions.
 #define COUNT_INTERACTION
 
+// Make the option -fprofile-rules available, which counts interactions,
+// allocated agents and names, and cycles for each active pair.
+#define PROFILE_RULES
+
 #endif
 #endif // IMPLA_CONFIG_H
\ No newline at end of file
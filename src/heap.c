@@ -1,11 +1,49 @@
 #include "heap.h"
 
+#include "topology.h"
 #include "types.h"
 
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+// Heaps bound to the current thread, where freed cells are counted.
+#ifdef THREAD
+static __thread Heap *Bound_agentHeap = NULL;
+static __thread Heap *Bound_nameHeap = NULL;
+#else
+static Heap *Bound_agentHeap = NULL;
+static Heap *Bound_nameHeap = NULL;
+#endif
+
+#ifdef REMOTE_FREE
+// The VM of the heaps bound to the current thread.
+static __thread unsigned int Bound_owner = 0;
+#endif
+
+void Heap_Bind(Heap *agentHeap, Heap *nameHeap) {
+  Bound_agentHeap = agentHeap;
+  Bound_nameHeap = nameHeap;
+#ifdef REMOTE_FREE
+  Bound_owner = agentHeap->owner;
+#endif
+}
+
+// The given cell must be in use.
+static inline void count_free(VALUE ptr) {
+  if (IS_NAMEID(BASIC(ptr)->id)) {
+    Bound_nameHeap->frees++;
+  } else {
+    Bound_agentHeap->frees++;
+  }
+}
+
+// Sets the counters to the number of cells in use, found by scanning.
+void Heap_Recount(Heap *hp, unsigned long used) {
+  hp->allocs = used;
+  hp->frees = 0;
+}
+
 #ifdef EXPANDABLE_HEAP
 
 HoopList *HoopList_new_forName(void) {
@@ -123,6 +161,7 @@ VALUE myalloc_Agent(Heap *hp) {
         hp->last_alloc_list = hoop_list;
 
         //    printf("hit[%d]\n", idx);
+        hp->allocs++;
         return (VALUE) & (hoop[idx]);
       }
       idx++;
@@ -150,9 +189,11 @@ VALUE myalloc_Agent(Heap *hp) {
 #  ifdef VERBOSE_HOOP_EXPANSION
       puts("(Agent hoop is expanded)");
 #  endif
+      hp->expansions++;
 
       HoopList *new_hoop_list;
       new_hoop_list = HoopList_new_forAgent();
+      hp->capacity += HOOP_SIZE;
 
       HoopList *last_alloc = hoop_list->next;
       hoop_list->next = new_hoop_list;
@@ -197,6 +238,7 @@ VALUE myalloc_Name(Heap *hp) {
         hp->last_alloc_list = hoop_list;
 
         //    printf("hit[%d]\n", idx);
+        hp->allocs++;
         return (VALUE) & (hoop[idx]);
       }
       idx++;
@@ -225,9 +267,11 @@ VALUE myalloc_Name(Heap *hp) {
 #  ifdef VERBOSE_HOOP_EXPANSION
       puts("(Name hoop is expanded)");
 #  endif
+      hp->expansions++;
 
       HoopList *new_hoop_list;
       new_hoop_list = HoopList_new_forName();
+      hp->capacity += HOOP_SIZE;
 
       HoopList *last_alloc = hoop_list->next;
       hoop_list->next = new_hoop_list;
@@ -239,11 +283,16 @@ VALUE myalloc_Name(Heap *hp) {
   }
 }
 
-void myfree(VALUE ptr) { SET_HOOPFLAG_READYFORUSE(BASIC(ptr)->id); }
+void myfree(VALUE ptr) {
+  if (!IS_READYFORUSE(BASIC(ptr)->id)) {
+    count_free(ptr);
+  }
+  SET_HOOPFLAG_READYFORUSE(BASIC(ptr)->id);
+}
 
 void myfree2(VALUE ptr, VALUE ptr2) {
-  SET_HOOPFLAG_READYFORUSE(BASIC(ptr)->id);
-  SET_HOOPFLAG_READYFORUSE(BASIC(ptr2)->id);
+  myfree(ptr);
+  myfree(ptr2);
 }
 
 #elif defined(FLEX_EXPANDABLE_HEAP)
@@ -251,6 +300,211 @@ void myfree2(VALUE ptr, VALUE ptr2) {
 unsigned int Hoop_init_size = 12;           // 2^12 = 4096
 unsigned int Hoop_increasing_magnitude = 3; // 2^3  = 8
 
+#  ifdef THREAD
+// NUMA node whose memory is used for hoops made by the current thread.
+static __thread int Hoop_node = -1;
+
+void Heap_Bind_Node(int node) { Hoop_node = node; }
+#  endif
+
+#  ifdef HOOP_MMAP
+#    include <sys/mman.h>
+
+unsigned int Hoop_hugepages = 1;
+
+// Large hoops are mapped in multiples of the huge page size,
+// so that they can be unmapped with the same length in any mode.
+static size_t Hoop_length(size_t bytes) {
+  if (bytes < HOOP_HUGEPAGE_SIZE) {
+    return bytes;
+  }
+  return (bytes + HOOP_HUGEPAGE_SIZE - 1) & ~(HOOP_HUGEPAGE_SIZE - 1);
+}
+
+#    ifdef COMPRESSED_REFS
+// ------------------------------------------------------------
+// Region of hoops for compressed references
+// ------------------------------------------------------------
+// All hoops are taken from one region reserved at first, so that cells are
+// referred to by offsets from its start. Pages of released hoops are given
+// back by madvise, and their ranges are reused for new hoops.
+// The first page is never used, so the offset zero stays NULL.
+#      include <pthread.h>
+
+#      define HEAP_REGION_SIZE (4UL << 30)
+#      define HEAP_PAGE_SIZE   4096UL
+
+char *Heap_region = NULL;
+
+typedef struct RegionRange_tag {
+  size_t                  offset, len;
+  struct RegionRange_tag *next;
+} RegionRange;
+
+static size_t       Region_top = HEAP_PAGE_SIZE;
+static RegionRange *Region_free = NULL;
+#      ifdef THREAD
+static pthread_mutex_t Region_lock = PTHREAD_MUTEX_INITIALIZER;
+#      endif
+
+static void Region_init(void) {
+  // Huge pages are aligned in the region, so it starts at one of them.
+  size_t len = HEAP_REGION_SIZE + HOOP_HUGEPAGE_SIZE;
+  char  *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) {
+    printf("[Heap region]Mmap error\n");
+    exit(-1);
+  }
+  Heap_region = (char *)(((uintptr_t)p + HOOP_HUGEPAGE_SIZE - 1) &
+                         ~(HOOP_HUGEPAGE_SIZE - 1));
+}
+
+// Returns the offset of a range of len bytes, or 0 when the region is full.
+static size_t Region_take(size_t len) {
+  for (RegionRange **r = &Region_free; *r != NULL; r = &(*r)->next) {
+    if ((*r)->len >= len) {
+      size_t offset = (*r)->offset;
+      (*r)->offset += len;
+      (*r)->len -= len;
+      if ((*r)->len == 0) {
+        RegionRange *used = *r;
+        *r = used->next;
+        free(used);
+      }
+      return offset;
+    }
+  }
+
+  size_t offset = Region_top;
+  if (len >= HOOP_HUGEPAGE_SIZE) {
+    offset = (offset + HOOP_HUGEPAGE_SIZE - 1) & ~(HOOP_HUGEPAGE_SIZE - 1);
+  }
+  if (offset + len > HEAP_REGION_SIZE) {
+    return 0;
+  }
+  Region_top = offset + len;
+  return offset;
+}
+
+static void Region_give_back(size_t offset, size_t len) {
+  RegionRange *r = malloc(sizeof(RegionRange));
+  if (r == NULL) {
+    printf("[RegionRange]Malloc error\n");
+    exit(-1);
+  }
+  r->offset = offset;
+  r->len = len;
+  r->next = Region_free;
+  Region_free = r;
+}
+
+// Returns zero-filled memory for a hoop. The pages are not touched here.
+static VALUE *Hoop_alloc(size_t bytes) {
+  size_t len = (Hoop_length(bytes) + HEAP_PAGE_SIZE - 1) & ~(HEAP_PAGE_SIZE - 1);
+
+#      ifdef THREAD
+  pthread_mutex_lock(&Region_lock);
+#      endif
+  if (Heap_region == NULL) {
+    Region_init();
+  }
+  size_t offset = Region_take(len);
+#      ifdef THREAD
+  pthread_mutex_unlock(&Region_lock);
+#      endif
+
+  if (offset == 0) {
+    return NULL;
+  }
+  char *p = Heap_region + offset;
+
+#      ifdef MADV_HUGEPAGE
+  if (Hoop_hugepages != 0 && bytes >= HOOP_HUGEPAGE_SIZE) {
+    madvise(p, len, MADV_HUGEPAGE);
+  }
+#      endif
+#      ifdef THREAD
+  Topology_bind_memory(p, len, Hoop_node);
+#      endif
+
+  return (VALUE *)p;
+}
+
+static void Hoop_free(void *hoop, size_t bytes) {
+  size_t len = (Hoop_length(bytes) + HEAP_PAGE_SIZE - 1) & ~(HEAP_PAGE_SIZE - 1);
+
+  // The pages become zero-filled again when they are touched next.
+  madvise(hoop, len, MADV_DONTNEED);
+
+#      ifdef THREAD
+  pthread_mutex_lock(&Region_lock);
+#      endif
+  Region_give_back((char *)hoop - Heap_region, len);
+#      ifdef THREAD
+  pthread_mutex_unlock(&Region_lock);
+#      endif
+}
+
+#    else
+// Returns zero-filled memory for a hoop. The pages are not touched here.
+static VALUE *Hoop_alloc(size_t bytes) {
+  size_t len = Hoop_length(bytes);
+  void  *p = MAP_FAILED;
+
+#    ifdef MAP_HUGETLB
+  if (Hoop_hugepages == 2 && bytes >= HOOP_HUGEPAGE_SIZE) {
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  }
+#    endif
+
+  if (p == MAP_FAILED) {
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+             0);
+    if (p == MAP_FAILED) {
+      return NULL;
+    }
+#    ifdef MADV_HUGEPAGE
+    if (Hoop_hugepages != 0 && bytes >= HOOP_HUGEPAGE_SIZE) {
+      madvise(p, len, MADV_HUGEPAGE);
+    }
+#    endif
+  }
+
+#    ifdef THREAD
+  // Pages are not touched yet, so they will come from the node.
+  Topology_bind_memory(p, len, Hoop_node);
+#    endif
+
+  return (VALUE *)p;
+}
+
+static void Hoop_free(void *hoop, size_t bytes) {
+  munmap(hoop, Hoop_length(bytes));
+}
+#    endif
+#  else
+
+// Hoops start at cache lines, so that cells of different VMs never share one.
+static VALUE *Hoop_alloc(size_t bytes) {
+  void *p;
+  if (posix_memalign(&p, 64, bytes) != 0) {
+    return NULL;
+  }
+  return (VALUE *)p;
+}
+#  endif
+
+static void HoopList_release(HoopList *hp_list, size_t cell_size) {
+#  ifdef HOOP_MMAP
+  Hoop_free(hp_list->hoop, hp_list->size * cell_size);
+#  else
+  free(hp_list->hoop);
+#  endif
+  free(hp_list);
+}
+
 HoopList *HoopList_new_forName(unsigned int size) {
   HoopList *hp_list = malloc(sizeof(HoopList));
   if (hp_list == NULL) {
@@ -259,7 +513,14 @@ HoopList *HoopList_new_forName(unsigned int size) {
   }
 
   // Name Heap
-  hp_list->hoop = (VALUE *)malloc(size * sizeof(Name));
+#  ifdef HOOP_MMAP
+  hp_list->hoop = Hoop_alloc(size * sizeof(Name));
+  if (hp_list->hoop == (VALUE *)NULL) {
+    printf("[HoopList->Hoop (name)]Mmap error\n");
+    exit(-1);
+  }
+#  else
+  hp_list->hoop = Hoop_alloc(size * sizeof(Name));
   if (hp_list->hoop == (VALUE *)NULL) {
     printf("[HoopList->Hoop (name)]Malloc error\n");
     exit(-1);
@@ -267,6 +528,7 @@ HoopList *HoopList_new_forName(unsigned int size) {
   for (unsigned int i = 0; i < size; i++) {
     RESET_HOOPFLAG_READYFORUSE_NAME(((Name *)hp_list->hoop)[i].basic.id);
   }
+#  endif
   hp_list->size = size;
 
   // hp->next = NULL;   // this should be executed only for the first creation.
@@ -289,7 +551,14 @@ HoopList *HoopList_new_forAgent(unsigned int size) {
   }
 
   // Agent Heap
-  hp_list->hoop = (VALUE *)malloc(size * sizeof(Agent));
+#  ifdef HOOP_MMAP
+  hp_list->hoop = Hoop_alloc(size * sizeof(Agent));
+  if (hp_list->hoop == (VALUE *)NULL) {
+    printf("[HoopList->Hoop]Mmap error\n");
+    exit(-1);
+  }
+#  else
+  hp_list->hoop = Hoop_alloc(size * sizeof(Agent));
   if (hp_list->hoop == (VALUE *)NULL) {
     printf("[HoopList->Hoop]Malloc error\n");
     exit(-1);
@@ -297,6 +566,7 @@ HoopList *HoopList_new_forAgent(unsigned int size) {
   for (unsigned int i = 0; i < size; i++) {
     RESET_HOOPFLAG_READYFORUSE_AGENT(((Agent *)hp_list->hoop)[i].basic.id);
   }
+#  endif
   hp_list->size = size;
 
 #  ifdef PUT_NEW_AGENTHOOP_TIME
@@ -308,6 +578,56 @@ HoopList *HoopList_new_forAgent(unsigned int size) {
   return hp_list;
 }
 
+#  ifdef AGENT_SIZE_CLASS
+HoopList *HoopList_new_forSmallAgent(unsigned int size) {
+  HoopList *hp_list = malloc(sizeof(HoopList));
+  if (hp_list == NULL) {
+    printf("[HoopList]Malloc error\n");
+    exit(-1);
+  }
+
+  // Small Agent Heap
+#    ifdef HOOP_MMAP
+  hp_list->hoop = Hoop_alloc(size * sizeof(SmallAgent));
+  if (hp_list->hoop == (VALUE *)NULL) {
+    printf("[HoopList->Hoop (small agent)]Mmap error\n");
+    exit(-1);
+  }
+#    else
+  hp_list->hoop = Hoop_alloc(size * sizeof(SmallAgent));
+  if (hp_list->hoop == (VALUE *)NULL) {
+    printf("[HoopList->Hoop (small agent)]Malloc error\n");
+    exit(-1);
+  }
+  for (unsigned int i = 0; i < size; i++) {
+    RESET_HOOPFLAG_READYFORUSE_AGENT(
+        ((SmallAgent *)hp_list->hoop)[i].basic.id);
+  }
+#    endif
+  hp_list->size = size;
+
+  return hp_list;
+}
+
+unsigned long Heap_GetNum_Usage_forSmallAgent(Heap *hp) {
+
+  unsigned long count = 0;
+  const HoopList *hoop_list = hp->last_alloc_list;
+
+  do {
+    const SmallAgent *hoop = (SmallAgent *)hoop_list->hoop;
+    for (unsigned int i = 0; i < hoop_list->size; i++) {
+      if (!IS_READYFORUSE(hoop[i].basic.id)) {
+        count++;
+      }
+    }
+    hoop_list = hoop_list->next;
+  } while (hoop_list != hp->last_alloc_list);
+
+  return count;
+}
+#  endif
+
 unsigned long Heap_GetNum_Usage_forAgent(Heap *hp) {
 
   unsigned long count = 0;
@@ -344,6 +664,212 @@ unsigned long Heap_GetNum_Usage_forName(Heap *hp) {
   return count;
 }
 
+// ------------------------------------------------------------
+// Release of free hoops
+// ------------------------------------------------------------
+unsigned int Hoop_retained_size = 18; // 2^18
+
+static bool Hoop_is_free(const HoopList *hp_list, size_t cell_size) {
+  const char *cell = (const char *)hp_list->hoop;
+  for (unsigned int i = 0; i < hp_list->size; i++, cell += cell_size) {
+    if (!IS_READYFORUSE(((const Basic *)cell)->id)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static unsigned long Heap_Shrink(Heap *hp, size_t cell_size) {
+  unsigned long released = 0;
+
+  // The smallest hoop is always kept, so the ring never becomes empty.
+  HoopList *keep = hp->last_alloc_list;
+  for (HoopList *p = keep->next; p != hp->last_alloc_list; p = p->next) {
+    if (p->size < keep->size) {
+      keep = p;
+    }
+  }
+
+  HoopList *prev = keep;
+  HoopList *hoop_list = keep->next;
+  while (hoop_list != keep) {
+    HoopList *next = hoop_list->next;
+
+    if (hp->capacity - hoop_list->size >= Hoop_retained_size &&
+        Hoop_is_free(hoop_list, cell_size)) {
+      prev->next = next;
+      if (hoop_list == hp->last_alloc_list) {
+        hp->last_alloc_list = next;
+        hp->last_alloc_idx = 0;
+      }
+#  ifdef HEAP_FREELIST
+      if (hoop_list == hp->top_list) {
+        hp->top_list = next;
+      }
+#  endif
+      hp->capacity -= hoop_list->size;
+      HoopList_release(hoop_list, cell_size);
+      released++;
+    } else {
+      prev = hoop_list;
+    }
+    hoop_list = next;
+  }
+
+  // Cells are taken from the kept hoop first from now on. Otherwise the
+  // next nets would be allocated in the other hoops again, and those
+  // would never become free.
+#  ifdef HEAP_FREELIST
+  // Its cells come first in the free list rebuilt after this.
+  hp->top_list = keep->next;
+#  else
+  hp->last_alloc_list = keep;
+  hp->last_alloc_idx = 0;
+#  endif
+
+  return released;
+}
+
+unsigned long Heap_Shrink_forAgent(Heap *hp) {
+  return Heap_Shrink(hp, sizeof(Agent));
+}
+
+unsigned long Heap_Shrink_forName(Heap *hp) {
+  return Heap_Shrink(hp, sizeof(Name));
+}
+
+#  ifdef AGENT_SIZE_CLASS
+unsigned long Heap_Shrink_forSmallAgent(Heap *hp) {
+  return Heap_Shrink(hp, sizeof(SmallAgent));
+}
+#  endif
+
+#  ifdef REMOTE_FREE
+// ------------------------------------------------------------
+// Remote free
+// ------------------------------------------------------------
+// Cells are chained in remote-free lists through the same fields as
+// the free lists of HEAP_FREELIST, which are not read soon after freeing.
+#    define LINK_AGENT offsetof(Agent, port[MAX_PORT - 1])
+#    define LINK_NAME  offsetof(Name, port)
+#    ifdef AGENT_SIZE_CLASS
+#      define LINK_SMALLAGENT offsetof(SmallAgent, port[AGENT_SMALL_PORT - 1])
+#    endif
+#    define CELL_LINK(ptr, link) (*(VALUE *)((char *)VALUE2PTR(ptr) + (link)))
+
+#    define SET_OWNER(hp, ptr) (BASIC(ptr)->owner = (hp)->owner)
+
+typedef struct {
+  Heap *agent, *name, *smallAgent;
+} OwnerHeaps;
+
+static OwnerHeaps  *Owner_heaps = NULL;
+static unsigned int Owner_num = 0;
+
+_Static_assert(IDTABLE_SIZE <= HOOPFLAG_REMOTEFREE,
+               "HOOPFLAG_REMOTEFREE is taken by an id");
+
+// Called for each VM before threads start.
+void Heap_Register(unsigned int owner, Heap *agentHeap, Heap *nameHeap,
+                   Heap *smallAgentHeap) {
+#    ifdef CELL_OWNER_MAX
+  if (owner >= CELL_OWNER_MAX) {
+    printf("ERROR: Too many threads for the owner of cells.\n");
+    exit(-1);
+  }
+#    endif
+  if (owner >= Owner_num) {
+    OwnerHeaps *heaps = realloc(Owner_heaps, sizeof(OwnerHeaps) * (owner + 1));
+    if (heaps == NULL) {
+      printf("[OwnerHeaps]Malloc error\n");
+      exit(-1);
+    }
+    Owner_heaps = heaps;
+    Owner_num = owner + 1;
+  }
+
+  Owner_heaps[owner].agent = agentHeap;
+  Owner_heaps[owner].name = nameHeap;
+  Owner_heaps[owner].smallAgent = smallAgentHeap;
+
+  agentHeap->owner = nameHeap->owner = owner;
+  agentHeap->remote_free = nameHeap->remote_free = VALUE_NULL;
+  if (smallAgentHeap != NULL) {
+    smallAgentHeap->owner = owner;
+    smallAgentHeap->remote_free = VALUE_NULL;
+  }
+}
+
+static inline void remote_free_push(Heap *hp, VALUE ptr, size_t link) {
+  VALUE head = __atomic_load_n(&hp->remote_free, __ATOMIC_RELAXED);
+  do {
+    CELL_LINK(ptr, link) = head;
+  } while (!__atomic_compare_exchange_n(&hp->remote_free, &head, ptr, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// The given cell must be in use and owned by another VM.
+static void remote_free(VALUE ptr) {
+  IDTYPE      id = BASIC(ptr)->id;
+  OwnerHeaps *heaps = &Owner_heaps[BASIC(ptr)->owner];
+
+  BASIC(ptr)->id = HOOPFLAG_REMOTEFREE;
+
+  if (IS_NAMEID(id)) {
+    remote_free_push(heaps->name, ptr, LINK_NAME);
+#    ifdef AGENT_SIZE_CLASS
+  } else if (IS_SMALL_AGENT(id, IdTable_get_arity(id))) {
+    // Agent cells given a small id also go to the small class.
+    remote_free_push(heaps->smallAgent, ptr, LINK_SMALLAGENT);
+#    endif
+  } else {
+    remote_free_push(heaps->agent, ptr, LINK_AGENT);
+  }
+}
+
+// The list is taken at once, so pushes by the others never wait.
+static unsigned long remote_free_drain(Heap *hp, size_t link) {
+  if (__atomic_load_n(&hp->remote_free, __ATOMIC_RELAXED) == VALUE_NULL) {
+    return 0;
+  }
+
+  VALUE ptr =
+      __atomic_exchange_n(&hp->remote_free, VALUE_NULL, __ATOMIC_ACQUIRE);
+  unsigned long count = 0;
+
+  while (ptr != VALUE_NULL) {
+    VALUE next = CELL_LINK(ptr, link);
+    SET_HOOPFLAG_READYFORUSE(BASIC(ptr)->id);
+#    ifdef HEAP_FREELIST
+    CELL_LINK(ptr, link) = hp->free_list;
+    hp->free_list = ptr;
+#    endif
+    ptr = next;
+    count++;
+  }
+
+  return count;
+}
+
+unsigned long Heap_Drain_RemoteFree_forAgent(Heap *hp) {
+  return remote_free_drain(hp, LINK_AGENT);
+}
+
+unsigned long Heap_Drain_RemoteFree_forName(Heap *hp) {
+  return remote_free_drain(hp, LINK_NAME);
+}
+
+#    ifdef AGENT_SIZE_CLASS
+unsigned long Heap_Drain_RemoteFree_forSmallAgent(Heap *hp) {
+  return remote_free_drain(hp, LINK_SMALLAGENT);
+}
+#    endif
+
+#  else
+#    define SET_OWNER(hp, ptr)
+#  endif
+
+#  ifndef HEAP_FREELIST
 // static inline
 VALUE myalloc_Agent(Heap *hp) {
 
@@ -364,7 +890,9 @@ VALUE myalloc_Agent(Heap *hp) {
         hp->last_alloc_list = hoop_list;
 
         //    printf("hit[%d]\n", idx);
-        return (VALUE) & hoop[idx];
+        hp->allocs++;
+        SET_OWNER(hp, PTR2VALUE(&hoop[idx]));
+        return PTR2VALUE(&hoop[idx]);
       }
       idx++;
     }
@@ -378,6 +906,14 @@ VALUE myalloc_Agent(Heap *hp) {
 
     } else {
       // There are no other hoops. A new hoop should be created.
+#    ifdef REMOTE_FREE
+      // But cells freed by the other threads are reused first if any.
+      if (Heap_Drain_RemoteFree_forAgent(hp) > 0) {
+        hoop_list = hp->last_alloc_list;
+        idx = 0;
+        continue;
+      }
+#    endif
 
       //          v when come again here
       //    current    last_alloc
@@ -392,6 +928,7 @@ VALUE myalloc_Agent(Heap *hp) {
 #  ifdef VERBOSE_HOOP_EXPANSION
       puts("(Agent hoop is expanded)");
 #  endif
+      hp->expansions++;
 
       // puts("!");
       /*
@@ -415,6 +952,7 @@ VALUE myalloc_Agent(Heap *hp) {
       unsigned int new_size_p2 =
           hp->last_alloc_list->size * Hoop_increasing_magnitude;
       new_hoop_list = HoopList_new_forAgent(new_size_p2);
+      hp->capacity += new_size_p2;
 
       HoopList *last_alloc = hoop_list->next;
       hoop_list->next = new_hoop_list;
@@ -457,7 +995,9 @@ VALUE myalloc_Name(Heap *hp) {
 
         //		printf("%d\n", hp->last_alloc_idx); exit(1);
         //    printf("hit[%d]\n", idx);
-        return (VALUE) & hoop[idx];
+        hp->allocs++;
+        SET_OWNER(hp, PTR2VALUE(&hoop[idx]));
+        return PTR2VALUE(&hoop[idx]);
       }
       idx++;
     }
@@ -472,6 +1012,13 @@ VALUE myalloc_Name(Heap *hp) {
     } else {
 
       // There are no other hoops. A new hoop should be created.
+#    ifdef REMOTE_FREE
+      if (Heap_Drain_RemoteFree_forName(hp) > 0) {
+        hoop_list = hp->last_alloc_list;
+        idx = 0;
+        continue;
+      }
+#    endif
 
       //          v when come again here
       //    current    last_alloc
@@ -485,12 +1032,14 @@ VALUE myalloc_Name(Heap *hp) {
 #  ifdef VERBOSE_HOOP_EXPANSION
       puts("(Name hoop is expanded)");
 #  endif
+      hp->expansions++;
 
       // unsigned int new_size_p2 = hoop_list->size * Hoop_increasing_magnitude;
       const unsigned int new_size_p2 =
           hp->last_alloc_list->size * Hoop_increasing_magnitude;
 
       HoopList *new_hoop_list = HoopList_new_forName(new_size_p2);
+      hp->capacity += new_size_p2;
 
       HoopList *last_alloc = hoop_list->next;
       hoop_list->next = new_hoop_list;
@@ -502,13 +1051,377 @@ VALUE myalloc_Name(Heap *hp) {
   }
 }
 
-void myfree(VALUE ptr) { SET_HOOPFLAG_READYFORUSE(BASIC(ptr)->id); }
+#    ifdef AGENT_SIZE_CLASS
+// static inline
+VALUE myalloc_SmallAgent(Heap *hp) {
+
+  unsigned int idx = hp->last_alloc_idx;
+  HoopList *hoop_list = hp->last_alloc_list;
+
+  while (true) {
+    SmallAgent *hoop = (SmallAgent *)hoop_list->hoop;
+
+    while (idx < hoop_list->size) {
+      if (IS_READYFORUSE(hoop[idx].basic.id)) {
+        hp->last_alloc_idx = idx;
+        hp->last_alloc_list = hoop_list;
+        hp->allocs++;
+        SET_OWNER(hp, PTR2VALUE(&hoop[idx]));
+        return PTR2VALUE(&hoop[idx]);
+      }
+      idx++;
+    }
+
+    // No nodes are available in this hoop.
+
+    if (hoop_list->next != hp->last_alloc_list) {
+      // There is another hoop.
+      hoop_list = hoop_list->next;
+      idx = 0;
+
+    } else {
+      // There are no other hoops. A new hoop should be created
+      // in the same way as myalloc_Agent.
+#      ifdef REMOTE_FREE
+      if (Heap_Drain_RemoteFree_forSmallAgent(hp) > 0) {
+        hoop_list = hp->last_alloc_list;
+        idx = 0;
+        continue;
+      }
+#      endif
+
+#      ifdef VERBOSE_HOOP_EXPANSION
+      puts("(Small agent hoop is expanded)");
+#      endif
+      hp->expansions++;
+
+      unsigned int new_size_p2 =
+          hp->last_alloc_list->size * Hoop_increasing_magnitude;
+      HoopList *new_hoop_list = HoopList_new_forSmallAgent(new_size_p2);
+      hp->capacity += new_size_p2;
+
+      HoopList *last_alloc = hoop_list->next;
+      hoop_list->next = new_hoop_list;
+      new_hoop_list->next = last_alloc;
+
+      hoop_list = new_hoop_list;
+      idx = 0;
+    }
+  }
+}
+#    endif
+
+void myfree(VALUE ptr) {
+#    ifdef REMOTE_FREE
+  IDTYPE id = BASIC(ptr)->id;
+  if (IS_READYFORUSE(id) || id == HOOPFLAG_REMOTEFREE) {
+    return;
+  }
+  count_free(ptr);
+  if (BASIC(ptr)->owner != Bound_owner) {
+    remote_free(ptr);
+    return;
+  }
+#    else
+  if (!IS_READYFORUSE(BASIC(ptr)->id)) {
+    count_free(ptr);
+  }
+#    endif
+  SET_HOOPFLAG_READYFORUSE(BASIC(ptr)->id);
+}
 
 void myfree2(VALUE ptr, VALUE ptr2) {
+  myfree(ptr);
+  myfree(ptr2);
+}
+
+#  else
+// ------------------------------------------------------------
+// Free-list mode (HEAP_FREELIST)
+// ------------------------------------------------------------
+// Allocation pops a freed cell, or bumps a never-used cell, in O(1).
+// Freed cells keep the READYFORUSE id so that Heap_GetNum_Usage_* and
+// the sweep work as they are.
+
+#    ifdef AGENT_SIZE_CLASS
+#      ifdef THREAD
+static __thread Heap *FreeList_smallAgentHeap = NULL;
+#      else
+static Heap *FreeList_smallAgentHeap = NULL;
+#      endif
+
+void Heap_Bind_FreeList_forSmallAgent(Heap *smallAgentHeap) {
+  FreeList_smallAgentHeap = smallAgentHeap;
+}
+#    endif
+
+// static inline
+VALUE myalloc_Agent(Heap *hp) {
+
+  VALUE ptr = hp->free_list;
+  if (ptr != VALUE_NULL) {
+    hp->free_list = FREELIST_NEXT_AGENT(ptr);
+    hp->allocs++;
+    SET_OWNER(hp, ptr);
+    return ptr;
+  }
+
+  HoopList *hoop_list = hp->last_alloc_list;
+  if (hp->last_alloc_idx >= hoop_list->size) {
+
+    if (hoop_list->next != hp->top_list) {
+      // The next hoop has not been used yet.
+      hoop_list = hoop_list->next;
+
+    } else {
+      // All hoops have been used. A new hoop is inserted before the top.
+      //
+      //    current      top
+      // -->|xxxxxx|-->|xxxxxx|-->
+      //
+      // ==>
+      //               new current
+      // -->|xxxxxx|-->|oooooo|-->|xxxxxx|-->
+#    ifdef REMOTE_FREE
+      // But cells freed by the other threads are reused first if any.
+      if (Heap_Drain_RemoteFree_forAgent(hp) > 0) {
+        return myalloc_Agent(hp);
+      }
+#    endif
+
+#    ifdef VERBOSE_HOOP_EXPANSION
+      puts("(Agent hoop is expanded)");
+#    endif
+      hp->expansions++;
+
+      HoopList *new_hoop_list =
+          HoopList_new_forAgent(hoop_list->size * Hoop_increasing_magnitude);
+      hp->capacity += new_hoop_list->size;
+      new_hoop_list->next = hoop_list->next;
+      hoop_list->next = new_hoop_list;
+      hoop_list = new_hoop_list;
+    }
+
+    hp->last_alloc_list = hoop_list;
+    hp->last_alloc_idx = 0;
+  }
+
+  hp->allocs++;
+  ptr = PTR2VALUE(&((Agent *)hoop_list->hoop)[hp->last_alloc_idx++]);
+  SET_OWNER(hp, ptr);
+  return ptr;
+}
+
+// static inline
+VALUE myalloc_Name(Heap *hp) {
+
+  VALUE ptr = hp->free_list;
+  if (ptr != VALUE_NULL) {
+    hp->free_list = FREELIST_NEXT_NAME(ptr);
+    hp->allocs++;
+    SET_OWNER(hp, ptr);
+    return ptr;
+  }
+
+  HoopList *hoop_list = hp->last_alloc_list;
+  if (hp->last_alloc_idx >= hoop_list->size) {
+
+    if (hoop_list->next != hp->top_list) {
+      hoop_list = hoop_list->next;
+
+    } else {
+#    ifdef REMOTE_FREE
+      if (Heap_Drain_RemoteFree_forName(hp) > 0) {
+        return myalloc_Name(hp);
+      }
+#    endif
+#    ifdef VERBOSE_HOOP_EXPANSION
+      puts("(Name hoop is expanded)");
+#    endif
+      hp->expansions++;
+
+      HoopList *new_hoop_list =
+          HoopList_new_forName(hoop_list->size * Hoop_increasing_magnitude);
+      hp->capacity += new_hoop_list->size;
+      new_hoop_list->next = hoop_list->next;
+      hoop_list->next = new_hoop_list;
+      hoop_list = new_hoop_list;
+    }
+
+    hp->last_alloc_list = hoop_list;
+    hp->last_alloc_idx = 0;
+  }
+
+  hp->allocs++;
+  ptr = PTR2VALUE(&((Name *)hoop_list->hoop)[hp->last_alloc_idx++]);
+  SET_OWNER(hp, ptr);
+  return ptr;
+}
+
+#    ifdef AGENT_SIZE_CLASS
+// static inline
+VALUE myalloc_SmallAgent(Heap *hp) {
+
+  VALUE ptr = hp->free_list;
+  if (ptr != VALUE_NULL) {
+    hp->free_list = FREELIST_NEXT_SMALLAGENT(ptr);
+    hp->allocs++;
+    SET_OWNER(hp, ptr);
+    return ptr;
+  }
+
+  HoopList *hoop_list = hp->last_alloc_list;
+  if (hp->last_alloc_idx >= hoop_list->size) {
+
+    if (hoop_list->next != hp->top_list) {
+      hoop_list = hoop_list->next;
+
+    } else {
+#      ifdef REMOTE_FREE
+      if (Heap_Drain_RemoteFree_forSmallAgent(hp) > 0) {
+        return myalloc_SmallAgent(hp);
+      }
+#      endif
+#      ifdef VERBOSE_HOOP_EXPANSION
+      puts("(Small agent hoop is expanded)");
+#      endif
+      hp->expansions++;
+
+      HoopList *new_hoop_list = HoopList_new_forSmallAgent(
+          hoop_list->size * Hoop_increasing_magnitude);
+      hp->capacity += new_hoop_list->size;
+      new_hoop_list->next = hoop_list->next;
+      hoop_list->next = new_hoop_list;
+      hoop_list = new_hoop_list;
+    }
+
+    hp->last_alloc_list = hoop_list;
+    hp->last_alloc_idx = 0;
+  }
+
+  hp->allocs++;
+  ptr = PTR2VALUE(&((SmallAgent *)hoop_list->hoop)[hp->last_alloc_idx++]);
+  SET_OWNER(hp, ptr);
+  return ptr;
+}
+#    endif
+
+// static inline
+static void freelist_push(VALUE ptr) {
+  IDTYPE id = BASIC(ptr)->id;
+
+  if (IS_READYFORUSE(id)) {
+    // Already freed. Chaining it twice would make a cycle.
+    return;
+  }
+#    ifdef REMOTE_FREE
+  if (id == HOOPFLAG_REMOTEFREE) {
+    return;
+  }
+#    endif
+
+  count_free(ptr);
+#    ifdef REMOTE_FREE
+  if (BASIC(ptr)->owner != Bound_owner) {
+    remote_free(ptr);
+    return;
+  }
+#    endif
   SET_HOOPFLAG_READYFORUSE(BASIC(ptr)->id);
-  SET_HOOPFLAG_READYFORUSE(BASIC(ptr2)->id);
+
+  if (IS_NAMEID(id)) {
+    FREELIST_NEXT_NAME(ptr) = Bound_nameHeap->free_list;
+    Bound_nameHeap->free_list = ptr;
+#    ifdef AGENT_SIZE_CLASS
+  } else if (IS_SMALL_AGENT(id, IdTable_get_arity(id))) {
+    // Agent cells given a small id also go to the small class.
+    FREELIST_NEXT_SMALLAGENT(ptr) = FreeList_smallAgentHeap->free_list;
+    FreeList_smallAgentHeap->free_list = ptr;
+#    endif
+  } else {
+    FREELIST_NEXT_AGENT(ptr) = Bound_agentHeap->free_list;
+    Bound_agentHeap->free_list = ptr;
+  }
+}
+
+void myfree(VALUE ptr) { freelist_push(ptr); }
+
+void myfree2(VALUE ptr, VALUE ptr2) {
+  freelist_push(ptr);
+  freelist_push(ptr2);
+}
+
+// After the sweep, all free cells including never-used ones are chained
+// again, and the bump allocation restarts from the end of the ring.
+void Heap_Rebuild_FreeList_forAgent(Heap *hp) {
+
+  HoopList *hoop_list = hp->top_list;
+  hp->free_list = VALUE_NULL;
+
+  do {
+    Agent *hoop = (Agent *)hoop_list->hoop;
+    for (unsigned int i = hoop_list->size; i-- > 0;) {
+      if (IS_READYFORUSE(hoop[i].basic.id)) {
+        FREELIST_NEXT_AGENT(PTR2VALUE(&hoop[i])) = hp->free_list;
+        hp->free_list = PTR2VALUE(&hoop[i]);
+      }
+    }
+
+    if (hoop_list->next == hp->top_list) {
+      hp->last_alloc_list = hoop_list;
+      hp->last_alloc_idx = hoop_list->size;
+    }
+    hoop_list = hoop_list->next;
+  } while (hoop_list != hp->top_list);
+}
+
+void Heap_Rebuild_FreeList_forName(Heap *hp) {
+
+  HoopList *hoop_list = hp->top_list;
+  hp->free_list = VALUE_NULL;
+
+  do {
+    Name *hoop = (Name *)hoop_list->hoop;
+    for (unsigned int i = hoop_list->size; i-- > 0;) {
+      if (IS_READYFORUSE(hoop[i].basic.id)) {
+        FREELIST_NEXT_NAME(PTR2VALUE(&hoop[i])) = hp->free_list;
+        hp->free_list = PTR2VALUE(&hoop[i]);
+      }
+    }
+
+    if (hoop_list->next == hp->top_list) {
+      hp->last_alloc_list = hoop_list;
+      hp->last_alloc_idx = hoop_list->size;
+    }
+    hoop_list = hoop_list->next;
+  } while (hoop_list != hp->top_list);
 }
 
+#    ifdef AGENT_SIZE_CLASS
+void Heap_Rebuild_FreeList_forSmallAgent(Heap *hp) {
+
+  HoopList *hoop_list = hp->top_list;
+  hp->free_list = VALUE_NULL;
+
+  do {
+    SmallAgent *hoop = (SmallAgent *)hoop_list->hoop;
+    for (unsigned int i = hoop_list->size; i-- > 0;) {
+      if (IS_READYFORUSE(hoop[i].basic.id)) {
+        FREELIST_NEXT_SMALLAGENT(PTR2VALUE(&hoop[i])) = hp->free_list;
+        hp->free_list = PTR2VALUE(&hoop[i]);
+      }
+    }
+
+    if (hoop_list->next == hp->top_list) {
+      hp->last_alloc_list = hoop_list;
+      hp->last_alloc_idx = hoop_list->size;
+    }
+    hoop_list = hoop_list->next;
+  } while (hoop_list != hp->top_list);
+}
+#    endif
+#  endif // HEAP_FREELIST
+
 #else
 // v0.5.6 -------------------------------------
 // Fixed size buffer
@@ -587,6 +1500,7 @@ VALUE myalloc_Agent(Heap *hp) {
 
     hp->lastAlloc = idx;
 
+    hp->allocs++;
     return (VALUE) & (hp_heap[idx]);
   }
 
@@ -621,6 +1535,7 @@ VALUE myalloc_Name(Heap *hp) {
     hp->lastAlloc = idx;
 
     //    return (VALUE)&(((Name *)hp->heap)[idx]);
+    hp->allocs++;
     return (VALUE) & (hp_heap[idx]);
   }
 
@@ -654,15 +1569,16 @@ unsigned long Heap_GetNum_Usage_forAgent(Heap *hp) {
 void myfree(VALUE ptr) {
 
   //  TOGGLE_HEAPFLAG_READYFORUSE(BASIC(ptr)->id);
+  if (!IS_READYFORUSE(BASIC(ptr)->id)) {
+    count_free(ptr);
+  }
   SET_HEAPFLAG_READYFORUSE(BASIC(ptr)->id);
 }
 
 // static inline
 void myfree2(VALUE ptr, VALUE ptr2) {
-
-  //  TOGGLE_HEAPFLAG_READYFORUSE(BASIC(ptr)->id);
-  SET_HEAPFLAG_READYFORUSE(BASIC(ptr)->id);
-  SET_HEAPFLAG_READYFORUSE(BASIC(ptr2)->id);
+  myfree(ptr);
+  myfree(ptr2);
 }
 
 //---------------------------------------------
@@ -6,7 +6,21 @@
 
 #include <stddef.h>
 
+// Heap.allocs, frees and capacity:
+// Counters of cells for memory usage, maintained incrementally.
+// A cell is counted in `allocs' of the heap it is taken from, but in `frees'
+// of the heap bound to the current thread by Heap_Bind, because myfree does
+// not know which heap the cell comes from. So the numbers of live cells are
+// correct only in the sum over all heaps of the same kind.
+// Freed small agents are also counted in the bound agent heap.
+
 #ifdef EXPANDABLE_HEAP
+#  ifdef HEAP_FREELIST
+#    error "HEAP_FREELIST is available only with FLEX_EXPANDABLE_HEAP."
+#  endif
+#  ifdef AGENT_SIZE_CLASS
+#    error "AGENT_SIZE_CLASS is available only with FLEX_EXPANDABLE_HEAP."
+#  endif
 
 // HOOP_SIZE must be power of two
 // #define INIT_HOOP_SIZE (1 << 10)
@@ -31,6 +45,9 @@ typedef struct HoopList_tag {
 typedef struct Heap_tag {
   HoopList *last_alloc_list;
   int last_alloc_idx;
+  unsigned long expansions; // hoops inserted, for run statistics
+  unsigned long allocs, frees; // cells, see the top of this file
+  unsigned long capacity;      // cells in the hoops
 } Heap;
 
 HoopList *HoopList_new_forName(void);
@@ -42,6 +59,23 @@ HoopList *HoopList_new_forAgent(void);
 #elif defined(FLEX_EXPANDABLE_HEAP)
 extern unsigned int Hoop_init_size;
 extern unsigned int Hoop_increasing_magnitude;
+#  ifdef HOOP_MMAP
+// Huge pages for hoops of HOOP_HUGEPAGE_SIZE bytes or more:
+//   0: not used
+//   1: transparent huge pages by madvise (DEFAULT)
+//   2: explicit huge pages by MAP_HUGETLB, or 1 when they are not reserved
+extern unsigned int Hoop_hugepages;
+#    define HOOP_HUGEPAGE_SIZE (2UL << 20)
+#  endif
+
+// Cells kept in each heap when free hoops are released (see -Xkeep).
+extern unsigned int Hoop_retained_size;
+
+#  ifdef THREAD
+// Hoops made by the current thread are taken from the memory of the node.
+// A negative node means the default policy of the OS.
+void Heap_Bind_Node(int node);
+#  endif
 
 typedef struct HoopList_tag {
   VALUE *hoop;
@@ -58,12 +92,100 @@ typedef struct HoopList_tag {
 typedef struct Heap_tag {
   HoopList *last_alloc_list;
   unsigned int last_alloc_idx;
+  unsigned long expansions; // hoops inserted, for run statistics
+  unsigned long allocs, frees; // cells, see the top of this file
+  unsigned long capacity;      // cells in the hoops
+#  ifdef HEAP_FREELIST
+  // Free-list mode:
+  // Freed cells are chained through their last port and popped in O(1).
+  // When the chain is empty, cells are bumped from `last_alloc_list' at
+  // `last_alloc_idx', and hoops after it are still untouched until the ring
+  // comes back to `top_list'.
+  VALUE free_list;
+  HoopList *top_list;
+#  endif
+#  ifdef REMOTE_FREE
+  unsigned int owner; // the id of the VM that has this heap
+  // Cells of this heap freed by the other threads. They are pushed by CAS
+  // and taken all at once by the owner. Written by the other threads,
+  // so it is kept apart from the fields above.
+  VALUE remote_free __attribute__((aligned(64)));
+#  endif
 } Heap;
 
 HoopList *HoopList_new_forName(unsigned int size);
 HoopList *HoopList_new_forAgent(unsigned int size);
 
+#  ifdef REMOTE_FREE
+// Cells in the remote-free lists have this id until they are drained.
+// It is no id of agents and names, and fits in the packed id of cells.
+#    define HOOPFLAG_REMOTEFREE ((IDTYPE)0xFFFF)
+
+// Heaps of the VM `owner', to which cells of the VM are freed by the others.
+// `smallAgentHeap' is NULL without AGENT_SIZE_CLASS.
+void Heap_Register(unsigned int owner, Heap *agentHeap, Heap *nameHeap,
+                   Heap *smallAgentHeap);
+
+// They move the cells freed by the other threads back to the heap,
+// and return the number of the cells. Only the owner may call them,
+// or any thread while no VM is running.
+unsigned long Heap_Drain_RemoteFree_forAgent(Heap *hp);
+unsigned long Heap_Drain_RemoteFree_forName(Heap *hp);
+#    ifdef AGENT_SIZE_CLASS
+unsigned long Heap_Drain_RemoteFree_forSmallAgent(Heap *hp);
+#    endif
+#  endif
+
+// Release hoops whose cells are all free, as long as the heap keeps
+// Hoop_retained_size cells. They return the number of released hoops.
+// The next cells are taken from the smallest hoop, which is always kept.
+// With HEAP_FREELIST, free lists must be rebuilt after them.
+unsigned long Heap_Shrink_forAgent(Heap *hp);
+unsigned long Heap_Shrink_forName(Heap *hp);
+
+#  ifdef AGENT_SIZE_CLASS
+// Merger agents keep their state on port[1] and port[2] besides the arity,
+// and agents whose arity is still unknown are allocated in Agent cells.
+// Any id given to an existing cell must not be larger than the class of
+// the cell, so (*L) and (*R) reuse is checked by the compiler.
+#    define IS_SMALL_AGENT(id, arity)                                          \
+      ((arity) >= 0 && (arity) <= AGENT_SMALL_PORT && (id) != ID_MERGER &&    \
+       (id) != ID_MERGER_P)
+
+HoopList *HoopList_new_forSmallAgent(unsigned int size);
+VALUE myalloc_SmallAgent(Heap *hp);
+unsigned long Heap_GetNum_Usage_forSmallAgent(Heap *hp);
+unsigned long Heap_Shrink_forSmallAgent(Heap *hp);
+#  endif
+
+#  ifdef HEAP_FREELIST
+// The link field of free cells. The last port is used for agents so that
+// the principal port and the auxiliary ports that are read soon after freeing
+// are not overwritten.
+#    define FREELIST_NEXT_AGENT(a) (AGENT(a)->port[MAX_PORT - 1])
+#    define FREELIST_NEXT_NAME(a)  (NAME(a)->port)
+#    ifdef AGENT_SIZE_CLASS
+#      define FREELIST_NEXT_SMALLAGENT(a)                                      \
+        (((SmallAgent *)VALUE2PTR(a))->port[AGENT_SMALL_PORT - 1])
+#    endif
+
+// myfree does not know which VM frees a cell, so freed cells are pushed onto
+// the free lists of heaps bound to the current thread by Heap_Bind.
+void Heap_Rebuild_FreeList_forAgent(Heap *hp);
+void Heap_Rebuild_FreeList_forName(Heap *hp);
+#    ifdef AGENT_SIZE_CLASS
+void Heap_Bind_FreeList_forSmallAgent(Heap *smallAgentHeap);
+void Heap_Rebuild_FreeList_forSmallAgent(Heap *hp);
+#    endif
+#  endif
+
 #else
+#  ifdef HEAP_FREELIST
+#    error "HEAP_FREELIST is available only with FLEX_EXPANDABLE_HEAP."
+#  endif
+#  ifdef AGENT_SIZE_CLASS
+#    error "AGENT_SIZE_CLASS is available only with FLEX_EXPANDABLE_HEAP."
+#  endif
 // v0.5.6 -------------------------------------
 // Fixed size buffer
 // --------------------------------------------
@@ -71,6 +193,8 @@ typedef struct Heap_tag {
   VALUE *heap;
   int lastAlloc;
   unsigned int size;
+  unsigned long allocs, frees; // cells, see the top of this file
+  unsigned long capacity;      // cells in the hoops
 } Heap;
 
 // Heap cells having '1' on the 31bit are ready for use and
@@ -125,10 +249,16 @@ VALUE *MakeNameHeap(int size) {
 VALUE myalloc_Agent(Heap *hp);
 VALUE myalloc_Name(Heap *hp);
 
+// Freed cells are counted in (and with HEAP_FREELIST, chained to)
+// the heaps bound to the current thread.
+void Heap_Bind(Heap *agentHeap, Heap *nameHeap);
+
 void myfree(VALUE ptr);
 void myfree2(VALUE ptr, VALUE ptr2);
 
+// These scan all cells, so Heap_Recount is used only after the sweep.
 unsigned long Heap_GetNum_Usage_forName(Heap *hp);
 unsigned long Heap_GetNum_Usage_forAgent(Heap *hp);
+void Heap_Recount(Heap *hp, unsigned long used);
 
 #endif // INPLA_HEAP_H
@@ -23,7 +23,7 @@ void IdTable_init() {
   }
   for (i = START_ID_OF_GNAME; i < IDTABLE_SIZE; i++) {
     IdTable[i].name = NULL;
-    IdTable[i].aux.heap = (VALUE)NULL;
+    IdTable[i].aux.heap = VALUE_NULL;
   }
 
   // built-in agent
@@ -177,6 +177,8 @@ int IdTable_new_agentid() {
   return NextAgentId;
 }
 
+int IdTable_get_last_agentid(void) { return NextAgentId; }
+
 int IdTable_new_gnameid() {
   NextGnameId++;
   if (NextGnameId < IDTABLE_SIZE) {
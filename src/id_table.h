@@ -106,6 +106,7 @@ void IdTable_set_heap(unsigned long id, VALUE heap);
 VALUE IdTable_get_heap(unsigned long id);
 
 int IdTable_new_agentid();
+int IdTable_get_last_agentid(void);
 int IdTable_new_gnameid();
 
 int IdTable_getid_builtin_funcAgent(Ast *agent);
@@ -3,87 +3,91 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-static void IMCODE_OVERFLOW_CHECK() {
-  if (IMCode_n > MAX_IMCODE_SEQUENCE) {
-    fprintf(stderr, "IMCODE overflow: %d\n", IMCode_n);
-    exit(EXIT_FAILURE);
-  }
-}
+// The first size of the sequence, which is doubled when it runs out.
+#define IMCODE_INIT_SIZE 1024
 
 int IMCode_n;
-struct IMCode_tag IMCode[MAX_IMCODE_SEQUENCE];
+struct IMCode_tag *IMCode = NULL;
+static int IMCode_size = 0;
 
 void IMCode_init(void) { IMCode_n = 0; }
 
-void IMCode_genCode0(int opcode) {
-  IMCode[IMCode_n++].opcode = opcode;
-  IMCODE_OVERFLOW_CHECK();
+// Returns the line for a new code, enlarging the sequence if needed.
+static struct IMCode_tag *IMCode_new(int opcode) {
+  if (IMCode_n >= IMCode_size) {
+    int size = (IMCode_size == 0) ? IMCODE_INIT_SIZE : IMCode_size * 2;
+    struct IMCode_tag *imcode = realloc(IMCode, sizeof(*IMCode) * size);
+    if (imcode == NULL) {
+      fprintf(stderr, "IMCODE overflow: %d\n", IMCode_n);
+      exit(EXIT_FAILURE);
+    }
+    IMCode = imcode;
+    IMCode_size = size;
+  }
+
+  IMCode[IMCode_n].opcode = opcode;
+  return &IMCode[IMCode_n++];
 }
 
+void IMCode_genCode0(int opcode) { IMCode_new(opcode); }
+
 void IMCode_genCode1(int opcode, long operand1) {
-  IMCode[IMCode_n].operand1 = operand1;
-  IMCode[IMCode_n++].opcode = opcode;
-  IMCODE_OVERFLOW_CHECK();
+  struct IMCode_tag *imcode = IMCode_new(opcode);
+  imcode->operand1 = operand1;
 }
 
 void IMCode_genCode2(int opcode, long operand1, long operand2) {
-  IMCode[IMCode_n].operand1 = operand1;
-  IMCode[IMCode_n].operand2 = operand2;
-  IMCode[IMCode_n++].opcode = opcode;
-  IMCODE_OVERFLOW_CHECK();
+  struct IMCode_tag *imcode = IMCode_new(opcode);
+  imcode->operand1 = operand1;
+  imcode->operand2 = operand2;
 }
 
 void IMCode_genCode3(int opcode, long operand1, long operand2, long operand3) {
-  IMCode[IMCode_n].operand1 = operand1;
-  IMCode[IMCode_n].operand2 = operand2;
-  IMCode[IMCode_n].operand3 = operand3;
-  IMCode[IMCode_n++].opcode = opcode;
-  IMCODE_OVERFLOW_CHECK();
+  struct IMCode_tag *imcode = IMCode_new(opcode);
+  imcode->operand1 = operand1;
+  imcode->operand2 = operand2;
+  imcode->operand3 = operand3;
 }
 
 void IMCode_genCode4(int opcode, long operand1, long operand2, long operand3,
                      long operand4) {
-  IMCode[IMCode_n].operand1 = operand1;
-  IMCode[IMCode_n].operand2 = operand2;
-  IMCode[IMCode_n].operand3 = operand3;
-  IMCode[IMCode_n].operand4 = operand4;
-  IMCode[IMCode_n++].opcode = opcode;
-  IMCODE_OVERFLOW_CHECK();
+  struct IMCode_tag *imcode = IMCode_new(opcode);
+  imcode->operand1 = operand1;
+  imcode->operand2 = operand2;
+  imcode->operand3 = operand3;
+  imcode->operand4 = operand4;
 }
 
 void IMCode_genCode5(int opcode, long operand1, long operand2, long operand3,
                      long operand4, long operand5) {
-  IMCode[IMCode_n].operand1 = operand1;
-  IMCode[IMCode_n].operand2 = operand2;
-  IMCode[IMCode_n].operand3 = operand3;
-  IMCode[IMCode_n].operand4 = operand4;
-  IMCode[IMCode_n].operand5 = operand5;
-  IMCode[IMCode_n++].opcode = opcode;
-  IMCODE_OVERFLOW_CHECK();
+  struct IMCode_tag *imcode = IMCode_new(opcode);
+  imcode->operand1 = operand1;
+  imcode->operand2 = operand2;
+  imcode->operand3 = operand3;
+  imcode->operand4 = operand4;
+  imcode->operand5 = operand5;
 }
 
 void IMCode_genCode6(int opcode, long operand1, long operand2, long operand3,
                      long operand4, long operand5, long operand6) {
-  IMCode[IMCode_n].operand1 = operand1;
-  IMCode[IMCode_n].operand2 = operand2;
-  IMCode[IMCode_n].operand3 = operand3;
-  IMCode[IMCode_n].operand4 = operand4;
-  IMCode[IMCode_n].operand5 = operand5;
-  IMCode[IMCode_n].operand6 = operand6;
-  IMCode[IMCode_n++].opcode = opcode;
-  IMCODE_OVERFLOW_CHECK();
+  struct IMCode_tag *imcode = IMCode_new(opcode);
+  imcode->operand1 = operand1;
+  imcode->operand2 = operand2;
+  imcode->operand3 = operand3;
+  imcode->operand4 = operand4;
+  imcode->operand5 = operand5;
+  imcode->operand6 = operand6;
 }
 
 void IMCode_genCode7(int opcode, long operand1, long operand2, long operand3,
                      long operand4, long operand5, long operand6,
                      long operand7) {
-  IMCode[IMCode_n].operand1 = operand1;
-  IMCode[IMCode_n].operand2 = operand2;
-  IMCode[IMCode_n].operand3 = operand3;
-  IMCode[IMCode_n].operand4 = operand4;
-  IMCode[IMCode_n].operand5 = operand5;
-  IMCode[IMCode_n].operand6 = operand6;
-  IMCode[IMCode_n].operand7 = operand7;
-  IMCode[IMCode_n++].opcode = opcode;
-  IMCODE_OVERFLOW_CHECK();
-}
\ No newline at end of file
+  struct IMCode_tag *imcode = IMCode_new(opcode);
+  imcode->operand1 = operand1;
+  imcode->operand2 = operand2;
+  imcode->operand3 = operand3;
+  imcode->operand4 = operand4;
+  imcode->operand5 = operand5;
+  imcode->operand6 = operand6;
+  imcode->operand7 = operand7;
+}
@@ -2,14 +2,14 @@
 #define INPLA_IMCODE_H
 
 // http://www.hpcs.cs.tsukuba.ac.jp/~msato/lecture-note/comp-lecture/note10.html
-#define MAX_IMCODE_SEQUENCE 1024
 
 struct IMCode_tag {
   int opcode;
   long operand1, operand2, operand3, operand4, operand5, operand6, operand7;
 };
 
-extern struct IMCode_tag IMCode[MAX_IMCODE_SEQUENCE];
+// The sequence is enlarged as codes are generated.
+extern struct IMCode_tag *IMCode;
 extern int IMCode_n;
 
 void IMCode_init(void);
@@ -2,6 +2,7 @@
 
 #include "timer.h"
 
+#include "aot.h"
 #include "ast.h"
 #include "cmenv.h"
 #include "heap.h"
@@ -9,7 +10,9 @@
 #include "imcode.h"
 #include "name_table.h"
 #include "opt.h"
+#include "rulecache.h"
 #include "ruletable.h"
+#include "topology.h"
 #include "types.h"
 #include "vm.h"
 
@@ -32,13 +35,36 @@
 
 // For global options  ---------------------------------
 
-#ifndef THREAD
 typedef struct {
   int verbose_memory_use; // default is 0 (NOT enable)
+#ifdef THREAD
+  int verbose_threads; // default is 0 (NOT enable)
+  int idle_spin;       // `pause' loops of idle threads before yielding
+  int idle_yield;      // sched_yield calls of idle threads before parking
+  Placement placement; // -Xplace: placement of threads on CPUs
+#endif
+#ifdef PROFILE_RULES
+  int profile_rules; // default is 0 (NOT enable)
+#endif
+  FILE *stats_json;  // --stats=json: statistics of each net are put into it
+  int   stream_nets; // -fstream-nets: nets are executed chunk by chunk
 } GlobalOptions_t;
 
+#ifndef THREAD
+static GlobalOptions_t GlobalOptions = {
+    .verbose_memory_use = 0,
+    .stats_json = NULL,
+    .stream_nets = 0,
+};
+#else
 static GlobalOptions_t GlobalOptions = {
     .verbose_memory_use = 0,
+    .verbose_threads = 0,
+    .idle_spin = 1024,
+    .idle_yield = 16,
+    .placement = PLACEMENT_COMPACT,
+    .stats_json = NULL,
+    .stream_nets = 0,
 };
 #endif
 
@@ -56,11 +82,12 @@ static int MaxThreadsNum = 1;
 #  endif
 
 #  include <pthread.h>
+#  include <unistd.h>
 extern int pthread_setconcurrency(int concurrency);
 
 static int SleepingThreadsNum = 0;
 
-// for cas spinlock
+// for cpu_relax of idle threads
 #  include "cas_spinlock.h"
 
 #endif
@@ -76,209 +103,84 @@ extern int   popFP();
 
 // ----------------------------------------------
 
-#ifndef THREAD
-#  define MYPUSH(vm, a1, a2)                                                   \
-    if ((!IS_FIXNUM(a1)) && (IS_NAMEID(BASIC(a1)->id)) &&                      \
-        (NAME(a1)->port == (VALUE)NULL)) {                                     \
-      NAME(a1)->port = a2;                                                     \
-    } else if ((!IS_FIXNUM(a2)) && (IS_LOCAL_NAMEID(BASIC(a2)->id)) &&         \
-               (NAME(a2)->port == (VALUE)NULL)) {                              \
-      NAME(a2)->port = a1;                                                     \
-    } else {                                                                   \
-      VM_EQStack_Push(vm, a1, a2);                                             \
-    }
-#else
-#  define MYPUSH(vm, a1, a2)                                                   \
-    if ((!IS_FIXNUM(a1)) && (IS_NAMEID(BASIC(a1)->id)) &&                      \
-        (NAME(a1)->port == (VALUE)NULL)) {                                     \
-      if (!(__sync_bool_compare_and_swap(&(NAME(a1)->port), NULL, a2))) {      \
-        VM_EQStack_Push(vm, a1, a2);                                           \
-      }                                                                        \
-    } else if ((!IS_FIXNUM(a2)) && (IS_NAMEID(BASIC(a2)->id)) &&               \
-               (NAME(a2)->port == (VALUE)NULL)) {                              \
-      if (!(__sync_bool_compare_and_swap(&(NAME(a2)->port), NULL, a1))) {      \
-        VM_EQStack_Push(vm, a1, a2);                                           \
-      }                                                                        \
-    } else {                                                                   \
-      VM_EQStack_Push(vm, a1, a2);                                             \
-    }
-#endif
-
-/*
-  ===TODO===
-  2021/9/18
-  a2->t であるところに a1->a2 が与えられても a2->t, a1->a2 のままにしてある。
-  a2 がここで解放できればメモリ利用が助かるのでは？
-  仮に助からないとしても、グローバル環境で与えられたネットの場合には
-  単純に eval_equation へ持ち込んだ方が、indirection を生成しなくて済むのでは？
-
-  ==>
-  DONE 21 September 2021
-  誤差程度しか変わらない。
-
- */
-#ifndef THREAD
-#  define PUSH(vm, a1, a2)                                                     \
-    if ((!IS_FIXNUM(a1)) && (IS_NAMEID(BASIC(a1)->id)) &&                      \
-        (NAME(a1)->port == (VALUE)NULL)) {                                     \
-      NAME(a1)->port = a2;                                                     \
-    } else if ((!IS_FIXNUM(a2)) && (IS_NAMEID(BASIC(a2)->id)) &&               \
-               (NAME(a2)->port == (VALUE)NULL)) {                              \
-      NAME(a2)->port = a1;                                                     \
-    } else {                                                                   \
-      VM_EQStack_Push(vm, a1, a2);                                             \
-    }
-#else
-#  define PUSH(vm, a1, a2)                                                     \
-    if ((!IS_FIXNUM(a1)) && (IS_NAMEID(BASIC(a1)->id)) &&                      \
-        (NAME(a1)->port == (VALUE)NULL)) {                                     \
-      if (!(__sync_bool_compare_and_swap(&(NAME(a1)->port), NULL, a2))) {      \
-        if (SleepingThreadsNum == 0) {                                         \
-          VM_EQStack_Push(vm, NAME(a1)->port, a2);                             \
-          free_Name(a1);                                                       \
-        } else {                                                               \
-          GlobalEQStack_Push(NAME(a1)->port, a2);                              \
-          free_Name(a1);                                                       \
-        }                                                                      \
-      }                                                                        \
-    } else if ((!IS_FIXNUM(a2)) && (IS_NAMEID(BASIC(a2)->id)) &&               \
-               (NAME(a2)->port == (VALUE)NULL)) {                              \
-      if (!(__sync_bool_compare_and_swap(&(NAME(a2)->port), NULL, a1))) {      \
-        if (SleepingThreadsNum == 0) {                                         \
-          VM_EQStack_Push(vm, a1, NAME(a2)->port);                             \
-          free_Name(a2);                                                       \
-        } else {                                                               \
-          GlobalEQStack_Push(a1, NAME(a2)->port);                              \
-          free_Name(a2);                                                       \
-        }                                                                      \
-      }                                                                        \
-    } else {                                                                   \
-      if (SleepingThreadsNum == 0) {                                           \
-        VM_EQStack_Push(vm, a1, a2);                                           \
-      } else {                                                                 \
-        GlobalEQStack_Push(a1, a2);                                            \
-      }                                                                        \
-    }
-#endif
-
-void puts_memory_stat(void) {
-#ifndef THREAD
-  print_memory_usage(&VM.agentHeap, &VM.nameHeap);
-#else
-  puts("Not supported in the multi-threaded version.");
-#endif
-}
-
 // -----------------------------------------------------
-// The global equation stack
+// Equation stacks with work stealing
 // -----------------------------------------------------
 
 #ifdef THREAD
 static pthread_cond_t  EQStack_not_empty = PTHREAD_COND_INITIALIZER;
 static pthread_mutex_t Sleep_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t AllSleep_lock = PTHREAD_MUTEX_INITIALIZER;
-#endif
+static pthread_cond_t  ActiveThread_all_sleep = PTHREAD_COND_INITIALIZER;
 
-// GlobalEQStack for execution with threads
-#ifdef THREAD
-typedef struct {
-  EQ          *stack;
-  int          nextPtr;
-  int          size;
-  volatile int lock; // for lightweight spin lock
-} EQStack;
-static EQStack GlobalEQS;
-#endif
+static VirtualMachine **VMs;
 
-#ifdef THREAD
-void GlobalEQStack_Init(int size) {
-  GlobalEQS.nextPtr = -1;
-  GlobalEQS.stack = malloc(sizeof(EQ) * size);
-  GlobalEQS.size = size;
-  if (GlobalEQS.stack == NULL) {
-    printf("Malloc error\n");
-    exit(-1);
+// Returns 1 if some equations remain in any EQStack.
+static int EQStack_Exist(void) {
+  for (int i = 0; i < MaxThreadsNum; i++) {
+    if (VM_EQStack_Num(VMs[i]) > 0) {
+      return 1;
+    }
   }
-  // for cas_lock
-  GlobalEQS.lock = 0;
+  return 0;
 }
-#endif
 
-#ifdef THREAD
-void GlobalEQStack_Push(VALUE l, VALUE r) {
-
-  lock(&GlobalEQS.lock);
+// Waits for equations by spinning and then yielding.
+// Returns 1 if some equations appear in the meantime.
+static int EQStack_Idle_wait(VirtualMachine *vm) {
+  unsigned long long t;
+  int                found = 0;
 
-  GlobalEQS.nextPtr++;
-  if (GlobalEQS.nextPtr >= GlobalEQS.size) {
-    GlobalEQS.size += GlobalEQS.size;
-    GlobalEQS.stack = realloc(GlobalEQS.stack, sizeof(EQ) * GlobalEQS.size);
-
-#  ifdef VERBOSE_EQSTACK_EXPANSION
-    puts("(Global EQStack is expanded)");
-#  endif
+  start_timer(&t);
+  for (int i = 0; i < GlobalOptions.idle_spin; i++) {
+    if (EQStack_Exist()) {
+      found = 1;
+      goto end;
+    }
+    cpu_relax();
   }
 
-  GlobalEQS.stack[GlobalEQS.nextPtr].l = l;
-  GlobalEQS.stack[GlobalEQS.nextPtr].r = r;
-
-  unlock(&GlobalEQS.lock);
-
-  if (SleepingThreadsNum > 0) {
-    pthread_mutex_lock(&Sleep_lock);
-    pthread_cond_signal(&EQStack_not_empty);
-    pthread_mutex_unlock(&Sleep_lock);
+  for (int i = 0; i < GlobalOptions.idle_yield; i++) {
+    sched_yield();
+    if (EQStack_Exist()) {
+      found = 1;
+      goto end;
+    }
   }
+
+end:
+  vm->spin_time += stop_timer(&t);
+  return found;
 }
 #endif
 
 int EQStack_Pop(VirtualMachine *vm, VALUE *l, VALUE *r) {
 
+#ifndef THREAD
   if (vm->nextPtr_eqStack >= 0) {
     *l = vm->eqStack[vm->nextPtr_eqStack].l;
     *r = vm->eqStack[vm->nextPtr_eqStack].r;
     vm->nextPtr_eqStack--;
-
-    /*
-#ifdef DEBUG
-    puts("");
-    puts("====================================");
-    puts("POP");
-    puts("====================================");
-    puts_term(*l);
-    puts("");
-    puts("><");
-    puts_term(*r);
-    puts("");
-    puts("====================================");
-#endif
-    */
-
     return 1;
   }
-#ifndef THREAD
   return 0;
-#else
-
-  lock(&GlobalEQS.lock);
 
-  if (GlobalEQS.nextPtr < 0) {
-    // When GlobalEQStack is empty
-    unlock(&GlobalEQS.lock);
-    return 0;
+#else
+  if (VM_EQStack_Pop(vm, l, r)) {
+    return 1;
   }
 
-  *l = GlobalEQS.stack[GlobalEQS.nextPtr].l;
-  *r = GlobalEQS.stack[GlobalEQS.nextPtr].r;
-  GlobalEQS.nextPtr--;
-
-  unlock(&GlobalEQS.lock);
-  return 1;
-
+  // Steal from the other VMs, on the same node first.
+  for (int i = 0; i < MaxThreadsNum - 1; i++) {
+    VirtualMachine *victim = VMs[vm->victims[i]];
+    if (VM_EQStack_Steal(victim, l, r)) {
+      return 1;
+    }
+  }
+  return 0;
 #endif
 }
 
-#ifdef DEBUG
+#if defined(DEBUG) && !defined(THREAD)
 void VM_EQStack_allputs(VirtualMachine *vm) {
   int i;
   if (vm->nextPtr_eqStack == -1)
@@ -306,10 +208,115 @@ void CodeAddr_init(void) {
   }
 }
 
-void print_memory_usage(Heap *agent_heap, Heap *name_heap) {
-  fprintf(stderr, "Using %lu agent nodes and %lu name nodes.\n\n",
-          Heap_GetNum_Usage_forAgent(agent_heap),
-          Heap_GetNum_Usage_forName(name_heap));
+static void get_memory_usage(MemoryUsage *usage) {
+#ifndef THREAD
+  VirtualMachine *vms[] = {&VM};
+  VM_Get_MemoryUsage(vms, 1, usage);
+#else
+  VM_Get_MemoryUsage(VMs, MaxThreadsNum, usage);
+#endif
+}
+
+void print_memory_usage(void) {
+  MemoryUsage usage;
+  get_memory_usage(&usage);
+  fprintf(stderr,
+          "Using %lu agent nodes and %lu name nodes "
+          "(capacity: %lu and %lu).\n\n",
+          usage.agents, usage.names, usage.agent_capacity,
+          usage.name_capacity);
+}
+
+void puts_memory_stat(void) { print_memory_usage(); }
+
+#ifdef FLEX_EXPANDABLE_HEAP
+// It must be called while no VM is running.
+static void shrink_heaps(void) {
+#  ifndef THREAD
+  VirtualMachine *vms[] = {&VM};
+  VM_Shrink_Heaps(vms, 1);
+#  else
+  VM_Shrink_Heaps(VMs, MaxThreadsNum);
+#  endif
+}
+#endif
+
+// -----------------------------------------------------
+// Run statistics: --stats=json
+// -----------------------------------------------------
+
+static unsigned long get_hoop_expansions(VirtualMachine *vm) {
+#if defined(EXPANDABLE_HEAP) || defined(FLEX_EXPANDABLE_HEAP)
+  unsigned long num = vm->agentHeap.expansions + vm->nameHeap.expansions;
+#  ifdef AGENT_SIZE_CLASS
+  num += vm->smallAgentHeap.expansions;
+#  endif
+  return num;
+#else
+  return 0;
+#endif
+}
+
+// Puts statistics of a top-level net as a line of JSON.
+// `wall' and `cpu' are given in usec.
+static void puts_stats_json(VirtualMachine **vms, int n,
+                            unsigned long long wall, unsigned long long cpu) {
+  static unsigned long net = 0;
+  FILE                *fp = GlobalOptions.stats_json;
+  unsigned long        expansions = 0;
+  long                 high_water = 0;
+  unsigned long        name_chains = 0, name_shortcuts = 0;
+  MemoryUsage          usage;
+#ifdef COUNT_INTERACTION
+  unsigned long interactions = 0;
+#endif
+
+  VM_Get_MemoryUsage(vms, n, &usage);
+
+  for (int i = 0; i < n; i++) {
+    expansions += get_hoop_expansions(vms[i]);
+    if (vms[i]->eqStack_high_water > high_water) {
+      high_water = vms[i]->eqStack_high_water;
+    }
+    name_chains += vms[i]->name_chains;
+    name_shortcuts += vms[i]->name_shortcuts;
+#ifdef COUNT_INTERACTION
+    interactions += VM_Get_InteractionCount(vms[i]);
+#endif
+  }
+
+  fprintf(fp, "{\"net\":%lu", ++net);
+#ifdef COUNT_INTERACTION
+  fprintf(fp, ",\"interactions\":%lu", interactions);
+#endif
+  fprintf(fp, ",\"wall_time_sec\":%.6f,\"cpu_time_sec\":%.6f",
+          (double)wall / 1000000, (double)cpu / 1000000);
+#ifdef COUNT_INTERACTION
+  fprintf(fp, ",\"interactions_per_sec\":%.0f",
+          (wall == 0) ? 0.0 : (double)interactions * 1000000 / wall);
+#endif
+  fprintf(fp,
+          ",\"hoop_expansions\":%lu,\"eqstack_high_water\":%ld"
+          ",\"name_chains\":%lu,\"name_shortcuts\":%lu"
+          ",\"heap\":{\"agents\":%lu,\"names\":%lu"
+          ",\"agent_capacity\":%lu,\"name_capacity\":%lu}",
+          expansions, high_water, name_chains, name_shortcuts, usage.agents,
+          usage.names, usage.agent_capacity, usage.name_capacity);
+
+  fprintf(fp, ",\"threads\":[");
+  for (int i = 0; i < n; i++) {
+    fprintf(fp, "%s{\"id\":%d", (i == 0) ? "" : ",", i);
+#ifdef COUNT_INTERACTION
+    fprintf(fp, ",\"interactions\":%lu", VM_Get_InteractionCount(vms[i]));
+#endif
+    fprintf(fp,
+            ",\"hoop_expansions\":%lu,\"eqstack_high_water\":%ld"
+            ",\"name_chains\":%lu,\"name_shortcuts\":%lu}",
+            get_hoop_expansions(vms[i]), vms[i]->eqStack_high_water,
+            vms[i]->name_chains, vms[i]->name_shortcuts);
+  }
+  fprintf(fp, "]}\n");
+  fflush(fp);
 }
 
 //-----------------------------------------------------------
@@ -317,13 +324,13 @@ void print_memory_usage(Heap *agent_heap, Heap *name_heap) {
 //-----------------------------------------------------------
 
 static VALUE ShowNameHeap =
-    (VALUE)NULL; // showname で表示するときの cyclic 防止
+    VALUE_NULL; // showname で表示するときの cyclic 防止
 // showname 時に、呼び出し変数の heap num を入れておく。
 // showname 呼び出し以外は NULL に。
 
 void puts_name(VALUE ptr) {
 
-  if (ptr == (VALUE)NULL) {
+  if (ptr == VALUE_NULL) {
     printf("[NULL]");
     return;
   }
@@ -422,13 +429,13 @@ void       puts_term(VALUE ptr) {
   if (IS_FIXNUM(ptr)) {
     printf("%ld", FIX2INT(ptr));
     return;
-  } else if (BASIC(ptr) == NULL) {
+  } else if (ptr == VALUE_NULL) {
     printf("<NULL>");
     return;
   }
 
   if (IS_NAMEID(BASIC(ptr)->id)) {
-    if (NAME(ptr)->port == (VALUE)NULL) {
+    if (NAME(ptr)->port == VALUE_NULL) {
       if (IS_GNAMEID(BASIC(ptr)->id)) {
         printf("%s", IdTable_get_name(BASIC(ptr)->id));
 
@@ -470,11 +477,11 @@ void       puts_term(VALUE ptr) {
   } else if (BASIC(ptr)->id == ID_CONS) {
     printf("[");
 
-    while (ptr != (VALUE)NULL) {
+    while (ptr != VALUE_NULL) {
       puts_term(AGENT(ptr)->port[0]);
 
       ptr = AGENT(ptr)->port[1];
-      while (IS_NAMEID(BASIC(ptr)->id) && NAME(ptr)->port != (VALUE)NULL) {
+      while (IS_NAMEID(BASIC(ptr)->id) && NAME(ptr)->port != VALUE_NULL) {
         ptr = NAME(ptr)->port;
       }
       if (BASIC(ptr)->id == ID_NIL) {
@@ -483,7 +490,7 @@ void       puts_term(VALUE ptr) {
         break;
       }
 
-      if (IS_NAMEID(BASIC(ptr)->id) && NAME(ptr)->port == (VALUE)NULL) {
+      if (IS_NAMEID(BASIC(ptr)->id) && NAME(ptr)->port == VALUE_NULL) {
         // for WHNF
         printf(",");
         puts_term(ptr);
@@ -563,12 +570,12 @@ void puts_Name_port0_nat(char *sym) {
   const IDTYPE idS = NameTable_get_set_id_with_IdTable_forAgent("S");
   const IDTYPE idZ = NameTable_get_set_id_with_IdTable_forAgent("Z");
 
-  if (a1 == (VALUE)NULL) {
+  if (a1 == VALUE_NULL) {
     printf("<NUll>");
   } else if (!IS_NAMEID(BASIC(a1)->id)) {
     printf("<NON-NAME>");
   } else {
-    if (NAME(a1)->port == (VALUE)NULL) {
+    if (NAME(a1)->port == VALUE_NULL) {
       printf("<EMPTY>");
     } else {
 
@@ -607,12 +614,22 @@ void puts_eqlist(EQList *at) {
 // static inline
 VALUE make_Agent(VirtualMachine *restrict vm, int id) {
   VALUE ptr;
+#ifdef AGENT_SIZE_CLASS
+  if (IS_SMALL_AGENT(id, IdTable_get_arity(id))) {
+    ptr = myalloc_SmallAgent(&vm->smallAgentHeap);
+  } else {
+    ptr = myalloc_Agent(&vm->agentHeap);
+  }
+#else
   ptr = myalloc_Agent(&vm->agentHeap);
+#endif
 
 #ifdef COUNT_MKAGENT
   NumberOfMkAgent++;
 #endif
 
+  PROFILE_COUNTUP(vm, agents);
+
   AGENT(ptr)->basic.id = id;
   return ptr;
 }
@@ -623,7 +640,9 @@ VALUE make_Name(VirtualMachine *restrict vm) {
 
   ptr = myalloc_Name(&vm->nameHeap);
   SET_LOCAL_NAMEID(AGENT(ptr)->basic.id);
-  NAME(ptr)->port = (VALUE)NULL;
+  NAME(ptr)->port = VALUE_NULL;
+
+  PROFILE_COUNTUP(vm, names);
 
   return ptr;
 }
@@ -664,6 +683,7 @@ loop:
       void **code = NULL;
 
       RuleTable_get_code_for_Int(a1, &code);
+      PROFILE_PAIR(vm, BASIC(a1)->id, ID_INT);
 
       if (code == NULL) {
         // built-in: BUILT-IN_OP >< int
@@ -868,7 +888,7 @@ loop:
 
     } else {
       // a1 is name, a2 is Fixint
-      if (NAME(a1)->port != (VALUE)NULL) {
+      if (NAME(a1)->port != VALUE_NULL) {
         VALUE a1p0;
         a1p0 = NAME(a1)->port;
         free_Name(a1);
@@ -936,6 +956,7 @@ loop:
       void **code;
 
       code = RuleTable_get_code(BASIC(a1)->id, BASIC(a2)->id, &result);
+      PROFILE_PAIR(vm, BASIC(a1)->id, BASIC(a2)->id);
 
       if (result == 0) {
         // there is no user-defined rule.
@@ -1531,8 +1552,8 @@ loop:
             COUNTUP_INTERACTION(vm);
 
             BASIC(a1)->id = ID_MERGER_P;
-            AGENT(a1)->port[1] = (VALUE)NULL;
-            AGENT(a1)->port[2] = (VALUE)NULL;
+            AGENT(a1)->port[1] = VALUE_NULL;
+            AGENT(a1)->port[2] = VALUE_NULL;
             PUSH(vm, a1, AGENT(a2)->port[1]);
             PUSH(vm, a1, AGENT(a2)->port[0]);
             free_Agent(a2);
@@ -1549,7 +1570,7 @@ loop:
 
             COUNTUP_INTERACTION(vm);
 
-            if (AGENT(a1)->port[1] == (VALUE)NULL) {
+            if (AGENT(a1)->port[1] == VALUE_NULL) {
               AGENT(a1)->port[1] = a2;
               return;
             } else {
@@ -1563,7 +1584,7 @@ loop:
             }
 #else
             // AGENT(a1)->port[2] is used as a lock for NIL case
-            if (AGENT(a1)->port[2] == (VALUE)NULL) {
+            if (AGENT(a1)->port[2] == VALUE_NULL) {
               if (!(__sync_bool_compare_and_swap(&(AGENT(a1)->port[2]), NULL,
                                                  a2))) {
                 // something exists already
@@ -1572,7 +1593,7 @@ loop:
               } else {
                 return;
               }
-            } else if ((AGENT(a1)->port[2] != (VALUE)NULL) &&
+            } else if ((AGENT(a1)->port[2] != VALUE_NULL) &&
                        (BASIC(AGENT(a1)->port[2])->id == ID_NIL)) {
 
               COUNTUP_INTERACTION(vm);
@@ -1607,7 +1628,7 @@ loop:
               // AGENT(a1)->port[1] is used as a lock for CONS case
               // AGENT(a1)->port[2] is used as a lock for NIL case
 
-              if (AGENT(a1)->port[2] != (VALUE)NULL) {
+              if (AGENT(a1)->port[2] != VALUE_NULL) {
                 // The other MGP finished still, so:
                 // *MGP(r)~x:xs => r~x:xs;
 
@@ -1620,7 +1641,7 @@ loop:
                 a1 = a1p0;
                 goto loop;
 
-              } else if (AGENT(a1)->port[1] == (VALUE)NULL) {
+              } else if (AGENT(a1)->port[1] == VALUE_NULL) {
                 if (!(__sync_bool_compare_and_swap(&(AGENT(a1)->port[1]), NULL,
                                                    a2))) {
                   // Failure to be locked.
@@ -1637,7 +1658,7 @@ loop:
 
                 AGENT(a2)->port[1] = w;
 
-                AGENT(a1)->port[1] = (VALUE)NULL; // free the lock
+                AGENT(a1)->port[1] = VALUE_NULL; // free the lock
 
                 a1 = a1p0;
 
@@ -1713,6 +1734,14 @@ loop:
                 VALUE preserved_p = AGENT(a2)->port[0];
                 VALUE preserved_q = AGENT(a2)->port[1];
                 VALUE tuple = a2;
+#ifdef AGENT_SIZE_CLASS
+                // The cells of % and the pair are too small for the ports.
+                if (arity > AGENT_SMALL_PORT) {
+                  free_Agent2(a1, a2);
+                  a1 = make_Agent(vm, percented_id);
+                  tuple = make_Agent(vm, GET_TUPLEID(arity));
+                }
+#endif
                 BASIC(a1)->id = percented_id;
                 for (int i = 0; i < arity; i++) {
                   VALUE new_name = make_Name(vm);
@@ -1846,7 +1875,7 @@ loop:
 
       // a1 is name
       // a2 is agent
-      if (NAME(a1)->port != (VALUE)NULL) {
+      if (NAME(a1)->port != VALUE_NULL) {
 
         VALUE a1p0;
         a1p0 = NAME(a1)->port;
@@ -1870,13 +1899,14 @@ loop:
   } else {
     // a2 is name, a1 is unknown.
 
-    if (NAME(a2)->port != (VALUE)NULL) {
+    if (NAME(a2)->port != VALUE_NULL) {
       VALUE a2p0;
       a2p0 = NAME(a2)->port;
       free_Name(a2);
       a2 = a2p0;
       goto loop;
     } else {
+      SHORTCUT_NAME(vm, a1);
 #ifndef THREAD
       NAME(a2)->port = a1;
 #else
@@ -1892,6 +1922,191 @@ loop:
   }
 }
 
+// Streaming execution of nets: -fstream-nets  ---------------------------
+
+// Names of a net. The symbols are shared in the AST, so they are compared
+// as pointers.
+typedef struct {
+  char *sym;
+  int   total; // occurrences in the net, or -1 for names bound by `where'
+  int   seen;  // occurrences in the equations compiled so far
+} StreamName;
+
+static struct {
+  StreamName *names;
+  int         num, size;
+  int         open; // names seen once, which occur once more after that
+} Stream;
+
+static StreamName *Stream_get_name(char *sym) {
+  for (int i = 0; i < Stream.num; i++) {
+    if (Stream.names[i].sym == sym) {
+      return &Stream.names[i];
+    }
+  }
+
+  if (Stream.num == Stream.size) {
+    Stream.size = (Stream.size == 0) ? 64 : Stream.size * 2;
+    Stream.names = realloc(Stream.names, sizeof(StreamName) * Stream.size);
+    if (Stream.names == NULL) {
+      printf("[Stream]Malloc error\n");
+      exit(-1);
+    }
+  }
+
+  StreamName *name = &Stream.names[Stream.num++];
+  name->sym = sym;
+  name->total = name->seen = 0;
+  return name;
+}
+
+// Counts the names in the term. When `seen' is 1, those compiled are counted.
+static void Stream_count_names(Ast *p, int seen) {
+  if (p == NULL) {
+    return;
+  }
+
+  switch (p->id) {
+  case AST_SYM:
+  case AST_INT:
+    // Their children are not initialised.
+    return;
+
+  case AST_NAME: {
+    StreamName *name = Stream_get_name(p->left->sym);
+    if (name->total == -1) {
+      return;
+    }
+    if (!seen) {
+      name->total++;
+    } else if (name->total == 2) {
+      // It is open between the occurrences.
+      Stream.open += (++name->seen == 1) ? 1 : -1;
+    }
+    return;
+  }
+
+  case AST_TUPLE:
+    Stream_count_names(p->right, seen);
+    return;
+
+  default:
+    // Lists are followed by the loop.
+    for (; p != NULL && p->id == AST_LIST; p = p->right) {
+      Stream_count_names(p->left, seen);
+    }
+    if (p != NULL) {
+      Stream_count_names(p->left, seen);
+      Stream_count_names(p->right, seen);
+    }
+  }
+}
+
+// Counts the names of the aplist before it is divided into chunks.
+// Chunks are closed only where no name is open, so every name is compiled
+// in one chunk as in the whole net.
+static int Stream_init(Ast *stmlist, Ast *aplist) {
+  Stream.num = Stream.open = 0;
+
+  for (Ast *stm = stmlist; stm != NULL; stm = ast_getTail(stm)) {
+    // stm: (AST_LD (AST_NAME sym) expr)
+    Stream_get_name(stm->left->left->left->sym)->total = -1;
+  }
+  for (Ast *eq = aplist; eq != NULL; eq = ast_getTail(eq)) {
+    Stream_count_names(eq->left, 0);
+  }
+
+  for (int i = 0; i < Stream.num; i++) {
+    if (Stream.names[i].total > 2) {
+      printf("%d:ERROR: The name `%s' occurs more than twice.\n", yylineno,
+             Stream.names[i].sym);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Compiles equations of the aplist `*at' into VM code, and sets `*at' to the
+// rest of them. All of them are compiled unless -fstream-nets is given,
+// and otherwise the first chunk of about STREAM_CHUNK_IMCODE lines of IMCode.
+// Returns NULL when the compilation fails.
+static void **compile_nets(Ast *stmlist, Ast **at, int *eqsnum) {
+  void **code;
+
+  CmEnv_clear_all();
+
+  // for `where' expression
+  if (!Compile_stmlist_on_ast(stmlist))
+    return NULL;
+
+  // Reset the counter of compilation errors
+  CmEnv.count_compilation_errors = 0;
+
+  *eqsnum = 0;
+  while (*at != NULL) {
+    int  p1, p2;
+    Ast *eq, *left, *right;
+
+    eq = (*at)->left;
+    left = eq->left;
+    right = eq->right;
+    p1 = Compile_term_on_ast(left, -1);
+    p2 = Compile_term_on_ast(right, -1);
+
+    // Check whether compilation errors arise
+    if (CmEnv.count_compilation_errors != 0) {
+      return NULL;
+    }
+
+    if (left->id == AST_NAME) {
+      select_kind_of_push(left, p1, p2);
+
+    } else if (right->id == AST_NAME) {
+      select_kind_of_push(right, p2, p1);
+
+    } else {
+      IMCode_genCode2(OP_PUSH, p1, p2);
+    }
+
+    (*eqsnum)++; // for distrubution
+    *at = ast_getTail(*at);
+
+    if (GlobalOptions.stream_nets) {
+      Stream_count_names(eq, 1);
+      if (IMCode_n >= STREAM_CHUNK_IMCODE && Stream.open == 0) {
+        break;
+      }
+    }
+  }
+  IMCode_genCode0(OP_RET);
+
+  // checking whether names occur more than twice
+  if (!CmEnv_check_name_reference_times()) {
+    if (yyin != stdin)
+      exit(-1);
+    return NULL;
+  }
+
+#ifndef DEBUG_NETS
+  // for regular operation
+  CmEnv_retrieve_MKGNAME();
+  code = CmEnv_realloc_VMCode(NULL, CmEnv_get_VMCode_bound());
+  CmEnv_generate_VMCode(code);
+
+#else
+  // for debug
+  CmEnv_retrieve_MKGNAME();
+  IMCode_puts(0); // exit(1);
+
+  code = CmEnv_realloc_VMCode(NULL, CmEnv_get_VMCode_bound());
+  int codenum = CmEnv_generate_VMCode(code);
+  VMCode_puts(code, codenum - 2); // exit(1);
+  // end for debug
+#endif
+
+  return code;
+}
+
 #ifndef THREAD
 
 #  define WHNF_UNUSED_STACK_SIZE 100
@@ -1951,16 +2166,13 @@ void WHNF_execution_loop(void) {
 int exec(Ast *at) {
   // Ast at: (AST_BODY stmlist aplist)
 
-  unsigned long long t, time;
-  void              *code[MAX_VMCODE_SEQUENCE];
+  unsigned long long t, time, cputime;
+  void             **code;
+  Ast               *stmlist = at->left;
+  int                eqsnum;
 
   start_timer(&t);
-
-  CmEnv_clear_all();
-
-  // for `where' expression
-  if (!Compile_stmlist_on_ast(at->left))
-    return 0;
+  cputime = getcputime();
 
   // aplist
   at = at->right;
@@ -2011,106 +2223,84 @@ int exec(Ast *at) {
     }
   }
 
-  // Reset the counter of compilation errors
-  CmEnv.count_compilation_errors = 0;
+  if (GlobalOptions.stream_nets && !Stream_init(stmlist, at)) {
+    if (yyin != stdin)
+      exit(-1);
+    return 0;
+  }
 
-  while (at != NULL) {
-    int  p1, p2;
-    Ast *left, *right;
+#  ifdef COUNT_MKAGENT
+  NumberOfMkAgent = 0;
+#  endif
 
-    left = at->left->left;
-    right = at->left->right;
-    p1 = Compile_term_on_ast(left, -1);
-    p2 = Compile_term_on_ast(right, -1);
+  // WHNF: Unused equations are stacked to be execution targets again.
+  if (WHNFinfo.enable) {
+    for (int i = 0; i < WHNFinfo.eqs_index; i++) {
+      MYPUSH(&VM, WHNFinfo.eqs[i].l, WHNFinfo.eqs[i].r);
+    }
+    WHNFinfo.eqs_index = 0;
+  }
 
-    // Check whether compilation errors arise
-    if (CmEnv.count_compilation_errors != 0) {
+#  ifdef COUNT_INTERACTION
+  VM_Clear_InteractionCount(&VM);
+#  endif
+  VM_Clear_RunStats(&VM);
+
+  // Each chunk is reduced before the next one is compiled.
+  do {
+    code = compile_nets(stmlist, &at, &eqsnum);
+    if (code == NULL) {
       return 0;
     }
 
-    if (left->id == AST_NAME) {
-      select_kind_of_push(left, p1, p2);
+    VM_Reg_Fit(&VM);
+    exec_code(1, &VM, code);
+    free(code);
 
-    } else if (right->id == AST_NAME) {
-      select_kind_of_push(right, p2, p1);
+    // EXECUTION LOOP
 
-    } else {
-      IMCode_genCode2(OP_PUSH, p1, p2);
-    }
-
-    at = ast_getTail(at);
-  }
-  IMCode_genCode0(OP_RET);
-
-  // checking whether names occur more than twice
-  if (!CmEnv_check_name_reference_times()) {
-    if (yyin != stdin)
-      exit(-1);
-    return 0;
-  }
-
-#  ifndef DEBUG_NETS
-  // for regular operation
-  CmEnv_retrieve_MKGNAME();
-  CmEnv_generate_VMCode(code);
-
-#  else
-  // for debug
-  CmEnv_retrieve_MKGNAME();
-  IMCode_puts(0); // exit(1);
+    if (!WHNFinfo.enable) {
+      // no-stategy execution
 
-  int codenum = CmEnv_generate_VMCode(code);
-  VMCode_puts(code, codenum - 2); // exit(1);
-  // end for debug
-#  endif
-
-#  ifdef COUNT_MKAGENT
-  NumberOfMkAgent = 0;
-#  endif
+      VALUE t1, t2;
+      while (EQStack_Pop(&VM, &t1, &t2)) {
+        eval_equation(&VM, t1, t2);
+      }
 
-  // WHNF: Unused equations are stacked to be execution targets again.
-  if (WHNFinfo.enable) {
-    for (int i = 0; i < WHNFinfo.eqs_index; i++) {
-      MYPUSH(&VM, WHNFinfo.eqs[i].l, WHNFinfo.eqs[i].r);
+    } else {
+      // WHNF stragety
+      WHNF_execution_loop();
     }
-    WHNFinfo.eqs_index = 0;
-  }
-
-  exec_code(1, &VM, code);
-
-#  ifdef COUNT_INTERACTION
-  VM_Clear_InteractionCount(&VM);
-#  endif
+  } while (at != NULL);
+  PROFILE_STOP((&VM));
 
-  // EXECUTION LOOP
-
-  if (!WHNFinfo.enable) {
-    // no-stategy execution
-
-    VALUE t1, t2;
-    while (EQStack_Pop(&VM, &t1, &t2)) {
-      eval_equation(&VM, t1, t2);
-    }
+  time = stop_timer(&t);
 
-  } else {
-    // WHNF stragety
-    WHNF_execution_loop();
+  if (GlobalOptions.stats_json != NULL) {
+    VirtualMachine *vms[] = {&VM};
+    puts_stats_json(vms, 1, time, getcputime() - cputime);
   }
 
-  time = stop_timer(&t);
+  // The free text is replaced with JSON when it is put on stdout.
+  if (GlobalOptions.stats_json != stdout) {
 #  ifdef COUNT_INTERACTION
-  printf("(%lu interactions, %.2f sec)\n", VM_Get_InteractionCount(&VM),
-         (double)time / 1000000);
+    printf("(%lu interactions, %.2f sec)\n", VM_Get_InteractionCount(&VM),
+           (double)time / 1000000);
 #  else
-  printf("(%.2f sec)\n", (double)(time) / 1000000);
+    printf("(%.2f sec)\n", (double)(time) / 1000000);
 #  endif
+  }
 
 #  ifdef COUNT_MKAGENT
   printf("(%d mkAgent calls)\n", NumberOfMkAgent);
 #  endif
 
+#  ifdef FLEX_EXPANDABLE_HEAP
+  shrink_heaps();
+#  endif
+
   if (GlobalOptions.verbose_memory_use) {
-    print_memory_usage(&VM.agentHeap, &VM.nameHeap);
+    print_memory_usage();
   }
 
 #  ifdef COUNT_CNCT
@@ -2129,9 +2319,7 @@ int exec(Ast *at) {
 // it is calculated by using sysconf(_SC_NPROSSEORS_CONF) in tpool_init
 static int CpuNum = 1;
 
-static pthread_cond_t   ActiveThread_all_sleep = PTHREAD_COND_INITIALIZER;
 static pthread_t       *Threads;
-static VirtualMachine **VMs;
 
 void *tpool_thread(void *arg) {
 
@@ -2139,14 +2327,21 @@ void *tpool_thread(void *arg) {
 
   vm = (VirtualMachine *)arg;
 
+  Heap_Bind(&vm->agentHeap, &vm->nameHeap);
+#  if defined(HEAP_FREELIST) && defined(AGENT_SIZE_CLASS)
+  Heap_Bind_FreeList_forSmallAgent(&vm->smallAgentHeap);
+#  endif
+#  ifdef FLEX_EXPANDABLE_HEAP
+  Heap_Bind_Node(vm->node);
+#  endif
+
 #  ifdef CPU_ZERO
   cpu_set_t mask;
   CPU_ZERO(&mask);
-  CPU_SET((vm->id) % CpuNum, &mask);
+  CPU_SET(vm->cpu, &mask);
   if (sched_setaffinity(0, sizeof(mask), &mask) == -1) {
     printf("WARNING:");
-    printf("Thread%d works on Core%d/%d\n", vm->id, (vm->id) % CpuNum,
-           CpuNum - 1);
+    printf("Thread%d works on Core%d/%d\n", vm->id, vm->cpu, CpuNum - 1);
   }
   //  printf("Thread%d works on Core%d/%d\n", vm->id, (vm->id)%CpuNum,
   //  CpuNum-1);
@@ -2156,29 +2351,45 @@ void *tpool_thread(void *arg) {
 
     VALUE t1, t2;
     while (!EQStack_Pop(vm, &t1, &t2)) {
+      PROFILE_STOP(vm);
+#  ifdef REMOTE_FREE
+      VM_Drain_RemoteFree(vm);
+#  endif
 
-      // Not sure, but it works well. Perhaps it can reduce race condition.
-      usleep(CAS_LOCK_USLEEP);
-      usleep(CAS_LOCK_USLEEP);
-      usleep(CAS_LOCK_USLEEP);
+      // Equations often appear again soon in fine-grained nets,
+      // so spin and yield for a while before parking.
+      if (EQStack_Idle_wait(vm)) {
+        continue;
+      }
 
+      // Threads sleep only after seeing all EQStacks empty under Sleep_lock.
+      // So, when the last one falls asleep, no equation is left anywhere.
       pthread_mutex_lock(&Sleep_lock);
-      SleepingThreadsNum++;
+      while (!EQStack_Exist()) {
+        SleepingThreadsNum++;
 
-      if (SleepingThreadsNum == MaxThreadsNum) {
-        pthread_mutex_lock(&AllSleep_lock);
-        pthread_cond_signal(&ActiveThread_all_sleep);
-        pthread_mutex_unlock(&AllSleep_lock);
-      }
+        if (SleepingThreadsNum == MaxThreadsNum) {
+          pthread_cond_signal(&ActiveThread_all_sleep);
+        }
 
-      //            printf("[Thread %d is slept.]\n", vm->id);
-      pthread_cond_wait(&EQStack_not_empty, &Sleep_lock);
-      SleepingThreadsNum--;
+        //            printf("[Thread %d is slept.]\n", vm->id);
+        start_timer(&vm->park_start);
+        pthread_cond_wait(&EQStack_not_empty, &Sleep_lock);
+        vm->park_time += stop_timer(&vm->park_start);
+        SleepingThreadsNum--;
+        //            printf("[Thread %d is waked up.]\n", vm->id);
+      }
       pthread_mutex_unlock(&Sleep_lock);
-      //            printf("[Thread %d is waked up.]\n", vm->id);
     }
 
     eval_equation(vm, t1, t2);
+
+    // Wake a sleeping thread up when this VM has equations to be stolen.
+    if (SleepingThreadsNum > 0 && VM_EQStack_Num(vm) > 1) {
+      pthread_mutex_lock(&Sleep_lock);
+      pthread_cond_signal(&EQStack_not_empty);
+      pthread_mutex_unlock(&Sleep_lock);
+    }
   }
 
   return (void *)NULL;
@@ -2215,24 +2426,79 @@ void tpool_init(unsigned int agentBufferSize, unsigned int eqstack_size) {
     exit(-1);
   }
 
+  Topology_init();
+
   for (i = 0; i < MaxThreadsNum; i++) {
     VMs[i] = malloc(sizeof(VirtualMachine));
     VMs[i]->id = i;
+    Topology_place(i, GlobalOptions.placement, &VMs[i]->cpu, &VMs[i]->node);
+
+    if (GlobalOptions.verbose_threads) {
+      printf("(Thread%d is placed on CPU%d of node%d)\n", i, VMs[i]->cpu,
+             VMs[i]->node);
+    }
 
     //    usleep(i*2);
 
+#  ifdef FLEX_EXPANDABLE_HEAP
+    // The first hoops of the VM are also taken from its node.
+    Heap_Bind_Node(VMs[i]->node);
+#  endif
+
 #  if defined(EXPANDABLE_HEAP) || defined(FLEX_EXPANDABLE_HEAP)
     VM_Init(VMs[i], eqstack_size);
 #  else
     VM_Init(VMs[i], agentBufferSize, eqstack_size);
 #  endif
 
+#  ifdef PROFILE_RULES
+    if (GlobalOptions.profile_rules) {
+      VM_Profile_init(VMs[i]);
+    }
+#  endif
+  }
+
+  // Victims on the same node come first, each starting with the next VM
+  // so that thieves spread over victims.
+  for (i = 0; i < MaxThreadsNum; i++) {
+    VMs[i]->victims = malloc(sizeof(int) * MaxThreadsNum);
+    if (VMs[i]->victims == NULL) {
+      printf("the thread pool could not be created.");
+      exit(-1);
+    }
+
+    int n = 0;
+    for (int j = 1; j < MaxThreadsNum; j++) {
+      int victim = (i + j) % MaxThreadsNum;
+      if (VMs[victim]->node == VMs[i]->node) {
+        VMs[i]->victims[n++] = victim;
+      }
+    }
+    for (int j = 1; j < MaxThreadsNum; j++) {
+      int victim = (i + j) % MaxThreadsNum;
+      if (VMs[victim]->node != VMs[i]->node) {
+        VMs[i]->victims[n++] = victim;
+      }
+    }
+  }
+
+  // Threads start after all VMs are ready because they steal from each other.
+  for (i = 0; i < MaxThreadsNum; i++) {
     status = pthread_create(&Threads[i], &attr, tpool_thread, (void *)VMs[i]);
     if (status != 0) {
       printf("ERROR: Thread%d could not be created.", i);
       exit(-1);
     }
   }
+
+  // The main thread also makes nets on VMs[0] at the top-level execution.
+  Heap_Bind(&VMs[0]->agentHeap, &VMs[0]->nameHeap);
+#  if defined(HEAP_FREELIST) && defined(AGENT_SIZE_CLASS)
+  Heap_Bind_FreeList_forSmallAgent(&VMs[0]->smallAgentHeap);
+#  endif
+#  ifdef FLEX_EXPANDABLE_HEAP
+  Heap_Bind_Node(VMs[0]->node);
+#  endif
 }
 
 void tpool_destroy(void) {
@@ -2245,24 +2511,21 @@ void tpool_destroy(void) {
 int exec(Ast *at) {
   // Ast at: (AST_BODY stmlist aplist)
 
-  unsigned long long t, time;
+  unsigned long long t, time, cputime;
 
-  void *code[MAX_VMCODE_SEQUENCE];
-  int   eqsnum = 0;
+  void **code;
+  Ast   *stmlist = at->left;
+  int    eqsnum;
 
-#  ifdef COUNT_INTERACTION
   for (int i = 0; i < MaxThreadsNum; i++) {
+#  ifdef COUNT_INTERACTION
     VM_Clear_InteractionCount(VMs[i]);
-  }
 #  endif
+    VM_Clear_RunStats(VMs[i]);
+  }
 
   start_timer(&t);
-
-  CmEnv_clear_all();
-
-  // for `where' expression
-  if (!Compile_stmlist_on_ast(at->left))
-    return 0;
+  cputime = getcputime();
 
   // aplist
   at = at->right;
@@ -2289,120 +2552,138 @@ int exec(Ast *at) {
     }
   }
 
-  // Reset the counter of compilation errors
-  CmEnv.count_compilation_errors = 0;
-
-  while (at != NULL) {
-    int  p1, p2;
-    Ast *left, *right;
-    left = at->left->left;
-    right = at->left->right;
-    p1 = Compile_term_on_ast(left, -1);
-    p2 = Compile_term_on_ast(right, -1);
-
-    // Check whether compilation errors arise
-    if (CmEnv.count_compilation_errors != 0) {
-      return 0;
-    }
-
-    if (left->id == AST_NAME) {
-      select_kind_of_push(left, p1, p2);
-
-    } else if (right->id == AST_NAME) {
-      select_kind_of_push(right, p2, p1);
-
-    } else {
-      IMCode_genCode2(OP_PUSH, p1, p2);
-    }
-
-    eqsnum++; // for distrubution
-    at = ast_getTail(at);
-  }
-  IMCode_genCode0(OP_RET);
-
-  // checking whether names occur more than twice
-  if (!CmEnv_check_name_reference_times()) {
+  if (GlobalOptions.stream_nets && !Stream_init(stmlist, at)) {
+    if (yyin != stdin)
+      exit(-1);
     return 0;
   }
 
-#  ifndef DEBUG_NETS
-  // for regular
-  CmEnv_retrieve_MKGNAME();
-  CmEnv_generate_VMCode(code);
+  // All threads are sleeping now, and they cannot wake up
+  // while the lock is held, so VMs[0] is used here exclusively.
+  pthread_mutex_lock(&Sleep_lock);
 
-#  else
-  // for debug
-  CmEnv_retrieve_MKGNAME();
-  IMCode_puts(0); // exit(1);
+  for (int i = 0; i < MaxThreadsNum; i++) {
+    VMs[i]->spin_time = VMs[i]->park_time = 0;
+    start_timer(&VMs[i]->park_start);
+  }
 
-  int codenum = CmEnv_generate_VMCode(code);
-  VMCode_puts(code, codenum - 2); // exit(1);
-  // end for debug
-#  endif
+  // Each chunk is reduced before the next one is compiled,
+  // and the threads are sleeping again then.
+  do {
+    code = compile_nets(stmlist, &at, &eqsnum);
+    if (code == NULL) {
+      pthread_mutex_unlock(&Sleep_lock);
+      return 0;
+    }
 
-  exec_code(1, VMs[0], code);
+    // Registers are enlarged for rules compiled so far.
+    for (int i = 0; i < MaxThreadsNum; i++) {
+      VM_Reg_Fit(VMs[i]);
+    }
 
-  // Distribute equations to virtual machines
-  {
-    int each_eqsnum = eqsnum / MaxThreadsNum;
-    if (each_eqsnum == 0)
-      each_eqsnum = 1;
+    exec_code(1, VMs[0], code);
+    free(code);
 
-    VALUE t1, t2;
-    for (int i = 1; i < MaxThreadsNum; i++) {
-      for (int j = 0; j < each_eqsnum; j++) {
-        if (!VM_EQStack_Pop(VMs[0], &t1, &t2))
-          goto endloop;
-        VM_EQStack_Push(VMs[i], t1, t2);
+    // Distribute equations to virtual machines
+    {
+      int each_eqsnum = eqsnum / MaxThreadsNum;
+      if (each_eqsnum == 0)
+        each_eqsnum = 1;
+
+      VALUE t1, t2;
+      for (int i = 1; i < MaxThreadsNum; i++) {
+        for (int j = 0; j < each_eqsnum; j++) {
+          if (!VM_EQStack_Pop(VMs[0], &t1, &t2))
+            goto endloop;
+          VM_EQStack_Push(VMs[i], t1, t2);
+        }
       }
     }
-  }
-endloop:
+  endloop:
 
-  pthread_mutex_lock(&Sleep_lock);
-  pthread_cond_broadcast(&EQStack_not_empty);
-  pthread_mutex_unlock(&Sleep_lock);
-
-  // a little wait until all threads start.
-  // usleep(CAS_LOCK_USLEEP);
-  usleep(10000); // 0.01 sec wait
+    pthread_cond_broadcast(&EQStack_not_empty);
 
-  // if some threads are working, wait for all of these to sleep.
-  if (SleepingThreadsNum < MaxThreadsNum) {
-    pthread_mutex_lock(&AllSleep_lock);
-    pthread_cond_wait(&ActiveThread_all_sleep, &AllSleep_lock);
-    pthread_mutex_unlock(&AllSleep_lock);
-  }
+    // The execution finishes exactly when all threads sleep
+    // and no equation is left in the EQStacks.
+    while (SleepingThreadsNum < MaxThreadsNum || EQStack_Exist()) {
+      pthread_cond_wait(&ActiveThread_all_sleep, &Sleep_lock);
+    }
+  } while (at != NULL);
 
-  usleep(10000); // 0.01 sec wait
-  //  usleep(CAS_LOCK_USLEEP);
+  // Count the current parking too, since all threads are parked now.
+  // No thread reads the retired buffers of the EQStacks either.
+  unsigned long long spin_time = 0, park_time = 0;
   for (int i = 0; i < MaxThreadsNum; i++) {
-    //    printf("VM[%d]: nextPtr_eqStack=%d\n", i, VMs[i]->nextPtr_eqStack);
-    if (VMs[i]->nextPtr_eqStack != -1)
-      goto endloop;
+    VM_EQStack_FreeRetired(VMs[i]);
+    VMs[i]->park_time += stop_timer(&VMs[i]->park_start);
+    start_timer(&VMs[i]->park_start);
+    spin_time += VMs[i]->spin_time;
+    park_time += VMs[i]->park_time;
   }
+  pthread_mutex_unlock(&Sleep_lock);
 
   time = stop_timer(&t);
 
+  if (GlobalOptions.stats_json != NULL) {
+    puts_stats_json(VMs, MaxThreadsNum, time, getcputime() - cputime);
+  }
+
+  // The free text is replaced with JSON when it is put on stdout.
+  if (GlobalOptions.stats_json != stdout) {
 #  ifdef COUNT_INTERACTION
-  {
     unsigned long total = 0;
     for (int i = 0; i < MaxThreadsNum; i++) {
       total += VM_Get_InteractionCount(VMs[i]);
     }
-    printf("(%lu interactions by %d threads, %.2f sec)\n", total, MaxThreadsNum,
-           (double)(time) / 1000000.0);
+    printf("(%lu interactions by %d threads, %.2f sec)\n", total,
+           MaxThreadsNum, (double)(time) / 1000000.0);
+#  else
+    printf("(%.2f sec by %d threads)\n", (double)(time) / 1000000.0,
+           MaxThreadsNum);
+#  endif
   }
 
-#  else
-  printf("(%.2f sec by %d threads)\n", (double)(time) / 1000000.0,
-         MaxThreadsNum);
+  if (GlobalOptions.verbose_threads) {
+    printf("(idle threads: %.2f sec spinning, %.2f sec parked in total)\n",
+           (double)spin_time / 1000000.0, (double)park_time / 1000000.0);
+  }
+
+#  ifdef FLEX_EXPANDABLE_HEAP
+  // All threads are parked, so their heaps can be changed here.
+  shrink_heaps();
 #  endif
 
+  if (GlobalOptions.verbose_memory_use) {
+    print_memory_usage();
+  }
+
   return 0;
 }
 #endif
 
+int make_rule(Ast *ast);
+
+// Rules into which the previous definition was inlined are compiled again,
+// so that -finline-rules does not change the result.
+static void recompile_stale_rules(void) {
+  static int recompiling = 0;
+  if (recompiling) {
+    return;
+  }
+  recompiling = 1;
+
+  int preserve_CmEnv_put_compiled_codes = CmEnv.put_compiled_codes;
+  CmEnv.put_compiled_codes = 0; // without outputting codes
+
+  Ast *rule;
+  while ((rule = Ast_InlineRule_take_stale()) != NULL) {
+    make_rule(rule);
+  }
+
+  CmEnv.put_compiled_codes = preserve_CmEnv_put_compiled_codes;
+  recompiling = 0;
+}
+
 int make_rule(Ast *ast) {
   //      (ASTRULE
   //       (AST_CNCT agentL agentR)
@@ -2426,6 +2707,10 @@ int make_rule(Ast *ast) {
   }
   */
 
+  if (CmEnv.inline_rules) {
+    Ast_InlineRule_begin(ast);
+  }
+
   ast->left->left = ast_remove_tuple1(ruleAgent_L);
   ast->left->right = ast_remove_tuple1(ruleAgent_R);
 
@@ -2465,6 +2750,12 @@ int make_rule(Ast *ast) {
   CmEnv.put_warning_for_cnct_property = 1; // retrieve warning
   CmEnv.put_compiled_codes = preserve_CmEnv_put_compiled_codes; // retrieve
 
+  if (result_make_rule && CmEnv.inline_rules) {
+    // For bodies compiled later
+    Ast_InlineRule_record(ast, CmEnv.idL, CmEnv.idR);
+    recompile_stale_rules();
+  }
+
   return result_make_rule;
 }
 
@@ -2528,9 +2819,26 @@ void IMCode_puts(int n) {
                                   "LOOP_RREC_FREE_R",
                                   "LOOP_RREC1_FREE_R",
                                   "LOOP_RREC2_FREE_R",
+                                  "JMPCNCT_RULE",
+                                  "TAILCALL",
+                                  "TAILCALL_FREE_R",
 
                                   "CNCTGN",
                                   "SUBSTGN",
+                                  "NATIVE",
+
+                                  "LOADP_LOADP",
+                                  "MKAGENT_LOADP",
+                                  "MKNAME_LOADP",
+                                  "LOADP_PUSH",
+                                  "LOADP_L_PUSH",
+                                  "LOADP_R_PUSH",
+                                  "PUSH_RET_FREE_LR",
+                                  "LT_R0_JMPEQ0_R0",
+                                  "LE_R0_JMPEQ0_R0",
+                                  "EQ_R0_JMPEQ0_R0",
+                                  "EQI_R0_JMPEQ0_R0",
+                                  "NE_R0_JMPEQ0_R0",
 
                                   "NOP",
 
@@ -2662,6 +2970,13 @@ void IMCode_puts(int n) {
              imcode->operand1, imcode->operand2);
       break;
 
+      // arity is 2: opcode var1 id2
+    case OP_TAILCALL:
+    case OP_TAILCALL_FREE_R:
+      printf("%s var%ld id%ld\n", string_opcode[imcode->opcode],
+             imcode->operand1, imcode->operand2);
+      break;
+
       // arity is 3: opcode var1 var2 var3
     case OP_ADD:
     case OP_SUB:
@@ -2694,6 +3009,7 @@ void IMCode_puts(int n) {
 
       // arity is 3: opcode var1 id2 LABEL3
     case OP_JMPCNCT:
+    case OP_JMPCNCT_RULE:
       printf("%s var%ld id%ld %s%ld\n", string_opcode[imcode->opcode],
              imcode->operand1, imcode->operand2, string_opcode[OP_LABEL],
              imcode->operand3);
@@ -2753,7 +3069,7 @@ int get_ruleagentID(Ast *ruleAgent) {
 }
 
 void print_name_port0(VALUE ptr) {
-  if (ptr == (VALUE)NULL) {
+  if (ptr == VALUE_NULL) {
     fprintf(stderr, "<NON-DEFINED>");
     return;
   }
@@ -2763,14 +3079,14 @@ void print_name_port0(VALUE ptr) {
     return;
   }
 
-  if (NAME(ptr)->port == (VALUE)NULL) {
+  if (NAME(ptr)->port == VALUE_NULL) {
     printf("<EMPTY>");
     return;
   }
 
   ShowNameHeap = ptr;
   puts_term(NAME(ptr)->port);
-  ShowNameHeap = (VALUE)NULL;
+  ShowNameHeap = VALUE_NULL;
 }
 
 int make_rule_oneway(Ast *ast) {
@@ -2789,7 +3105,8 @@ int make_rule_oneway(Ast *ast) {
   int  idL, idR;
   Ast *ruleAgent_L, *ruleAgent_R, *rule_mainbody;
 
-  void *code[MAX_VMCODE_SEQUENCE];
+  // The buffer is kept for the next rule, since rules are copied when recorded.
+  static void **code = NULL;
   int   gencode_num = 0;
 
   CmEnv_clear_all();
@@ -2876,6 +3193,9 @@ int make_rule_oneway(Ast *ast) {
 
   // IMPORTANT:
   // The first two codes stores arities of idL and idR, respectively.
+  if (code == NULL) {
+    code = CmEnv_realloc_VMCode(NULL, 2);
+  }
   if (idL == ID_INT || idL == ID_WILDCARD) {
     arity = 0;
   } else {
@@ -2906,6 +3226,11 @@ int make_rule_oneway(Ast *ast) {
 
   gencode_num = 2;
 
+  // The same codes as the previous run are reused for -fcache-rules
+  if (RuleCache_load(idL, idR, &code, &gencode_num)) {
+    goto compiled;
+  }
+
   if (idL == ID_INT) {
     set_metaL_as_IntName(ruleAgent_L);
     CmEnv.annotateL = ANNOTATE_INT_MODIFIER; // to prevent putting Free_L
@@ -2979,6 +3304,7 @@ int make_rule_oneway(Ast *ast) {
 
   //              #define DEBUG_MKRULE
 #ifndef DEBUG_MKRULE
+  code = CmEnv_realloc_VMCode(code, 2 + CmEnv_get_VMCode_bound());
   gencode_num += CmEnv_generate_VMCode(&code[2]);
 #else
 
@@ -2991,6 +3317,7 @@ int make_rule_oneway(Ast *ast) {
     IMCode_puts(0);
   }
 
+  code = CmEnv_realloc_VMCode(code, 2 + CmEnv_get_VMCode_bound());
   gencode_num += CmEnv_generate_VMCode(&code[2]);
 
   if (here_flag) {
@@ -3011,6 +3338,9 @@ int make_rule_oneway(Ast *ast) {
   //    ast_puts(ruleAgent_R); puts("");
 #endif
 
+  RuleCache_store(idL, idR, code, gencode_num);
+
+compiled:
   if (CmEnv.put_compiled_codes) {
     printf("Rule: %s(id:%d,arity:%lu) >< %s(id:%d,arity:%lu).\n",
            IdTable_get_name(idL), idL, (unsigned long)code[0],
@@ -3021,6 +3351,15 @@ int make_rule_oneway(Ast *ast) {
     }
   }
 
+  if (AOT_is_emitting()) {
+    AOT_emit_rule(idL, idR, code, gencode_num);
+  }
+
+#ifdef AOT_RULES
+  // Replace the code with the translated one if any
+  gencode_num = AOT_install(idL, idR, &code, gencode_num);
+#endif
+
   // Record the rule code for idL >< idR
   RuleTable_record(idL, idR, code, gencode_num);
 
@@ -3124,9 +3463,27 @@ void *exec_code(int mode, VirtualMachine *restrict vm, void *restrict *code) {
       &&E_LOOP_RREC_FREE_R,
       &&E_LOOP_RREC1_FREE_R,
       &&E_LOOP_RREC2_FREE_R,
+      &&E_JMPCNCT_RULE,
+      &&E_TAILCALL,
+      &&E_TAILCALL_FREE_R,
 
       &&E_CNCTGN,
       &&E_SUBSTGN,
+      &&E_NATIVE,
+
+      &&E_LOADP_LOADP,
+      &&E_MKAGENT_LOADP,
+      &&E_MKNAME_LOADP,
+      &&E_LOADP_PUSH,
+      &&E_LOADP_L_PUSH,
+      &&E_LOADP_R_PUSH,
+      &&E_PUSH_RET_FREE_LR,
+      &&E_LT_R0_JMPEQ0_R0,
+      &&E_LE_R0_JMPEQ0_R0,
+      &&E_EQ_R0_JMPEQ0_R0,
+      &&E_EQI_R0_JMPEQ0_R0,
+      &&E_NE_R0_JMPEQ0_R0,
+
       &&E_NOP,
   };
 
@@ -3154,7 +3511,7 @@ E_MKGNAME:
 
   inst = (unsigned long)code[++pc];
   a1 = IdTable_get_heap(inst);
-  if (a1 == (VALUE)NULL) {
+  if (a1 == VALUE_NULL) {
     a1 = make_Name(vm);
 
     // set GID
@@ -3293,6 +3650,40 @@ E_LOOP_RREC2:
   pc = 0;
   goto *code[0];
 
+E_TAILCALL_FREE_R:
+  free_Agent(reg[VM_OFFSET_ANNOTATE_R]);
+
+E_TAILCALL:
+  //      puts("tailcall reg id");
+
+  // The rule agent of the left is reused as the agent `id',
+  // and the code of the rule for it and the agent in `reg' is executed.
+  // Metavariables of the left have been loaded already.
+  {
+    unsigned long id = (unsigned long)code[pc + 2];
+    void        **rule;
+    int           result;
+
+    a1 = reg[(unsigned long)code[pc + 1]];
+    if (IS_FIXNUM(a1)) {
+      rule = RuleTable_get_code(id, ID_INT, &result);
+
+    } else {
+      rule = RuleTable_get_code(id, BASIC(a1)->id, &result);
+      for (unsigned long i = 0; i < (unsigned long)rule[1]; i++) {
+        reg[VM_OFFSET_METAVAR_R(i)] = AGENT(a1)->port[i];
+      }
+    }
+
+    BASIC(reg[VM_OFFSET_ANNOTATE_L])->id = id;
+    reg[VM_OFFSET_ANNOTATE_R] = a1;
+
+    code = &rule[2];
+  }
+
+  pc = 0;
+  goto *code[0];
+
 E_LOAD:
   //    puts("load src dest");
   a1 = reg[(unsigned long)code[++pc]];
@@ -3613,9 +4004,13 @@ E_JMPCNCT_CONS:
     goto *code[pc];
   }
 
+  int cons_hops = 0;
   while (IS_NAMEID(BASIC(a1)->id)) {
 
-    if (NAME(a1)->port == (VALUE)NULL) {
+    if (NAME(a1)->port == VALUE_NULL) {
+      if (cons_hops > 1) {
+        vm->name_chains++;
+      }
       pc += 3;
       goto *code[pc];
     }
@@ -3628,6 +4023,10 @@ E_JMPCNCT_CONS:
     free_Name(a1);
     a1 = a2;
     reg[(unsigned long)code[pc + 1]] = a2;
+    cons_hops++;
+  }
+  if (cons_hops > 1) {
+    vm->name_chains++;
   }
 
 #ifdef DEBUG
@@ -3672,9 +4071,13 @@ E_JMPCNCT:
     goto *code[pc];
   }
 
+  int hops = 0;
   while (IS_NAMEID(BASIC(a1)->id)) {
 
-    if (NAME(a1)->port == (VALUE)NULL) {
+    if (NAME(a1)->port == VALUE_NULL) {
+      if (hops > 1) {
+        vm->name_chains++;
+      }
       pc += 4;
       goto *code[pc];
     }
@@ -3686,6 +4089,10 @@ E_JMPCNCT:
     free_Name(a1);
     a1 = a2;
     reg[(unsigned long)code[pc + 1]] = a1;
+    hops++;
+  }
+  if (hops > 1) {
+    vm->name_chains++;
   }
 
   if (BASIC(a1)->id == (unsigned long)code[pc + 2]) {
@@ -3700,6 +4107,53 @@ E_JMPCNCT:
   pc += 4;
   goto *code[pc];
 
+E_JMPCNCT_RULE:
+  //      puts("JMPCNCT_RULE reg id pc");
+  // Jumps when a rule is defined for the agent `id' and the one in `reg'.
+
+#ifdef THREAD
+  if (SleepingThreadsNum > 0) {
+    pc += 4;
+    goto *code[pc];
+  }
+#endif
+
+  a1 = reg[(unsigned long)code[pc + 1]];
+  if (!IS_FIXNUM(a1)) {
+    int rule_hops = 0;
+    while (IS_NAMEID(BASIC(a1)->id)) {
+
+      if (NAME(a1)->port == VALUE_NULL) {
+        if (rule_hops > 1) {
+          vm->name_chains++;
+        }
+        pc += 4;
+        goto *code[pc];
+      }
+
+      VALUE a2 = NAME(a1)->port;
+      free_Name(a1);
+      a1 = a2;
+      reg[(unsigned long)code[pc + 1]] = a1;
+      rule_hops++;
+    }
+    if (rule_hops > 1) {
+      vm->name_chains++;
+    }
+  }
+
+  {
+    int result;
+    RuleTable_get_code((unsigned long)code[pc + 2],
+                       IS_FIXNUM(a1) ? ID_INT : BASIC(a1)->id, &result);
+    if (result) {
+      pc += (unsigned long)code[pc + 3];
+    }
+  }
+
+  pc += 4;
+  goto *code[pc];
+
 E_JMP:
   //      puts("JMP pc");
   pc += (unsigned long)code[pc + 1];
@@ -3800,6 +4254,138 @@ E_SUBSTGN:
   }
   goto *code[pc];
 
+E_NATIVE:
+  //    puts("NATIVE func");
+  return ((AOT_Func)code[pc + 1])(vm, reg);
+
+  // Superinstructions:
+  // execute the first instruction and jump to the second one directly.
+
+E_LOADP_LOADP:
+  //    puts("loadp src port dest; loadp ...");
+  a1 = reg[(unsigned long)code[++pc]];
+  inst = (unsigned long)code[++pc];
+  AGENT(reg[(unsigned long)code[++pc]])->port[inst] = a1;
+  ++pc;
+  goto E_LOADP;
+
+E_MKAGENT_LOADP:
+  //    puts("mkagent id dest; loadp ...");
+  inst = (unsigned long)code[++pc];
+  reg[(unsigned long)code[++pc]] = make_Agent(vm, inst);
+  ++pc;
+  goto E_LOADP;
+
+E_MKNAME_LOADP:
+  //    puts("mkname dest; loadp ...");
+  reg[(unsigned long)code[++pc]] = make_Name(vm);
+  ++pc;
+  goto E_LOADP;
+
+E_LOADP_PUSH:
+  //    puts("loadp src port dest; push ...");
+  a1 = reg[(unsigned long)code[++pc]];
+  inst = (unsigned long)code[++pc];
+  AGENT(reg[(unsigned long)code[++pc]])->port[inst] = a1;
+  ++pc;
+  goto E_PUSH;
+
+E_LOADP_L_PUSH:
+  //    puts("loadp_L src port; push ...");
+  a1 = reg[(unsigned long)code[++pc]];
+  inst = (unsigned long)code[++pc];
+  AGENT(reg[VM_OFFSET_ANNOTATE_L])->port[inst] = a1;
+  ++pc;
+  goto E_PUSH;
+
+E_LOADP_R_PUSH:
+  //    puts("loadp_R src port; push ...");
+  a1 = reg[(unsigned long)code[++pc]];
+  inst = (unsigned long)code[++pc];
+  AGENT(reg[VM_OFFSET_ANNOTATE_R])->port[inst] = a1;
+  ++pc;
+  goto E_PUSH;
+
+E_PUSH_RET_FREE_LR:
+  //    puts("push reg reg; ret_free_LR");
+  {
+    VALUE a1 = reg[(unsigned long)code[++pc]];
+    VALUE a2 = reg[(unsigned long)code[++pc]];
+    PUSH(vm, a1, a2);
+  }
+  ++pc;
+  goto E_RET_FREE_LR;
+
+E_LT_R0_JMPEQ0_R0:
+  //    puts("LT_R0 src1 src2; JMPEQ0_R0 pc");
+  {
+    long i = reg[(unsigned long)code[++pc]];
+    long j = reg[(unsigned long)code[++pc]];
+
+    reg[0] = (i < j);
+    pc += 2;
+    if (!reg[0]) {
+      pc += (int)(unsigned long)code[pc];
+    }
+  }
+  goto *code[++pc];
+
+E_LE_R0_JMPEQ0_R0:
+  //    puts("LE_R0 src1 src2; JMPEQ0_R0 pc");
+  {
+    long i = reg[(unsigned long)code[++pc]];
+    long j = reg[(unsigned long)code[++pc]];
+
+    reg[0] = (i <= j);
+    pc += 2;
+    if (!reg[0]) {
+      pc += (int)(unsigned long)code[pc];
+    }
+  }
+  goto *code[++pc];
+
+E_EQ_R0_JMPEQ0_R0:
+  //    puts("EQ_R0 src1 src2; JMPEQ0_R0 pc");
+  {
+    long i = reg[(unsigned long)code[++pc]];
+    long j = reg[(unsigned long)code[++pc]];
+
+    reg[0] = (i == j);
+    pc += 2;
+    if (!reg[0]) {
+      pc += (int)(unsigned long)code[pc];
+    }
+  }
+  goto *code[++pc];
+
+E_EQI_R0_JMPEQ0_R0:
+  //    puts("EQI_R0 src1 int; JMPEQ0_R0 pc");
+  {
+    long i = reg[(unsigned long)code[++pc]];
+    long j = (unsigned long)code[++pc];
+
+    reg[0] = (i == j);
+    pc += 2;
+    if (!reg[0]) {
+      pc += (int)(unsigned long)code[pc];
+    }
+  }
+  goto *code[++pc];
+
+E_NE_R0_JMPEQ0_R0:
+  //    puts("NE_R0 src1 src2; JMPEQ0_R0 pc");
+  {
+    long i = reg[(unsigned long)code[++pc]];
+    long j = reg[(unsigned long)code[++pc]];
+
+    reg[0] = (i != j);
+    pc += 2;
+    if (!reg[0]) {
+      pc += (int)(unsigned long)code[pc];
+    }
+  }
+  goto *code[++pc];
+
   // extended codes should be ended here.
 
 E_NOP:
@@ -3815,7 +4401,7 @@ void select_kind_of_push(Ast *ast, int p1, int p2) {
 
     // aheap is connected with something such as aheap->t
     // ==> p2 should be conncected with t, so OP_CNCTGN(p1,p2)
-    if (NAME(aheap)->port != (VALUE)NULL) {
+    if (NAME(aheap)->port != VALUE_NULL) {
       IMCode_genCode2(OP_CNCTGN, p1, p2);
 
     } else {
@@ -3847,17 +4433,75 @@ void Compile_gen_RET_for_rulebody(void) {
       IMCode_genCode0(OP_RET_FREE_R);
     }
 
-  } else if (CmEnv.annotateL != ANNOTATE_NOTHING &&
-             CmEnv.annotateR == ANNOTATE_NOTHING) {
-    // FreeR
-    if (CmEnv.reg_agentL == VM_OFFSET_ANNOTATE_L) {
-      IMCode_genCode0(OP_RET_FREE_R);
+  } else if (CmEnv.annotateL != ANNOTATE_NOTHING &&
+             CmEnv.annotateR == ANNOTATE_NOTHING) {
+    // FreeR
+    if (CmEnv.reg_agentL == VM_OFFSET_ANNOTATE_L) {
+      IMCode_genCode0(OP_RET_FREE_R);
+
+    } else {
+      IMCode_genCode0(OP_RET_FREE_L);
+    }
+  } else {
+    IMCode_genCode0(OP_RET);
+  }
+}
+
+// Return 1 if names in the term are bound by the preceding equations,
+// so that it can be compiled again after the label of OP_JMPCNCT_RULE.
+static int Compile_names_are_bound(Ast *ptr) {
+  NB_TYPE type;
+
+  switch (ptr->id) {
+  case AST_NAME:
+    return CmEnv_gettype_forname(ptr->left->sym, &type);
+
+  case AST_TUPLE:
+  case AST_OPCONS:
+  case AST_AGENT:
+    for (Ast *arg = ptr->right; arg != NULL; arg = ast_getTail(arg)) {
+      if (!Compile_names_are_bound(arg->left)) {
+        return 0;
+      }
+    }
+    return 1;
+
+  default:
+    return 1;
+  }
+}
 
-    } else {
-      IMCode_genCode0(OP_RET_FREE_L);
+// Loads the arguments `alloc' of a tail call into the registers of
+// the rule agent L. A register of L that is read by a later argument,
+// or is `*keep' read after the loads, is copied before it is overwritten.
+// Ex.  A(a,b,c)>< (int x):xs => A(c,a,a)~xs;
+//   LD 1,newreg
+//   LD 3,1
+//   LD newreg,2
+//   LD newreg,3
+static void Compile_load_tailcall_args(int *alloc, int arity, int *keep) {
+  for (int i = 0; i < arity; i++) {
+    if (alloc[i] == VM_OFFSET_METAVAR_L(i))
+      continue;
+
+    int newreg = -1;
+    if (keep != NULL && *keep == VM_OFFSET_METAVAR_L(i)) {
+      newreg = CmEnv_newvar();
+      IMCode_genCode2(OP_LOAD, VM_OFFSET_METAVAR_L(i), newreg);
+      *keep = newreg;
     }
-  } else {
-    IMCode_genCode0(OP_RET);
+
+    for (int j = i + 1; j < arity; j++) {
+      if (alloc[j] == VM_OFFSET_METAVAR_L(i)) {
+        if (newreg == -1) {
+          newreg = CmEnv_newvar();
+          IMCode_genCode2(OP_LOAD, VM_OFFSET_METAVAR_L(i), newreg);
+        }
+        alloc[j] = newreg;
+      }
+    }
+
+    IMCode_genCode2(OP_LOAD_META, alloc[i], VM_OFFSET_METAVAR_L(i));
   }
 }
 
@@ -3971,6 +4615,17 @@ int Compile_eqlist_on_ast_in_rulebody(Ast *at) {
 
       // WITH Tail Call Optimisation
 
+      if (eq->id == AST_CNCT_TCO_RULE) {
+        // The rewriting optimisation may have changed the equations.
+        Ast *other = eq->right;
+        if (next != NULL || !Compile_names_are_bound(eq->left->left) ||
+            !(Ast_is_expr(other) ||
+              (other->id == AST_NAME && Compile_names_are_bound(other)))) {
+          eq->id = AST_CNCT;
+          eq->left = eq->left->left;
+        }
+      }
+
       if (next != NULL || (next == NULL && eq->id == AST_CNCT)) {
         int var1 = Compile_term_on_ast(eq->left, -1);
         int var2 = Compile_term_on_ast(eq->right, -1);
@@ -4028,30 +4683,20 @@ int Compile_eqlist_on_ast_in_rulebody(Ast *at) {
             arg_list = ast_getTail(arg_list);
           }
 
+          // VM_OFFSET_ANNOTATE_R should be preserved
+          int newreg = -1;
           for (int i = 0; i < arity; i++) {
             if (alloc[i] == VM_OFFSET_ANNOTATE_R) {
-              // VM_OFFSET_ANNOTATE_R should be preserved
-              int newreg = CmEnv_newvar();
-              IMCode_genCode2(OP_LOAD, VM_OFFSET_ANNOTATE_R, newreg);
+              if (newreg == -1) {
+                newreg = CmEnv_newvar();
+                IMCode_genCode2(OP_LOAD, VM_OFFSET_ANNOTATE_R, newreg);
+              }
               alloc[i] = newreg;
-              break;
             }
           }
           IMCode_genCode2(OP_LOAD_META, var2, VM_OFFSET_ANNOTATE_R);
 
-          for (int i = 0; i < arity; i++) {
-            for (int j = i + 1; j < arity; j++) {
-              if (alloc[j] == VM_OFFSET_METAVAR_L(i)) {
-                // VM_OFFSET_METAVAR_L(i) should be preserved
-                int newreg = CmEnv_newvar();
-                IMCode_genCode2(OP_LOAD, VM_OFFSET_METAVAR_L(i), newreg);
-                alloc[j] = newreg;
-                break;
-              }
-            }
-
-            IMCode_genCode2(OP_LOAD_META, alloc[i], VM_OFFSET_METAVAR_L(i));
-          }
+          Compile_load_tailcall_args(alloc, arity, NULL);
 
           IMCode_genCode0(OP_LOOP);
 
@@ -4122,50 +4767,13 @@ int Compile_eqlist_on_ast_in_rulebody(Ast *at) {
             arg_list = ast_getTail(arg_list);
           }
 
-          for (int i = 0; i < arity; i++) {
-            if (alloc[i] == VM_OFFSET_METAVAR_L(i))
-              continue;
-
-            if (eq_rhs_name_reg == VM_OFFSET_METAVAR_L(i)) {
-              // preserve eq_rhs_name_reg to be overwritten
-              // because it is used for OP_LOOP_RREC.
-              // Ex.
-              // MergeCC(ret, int y, ys) >< (int x):xs
-              // | _      => ret~(y:cnt), MergeCC(cnt, x, xs) ~ ys;
-              // The `ys' is stored in reg(3), but it is overwritten by `xs',
-              // though `ys' is required by LOOP_RREC2 `ys' placed later.
-              // So, the `ys' must be preserved.
-
-              int newreg = CmEnv_newvar();
-              IMCode_genCode2(OP_LOAD, eq_rhs_name_reg, newreg);
-              eq_rhs_name_reg = newreg;
-            }
-
-            for (int j = i + 1; j < arity; j++) {
-              if (alloc[j] == VM_OFFSET_METAVAR_L(i)) {
-                // preserve VM_OFFSET_METAVAR_L(i)
-                // if it is used later.
-                // Ex.
-                // LD 3,1
-                // LD 1,3  <-- 1 is disappeared.
-                // ==>
-                // It must be as follows:
-                // LD 1, newreg
-                // LD 3, 1
-                // LD newreg, 3
-                //
-                // Ex.2  A(a,b,c)>< (int x):xs => A(c,a,b)~xs;
-                //
-
-                int newreg = CmEnv_newvar();
-                IMCode_genCode2(OP_LOAD, VM_OFFSET_METAVAR_L(i), newreg);
-                alloc[j] = newreg;
-                break;
-              }
-            }
-
-            IMCode_genCode2(OP_LOAD_META, alloc[i], VM_OFFSET_METAVAR_L(i));
-          }
+          // Ex.
+          // MergeCC(ret, int y, ys) >< (int x):xs
+          // | _      => ret~(y:cnt), MergeCC(cnt, x, xs) ~ ys;
+          // The `ys' is stored in reg(3), but it is overwritten by `xs',
+          // though `ys' is required by LOOP_RREC2 `ys' placed later.
+          // So, the `ys' must be preserved.
+          Compile_load_tailcall_args(alloc, arity, &eq_rhs_name_reg);
 
           int arityR = IdTable_get_arity(CmEnv.idR);
           if (CmEnv.annotateR == ANNOTATE_REUSE) {
@@ -4194,6 +4802,81 @@ int Compile_eqlist_on_ast_in_rulebody(Ast *at) {
 
           //		IMCode_puts(0); //exit(1);
 
+        } else if (eq->id == AST_CNCT_TCO_RULE) {
+          // other_agent ~ name   where the rule agent L becomes other_agent
+
+          // Pealing (*L)
+          Ast *eq_lhs = eq->left;           // (*L)(AGENT(Foo, arglist))
+          Ast *deconst_term = eq_lhs->left; // (AGENT(Foo, arglist))
+
+          int eq_rhs_name_reg = Compile_term_on_ast(eq->right, -1);
+          if (CmEnv.count_compilation_errors != 0) {
+            return 0;
+          }
+
+          int idB = IdTable_getid_builtin_funcAgent(deconst_term);
+          if (idB == -1) {
+            idB = NameTable_get_set_id_with_IdTable_forAgent(
+                deconst_term->left->sym);
+          }
+
+          int label1 = CmEnv_get_newlabel();
+
+          // JMPCNCT_RULE reg id pc
+          IMCode_genCode3(OP_JMPCNCT_RULE, eq_rhs_name_reg, idB, label1);
+
+#ifdef OPTIMISE_TWO_ADDRESS
+          IMCode_genCode0(OP_BEGIN_JMPCNCT_BLOCK);
+#endif
+
+          int var1 = Compile_term_on_ast(deconst_term, -1);
+
+          // Check whether compilation errors arise
+          if (CmEnv.count_compilation_errors != 0) {
+            return 0;
+          }
+
+          IMCode_genCode2(OP_PUSH, var1, eq_rhs_name_reg);
+          Compile_gen_RET_for_rulebody();
+
+          // From now on,
+          // prevent putting FREE_L, and ignore counting up for name ref
+          CmEnv.annotateL = ANNOTATE_TCO;
+
+#ifdef OPTIMISE_TWO_ADDRESS
+          IMCode_genCode0(OP_BEGIN_JMPCNCT_BLOCK);
+#endif
+
+          IMCode_genCode1(OP_LABEL, label1);
+
+          Ast *arg_list = deconst_term->right; // arglist
+          int  arity = 0;
+          int  alloc[MAX_PORT];
+
+          for (int i = 0; i < MAX_PORT; i++) {
+            if (arg_list == NULL)
+              break;
+            arity++;
+
+            alloc[i] = Compile_term_on_ast(arg_list->left, -1);
+            // Check whether compilation errors arise
+            if (CmEnv.count_compilation_errors != 0) {
+              return 0;
+            }
+
+            arg_list = ast_getTail(arg_list);
+          }
+
+          // eq_rhs_name_reg is used by OP_TAILCALL.
+          Compile_load_tailcall_args(alloc, arity, &eq_rhs_name_reg);
+
+          // The rule agent R is freed unless it is an integer or a wildcard.
+          if (CmEnv.annotateR == ANNOTATE_NOTHING) {
+            IMCode_genCode2(OP_TAILCALL_FREE_R, eq_rhs_name_reg, idB);
+          } else {
+            IMCode_genCode2(OP_TAILCALL, eq_rhs_name_reg, idB);
+          }
+
         } else {
           // unknown AST id
           puts("Fatal ERROR in Compile_eqlist_on_ast_in_rulebody");
@@ -4272,6 +4955,12 @@ int Compile_body_on_ast(Ast *body) {
 
   if (!Compile_stmlist_on_ast(stms))
     return 0;
+
+  // After the where-clause, so that its int names are known
+  if (CmEnv.inline_rules) {
+    Ast_InlineActivePairs_eqlist(eqs);
+  }
+
   if (!Compile_eqlist_on_ast_in_rulebody(eqs)) {
     printf("%d:ERROR: Compilation failure for %s >< %s.\n", yylineno,
            IdTable_get_name(CmEnv.idL), IdTable_get_name(CmEnv.idR));
@@ -4449,11 +5138,23 @@ int check_ast_arity(Ast *ast) {
 
 // MAIN ---------------------------
 
+#ifdef PROFILE_RULES
+static void puts_profile(void) {
+#  ifndef THREAD
+  VirtualMachine *vms[] = {&VM};
+  VM_Profile_puts(vms, 1);
+#  else
+  VM_Profile_puts(VMs, MaxThreadsNum);
+#  endif
+}
+#endif
+
 int main(int argc, char *argv[]) {
   int   i, param;
   char *fname = NULL;
   int   max_EQStack = 1 << 8; // 512
   bool  retrieve_flag = true; // 1: retrieve to interpreter even if error occurs
+  bool  cache_rules = false;
 
 #if !defined(EXPANDABLE_HEAP) && !defined(FLEX_EXPANDABLE_HEAP)
   // v0.5.6
@@ -4488,6 +5189,44 @@ int main(int argc, char *argv[]) {
         break;
 
       case '-':
+        if (!strcmp(argv[i], "--stats=json")) {
+          if (GlobalOptions.stats_json == NULL) {
+            GlobalOptions.stats_json = stdout;
+          }
+          break;
+        }
+
+        if (!strcmp(argv[i], "--stats-fd")) {
+          i++;
+          if (i >= argc || atoi(argv[i]) <= 0) {
+            printf(
+                "ERROR: The option `--stats-fd' needs a file descriptor.\n");
+            exit(-1);
+          }
+          GlobalOptions.stats_json = fdopen(atoi(argv[i]), "w");
+          if (GlobalOptions.stats_json == NULL) {
+            printf("ERROR: The file descriptor `%s' cannot be opened: %s\n",
+                   argv[i], strerror(errno));
+            exit(-1);
+          }
+          break;
+        }
+
+        if (!strcmp(argv[i], "--emit-c")) {
+          i++;
+          if (i < argc) {
+            fname = argv[i];
+            if (!AOT_emit_open(fname)) {
+              exit(-1);
+            }
+          } else {
+            printf("ERROR: The option `--emit-c' needs a file name.");
+            exit(-1);
+          }
+          break;
+        }
+        // fall through
+
       case 'h':
       case '?':
         printf("Inpla version %s\n", VERSION);
@@ -4509,6 +5248,19 @@ int main(int argc, char *argv[]) {
                "when it runs up.\n");
         printf("                    1: the heap size is twice (=2^1).\n");
         printf("                    2: the size is four times (=2^2).\n");
+        printf(" -Xkeep <num>     Set retained heap size to 2^<num>       "
+               "(Default: %2u (=%4u))\n",
+               Hoop_retained_size, 1 << Hoop_retained_size);
+        printf("                    Free hoops beyond it are released "
+               "after each net.\n");
+#  ifdef HOOP_MMAP
+        printf(" -Xhuge <num>     Use huge pages for large hoops          "
+               "(Default: %2u)\n",
+               Hoop_hugepages);
+        printf("                    0: not used.\n");
+        printf("                    1: transparent huge pages.\n");
+        printf("                    2: explicit huge pages if reserved.\n");
+#  endif
 #else
         // v0.5.6
         printf(" -m <num>         Set size of heaps                       "
@@ -4524,6 +5276,16 @@ int main(int argc, char *argv[]) {
         printf(" -t <num>         Set the number of threads               "
                "(Default: %10d)\n",
                MaxThreadsNum);
+        printf(" -Xspin <num>     Set spins of idle threads before yield  "
+               "(Default: %10d)\n",
+               GlobalOptions.idle_spin);
+        printf(" -Xyield <num>    Set yields of idle threads before park  "
+               "(Default: %10d)\n",
+               GlobalOptions.idle_yield);
+        printf(" -Xplace <mode>   Set placement of threads on CPUs        "
+               "(Default:    compact)\n");
+        printf("                    compact: fill CPUs of a NUMA node first.\n");
+        printf("                    scatter: put threads on nodes in turn.\n");
 
 #else
         printf(" -w               Enable Weak Reduction strategy          "
@@ -4535,12 +5297,31 @@ int main(int argc, char *argv[]) {
 
         printf(" -h               Print this help message\n");
 
+        printf(" --emit-c <file>  Translate rules in <file> into C       "
+               "(Output: <file>.c)\n");
+        printf(" --stats=json     Put statistics of each net in JSON      "
+               "(Default:    disable)\n");
+        printf(" --stats-fd <fd>  Put the JSON statistics into <fd>       "
+               "(Default:     stdout)\n");
+
         printf(" -foptimise-tail-calls   Enable tail call optimisation    "
                "(Default:    disable)\n");
+        printf(" -finline-rules          Inline rules of known pairs      "
+               "(Default:    disable)\n");
+        printf(" -fcache-rules           Reuse compiled rules of the file "
+               "(Default:    disable)\n");
+        printf(" -fstream-nets           Execute nets chunk by chunk      "
+               "(Default:    disable)\n");
+#ifdef PROFILE_RULES
+        printf(" -fprofile-rules         Profile each pair of agents      "
+               "(Default:    disable)\n");
+#endif
 
-#ifndef THREAD
         printf(" -fverbose-memory-usage  Show memory usage                "
                "(Default:    disable)\n");
+#ifdef THREAD
+        printf(" -fverbose-threads       Show idle time of threads        "
+               "(Default:    disable)\n");
 #endif
 
         puts("");
@@ -4618,6 +5399,71 @@ int main(int argc, char *argv[]) {
           param = atoi(argv[i]);
           Hoop_increasing_magnitude = param;
         }
+        else if (!strcmp(argv[i], "-Xkeep")) {
+          i++;
+          if (i >= argc) {
+            printf("ERROR: The option `-Xkeep' needs a number.");
+            exit(-1);
+          }
+          param = atoi(argv[i]);
+          if (argv[i][strspn(argv[i], "0123456789")] != '\0' || param > 31) {
+            printf("ERROR: `%s' is illegal parameter for -Xkeep\n", argv[i]);
+            exit(-1);
+          }
+          Hoop_retained_size = param;
+        }
+#  ifdef HOOP_MMAP
+        else if (!strcmp(argv[i], "-Xhuge")) {
+          i++;
+          if (i >= argc) {
+            printf("ERROR: The option `-Xhuge' needs a number.");
+            exit(-1);
+          }
+          if (strcmp(argv[i], "0") && strcmp(argv[i], "1") &&
+              strcmp(argv[i], "2")) {
+            printf("ERROR: `%s' is illegal parameter for -Xhuge\n", argv[i]);
+            exit(-1);
+          }
+          Hoop_hugepages = atoi(argv[i]);
+        }
+#  endif
+#endif
+
+#ifdef THREAD
+        else if (!strcmp(argv[i], "-Xspin") || !strcmp(argv[i], "-Xyield")) {
+          char *opt = argv[i];
+          i++;
+          if (i < argc) {
+            char *val = argv[i];
+            if (val[0] == '\0' || strspn(val, "0123456789") != strlen(val)) {
+              printf("ERROR: `%s' is illegal parameter for %s\n", val, opt);
+              exit(-1);
+            }
+          } else {
+            printf("ERROR: The option `%s' needs a number.", opt);
+            exit(-1);
+          }
+          param = atoi(argv[i]);
+          if (!strcmp(opt, "-Xspin")) {
+            GlobalOptions.idle_spin = param;
+          } else {
+            GlobalOptions.idle_yield = param;
+          }
+        } else if (!strcmp(argv[i], "-Xplace")) {
+          i++;
+          if (i >= argc) {
+            printf("ERROR: The option `-Xplace' needs compact or scatter.");
+            exit(-1);
+          }
+          if (!strcmp(argv[i], "compact")) {
+            GlobalOptions.placement = PLACEMENT_COMPACT;
+          } else if (!strcmp(argv[i], "scatter")) {
+            GlobalOptions.placement = PLACEMENT_SCATTER;
+          } else {
+            printf("ERROR: `%s' is illegal parameter for -Xplace\n", argv[i]);
+            exit(-1);
+          }
+        }
 #endif
         break;
 
@@ -4666,6 +5512,8 @@ int main(int argc, char *argv[]) {
           }
 
           ast_recordConst(varname, atoi(val));
+          RuleCache_add_key(varname);
+          RuleCache_add_key(val);
 
         } else {
           puts("ERROR: The option `-d' needs a string such as VarName=value.");
@@ -4678,14 +5526,42 @@ int main(int argc, char *argv[]) {
         // flags
         if (!strcmp(argv[i], "-foptimise-tail-calls")) {
           CmEnv.tco = 1;
+          RuleCache_add_key(argv[i]);
           break;
         }
 
-#ifndef THREAD
+        if (!strcmp(argv[i], "-finline-rules")) {
+          CmEnv.inline_rules = 1;
+          RuleCache_add_key(argv[i]);
+          break;
+        }
+
+        if (!strcmp(argv[i], "-fcache-rules")) {
+          cache_rules = true;
+          break;
+        }
+
+        if (!strcmp(argv[i], "-fstream-nets")) {
+          GlobalOptions.stream_nets = 1;
+          break;
+        }
+
+#ifdef PROFILE_RULES
+        if (!strcmp(argv[i], "-fprofile-rules")) {
+          GlobalOptions.profile_rules = 1;
+          break;
+        }
+#endif
+
         if (!strcmp(argv[i], "-fverbose-memory-usage")) {
           GlobalOptions.verbose_memory_use = 1;
           break;
         }
+#ifdef THREAD
+        if (!strcmp(argv[i], "-fverbose-threads")) {
+          GlobalOptions.verbose_threads = 1;
+          break;
+        }
 #endif
 
         // for files
@@ -4775,7 +5651,11 @@ int main(int argc, char *argv[]) {
         exit(-1);
       }
 
-      free(fname_in);
+      fname = fname_in;
+    }
+
+    if (cache_rules) {
+      RuleCache_open(fname);
     }
   }
 
@@ -4798,6 +5678,7 @@ int main(int argc, char *argv[]) {
 #elif defined(FLEX_EXPANDABLE_HEAP)
   Hoop_init_size = 1 << Hoop_init_size;
   Hoop_increasing_magnitude = 1 << Hoop_increasing_magnitude;
+  Hoop_retained_size = 1U << Hoop_retained_size;
 
 #else
   // v0.5.6
@@ -4817,14 +5698,14 @@ int main(int argc, char *argv[]) {
   RuleTable_init();
   CodeAddr_init();
 
-#ifdef THREAD
-  GlobalEQStack_Init(MaxThreadsNum * 8);
-#endif
-
 #if defined(EXPANDABLE_HEAP) || defined(FLEX_EXPANDABLE_HEAP)
 
 #  ifndef THREAD
   VM_Init(&VM, max_EQStack);
+  Heap_Bind(&VM.agentHeap, &VM.nameHeap);
+#    if defined(HEAP_FREELIST) && defined(AGENT_SIZE_CLASS)
+  Heap_Bind_FreeList_forSmallAgent(&VM.smallAgentHeap);
+#    endif
 #  else
   tpool_init(max_EQStack);
 #  endif
@@ -4834,20 +5715,30 @@ int main(int argc, char *argv[]) {
 
 #  ifndef THREAD
   VM_Init(&VM, heap_size, max_EQStack);
+  Heap_Bind(&VM.agentHeap, &VM.nameHeap);
 #  else
   tpool_init(heap_size, max_EQStack);
 #  endif
 
 #endif
 
+#ifdef PROFILE_RULES
+  if (GlobalOptions.profile_rules) {
+#  ifndef THREAD
+    VM_Profile_init(&VM);
+#  endif
+    atexit(puts_profile);
+  }
+#endif
+
 #ifdef THREAD
   // if some threads invoked by the initialise are still working,
   // wait until these all sleep.
-  if (SleepingThreadsNum < MaxThreadsNum) {
-    pthread_mutex_lock(&AllSleep_lock);
-    pthread_cond_wait(&ActiveThread_all_sleep, &AllSleep_lock);
-    pthread_mutex_unlock(&AllSleep_lock);
+  pthread_mutex_lock(&Sleep_lock);
+  while (SleepingThreadsNum < MaxThreadsNum) {
+    pthread_cond_wait(&ActiveThread_all_sleep, &Sleep_lock);
   }
+  pthread_mutex_unlock(&Sleep_lock);
 #endif
 
   linenoiseHistoryLoad(".inpla.history.txt");
@@ -4889,7 +5780,7 @@ void puts_Names_ast(Ast *ast) {
     if (IS_GNAMEID(sym_id)) {
       print_name_port0(IdTable_get_heap(sym_id));
     } else {
-      print_name_port0((VALUE)NULL);
+      print_name_port0(VALUE_NULL);
     }
 
     param = ast_getTail(param);
@@ -4946,7 +5837,7 @@ int check_invalid_occurrence(Ast *ast) {
 
       /*
       // it is connected with something.
-      if (NAME(aheap)->port != (VALUE)NULL) {
+      if (NAME(aheap)->port != VALUE_NULL) {
         printf("ERROR: '%s' is already connected with ", sym);
         puts_term(NAME(aheap)->port);
         puts(".");
@@ -5302,6 +6193,38 @@ int Compile_expr_on_ast(Ast *ptr, int target) {
   }
 }
 
+#ifdef AGENT_SIZE_CLASS
+// Small cells cannot be reused by (*L) and (*R) for terms that have
+// more ports than AGENT_SMALL_PORT. Return 1 if the term fits in the cell.
+static int Compile_reuse_fits_cell(int reuse_reg, Ast *ptr) {
+  int rule_id = (reuse_reg == VM_OFFSET_ANNOTATE_L) ? CmEnv.idL : CmEnv.idR;
+
+  if (!IS_SMALL_AGENT(rule_id, IdTable_get_arity(rule_id))) {
+    return 1;
+  }
+
+  switch (ptr->id) {
+  case AST_TUPLE:
+    if (ptr->intval == 1) {
+      return Compile_reuse_fits_cell(reuse_reg, ptr->right->left);
+    }
+    return ptr->intval <= AGENT_SMALL_PORT;
+
+  case AST_AGENT: {
+    int arity = 0;
+    for (Ast *arg = ptr->right; arg != NULL; arg = ast_getTail(arg)) {
+      arity++;
+    }
+    return IS_SMALL_AGENT(IdTable_getid_builtin_funcAgent(ptr), arity);
+  }
+
+  default:
+    // Nil and Cons are small, and the others do not use the cell.
+    return 1;
+  }
+}
+#endif
+
 int Compile_term_on_ast(Ast *ptr, int target) {
   // input:
   // target == -1  => a new node is allocated from localHeap.
@@ -5371,11 +6294,27 @@ int Compile_term_on_ast(Ast *ptr, int target) {
       // expanded operations
       IMCode_genCode2(OP_MKAGENT, ID_CONS, result);
 
-      alloc = Compile_term_on_ast(ptr->left, -1);
-      IMCode_genCode3(OP_LOADP, alloc, 0, result);
+      // Tails of Cons are compiled in the loop, not recursively,
+      // so that long lists neither overflow the stack nor keep
+      // all the elements in registers.
+      int cons = result;
+      while (1) {
+        alloc = Compile_term_on_ast(ptr->left, -1);
+        IMCode_genCode3(OP_LOADP, alloc, 0, cons);
 
-      alloc = Compile_term_on_ast(ptr->right->left, -1);
-      IMCode_genCode3(OP_LOADP, alloc, 1, result);
+        Ast *tail = ptr->right->left;
+        if (tail->id != AST_OPCONS) {
+          alloc = Compile_term_on_ast(tail, -1);
+          IMCode_genCode3(OP_LOADP, alloc, 1, cons);
+          break;
+        }
+
+        alloc = CmEnv_newvar();
+        IMCode_genCode2(OP_MKAGENT, ID_CONS, alloc);
+        IMCode_genCode3(OP_LOADP, alloc, 1, cons);
+        cons = alloc;
+        ptr = tail->right;
+      }
 
     } else {
       result = target;
@@ -5580,6 +6519,15 @@ int Compile_term_on_ast(Ast *ptr, int target) {
 
   case AST_ANNOTATION_L:
   case AST_ANNOTATION_R:
+#ifdef AGENT_SIZE_CLASS
+    if (!Compile_reuse_fits_cell((ptr->id == AST_ANNOTATION_L)
+                                     ? CmEnv.reg_agentL
+                                     : CmEnv.reg_agentR,
+                                 ptr->left)) {
+      // The rule agent is freed, and a new agent is made instead.
+      return Compile_term_on_ast(ptr->left, -1);
+    }
+#endif
     if (ptr->id == AST_ANNOTATION_L) {
       CmEnv.annotateL = ANNOTATE_REUSE; // turn *L_occurrence flag on
       result = CmEnv.reg_agentL;        // VM_OFFSET_ANNOTATE_L;
@@ -5682,7 +6630,7 @@ int Ast_make_annotation_TailCallOptimisation(Ast *mainbody) {
   // Return 1 when annotated.
   //
   // When there is an equation for TCO, its ID is changed from AST_CNCT into
-  // AST_CNCT_TCO_INTVAR or AST_CNCT_TCO.
+  // AST_CNCT_TCO_INTVAR, AST_CNCT_TCO or AST_CNCT_TCO_RULE.
 
   if (mainbody == NULL) {
     return 0;
@@ -5751,6 +6699,49 @@ int Ast_make_annotation_TailCallOptimisation(Ast *mainbody) {
       }
     }
 
+    if (!available_TCO && CmEnv.annotateL == ANNOTATE_NOTHING &&
+        !Ast_eqs_has_agentID(body->right, AST_ANNOTATION_R)) {
+      // --- CASE 3: other_agent ~ name (or expression)
+      // The rule agent L is reused as the other agent,
+      // and the rule for it is called directly when the name is bound to
+      // an agent that has a rule with it.
+      if (constructor_agent->id == AST_AGENT) {
+        recursion_agent = constructor_agent;
+        constructor_agent = eq->left;
+      }
+
+      int is_target = 0;
+      if (recursion_agent->id == AST_AGENT &&
+          IdTable_getid_builtin_funcAgent(recursion_agent) == -1) {
+
+        if (Ast_is_expr(constructor_agent)) {
+          is_target = 1;
+
+        } else if (constructor_agent->id == AST_NAME) {
+          char   *sym = constructor_agent->left->sym;
+          NB_TYPE type = 0;
+          int     exists_in_table = CmEnv_gettype_forname(sym, &type);
+          if (exists_in_table && (type == NB_META_R || type == NB_META_L ||
+                                  type == NB_INTVAR)) {
+            is_target = 1;
+          }
+        }
+      }
+
+#ifdef AGENT_SIZE_CLASS
+      if (is_target &&
+          !Compile_reuse_fits_cell(VM_OFFSET_ANNOTATE_L, recursion_agent)) {
+        is_target = 0;
+      }
+#endif
+
+      if (is_target) {
+        eq->right = constructor_agent;
+        available_TCO = 1;
+        astID_of_TCO = AST_CNCT_TCO_RULE;
+      }
+    }
+
     if (available_TCO) {
       //      puts("Target:");
       //      ast_puts(eq_TCO); puts("");
@@ -5971,14 +6962,19 @@ void free_Names_ast(Ast *ast) {
     if (IS_GNAMEID(sym_id)) {
       flush_name_port0(IdTable_get_heap(sym_id));
     } else {
-      flush_name_port0((VALUE)NULL);
+      flush_name_port0(VALUE_NULL);
     }
     param = ast_getTail(param);
   }
+
+#ifdef FLEX_EXPANDABLE_HEAP
+  // Hoops used only by the freed terms can be released now.
+  shrink_heaps();
+#endif
 }
 
 void flush_name_port0(const VALUE ptr) {
-  if (ptr == (VALUE)NULL) {
+  if (ptr == VALUE_NULL) {
     return;
   }
 
@@ -5998,20 +6994,18 @@ void flush_name_port0(const VALUE ptr) {
     return;
   }
 
-  if (NAME(ptr)->port == (VALUE)NULL) {
+  if (NAME(ptr)->port == VALUE_NULL) {
     free_Name(ptr);
   } else {
     ShowNameHeap = ptr;
     free_Agent_recursively(NAME(ptr)->port);
     free_Name(ptr);
-    ShowNameHeap = (VALUE)NULL;
+    ShowNameHeap = VALUE_NULL;
   }
 
-#ifndef THREAD
   if (GlobalOptions.verbose_memory_use) {
-    print_memory_usage(&VM.agentHeap, &VM.nameHeap);
+    print_memory_usage();
   }
-#endif
 }
 
 // ------------------------------------------------------
@@ -6020,19 +7014,19 @@ void flush_name_port0(const VALUE ptr) {
 
 // static inline
 void free_Agent(const VALUE ptr) {
-  assert(ptr != (VALUE)NULL);
+  assert(ptr != VALUE_NULL);
   myfree(ptr);
 }
 
 void free_Agent2(const VALUE ptr1, const VALUE ptr2) {
-  assert(ptr1 != (VALUE)NULL);
-  assert(ptr2 != (VALUE)NULL);
+  assert(ptr1 != VALUE_NULL);
+  assert(ptr2 != VALUE_NULL);
   myfree2(ptr1, ptr2);
 }
 
 // static inline
 void free_Name(VALUE ptr) {
-  if (ptr == (VALUE)NULL) {
+  if (ptr == VALUE_NULL) {
     puts("ERROR: NULL is applied to free_Name.");
     return;
   }
@@ -6043,7 +7037,7 @@ void free_Name(VALUE ptr) {
     // Global name
 
     NameTable_erase_id(IdTable_get_name(BASIC(ptr)->id));
-    IdTable_set_heap(BASIC(ptr)->id, (VALUE)NULL);
+    IdTable_set_heap(BASIC(ptr)->id, VALUE_NULL);
 
     SET_LOCAL_NAMEID(BASIC(ptr)->id);
     myfree(ptr);
@@ -6053,7 +7047,7 @@ void free_Name(VALUE ptr) {
 void free_Agent_recursively(VALUE ptr) {
 
 loop:
-  if (IS_FIXNUM(ptr) || ptr == (VALUE)NULL) {
+  if (IS_FIXNUM(ptr) || ptr == VALUE_NULL) {
     return;
   }
 
@@ -6065,7 +7059,7 @@ loop:
     if (ptr == ShowNameHeap)
       return;
 
-    if (NAME(ptr)->port != (VALUE)NULL) {
+    if (NAME(ptr)->port != VALUE_NULL) {
       VALUE port = NAME(ptr)->port;
       free_Name(ptr);
       ptr = port;
@@ -6099,10 +7093,16 @@ loop:
       goto loop;
     }
 
+    // Ports are saved before freeing because a freed cell may be reused
+    // as a link of the free list.
+    VALUE port[MAX_PORT];
+    for (int i = 0; i < arity; i++) {
+      port[i] = AGENT(ptr)->port[i];
+    }
     free_Agent(ptr);
     //      printf(" .");
     for (int i = 0; i < arity; i++) {
-      free_Agent_recursively(AGENT(ptr)->port[i]);
+      free_Agent_recursively(port[i]);
     }
   }
 }
@@ -10,7 +10,7 @@ void *exec_code(int mode, VirtualMachine *restrict vm, void *restrict *code);
 void flush_name_port0(VALUE ptr);
 
 void print_name_port0(VALUE ptr);
-void print_memory_usage(Heap *agent_heap, Heap *name_heap);
+void print_memory_usage(void);
 
 int make_rule_oneway(Ast *ast);
 
@@ -45,5 +45,7 @@ void free_Agent2(VALUE ptr1, VALUE ptr2);
 void free_Agent(VALUE ptr);
 void free_Names_ast(Ast *ast);
 void free_Name(VALUE ptr);
+VALUE make_Agent(VirtualMachine *restrict vm, int id);
+VALUE make_Name(VirtualMachine *restrict vm);
 void free_Agent_recursively(VALUE ptr);
 #endif
@@ -177,7 +177,7 @@ void NameTable_set_id(char *key, IDTYPE id) {
 int term_has_keynode(VALUE keynode, VALUE term) {
   int i;
 
-  if (term == (VALUE)NULL || IS_FIXNUM(term))
+  if (term == VALUE_NULL || IS_FIXNUM(term))
     return 0;
 
   // puts_term(term);
@@ -188,7 +188,7 @@ int term_has_keynode(VALUE keynode, VALUE term) {
     if (term == keynode) {
       return 1;
     } else {
-      if (NAME(term)->port == (VALUE)NULL) {
+      if (NAME(term)->port == VALUE_NULL) {
         return 0;
       } else {
         return term_has_keynode(keynode, NAME(term)->port);
@@ -245,7 +245,7 @@ int keynode_exists_in_another_term(VALUE keynode, VALUE *connected_from) {
 VALUE replace_keynode(VALUE keynode, VALUE term, VALUE heap) {
   // heap[term/keynode]
 
-  if (heap == (VALUE)NULL || IS_FIXNUM(heap)) {
+  if (heap == VALUE_NULL || IS_FIXNUM(heap)) {
     return heap;
   }
 
@@ -256,7 +256,7 @@ VALUE replace_keynode(VALUE keynode, VALUE term, VALUE heap) {
   }
 
   if (IS_NAMEID(BASIC(heap)->id)) {
-    if (NAME(heap)->port == (VALUE)NULL) {
+    if (NAME(heap)->port == VALUE_NULL) {
       return heap;
     } else {
       NAME(heap)->port = replace_keynode(keynode, term, NAME(heap)->port);
@@ -370,7 +370,7 @@ int NameTable_check_if_term_has_gname(VALUE term) {
       if (IS_GNAMEID(at->id)) {
         VALUE ptr = IdTable_get_heap(at->id);
 
-        while (ptr != (VALUE)NULL && !IS_FIXNUM(ptr) &&
+        while (ptr != VALUE_NULL && !IS_FIXNUM(ptr) &&
                IS_NAMEID(BASIC(ptr)->id)) {
 
           if (term_has_keynode(ptr, term)) {
@@ -391,18 +391,18 @@ int NameTable_check_if_term_has_gname(VALUE term) {
  Mark and Sweep for error recovery
 ******************************************/
 #ifndef THREAD
-static VALUE CyclicNameHeap = (VALUE)NULL;
+static VALUE CyclicNameHeap = VALUE_NULL;
 
 void markHeapRec(VALUE ptr) {
 loop:
-  if (ptr == (VALUE)NULL || IS_FIXNUM(ptr)) {
+  if (ptr == VALUE_NULL || IS_FIXNUM(ptr)) {
     return;
   } else if (IS_NAMEID(BASIC(ptr)->id)) {
     if (ptr == CyclicNameHeap)
       return;
 
     SET_FLAG_MARKED(BASIC(ptr)->id);
-    if (NAME(ptr)->port != (VALUE)NULL) {
+    if (NAME(ptr)->port != VALUE_NULL) {
       ptr = NAME(ptr)->port;
       goto loop;
     }
@@ -430,15 +430,15 @@ loop:
 }
 
 void mark_name_port0(VALUE ptr) {
-  if (ptr == (VALUE)NULL) {
+  if (ptr == VALUE_NULL) {
     return;
   }
 
   SET_FLAG_MARKED(BASIC(ptr)->id);
-  if (NAME(ptr)->port != (VALUE)NULL) {
+  if (NAME(ptr)->port != VALUE_NULL) {
     CyclicNameHeap = ptr;
     markHeapRec(NAME(ptr)->port);
-    CyclicNameHeap = (VALUE)NULL;
+    CyclicNameHeap = VALUE_NULL;
   }
 }
 
@@ -2,7 +2,13 @@
 
 #include "ast.h"
 #include "cmenv.h"
+#include "id_table.h"
+#include "name_table.h"
+#include "ruletable.h"
 
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 Ast *Ast_subst_term(char *sym, Ast *aterm, Ast *target, int *result) {
@@ -186,3 +192,685 @@ void Ast_RewriteOptimisation_eqlist(Ast *eqlist) {
     at = ast_getTail(at);
   }
 }
+
+// ------------------------------------------------------------
+// Inlining of active pairs known at compile time: -finline-rules
+// ------------------------------------------------------------
+//
+// An equation of two agents built in a rule body is reduced here,
+// so that these agents are never allocated:
+//   Op(r,x)~y  ==> r~x op y
+//     for Op = Add, Sub, Mul, Div, Mod when x and y are ints,
+//     unless a rule Op >< Int is defined.
+//   A(...)~B(...) ==> the body of the rule A >< B
+//     when the rule is simple: it has no guards, no where-clause,
+//     no annotations, and its body has at most INLINE_RULE_MAX_SIZE nodes.
+//     The arguments of A and B are substituted for the parameters,
+//     and the other names in the body are renamed to fresh ones.
+//
+// Rules defined later than the body are not inlined.
+// The source of a rule into which pairs were inlined is kept, and when
+// one of the pairs gets a rule (again), the rule is taken by
+// Ast_InlineRule_take_stale to be compiled again with the new one.
+
+#define INLINE_RULE_MAX_SIZE 32  // nodes of the body of an inlined rule
+#define INLINE_BUDGET        128 // nodes inlined into one body
+
+typedef struct InlineRule {
+  int  idL, idR;
+  Ast *agents; // a malloc-ed copy of (AST_CNCT agentL agentR)
+  Ast *body;   // a malloc-ed copy of the equations before inlining
+  int  size;
+  struct InlineRule *next;
+} InlineRule;
+
+// Rules into which pairs were inlined
+typedef struct InlineCaller {
+  int  idL, idR;
+  Ast *rule;        // a malloc-ed copy of the source
+  int (*pairs)[2];  // the inlined pairs
+  int  pair_num;
+  bool stale;       // to be compiled again
+  struct InlineCaller *next;
+} InlineCaller;
+
+static InlineRule   *InlineRules = NULL;
+static InlineCaller *InlineCallers = NULL;
+static int           Inline_budget;
+
+// Fresh names are numbered from 0 for each rule,
+// and their strings are kept in a pool to be used again.
+static unsigned long Inline_fresh_names = 0;
+static char        **Inline_fresh_pool = NULL;
+static unsigned long Inline_fresh_pool_size = 0;
+
+// The rule being compiled, set by Ast_InlineRule_begin
+static Ast  *Inline_source = NULL;
+static Ast  *Inline_source_body = NULL; // the first body before inlining
+static int (*Inline_pairs)[2] = NULL;
+static int   Inline_pair_num = 0, Inline_pair_max = 0;
+static bool  Inline_recompiling = false;
+
+// Returns the ID of the agent, or -1 unless it could be inlined.
+// IDs are not created here.
+static int inline_agentID(Ast *agent) {
+  int id;
+
+  switch (agent->id) {
+  case AST_TUPLE:
+    if (agent->intval == 1) {
+      return -1;
+    }
+    return GET_TUPLEID(agent->intval);
+
+  case AST_OPCONS:
+    return ID_CONS;
+
+  case AST_NIL:
+    return ID_NIL;
+
+  case AST_AGENT:
+    if (IdTable_getid_builtin_funcAgent(agent) != -1) {
+      return -1;
+    }
+    id = NameTable_get_id(agent->left->sym);
+    if (id < START_ID_OF_USER_AGENT || id > END_ID_OF_USER_AGENT) {
+      return -1;
+    }
+    return id;
+
+  default:
+    return -1;
+  }
+}
+
+// Terms that may occur in the body of an inlined rule.
+static bool inline_is_simple_term(Ast *term) {
+  switch (term->id) {
+  case AST_NAME:
+  case AST_INT:
+  case AST_NIL:
+    return true;
+
+  case AST_AGENT:
+  case AST_OPCONS:
+  case AST_TUPLE:
+    for (Ast *port = term->right; port != NULL; port = ast_getTail(port)) {
+      if (!inline_is_simple_term(port->left)) {
+        return false;
+      }
+    }
+    return true;
+
+  default:
+    return false;
+  }
+}
+
+static int inline_count_name(char *sym, Ast *term) {
+  if (term->id == AST_NAME) {
+    return (strcmp(term->left->sym, sym) == 0);
+  }
+
+  int count = 0;
+  if (term->id == AST_AGENT || term->id == AST_OPCONS ||
+      term->id == AST_TUPLE) {
+    for (Ast *port = term->right; port != NULL; port = ast_getTail(port)) {
+      count += inline_count_name(sym, port->left);
+    }
+  }
+  return count;
+}
+
+static int inline_count_name_eqlist(char *sym, Ast *eqlist) {
+  int count = 0;
+  for (Ast *at = eqlist; at != NULL; at = ast_getTail(at)) {
+    count += inline_count_name(sym, at->left->left);
+    count += inline_count_name(sym, at->left->right);
+  }
+  return count;
+}
+
+// Every parameter of the rule agents must occur once in the body,
+// and every other name twice.
+static bool inline_check_names(Ast *term, Ast *agentL, Ast *agentR,
+                               Ast *eqlist) {
+  if (term->id == AST_NAME) {
+    char *sym = term->left->sym;
+    int   params = inline_count_name(sym, agentL) +
+                 inline_count_name(sym, agentR);
+    int   occurrences = inline_count_name_eqlist(sym, eqlist);
+
+    return (params == 1 && occurrences == 1) ||
+           (params == 0 && occurrences == 2);
+  }
+
+  if (term->id == AST_AGENT || term->id == AST_OPCONS ||
+      term->id == AST_TUPLE) {
+    for (Ast *port = term->right; port != NULL; port = ast_getTail(port)) {
+      if (!inline_check_names(port->left, agentL, agentR, eqlist)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static int inline_size(Ast *term) {
+  int size = 1;
+  if (term->id == AST_AGENT || term->id == AST_OPCONS ||
+      term->id == AST_TUPLE) {
+    for (Ast *port = term->right; port != NULL; port = ast_getTail(port)) {
+      size += inline_size(port->left);
+    }
+  }
+  return size;
+}
+
+// Copies the tree with malloc so that it survives ast_heapReInit.
+// Children of symbols, integers and tuples are not always initialised,
+// so only those of the other nodes are followed.
+static Ast *inline_copy_persistent(Ast *p) {
+  if (p == NULL) {
+    return NULL;
+  }
+
+  Ast *copy = malloc(sizeof(Ast));
+  if (copy == NULL) {
+    printf("Malloc error [InlineRule]\n");
+    exit(-1);
+  }
+  *copy = *p;
+
+  switch (p->id) {
+  case AST_SYM:
+  case AST_INT:
+  case AST_NIL:
+    copy->left = copy->right = NULL;
+    break;
+
+  case AST_TUPLE:
+    copy->left = NULL;
+    copy->right = inline_copy_persistent(p->right);
+    break;
+
+  default:
+    copy->left = inline_copy_persistent(p->left);
+    copy->right = inline_copy_persistent(p->right);
+  }
+
+  return copy;
+}
+
+static void inline_free_persistent(Ast *p) {
+  if (p == NULL) {
+    return;
+  }
+
+  switch (p->id) {
+  case AST_SYM:
+  case AST_INT:
+  case AST_NIL:
+    break;
+
+  case AST_TUPLE:
+    inline_free_persistent(p->right);
+    break;
+
+  default:
+    inline_free_persistent(p->left);
+    inline_free_persistent(p->right);
+  }
+
+  free(p);
+}
+
+static void inline_add_pair(int idL, int idR) {
+  if (Inline_pair_num == Inline_pair_max) {
+    Inline_pair_max = (Inline_pair_max == 0) ? 16 : Inline_pair_max * 2;
+    Inline_pairs = realloc(Inline_pairs, sizeof(int[2]) * Inline_pair_max);
+    if (Inline_pairs == NULL) {
+      printf("Malloc error [InlineRule]\n");
+      exit(-1);
+    }
+  }
+  Inline_pairs[Inline_pair_num][0] = idL;
+  Inline_pairs[Inline_pair_num][1] = idR;
+  Inline_pair_num++;
+}
+
+static bool inline_same_pair(int idA, int idB, int idL, int idR) {
+  return (idA == idL && idB == idR) || (idA == idR && idB == idL);
+}
+
+void Ast_InlineRule_begin(Ast *rule) {
+  // Left by a compilation failure
+  inline_free_persistent(Inline_source);
+  inline_free_persistent(Inline_source_body);
+
+  Inline_source = inline_copy_persistent(rule);
+  Inline_source_body = NULL;
+  Inline_pair_num = 0;
+  Inline_fresh_names = 0;
+}
+
+static bool inline_is_simple_rule(Ast *agentL, Ast *agentR, Ast *mainbody,
+                                  Ast *eqlist, int *size) {
+  if (mainbody == NULL || mainbody->id != AST_BODY ||
+      mainbody->left != NULL || eqlist == NULL) {
+    return false;
+  }
+
+  for (Ast *param = agentL->right; param != NULL; param = ast_getTail(param)) {
+    if (param->left->id != AST_NAME) {
+      return false;
+    }
+  }
+  for (Ast *param = agentR->right; param != NULL; param = ast_getTail(param)) {
+    if (param->left->id != AST_NAME) {
+      return false;
+    }
+  }
+
+  *size = 0;
+  for (Ast *eq = eqlist; eq != NULL; eq = ast_getTail(eq)) {
+    if (eq->left->id != AST_CNCT ||
+        !inline_is_simple_term(eq->left->left) ||
+        !inline_is_simple_term(eq->left->right) ||
+        !inline_check_names(eq->left->left, agentL, agentR, eqlist) ||
+        !inline_check_names(eq->left->right, agentL, agentR, eqlist)) {
+      return false;
+    }
+    *size += 1 + inline_size(eq->left->left) + inline_size(eq->left->right);
+  }
+
+  return *size <= INLINE_RULE_MAX_SIZE;
+}
+
+void Ast_InlineRule_record(Ast *rule, int idL, int idR) {
+  // Rules into which the previous one was inlined get stale,
+  // but not while they are compiled again.
+  if (!Inline_recompiling) {
+    for (InlineCaller *c = InlineCallers; c != NULL; c = c->next) {
+      for (int i = 0; i < c->pair_num; i++) {
+        if (inline_same_pair(c->pairs[i][0], c->pairs[i][1], idL, idR)) {
+          c->stale = true;
+          break;
+        }
+      }
+    }
+  }
+
+  // Forget the previous definition
+  InlineCaller **at_caller = &InlineCallers;
+  while (*at_caller != NULL) {
+    InlineCaller *c = *at_caller;
+    if (inline_same_pair(c->idL, c->idR, idL, idR)) {
+      *at_caller = c->next;
+      inline_free_persistent(c->rule);
+      free(c->pairs);
+      free(c);
+    } else {
+      at_caller = &c->next;
+    }
+  }
+
+  InlineRule **at = &InlineRules;
+  while (*at != NULL) {
+    InlineRule *r = *at;
+    if (inline_same_pair(r->idL, r->idR, idL, idR)) {
+      *at = r->next;
+      inline_free_persistent(r->agents);
+      inline_free_persistent(r->body);
+      free(r);
+    } else {
+      at = &r->next;
+    }
+  }
+
+  if (Inline_pair_num > 0) {
+    InlineCaller *c = malloc(sizeof(InlineCaller));
+    int (*pairs)[2] = malloc(sizeof(int[2]) * Inline_pair_num);
+    if (c == NULL || pairs == NULL) {
+      printf("Malloc error [InlineRule]\n");
+      exit(-1);
+    }
+    memcpy(pairs, Inline_pairs, sizeof(int[2]) * Inline_pair_num);
+    c->idL = idL;
+    c->idR = idR;
+    c->rule = Inline_source;
+    c->pairs = pairs;
+    c->pair_num = Inline_pair_num;
+    c->stale = false;
+    c->next = InlineCallers;
+    InlineCallers = c;
+  } else {
+    inline_free_persistent(Inline_source);
+  }
+  Inline_source = NULL;
+
+  // The body is recorded as it was before inlining, so that it does not
+  // hold the bodies of other rules that may be redefined.
+  Ast *agentL = rule->left->left;
+  Ast *agentR = rule->left->right;
+  Ast *body = Inline_source_body;
+  int  size;
+
+  Inline_source_body = NULL;
+
+  if (inline_agentID(agentL) == -1 || inline_agentID(agentR) == -1 ||
+      !inline_is_simple_rule(agentL, agentR, rule->right, body, &size)) {
+    inline_free_persistent(body);
+    return;
+  }
+
+  InlineRule *r = malloc(sizeof(InlineRule));
+  if (r == NULL) {
+    printf("Malloc error [InlineRule]\n");
+    exit(-1);
+  }
+  r->idL = inline_agentID(agentL);
+  r->idR = inline_agentID(agentR);
+  r->agents = inline_copy_persistent(rule->left);
+  r->body = body;
+  r->size = size;
+  r->next = InlineRules;
+  InlineRules = r;
+}
+
+// Pairs of a name in the inlined body and the term replacing it.
+typedef struct {
+  char *sym;
+  Ast  *arg;   // the argument for a parameter, used once
+  char *fresh; // the fresh name for a name in the body
+} InlineSubst;
+
+static Ast *inline_clone_node(Ast *p) {
+  // AST_LIST is given for the allocation, because ast_makeAST turns
+  // an agent without arguments into an integer when defined as a constant.
+  Ast *copy = ast_makeAST(AST_LIST, NULL, NULL);
+  *copy = *p;
+  return copy;
+}
+
+// Copies a malloc-ed tree into the heap of Ast.
+static Ast *inline_copy_to_heap(Ast *p) {
+  if (p == NULL) {
+    return NULL;
+  }
+
+  Ast *copy = inline_clone_node(p);
+  switch (p->id) {
+  case AST_SYM:
+  case AST_INT:
+  case AST_NIL:
+    break;
+
+  case AST_TUPLE:
+    copy->right = inline_copy_to_heap(p->right);
+    break;
+
+  default:
+    copy->left = inline_copy_to_heap(p->left);
+    copy->right = inline_copy_to_heap(p->right);
+  }
+
+  return copy;
+}
+
+Ast *Ast_InlineRule_take_stale(void) {
+  for (InlineCaller *c = InlineCallers; c != NULL; c = c->next) {
+    if (c->stale) {
+      c->stale = false;
+      Inline_recompiling = true;
+      return inline_copy_to_heap(c->rule);
+    }
+  }
+
+  Inline_recompiling = false;
+  return NULL;
+}
+
+static char *inline_fresh_name(void) {
+  if (Inline_fresh_names == Inline_fresh_pool_size) {
+    unsigned long size =
+        (Inline_fresh_pool_size == 0) ? 64 : Inline_fresh_pool_size * 2;
+    Inline_fresh_pool = realloc(Inline_fresh_pool, sizeof(char *) * size);
+    if (Inline_fresh_pool == NULL) {
+      printf("Malloc error [InlineRule]\n");
+      exit(-1);
+    }
+
+    for (unsigned long i = Inline_fresh_pool_size; i < size; i++) {
+      char buf[32];
+      snprintf(buf, sizeof(buf), "#%lu", i);
+      Inline_fresh_pool[i] = strdup(buf);
+      if (Inline_fresh_pool[i] == NULL) {
+        printf("Malloc error [InlineRule]\n");
+        exit(-1);
+      }
+    }
+    Inline_fresh_pool_size = size;
+  }
+
+  return Inline_fresh_pool[Inline_fresh_names++];
+}
+
+static Ast *inline_instantiate(Ast *term, InlineSubst *subst, int *subst_num) {
+  if (term->id == AST_NAME) {
+    char *sym = term->left->sym;
+    int   i;
+
+    for (i = 0; i < *subst_num; i++) {
+      if (strcmp(subst[i].sym, sym) == 0) {
+        break;
+      }
+    }
+
+    if (i == *subst_num) {
+      subst[i].sym = sym;
+      subst[i].arg = NULL;
+      subst[i].fresh = inline_fresh_name();
+      (*subst_num)++;
+    }
+
+    if (subst[i].arg != NULL) {
+      return subst[i].arg;
+    }
+
+    Ast *fresh = inline_clone_node(term->left);
+    fresh->sym = subst[i].fresh;
+    return ast_makeAST(AST_NAME, fresh, NULL);
+  }
+
+  Ast *copy = inline_clone_node(term);
+  switch (term->id) {
+  case AST_INT:
+  case AST_NIL:
+    break;
+
+  case AST_AGENT:
+  case AST_OPCONS:
+  case AST_TUPLE: {
+    Ast **port = &copy->right;
+    for (Ast *at = term->right; at != NULL; at = ast_getTail(at)) {
+      *port = ast_makeList1(inline_instantiate(at->left, subst, subst_num));
+      port = &(*port)->right;
+    }
+  } break;
+
+  default:
+    break;
+  }
+
+  return copy;
+}
+
+// Replaces A(...)~B(...) in `at' with the body of the rule A >< B.
+static bool inline_rule(Ast *at) {
+  Ast *eq = at->left;
+  int  idA = inline_agentID(eq->left);
+  int  idB = inline_agentID(eq->right);
+
+  if (idA == -1 || idB == -1) {
+    return false;
+  }
+
+  InlineRule *r;
+  Ast        *agentL = NULL, *agentR = NULL;
+  for (r = InlineRules; r != NULL; r = r->next) {
+    if (r->idL == idA && r->idR == idB) {
+      agentL = eq->left;
+      agentR = eq->right;
+      break;
+    }
+    if (r->idL == idB && r->idR == idA) {
+      agentL = eq->right;
+      agentR = eq->left;
+      break;
+    }
+  }
+
+  if (r == NULL || r->size > Inline_budget) {
+    return false;
+  }
+
+  // Parameters are replaced with the arguments
+  InlineSubst subst[2 * MAX_PORT + INLINE_RULE_MAX_SIZE];
+  int         subst_num = 0;
+
+  Ast *params[2] = {r->agents->left->right, r->agents->right->right};
+  Ast *args[2] = {agentL->right, agentR->right};
+
+  for (int i = 0; i < 2; i++) {
+    Ast *param = params[i], *arg = args[i];
+    while (param != NULL && arg != NULL) {
+      subst[subst_num].sym = param->left->left->sym;
+      subst[subst_num].arg = arg->left;
+      subst[subst_num].fresh = NULL;
+      subst_num++;
+
+      param = ast_getTail(param);
+      arg = ast_getTail(arg);
+    }
+
+    if (param != NULL || arg != NULL) {
+      // The arity differs from that of the rule
+      return false;
+    }
+  }
+
+  Inline_budget -= r->size;
+  inline_add_pair(r->idL, r->idR);
+
+  // The equation is replaced with the first one of the body,
+  // and the rest follows it.
+  Ast *next = at->right;
+  Ast *tail = NULL;
+  for (Ast *body = r->body; body != NULL;
+       body = ast_getTail(body)) {
+    Ast *left = inline_instantiate(body->left->left, subst, &subst_num);
+    Ast *right = inline_instantiate(body->left->right, subst, &subst_num);
+    Ast *new_eq = ast_makeAST(AST_CNCT, left, right);
+
+    if (tail == NULL) {
+      at->left = new_eq;
+      tail = at;
+    } else {
+      tail->right = ast_makeList1(new_eq);
+      tail = tail->right;
+    }
+  }
+  tail->right = next;
+
+  return true;
+}
+
+// Replaces Op(r,x)~y in `at' with r~x op y.
+static bool inline_builtin_op(Ast *at) {
+  Ast *eq = at->left;
+  Ast *agent = eq->left;
+  Ast *partner = eq->right;
+
+  if (agent->id != AST_AGENT) {
+    agent = eq->right;
+    partner = eq->left;
+  }
+  if (agent->id != AST_AGENT) {
+    return false;
+  }
+
+  int    id = IdTable_getid_builtin_funcAgent(agent);
+  AST_ID op;
+  switch (id) {
+  case ID_ADD:
+    op = AST_PLUS;
+    break;
+  case ID_SUB:
+    op = AST_SUB;
+    break;
+  case ID_MUL:
+    op = AST_MUL;
+    break;
+  case ID_DIV:
+    op = AST_DIV;
+    break;
+  case ID_MOD:
+    op = AST_MOD;
+    break;
+  default:
+    return false;
+  }
+
+  Ast *port = agent->right;
+  if (port == NULL || port->right == NULL || ast_getTail(port->right) != NULL) {
+    return false;
+  }
+
+  Ast *r = port->left;
+  Ast *x = port->right->left;
+  if (Ast_is_expr(r) || !Ast_is_expr(x) || !Ast_is_expr(partner)) {
+    return false;
+  }
+
+  int result;
+  RuleTable_get_code(id, ID_INT, &result);
+  if (result) {
+    return false;
+  }
+  inline_add_pair(id, ID_INT);
+
+  eq->left = r;
+  eq->right = ast_makeAST(op, x, partner);
+  return true;
+}
+
+void Ast_InlineActivePairs_eqlist(Ast *eqlist) {
+  bool inlined;
+
+  Inline_budget = INLINE_BUDGET;
+
+  if (Inline_source != NULL && Inline_source_body == NULL) {
+    Inline_source_body = inline_copy_persistent(eqlist);
+  }
+
+  do {
+    inlined = false;
+
+    for (Ast *at = eqlist; at != NULL; at = ast_getTail(at)) {
+      if (at->left->id != AST_CNCT) {
+        continue;
+      }
+
+      while (inline_builtin_op(at) || inline_rule(at)) {
+        inlined = true;
+      }
+    }
+
+    // Names connected by the inlined bodies are substituted,
+    // and it may make new pairs.
+    if (inlined) {
+      Ast_RewriteOptimisation_eqlist(eqlist);
+    }
+  } while (inlined);
+}
@@ -7,4 +7,12 @@ void Ast_RewriteOptimisation_eqlist(Ast *eqlist);
 int  Ast_subst_eqlist(int nth, char *sym, Ast *aterm, Ast *eqlist);
 Ast *Ast_subst_term(char *sym, Ast *aterm, Ast *target, int *result);
 
+// They are called before and after a rule idL >< idR is compiled.
+void Ast_InlineRule_begin(Ast *rule);
+void Ast_InlineRule_record(Ast *rule, int idL, int idR);
+// Returns a copy of a rule that must be compiled again
+// because a rule inlined into it is redefined, or NULL.
+Ast *Ast_InlineRule_take_stale(void);
+void Ast_InlineActivePairs_eqlist(Ast *eqlist);
+
 #endif // INPLA_OPT_H
@@ -2,6 +2,7 @@
 
 #include "ast.h"
 #include "name_table.h"
+#include "rulecache.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -296,6 +297,7 @@ command:
 #endif
 
     pushFP(yyin);
+    RuleCache_use($2);
   }
 }
 | error END_OF_FILE {}
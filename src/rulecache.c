@@ -0,0 +1,604 @@
+#include "rulecache.h"
+
+#include "cmenv.h"
+#include "id_table.h"
+#include "name_table.h"
+#include "vm.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern void *CodeAddr[OP_NOP + 1];
+
+#define RULECACHE_MAGIC    "INPLARC1"
+#define RULECACHE_PATH_MAX 4096
+
+typedef struct {
+  int   id;
+  int   arity;
+  char *name;
+} RuleCacheAgent;
+
+// An entry is a rule, or a file given by `use' when `n' is 0.
+typedef struct {
+  unsigned long   hash; // of the file given by `use'
+  int             seq;  // order of the rule among all compiled rules
+  char           *nameL, *nameR;
+  int             n;
+  long           *code; // opcodes are stored as indices of CodeAddr
+  int             agent_num;
+  RuleCacheAgent *agents; // in ascending order of IDs
+} RuleCacheEntry;
+
+static int             RuleCache_enabled = 0;
+static unsigned long   RuleCache_key = 14695981039346656037UL;
+static char           *RuleCache_fname = NULL;
+static RuleCacheEntry *RuleCache_entries = NULL;
+static int             RuleCache_entry_num = 0;
+static int             RuleCache_entry_size = 0;
+static int             RuleCache_next = 0;  // entry to be compared next
+static int             RuleCache_dirty = 0; // 1 if entries are changed
+static int             RuleCache_seq = 0;
+static int             RuleCache_agentid; // last agent ID before compilation
+
+// Switches of the build that change compiled codes
+static const char RuleCache_build[] = "build:"
+#ifdef THREAD
+    " THREAD"
+#endif
+#ifdef EXPANDABLE_HEAP
+    " EXPANDABLE_HEAP"
+#endif
+#ifdef FIXED_HEAP
+    " FIXED_HEAP"
+#endif
+#ifdef FLEX_EXPANDABLE_HEAP
+    " FLEX_EXPANDABLE_HEAP"
+#endif
+#ifdef HEAP_FREELIST
+    " HEAP_FREELIST"
+#endif
+#ifdef AGENT_SIZE_CLASS
+    " AGENT_SIZE_CLASS"
+#endif
+#ifdef COMPRESSED_REFS
+    " COMPRESSED_REFS"
+#endif
+#ifdef REMOTE_FREE
+    " REMOTE_FREE"
+#endif
+#ifdef INPLA_USE_BUILTINS
+    " INPLA_USE_BUILTINS"
+#endif
+#ifdef OPTIMISE_IMCODE
+    " OPTIMISE_IMCODE"
+#endif
+#ifdef OPTIMISE_IMCODE_TCO
+    " OPTIMISE_IMCODE_TCO"
+#endif
+#ifdef OPTIMISE_TWO_ADDRESS
+    " OPTIMISE_TWO_ADDRESS"
+#endif
+#ifdef OPTIMISE_TWO_ADDRESS_UNARY
+    " OPTIMISE_TWO_ADDRESS_UNARY"
+#endif
+#ifdef OPTIMISE_SUPERINSTRUCTION
+    " OPTIMISE_SUPERINSTRUCTION"
+#endif
+#ifdef AOT_RULES
+    " AOT_RULES"
+#endif
+    ;
+
+// FNV-1a
+static unsigned long RuleCache_hash(unsigned long h, const void *buf,
+                                    size_t len) {
+  const unsigned char *p = buf;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ p[i]) * 1099511628211UL;
+  }
+  return h;
+}
+
+static int RuleCache_hash_file(char *fname, unsigned long *h) {
+  FILE *fp = fopen(fname, "r");
+  if (fp == NULL) {
+    return 0;
+  }
+
+  char   buf[4096];
+  size_t len;
+  while ((len = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    *h = RuleCache_hash(*h, buf, len);
+  }
+  fclose(fp);
+  return 1;
+}
+
+static int RuleCache_same_name(const char *s1, const char *s2) {
+  if (s1 == NULL || s2 == NULL) {
+    return s1 == s2;
+  }
+  return !strcmp(s1, s2);
+}
+
+static char *RuleCache_strdup(const char *str) {
+  if (str == NULL) {
+    return NULL;
+  }
+  char *dup = strdup(str);
+  if (dup == NULL) {
+    fprintf(stderr, "Error: RuleCache_strdup() failed: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  return dup;
+}
+
+static void RuleCache_free_entry(RuleCacheEntry *e) {
+  free(e->nameL);
+  free(e->nameR);
+  free(e->code);
+  for (int i = 0; i < e->agent_num; i++) {
+    free(e->agents[i].name);
+  }
+  free(e->agents);
+}
+
+// Entries after RuleCache_next are discarded because the source differs.
+static void RuleCache_truncate(void) {
+  for (int i = RuleCache_next; i < RuleCache_entry_num; i++) {
+    RuleCache_free_entry(&RuleCache_entries[i]);
+  }
+  RuleCache_entry_num = RuleCache_next;
+}
+
+static void RuleCache_append(RuleCacheEntry *e) {
+  RuleCache_truncate();
+
+  if (RuleCache_entry_num == RuleCache_entry_size) {
+    RuleCache_entry_size = RuleCache_entry_size * 2 + 64;
+    RuleCache_entries = realloc(RuleCache_entries,
+                                sizeof(RuleCacheEntry) * RuleCache_entry_size);
+    if (RuleCache_entries == NULL) {
+      fprintf(stderr, "Error: RuleCache_append() failed: %s\n",
+              strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  }
+  RuleCache_entries[RuleCache_entry_num++] = *e;
+  RuleCache_next = RuleCache_entry_num;
+  RuleCache_dirty = 1;
+}
+
+// ------------------------------------------------------------
+// Cache files
+// ------------------------------------------------------------
+
+#define RULECACHE_WRITE(ptr, size)                                             \
+  if (fwrite(ptr, size, 1, fp) != 1)                                           \
+  goto error
+
+#define RULECACHE_READ(ptr, size)                                              \
+  if (fread(ptr, size, 1, fp) != 1)                                            \
+  goto error
+
+static int RuleCache_write_str(FILE *fp, const char *str) {
+  int len = (str == NULL) ? -1 : (int)strlen(str);
+  RULECACHE_WRITE(&len, sizeof(len));
+  if (len > 0) {
+    RULECACHE_WRITE(str, len);
+  }
+  return 1;
+
+error:
+  return 0;
+}
+
+static int RuleCache_read_str(FILE *fp, char **str) {
+  int len;
+  *str = NULL;
+  RULECACHE_READ(&len, sizeof(len));
+  if (len < 0) {
+    return 1;
+  }
+  if (len > RULECACHE_PATH_MAX) {
+    return 0;
+  }
+
+  *str = malloc(len + 1);
+  if (*str == NULL) {
+    return 0;
+  }
+  if (len > 0) {
+    RULECACHE_READ(*str, len);
+  }
+  (*str)[len] = '\0';
+  return 1;
+
+error:
+  free(*str);
+  *str = NULL;
+  return 0;
+}
+
+static void RuleCache_write(void) {
+  if (!RuleCache_dirty) {
+    return;
+  }
+
+  // Written into another file first,
+  // because other processes may be reading the cache.
+  char tmpname[RULECACHE_PATH_MAX + 32];
+  snprintf(tmpname, sizeof(tmpname), "%s.%d", RuleCache_fname, (int)getpid());
+
+  FILE *fp = fopen(tmpname, "wb");
+  if (fp == NULL) {
+    return;
+  }
+
+  RULECACHE_WRITE(RULECACHE_MAGIC, strlen(RULECACHE_MAGIC));
+  RULECACHE_WRITE(&RuleCache_key, sizeof(RuleCache_key));
+  RULECACHE_WRITE(&RuleCache_entry_num, sizeof(RuleCache_entry_num));
+
+  for (int i = 0; i < RuleCache_entry_num; i++) {
+    RuleCacheEntry *e = &RuleCache_entries[i];
+    RULECACHE_WRITE(&e->n, sizeof(e->n));
+    if (e->n == 0) {
+      RULECACHE_WRITE(&e->hash, sizeof(e->hash));
+      continue;
+    }
+
+    RULECACHE_WRITE(&e->seq, sizeof(e->seq));
+    if (!RuleCache_write_str(fp, e->nameL) ||
+        !RuleCache_write_str(fp, e->nameR)) {
+      goto error;
+    }
+    RULECACHE_WRITE(e->code, sizeof(long) * e->n);
+    RULECACHE_WRITE(&e->agent_num, sizeof(e->agent_num));
+    for (int j = 0; j < e->agent_num; j++) {
+      RULECACHE_WRITE(&e->agents[j].id, sizeof(int));
+      RULECACHE_WRITE(&e->agents[j].arity, sizeof(int));
+      if (!RuleCache_write_str(fp, e->agents[j].name)) {
+        goto error;
+      }
+    }
+  }
+
+  if (fclose(fp) == 0) {
+    rename(tmpname, RuleCache_fname);
+  } else {
+    remove(tmpname);
+  }
+  return;
+
+error:
+  fclose(fp);
+  remove(tmpname);
+}
+
+static void RuleCache_read(void) {
+  FILE *fp = fopen(RuleCache_fname, "rb");
+  if (fp == NULL) {
+    return;
+  }
+
+  char          magic[sizeof(RULECACHE_MAGIC)];
+  unsigned long key;
+  int           num;
+
+  RULECACHE_READ(magic, strlen(RULECACHE_MAGIC));
+  RULECACHE_READ(&key, sizeof(key));
+  RULECACHE_READ(&num, sizeof(num));
+  if (memcmp(magic, RULECACHE_MAGIC, strlen(RULECACHE_MAGIC)) != 0 ||
+      key != RuleCache_key || num < 0) {
+    goto error;
+  }
+
+  for (int i = 0; i < num; i++) {
+    RuleCacheEntry e;
+    memset(&e, 0, sizeof(e));
+
+    RULECACHE_READ(&e.n, sizeof(e.n));
+    if (e.n == 0) {
+      RULECACHE_READ(&e.hash, sizeof(e.hash));
+      RuleCache_append(&e);
+      continue;
+    }
+    if (e.n < 2) {
+      goto error;
+    }
+
+    // Appended first so that it is freed in case of errors
+    RuleCache_append(&e);
+    RuleCacheEntry *ep = &RuleCache_entries[RuleCache_entry_num - 1];
+
+    RULECACHE_READ(&ep->seq, sizeof(ep->seq));
+    if (!RuleCache_read_str(fp, &ep->nameL) ||
+        !RuleCache_read_str(fp, &ep->nameR)) {
+      goto error;
+    }
+    ep->code = malloc(sizeof(long) * ep->n);
+    if (ep->code == NULL) {
+      goto error;
+    }
+    RULECACHE_READ(ep->code, sizeof(long) * ep->n);
+
+    RULECACHE_READ(&ep->agent_num, sizeof(ep->agent_num));
+    if (ep->agent_num < 0 || ep->agent_num > NUM_AGENTS) {
+      ep->agent_num = 0;
+      goto error;
+    }
+    ep->agents = calloc(ep->agent_num + 1, sizeof(RuleCacheAgent));
+    if (ep->agents == NULL) {
+      ep->agent_num = 0;
+      goto error;
+    }
+    for (int j = 0; j < ep->agent_num; j++) {
+      RULECACHE_READ(&ep->agents[j].id, sizeof(int));
+      RULECACHE_READ(&ep->agents[j].arity, sizeof(int));
+      if (!RuleCache_read_str(fp, &ep->agents[j].name)) {
+        goto error;
+      }
+    }
+  }
+
+  fclose(fp);
+  RuleCache_next = 0;
+  RuleCache_dirty = 0;
+  return;
+
+error:
+  // The broken cache is made again.
+  fclose(fp);
+  RuleCache_next = 0;
+  RuleCache_truncate();
+  RuleCache_dirty = 1;
+}
+
+#undef RULECACHE_WRITE
+#undef RULECACHE_READ
+
+// ------------------------------------------------------------
+// Interface
+// ------------------------------------------------------------
+
+// Adds options that change compiled codes, such as -d, to the cache key.
+void RuleCache_add_key(const char *str) {
+  RuleCache_key = RuleCache_hash(RuleCache_key, str, strlen(str) + 1);
+}
+
+int RuleCache_open(char *srcname) {
+  if (!RuleCache_hash_file(srcname, &RuleCache_key)) {
+    return 0;
+  }
+
+  // The layout of codes depends on the build and its switches.
+  const long layout[] = {OP_NOP, MAX_PORT, VM_OFFSET_LOCALVAR, VM_REG_SIZE,
+                         sizeof(void *)};
+  RuleCache_key = RuleCache_hash(RuleCache_key, layout, sizeof(layout));
+  RuleCache_key =
+      RuleCache_hash(RuleCache_key, RuleCache_build, sizeof(RuleCache_build));
+
+  char        dir[RULECACHE_PATH_MAX];
+  const char *base = getenv("XDG_CACHE_HOME");
+  int         len;
+  if (base != NULL && *base != '\0') {
+    len = snprintf(dir, sizeof(dir), "%s", base);
+  } else {
+    base = getenv("HOME");
+    if (base == NULL) {
+      return 0;
+    }
+    len = snprintf(dir, sizeof(dir), "%s/.cache", base);
+  }
+  if (len + strlen("/inpla") >= sizeof(dir)) {
+    return 0;
+  }
+  mkdir(dir, 0700);
+  strcat(dir, "/inpla");
+  mkdir(dir, 0700);
+
+  RuleCache_fname = malloc(RULECACHE_PATH_MAX);
+  if (RuleCache_fname == NULL) {
+    return 0;
+  }
+  len = snprintf(RuleCache_fname, RULECACHE_PATH_MAX, "%s/%016lx.rules", dir,
+                 RuleCache_key);
+  if (len >= RULECACHE_PATH_MAX) {
+    return 0;
+  }
+
+  RuleCache_read();
+  RuleCache_enabled = 1;
+  atexit(RuleCache_write);
+
+  return 1;
+}
+
+void RuleCache_use(char *srcname) {
+  if (!RuleCache_enabled) {
+    return;
+  }
+
+  unsigned long hash = 14695981039346656037UL;
+  RuleCache_hash_file(srcname, &hash);
+
+  if (RuleCache_next < RuleCache_entry_num &&
+      RuleCache_entries[RuleCache_next].n == 0 &&
+      RuleCache_entries[RuleCache_next].hash == hash) {
+    RuleCache_next++;
+    return;
+  }
+
+  RuleCacheEntry e;
+  memset(&e, 0, sizeof(e));
+  e.hash = hash;
+  RuleCache_append(&e);
+}
+
+// Loads the codes of the rule idL >< idR into `code' and `n'
+// if the cache has the same rule in the same order.
+// Returns 0 if it should be compiled.
+// The buffer `*code' is enlarged to hold the codes.
+int RuleCache_load(int idL, int idR, void ***code, int *n) {
+  RuleCache_seq++;
+  RuleCache_agentid = IdTable_get_last_agentid();
+
+  if (!RuleCache_enabled || RuleCache_next >= RuleCache_entry_num) {
+    return 0;
+  }
+
+  RuleCacheEntry *e = &RuleCache_entries[RuleCache_next];
+  if (e->n == 0 || e->seq != RuleCache_seq ||
+      !RuleCache_same_name(e->nameL, IdTable_get_name(idL)) ||
+      !RuleCache_same_name(e->nameR, IdTable_get_name(idR)) ||
+      e->code[0] != (long)(*code)[0] || e->code[1] != (long)(*code)[1]) {
+    return 0;
+  }
+
+  // Everything is checked before agents are registered,
+  // so that an entry that fails to load leaves no names behind.
+  int last_agentid = IdTable_get_last_agentid();
+  for (int i = 0; i < e->agent_num; i++) {
+    RuleCacheAgent *agent = &e->agents[i];
+    if (agent->id > IdTable_get_last_agentid()) {
+      // New agents get the next IDs in the same order as the compilation.
+      if (agent->id != ++last_agentid || agent->name == NULL ||
+          NameTable_get_id(agent->name) != -1) {
+        return 0;
+      }
+    } else if (!RuleCache_same_name(agent->name,
+                                    IdTable_get_name(agent->id))) {
+      return 0;
+    }
+  }
+
+  for (int pc = 2; pc < e->n; pc += CmEnv_get_VMCode_size(e->code[pc])) {
+    if (e->code[pc] < 0 || e->code[pc] > OP_NOP) {
+      return 0;
+    }
+  }
+
+  for (int i = 0; i < e->agent_num; i++) {
+    RuleCacheAgent *agent = &e->agents[i];
+    if (agent->id > IdTable_get_last_agentid()) {
+      NameTable_get_set_id_with_IdTable_forAgent(
+          RuleCache_strdup(agent->name));
+    }
+  }
+
+  // Relocation
+  *code = CmEnv_realloc_VMCode(*code, e->n);
+  for (int pc = 2; pc < e->n;) {
+    long op = e->code[pc];
+    (*code)[pc] = CodeAddr[op];
+
+    int size = CmEnv_get_VMCode_size(op);
+    for (int i = 1; i < size && pc + i < e->n; i++) {
+      (*code)[pc + i] = (void *)e->code[pc + i];
+    }
+    pc += size;
+  }
+
+  for (int i = 0; i < e->agent_num; i++) {
+    if (e->agents[i].arity != -1) {
+      IdTable_set_arity(e->agents[i].id, e->agents[i].arity);
+    }
+  }
+
+  *n = e->n;
+  RuleCache_next++;
+  return 1;
+}
+
+// Stores the codes of the rule compiled after RuleCache_load.
+void RuleCache_store(int idL, int idR, void **code, int n) {
+  if (!RuleCache_enabled) {
+    return;
+  }
+
+  // The number of registers is not recorded,
+  // so codes are kept only while they fit in the first registers.
+  if (VM_RegSize > VM_REG_SIZE) {
+    return;
+  }
+
+  RuleCacheEntry e;
+  memset(&e, 0, sizeof(e));
+  e.seq = RuleCache_seq;
+  e.n = n;
+  e.code = malloc(sizeof(long) * n);
+  if (e.code == NULL) {
+    return;
+  }
+  e.code[0] = (long)code[0];
+  e.code[1] = (long)code[1];
+
+  // Agents in the codes, and ones newly registered by the compilation.
+  char is_agent[NUM_AGENTS];
+  memset(is_agent, 0, sizeof(is_agent));
+  for (int i = RuleCache_agentid + 1; i <= IdTable_get_last_agentid(); i++) {
+    is_agent[i] = 1;
+  }
+
+  for (int pc = 2; pc < n;) {
+    Code op = CmEnv_get_opcode(code[pc]);
+    if ((op == OP_NOP && code[pc] != CodeAddr[OP_NOP]) || op == OP_MKGNAME ||
+        op == OP_NATIVE) {
+      // IDs of global names are not kept.
+      free(e.code);
+      return;
+    }
+    e.code[pc] = op;
+
+    int size = CmEnv_get_VMCode_size(op);
+    for (int i = 1; i < size && pc + i < n; i++) {
+      e.code[pc + i] = (long)code[pc + i];
+    }
+
+    unsigned long id = NUM_AGENTS;
+    switch (CmEnv_get_unfused_opcode(code[pc])) {
+    case OP_MKAGENT:
+    case OP_CHID_L:
+    case OP_CHID_R:
+      id = (unsigned long)code[pc + 1];
+      break;
+    case OP_JMPCNCT:
+    case OP_JMPCNCT_RULE:
+    case OP_TAILCALL:
+    case OP_TAILCALL_FREE_R:
+      id = (unsigned long)code[pc + 2];
+      break;
+    default:
+      break;
+    }
+    if (id < NUM_AGENTS) {
+      is_agent[id] = 1;
+    }
+
+    pc += size;
+  }
+
+  e.agents = malloc(sizeof(RuleCacheAgent) * NUM_AGENTS);
+  if (e.agents == NULL) {
+    free(e.code);
+    return;
+  }
+  for (int id = START_ID_OF_USER_AGENT; id <= END_ID_OF_USER_AGENT; id++) {
+    if (is_agent[id]) {
+      e.agents[e.agent_num].id = id;
+      e.agents[e.agent_num].arity = IdTable_get_arity(id);
+      e.agents[e.agent_num].name = RuleCache_strdup(IdTable_get_name(id));
+      e.agent_num++;
+    }
+  }
+
+  e.nameL = RuleCache_strdup(IdTable_get_name(idL));
+  e.nameR = RuleCache_strdup(IdTable_get_name(idR));
+
+  RuleCache_append(&e);
+}
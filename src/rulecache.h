@@ -0,0 +1,26 @@
+#ifndef INPLA_RULECACHE_H
+#define INPLA_RULECACHE_H
+
+// ------------------------------------------------------------
+// Cache of compiled rules: -fcache-rules
+// ------------------------------------------------------------
+//
+// Bytecodes of rules compiled from a source file are stored in
+// $XDG_CACHE_HOME/inpla (or ~/.cache/inpla), keyed by a hash of the file,
+// the files given by `use', the options for the compilation and the switches
+// of the build that change the codes.
+// When the source is unchanged, the codes are loaded instead of compiled.
+//
+// Agents that appear in the codes are recorded with their names,
+// and they are registered to IdTable and NameTable again in the same order,
+// so their IDs in the codes stay valid.
+// Opcodes are stored as indices of CodeAddr, and relocated when loaded.
+
+void RuleCache_add_key(const char *str);
+int  RuleCache_open(char *srcname);
+void RuleCache_use(char *srcname);
+
+int  RuleCache_load(int idL, int idR, void ***code, int *n);
+void RuleCache_store(int idL, int idR, void **code, int n);
+
+#endif // INPLA_RULECACHE_H
@@ -5,10 +5,14 @@
 #include <stdlib.h>
 #include <string.h>
 
-#ifndef RULETABLE_SIMPLE
+#if defined(RULETABLE_HASHED)
 
 RuleList *RuleTable[RULEHASH_SIZE];
 
+// The most recently hit entry for each symL.
+// Hot pairs are found here without walking the linear list.
+static RuleList *volatile RuleCache[RULEHASH_SIZE];
+
 RuleList *RuleList_new(void) {
   RuleList *alist = malloc(sizeof(RuleList));
   if (alist == NULL) {
@@ -16,6 +20,7 @@ RuleList *RuleList_new(void) {
     exit(EXIT_FAILURE);
   }
   alist->available = 0;
+  alist->code = NULL;
   return alist;
 }
 
@@ -23,6 +28,7 @@ void RuleList_set_code(RuleList *at, int sym, void **code, int byte,
                        RuleList *next) {
   at->sym = sym;
   at->available = 1;
+  at->code = CmEnv_realloc_VMCode(at->code, byte);
   CmEnv_copy_VMCode(byte, code, at->code);
   at->next = next;
 }
@@ -32,6 +38,7 @@ void RuleList_inavailable(RuleList *at) { at->available = 0; }
 void RuleTable_init(void) {
   for (int i = 0; i < RULEHASH_SIZE; i++) {
     RuleTable[i] = NULL;
+    RuleCache[i] = NULL;
   }
 }
 
@@ -39,6 +46,9 @@ void RuleTable_record(int symlID, int symrID, void **code, int byte) {
 
   RuleList *add;
 
+  // Invalidate the cache because the entry may be overwritten.
+  RuleCache[symlID] = NULL;
+
   if (RuleTable[symlID] == NULL) {
     // No entry for symlID
 
@@ -60,6 +70,7 @@ void RuleTable_record(int symlID, int symrID, void **code, int byte) {
       // already exists
 
       // overwrite
+      at->code = CmEnv_realloc_VMCode(at->code, byte);
       CmEnv_copy_VMCode(byte, code, at->code);
       return;
     }
@@ -76,6 +87,8 @@ void RuleTable_record(int symlID, int symrID, void **code, int byte) {
 }
 void RuleTable_delete(int symlID, int symrID) {
 
+  RuleCache[symlID] = NULL;
+
   if (RuleTable[symlID] == NULL) {
     // No entry for symlID
     return;
@@ -106,6 +119,12 @@ void *RuleTable_get_code(int syml, int symr, int *result) {
 
   // RuleList *add;
 
+  RuleList *cache = RuleCache[syml];
+  if (cache != NULL && cache->sym == symr) {
+    *result = 1;
+    return cache->code;
+  }
+
   if (RuleTable[syml] == NULL) {
     // When ResultTable for syml is empty
 
@@ -127,6 +146,7 @@ void *RuleTable_get_code(int syml, int symr, int *result) {
       return NULL;
     }
 
+    RuleCache[syml] = at;
     *result = 1;
     return at->code;
   }
@@ -158,7 +178,7 @@ void RuleTable_get_code_for_Int(const VALUE heap_syml, void ***code) {
   }
 }
 
-#else
+#elif defined(RULETABLE_SIMPLE)
 
 void *RuleTable[NUM_AGENTS][NUM_AGENTS];
 
@@ -170,9 +190,8 @@ void RuleTable_init(void) {
   }
 }
 void RuleTable_record(int symlID, int symrID, void **code, int byte) {
-  if (RuleTable[symrID][symlID] == NULL) {
-    RuleTable[symrID][symlID] = malloc(MAX_VMCODE_SEQUENCE * sizeof(void *));
-  }
+  RuleTable[symrID][symlID] =
+      CmEnv_realloc_VMCode(RuleTable[symrID][symlID], byte);
   CmEnv_copy_VMCode(byte, code, RuleTable[symrID][symlID]);
 }
 void *RuleTable_get_code(int symlID, int symrID, int *result) {
@@ -193,4 +212,67 @@ void RuleTable_get_code_for_Int(VALUE heap_syml, void ***code) {
   *code = RuleTable[ID_INT][symlID];
 }
 
+#else
+
+RuleRow *RuleTable[NUM_AGENTS];
+
+static RuleRow RuleRow_empty;
+
+static RuleArena *RuleArena_top = NULL;
+
+static void **RuleArena_alloc(int byte) {
+  RuleArena *arena = RuleArena_top;
+
+  if (arena == NULL || arena->used + byte > arena->size) {
+    int size = RULEARENA_CHUNK_SIZE;
+    if (size < byte) {
+      size = byte;
+    }
+
+    arena = malloc(sizeof(RuleArena) + sizeof(void *) * size);
+    if (arena == NULL) {
+      fprintf(stderr, "Error: RuleArena_alloc() failed: %s\n",
+              strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    arena->size = size;
+    arena->used = 0;
+    arena->next = RuleArena_top;
+    RuleArena_top = arena;
+  }
+
+  void **code = &arena->code[arena->used];
+  arena->used += byte;
+  return code;
+}
+
+void RuleTable_init(void) {
+  for (int i = 0; i < NUM_AGENTS; i++) {
+    RuleTable[i] = &RuleRow_empty;
+  }
+}
+
+void RuleTable_record(int symlID, int symrID, void **code, int byte) {
+  if (RuleTable[symlID] == &RuleRow_empty) {
+    RuleTable[symlID] = calloc(1, sizeof(RuleRow));
+    if (RuleTable[symlID] == NULL) {
+      fprintf(stderr, "Error: RuleTable_record() failed: %s\n",
+              strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // An overwritten rule gets a new area, and the old one is left unused
+  // because the size of the new code may differ.
+  void **at = RuleArena_alloc(byte);
+  CmEnv_copy_VMCode(byte, code, at);
+  (*RuleTable[symlID])[symrID] = at;
+}
+
+void RuleTable_delete(int symlID, int symrID) {
+  if (RuleTable[symlID] != &RuleRow_empty) {
+    (*RuleTable[symlID])[symrID] = NULL;
+  }
+}
+
 #endif
@@ -8,17 +8,18 @@
 // TABLE for RULES
 // ------------------------------------------------------------
 
-#ifndef RULETABLE_SIMPLE
+#if defined(RULETABLE_HASHED)
 #  define RULEHASH_SIZE NUM_AGENTS
 typedef struct RuleList {
   int sym;
   int available;
-  void *code[MAX_VMCODE_SEQUENCE];
+  void **code;
   struct RuleList *next;
 } RuleList;
 
 extern RuleList *RuleTable[RULEHASH_SIZE];
-#else
+
+#elif defined(RULETABLE_SIMPLE)
 // ------------------------------------------
 // RuleTable: simple realisation with arrays
 // ------------------------------------------
@@ -27,11 +28,53 @@ extern RuleList *RuleTable[RULEHASH_SIZE];
 // RuleTable[id_Beta][id_alpha]
 
 extern void *RuleTable[NUM_AGENTS][NUM_AGENTS];
+
+#else
+// ------------------------------------------
+// RuleTable: two-level direct table (DEFAULT)
+// ------------------------------------------
+//
+// codes for alpha><beta is stored in
+// (*RuleTable[id_alpha])[id_beta],
+// where the row RuleTable[id_alpha] is allocated
+// when the first rule for alpha is recorded.
+// Until then it points to the shared empty row RuleRow_empty,
+// so the dispatch is just two indexed loads without NULL checks.
+//
+// The codes are exactly sized and packed in RuleArena,
+// a list of contiguous chunks, so that rules share a few pages.
+
+#  define RULEARENA_CHUNK_SIZE 8192 // words
+
+typedef struct RuleArena {
+  struct RuleArena *next;
+  int size, used;
+  void *code[];
+} RuleArena;
+
+typedef void **RuleRow[NUM_AGENTS];
+
+extern RuleRow *RuleTable[NUM_AGENTS];
+
+static inline void *RuleTable_get_code(int syml, int symr, int *result) {
+  void **code = (*RuleTable[syml])[symr];
+  *result = (code != NULL);
+  return code;
+}
+
+static inline void RuleTable_get_code_for_Int(VALUE heap_syml, void ***code) {
+  void **at = (*RuleTable[AGENT(heap_syml)->basic.id])[ID_INT];
+  if (at != NULL) {
+    *code = at;
+  }
+}
 #endif
 
 void RuleTable_init(void);
+#if defined(RULETABLE_HASHED) || defined(RULETABLE_SIMPLE)
 void *RuleTable_get_code(int syml, int symr, int *result);
 void RuleTable_get_code_for_Int(VALUE heap_syml, void ***code);
+#endif
 void RuleTable_record(int symlID, int symrID, void **code, int byte);
 
 #endif // INPLA_RULETABLE_H
@@ -4,6 +4,7 @@
 #define INPLA_TIMER_H
 
 #include <sys/time.h>
+#include <time.h>
 
 static unsigned long long gettimeval(void) {
   struct timeval tv;
@@ -19,6 +20,13 @@ static unsigned long long stop_timer(const unsigned long long *startt) {
   return stopt >= *startt ? stopt - *startt : stopt;
 }
 
+// CPU time of the whole process (all threads) in usec
+static unsigned long long getcputime(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 #define print_timer(te)                                                        \
   {                                                                            \
     printf("time of %s:%f[sec]\n", #te, (te * 1.0e-3) / 1000);                 \
@@ -0,0 +1,173 @@
+#include "topology.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#  include <sys/syscall.h>
+#endif
+
+#define TOPOLOGY_SYS_NODE "/sys/devices/system/node"
+
+// The memory policy of mbind(2), given here so that libnuma is not needed.
+#define TOPOLOGY_MPOL_PREFERRED 1
+#define TOPOLOGY_MAX_NODES      1024
+
+typedef struct {
+  int  id; // the number of the node in /sys
+  int  cpu_num;
+  int *cpus;
+} TopologyNode;
+
+// Nodes in ascending order of their numbers, only those having CPUs.
+static TopologyNode *Nodes = NULL;
+static int           Node_num = 0;
+static int           Cpu_total = 0;
+
+static void node_add_cpu(TopologyNode *node, int cpu) {
+  int *cpus = realloc(node->cpus, sizeof(int) * (node->cpu_num + 1));
+  if (cpus == NULL) {
+    printf("[Topology]Malloc error\n");
+    exit(-1);
+  }
+  node->cpus = cpus;
+  node->cpus[node->cpu_num++] = cpu;
+  Cpu_total++;
+}
+
+// Reads a list such as `0-3,8-11' in the file.
+static void node_read_cpulist(TopologyNode *node, const char *path) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    return;
+  }
+
+  int from, to;
+  while (fscanf(fp, "%d", &from) == 1) {
+    to = from;
+    int c = fgetc(fp);
+    if (c == '-') {
+      if (fscanf(fp, "%d", &to) != 1) {
+        break;
+      }
+      c = fgetc(fp);
+    }
+    for (int cpu = from; cpu <= to; cpu++) {
+      node_add_cpu(node, cpu);
+    }
+    if (c != ',') {
+      break;
+    }
+  }
+
+  fclose(fp);
+}
+
+static int compare_node(const void *a, const void *b) {
+  return ((const TopologyNode *)a)->id - ((const TopologyNode *)b)->id;
+}
+
+static void read_sys_nodes(void) {
+  DIR *dir = opendir(TOPOLOGY_SYS_NODE);
+  if (dir == NULL) {
+    return;
+  }
+
+  struct dirent *ent;
+  while ((ent = readdir(dir)) != NULL) {
+    int  id;
+    char rest;
+    if (sscanf(ent->d_name, "node%d%c", &id, &rest) != 1 || id < 0) {
+      continue;
+    }
+
+    char path[sizeof(TOPOLOGY_SYS_NODE) + 64];
+    snprintf(path, sizeof(path), TOPOLOGY_SYS_NODE "/node%d/cpulist", id);
+
+    TopologyNode node = {id, 0, NULL};
+    node_read_cpulist(&node, path);
+    if (node.cpu_num == 0) {
+      // Nodes of memory only have no CPU to place threads on.
+      continue;
+    }
+
+    TopologyNode *nodes = realloc(Nodes, sizeof(TopologyNode) * (Node_num + 1));
+    if (nodes == NULL) {
+      printf("[Topology]Malloc error\n");
+      exit(-1);
+    }
+    Nodes = nodes;
+    Nodes[Node_num++] = node;
+  }
+  closedir(dir);
+
+  qsort(Nodes, Node_num, sizeof(TopologyNode), compare_node);
+}
+
+void Topology_init(void) {
+  if (Node_num > 0) {
+    return;
+  }
+
+  read_sys_nodes();
+
+  if (Node_num == 0) {
+    // All CPUs are regarded as one node.
+    Nodes = calloc(1, sizeof(TopologyNode));
+    if (Nodes == NULL) {
+      printf("[Topology]Malloc error\n");
+      exit(-1);
+    }
+    Node_num = 1;
+
+    long num = sysconf(_SC_NPROCESSORS_CONF);
+    for (int cpu = 0; cpu < ((num > 0) ? num : 1); cpu++) {
+      node_add_cpu(&Nodes[0], cpu);
+    }
+  }
+}
+
+int Topology_node_num(void) { return Node_num; }
+
+void Topology_place(int i, Placement placement, int *cpu, int *node) {
+  const TopologyNode *n;
+
+  if (placement == PLACEMENT_SCATTER) {
+    n = &Nodes[i % Node_num];
+    *cpu = n->cpus[(i / Node_num) % n->cpu_num];
+
+  } else {
+    int k = i % Cpu_total;
+    n = Nodes;
+    while (k >= n->cpu_num) {
+      k -= n->cpu_num;
+      n++;
+    }
+    *cpu = n->cpus[k];
+  }
+
+  *node = n->id;
+}
+
+void Topology_bind_memory(void *addr, size_t len, int node) {
+#ifdef SYS_mbind
+  if (Node_num <= 1 || node < 0 || node >= TOPOLOGY_MAX_NODES) {
+    return;
+  }
+
+  unsigned long mask[TOPOLOGY_MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+  mask[node / (8 * sizeof(unsigned long))] |=
+      1UL << (node % (8 * sizeof(unsigned long)));
+
+  // A failure leaves the default policy, that is, the first touch.
+  syscall(SYS_mbind, addr, len, TOPOLOGY_MPOL_PREFERRED, mask,
+          TOPOLOGY_MAX_NODES + 1, 0);
+#else
+  (void)addr;
+  (void)len;
+  (void)node;
+#endif
+}
@@ -0,0 +1,34 @@
+#ifndef INPLA_TOPOLOGY_H
+#define INPLA_TOPOLOGY_H
+
+#include <stddef.h>
+
+// ------------------------------------------------------------
+// CPU topology for placement of threads: -Xplace
+// ------------------------------------------------------------
+//
+// NUMA nodes and their CPUs are read from /sys/devices/system/node.
+// When it is not available, all CPUs are regarded as one node.
+//
+// Threads are placed on CPUs in one of the following ways:
+//   compact: fill the CPUs of a node before going to the next node,
+//            so threads share caches and memory of fewer nodes.
+//   scatter: put threads on nodes in turn,
+//            so threads use the memory bandwidth of all nodes.
+
+typedef enum {
+  PLACEMENT_COMPACT,
+  PLACEMENT_SCATTER,
+} Placement;
+
+void Topology_init(void);
+int  Topology_node_num(void);
+
+// The CPU and the NUMA node for the i-th thread.
+void Topology_place(int i, Placement placement, int *cpu, int *node);
+
+// Makes pages of [addr, addr+len) be taken from the node when touched first.
+// It does nothing on a single node, or when the node is negative.
+void Topology_bind_memory(void *addr, size_t len, int node);
+
+#endif // INPLA_TOPOLOGY_H
@@ -3,11 +3,47 @@
 
 #include "config.h"
 
+#include <stddef.h>
+#include <stdint.h>
+
 typedef unsigned int  IDTYPE;
+
+#ifdef COMPRESSED_REFS
+// References to cells are 32-bit offsets in the region reserved for hoops.
+// Cells are aligned to 4 bytes, so an offset is stored shifted by one bit,
+// which keeps the lowest bit zero for fixnums and covers 4GB of the region.
+// VALUE is signed so that tagged fixnums keep their order and sign
+// when they are compared or widened as long.
+typedef int32_t VALUE;
+
+extern char *Heap_region;
+#  define VALUE2PTR(a) ((void *)(Heap_region + ((uintptr_t)(uint32_t)(a) << 1)))
+#  define PTR2VALUE(p) ((VALUE)(((char *)(p) - Heap_region) >> 1))
+#else
 typedef unsigned long VALUE;
+#  define VALUE2PTR(a) ((void *)(a))
+#  define PTR2VALUE(p) ((VALUE)(p))
+#endif
+
+// The null reference. NULL is converted through uintptr_t,
+// because VALUE is narrower than pointers with COMPRESSED_REFS.
+#define VALUE_NULL ((VALUE)(uintptr_t)NULL)
 
 typedef struct {
+#if defined(REMOTE_FREE) && defined(COMPRESSED_REFS)
+  // Ports have no padding before them in this mode, so the id and the VM
+  // whose heap has this cell are packed in 4 bytes. Ids are less than
+  // IDTABLE_SIZE, and VMs are less than CELL_OWNER_MAX.
+  unsigned short id;
+  unsigned short owner;
+#  define CELL_OWNER_MAX 0xFFFF
+#else
   IDTYPE id;
+#  ifdef REMOTE_FREE
+  // The VM whose heap has this cell. It lies in the padding before ports.
+  unsigned int owner;
+#  endif
+#endif
 } Basic;
 
 typedef struct {
@@ -30,6 +66,32 @@ typedef struct {
 #endif
 } Agent;
 
+#ifdef AGENT_SIZE_CLASS
+// Agents having at most AGENT_SMALL_PORT ports are stored in small cells
+// such as S, Cons, Nil and Dup, and the others in Agent cells.
+#  define AGENT_SMALL_PORT 2
+
+typedef struct {
+  Basic basic;
+
+#  ifndef THREAD
+  VALUE port[AGENT_SMALL_PORT];
+#  else
+  volatile VALUE port[AGENT_SMALL_PORT];
+#  endif
+} SmallAgent;
+#endif
+
+// Cells are Basic and ports without padding but that after Basic.
+_Static_assert(sizeof(Basic) <= sizeof(VALUE), "Basic grows cells");
+_Static_assert(sizeof(Name) == sizeof(VALUE) * 2, "Name is not 2 words");
+_Static_assert(sizeof(Agent) == sizeof(VALUE) * (1 + MAX_PORT),
+               "Agent is not 1+MAX_PORT words");
+#ifdef AGENT_SIZE_CLASS
+_Static_assert(sizeof(SmallAgent) == sizeof(VALUE) * (1 + AGENT_SMALL_PORT),
+               "SmallAgent is not 1+AGENT_SMALL_PORT words");
+#endif
+
 /* Equation */
 typedef struct EQ_tag {
   VALUE l, r;
@@ -45,8 +107,8 @@ typedef struct EQList_tag {
 #define FIX2INT(i)   ((long)(i) >> 1)
 #define IS_FIXNUM(i) ((VALUE)(i) & FIXNUM_FLAG)
 
-#define AGENT(a) ((Agent *)(a))
-#define BASIC(a) ((Basic *)(a))
-#define NAME(a)  ((Name *)(a))
+#define AGENT(a) ((Agent *)VALUE2PTR(a))
+#define BASIC(a) ((Basic *)VALUE2PTR(a))
+#define NAME(a)  ((Name *)VALUE2PTR(a))
 
 #endif /* INPLA_TYPE_H */
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "vm.h"
+#include "cmenv.h"
 
 #include <errno.h>
 #include <stdio.h>
@@ -11,6 +12,34 @@ extern void *CodeAddr[OP_NOP + 1];
 VirtualMachine VM;
 #endif
 
+// -----------------------------------------------------
+// Registers
+// -----------------------------------------------------
+// The number of registers that compiled codes require.
+int VM_RegSize = VM_REG_SIZE;
+
+void VM_Reg_Reserve(int size) {
+  if (size > VM_RegSize) {
+    VM_RegSize = size;
+  }
+}
+
+// Enlarges the registers of the VM to VM_RegSize.
+// It must be called while the VM executes no code.
+void VM_Reg_Fit(VirtualMachine *vm) {
+  if (vm->reg_size >= VM_RegSize) {
+    return;
+  }
+
+  VALUE *reg = realloc(vm->reg, sizeof(VALUE) * VM_RegSize);
+  if (reg == NULL) {
+    printf("[Register]Malloc error\n");
+    exit(-1);
+  }
+  vm->reg = reg;
+  vm->reg_size = VM_RegSize;
+}
+
 // -----------------------------------------------------
 // Mark and Sweep for error recovery
 // -----------------------------------------------------
@@ -74,6 +103,26 @@ void sweep_AgentHeap(Heap *hp) {
   } while (hoop_list != hp->last_alloc_list);
 }
 
+#    ifdef AGENT_SIZE_CLASS
+void sweep_SmallAgentHeap(Heap *hp) {
+
+  HoopList *hoop_list = hp->last_alloc_list;
+
+  do {
+    SmallAgent *hoop = (SmallAgent *)hoop_list->hoop;
+    for (int i = 0; i < hoop_list->size; i++) {
+
+      if (!IS_FLAG_MARKED(hoop[i].basic.id)) {
+        SET_HOOPFLAG_READYFORUSE(hoop[i].basic.id);
+      } else {
+        TOGGLE_FLAG_MARKED(hoop[i].basic.id);
+      }
+    }
+    hoop_list = hoop_list->next;
+  } while (hoop_list != hp->last_alloc_list);
+}
+#    endif
+
 void sweep_NameHeap(Heap *hp) {
   HoopList *hoop_list = hp->last_alloc_list;
   Name     *hoop;
@@ -122,6 +171,24 @@ void mark_and_sweep(void) {
   mark_allHash();
   sweep_AgentHeap(&VM.agentHeap);
   sweep_NameHeap(&VM.nameHeap);
+#  ifdef AGENT_SIZE_CLASS
+  sweep_SmallAgentHeap(&VM.smallAgentHeap);
+#  endif
+
+  // Cells are freed by the sweep without myfree.
+  Heap_Recount(&VM.agentHeap, Heap_GetNum_Usage_forAgent(&VM.agentHeap));
+  Heap_Recount(&VM.nameHeap, Heap_GetNum_Usage_forName(&VM.nameHeap));
+#  ifdef AGENT_SIZE_CLASS
+  Heap_Recount(&VM.smallAgentHeap,
+               Heap_GetNum_Usage_forSmallAgent(&VM.smallAgentHeap));
+#  endif
+#  ifdef HEAP_FREELIST
+  Heap_Rebuild_FreeList_forAgent(&VM.agentHeap);
+  Heap_Rebuild_FreeList_forName(&VM.nameHeap);
+#    ifdef AGENT_SIZE_CLASS
+  Heap_Rebuild_FreeList_forSmallAgent(&VM.smallAgentHeap);
+#    endif
+#  endif
   VM.nextPtr_eqStack = -1;
 }
 
@@ -139,8 +206,16 @@ void VM_Buffer_Init(VirtualMachine *restrict vm) {
   vm->nameHeap.last_alloc_list->next = vm->nameHeap.last_alloc_list;
   vm->nameHeap.last_alloc_idx = 0;
 
+  vm->agentHeap.expansions = vm->nameHeap.expansions = 0;
+  vm->agentHeap.allocs = vm->agentHeap.frees = 0;
+  vm->agentHeap.capacity = HOOP_SIZE;
+  vm->nameHeap.allocs = vm->nameHeap.frees = 0;
+  vm->nameHeap.capacity = HOOP_SIZE;
+
   // Register
-  vm->reg = malloc(sizeof(VALUE) * VM_REG_SIZE);
+  vm->reg = NULL;
+  vm->reg_size = 0;
+  VM_Reg_Fit(vm);
 }
 
 #elif defined(FLEX_EXPANDABLE_HEAP)
@@ -177,8 +252,50 @@ void VM_Buffer_Init(VirtualMachine *restrict vm) {
   vm->nameHeap.last_alloc_list->next->next = vm->nameHeap.last_alloc_list;
   vm->nameHeap.last_alloc_idx = 0;
 
+#  ifdef AGENT_SIZE_CLASS
+  vm->smallAgentHeap.last_alloc_list =
+      HoopList_new_forSmallAgent(Hoop_init_size);
+  vm->smallAgentHeap.last_alloc_list->next =
+      HoopList_new_forSmallAgent(Hoop_init_size);
+  vm->smallAgentHeap.last_alloc_list->next->next =
+      vm->smallAgentHeap.last_alloc_list;
+  vm->smallAgentHeap.last_alloc_idx = 0;
+#  endif
+
+  vm->agentHeap.expansions = vm->nameHeap.expansions = 0;
+  vm->agentHeap.allocs = vm->agentHeap.frees = 0;
+  vm->agentHeap.capacity = Hoop_init_size * 2;
+  vm->nameHeap.allocs = vm->nameHeap.frees = 0;
+  vm->nameHeap.capacity = Hoop_init_size * 2;
+#  ifdef AGENT_SIZE_CLASS
+  vm->smallAgentHeap.expansions = 0;
+  vm->smallAgentHeap.allocs = vm->smallAgentHeap.frees = 0;
+  vm->smallAgentHeap.capacity = Hoop_init_size * 2;
+#  endif
+
+#  ifdef REMOTE_FREE
+#    ifdef AGENT_SIZE_CLASS
+  Heap_Register(vm->id, &vm->agentHeap, &vm->nameHeap, &vm->smallAgentHeap);
+#    else
+  Heap_Register(vm->id, &vm->agentHeap, &vm->nameHeap, NULL);
+#    endif
+#  endif
+
+#  ifdef HEAP_FREELIST
+  vm->agentHeap.free_list = VALUE_NULL;
+  vm->agentHeap.top_list = vm->agentHeap.last_alloc_list;
+  vm->nameHeap.free_list = VALUE_NULL;
+  vm->nameHeap.top_list = vm->nameHeap.last_alloc_list;
+#    ifdef AGENT_SIZE_CLASS
+  vm->smallAgentHeap.free_list = VALUE_NULL;
+  vm->smallAgentHeap.top_list = vm->smallAgentHeap.last_alloc_list;
+#    endif
+#  endif
+
   // Register
-  vm->reg = malloc(sizeof(VALUE) * VM_REG_SIZE);
+  vm->reg = NULL;
+  vm->reg_size = 0;
+  VM_Reg_Fit(vm);
 }
 #else
 
@@ -195,14 +312,24 @@ void VM_InitBuffer(VirtualMachine *restrict vm, int size) {
   // vm->nameHeap.lastAlloc = 0;
   vm->nameHeap.size = size;
 
+  vm->agentHeap.allocs = vm->agentHeap.frees = 0;
+  vm->agentHeap.capacity = size;
+  vm->nameHeap.allocs = vm->nameHeap.frees = 0;
+  vm->nameHeap.capacity = size;
+
   // Register
-  vm->reg = malloc(sizeof(VALUE) * VM_REG_SIZE);
+  vm->reg = NULL;
+  vm->reg_size = 0;
+  VM_Reg_Fit(vm);
 }
 
 #endif
 
+#ifndef THREAD
 void VM_EQStack_Init(VirtualMachine *vm, int size) {
   vm->nextPtr_eqStack = -1;
+  vm->eqStack_high_water = 0;
+  vm->name_chains = vm->name_shortcuts = 0;
   vm->eqStack = malloc(sizeof(EQ) * size);
   vm->eqStack_size = size;
   if (vm->eqStack == NULL) {
@@ -237,6 +364,10 @@ void VM_EQStack_Push(VirtualMachine *vm, VALUE l, VALUE r) {
   vm->eqStack[vm->nextPtr_eqStack].l = l;
   vm->eqStack[vm->nextPtr_eqStack].r = r;
 
+  if (vm->nextPtr_eqStack >= vm->eqStack_high_water) {
+    vm->eqStack_high_water = vm->nextPtr_eqStack + 1;
+  }
+
 #ifdef DEBUG
   // DEBUG
   printf(" PUSH:");
@@ -261,231 +392,387 @@ int VM_EQStack_Pop(VirtualMachine *vm, VALUE *l, VALUE *r) {
   return 1;
 }
 
+#else
+// -----------------------------------------------------
+// Work-stealing deque (Chase and Lev, SPAA 2005)
+// -----------------------------------------------------
+// Only the owner VM calls Push and Pop, so the bottom needs no lock.
+// The top is moved by CAS when the owner takes the last equation
+// or when another VM steals one.
+
+static EQDeque *EQDeque_new(long size) {
+  EQDeque *q = malloc(sizeof(EQDeque) + sizeof(EQ) * size);
+  if (q == NULL) {
+    fprintf(stderr, "ERROR: EQDeque_new: could not allocate memory: %s\n",
+            strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  q->mask = size - 1;
+  q->retired = NULL;
+  return q;
+}
+
+void VM_EQStack_Init(VirtualMachine *vm, int size) {
+  long deque_size = 16;
+  while (deque_size < size) {
+    deque_size <<= 1;
+  }
+
+  vm->eqDeque = EQDeque_new(deque_size);
+  vm->eqDeque_bottom = 0;
+  vm->eqDeque_top = 0;
+  vm->eqStack_high_water = 0;
+  vm->name_chains = vm->name_shortcuts = 0;
+}
+
+static EQDeque *EQDeque_expand(VirtualMachine *vm, EQDeque *q, long top,
+                               long bottom) {
+  EQDeque *new_q = EQDeque_new((q->mask + 1) * 2);
+
+  for (long i = top; i < bottom; i++) {
+    new_q->buf[i & new_q->mask] = q->buf[i & q->mask];
+  }
+  new_q->retired = q;
+  __atomic_store_n(&vm->eqDeque, new_q, __ATOMIC_RELEASE);
+
+#  ifdef VERBOSE_EQSTACK_EXPANSION
+  puts("(EQStack is expanded)");
+#  endif
+
+  return new_q;
+}
+
+void VM_EQStack_Push(VirtualMachine *vm, VALUE l, VALUE r) {
+  long bottom = vm->eqDeque_bottom;
+  long top = __atomic_load_n(&vm->eqDeque_top, __ATOMIC_ACQUIRE);
+  EQDeque *q = vm->eqDeque;
+
+  if (bottom - top > q->mask) {
+    q = EQDeque_expand(vm, q, top, bottom);
+  }
+  if (bottom - top >= vm->eqStack_high_water) {
+    vm->eqStack_high_water = bottom - top + 1;
+  }
+
+  q->buf[bottom & q->mask].l = l;
+  q->buf[bottom & q->mask].r = r;
+  __atomic_store_n(&vm->eqDeque_bottom, bottom + 1, __ATOMIC_RELEASE);
+}
+
+int VM_EQStack_Pop(VirtualMachine *vm, VALUE *l, VALUE *r) {
+  long bottom = vm->eqDeque_bottom - 1;
+  EQDeque *q = vm->eqDeque;
+
+  __atomic_store_n(&vm->eqDeque_bottom, bottom, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  long top = __atomic_load_n(&vm->eqDeque_top, __ATOMIC_RELAXED);
+
+  if (top > bottom) {
+    // empty
+    __atomic_store_n(&vm->eqDeque_bottom, bottom + 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+
+  *l = q->buf[bottom & q->mask].l;
+  *r = q->buf[bottom & q->mask].r;
+
+  if (top == bottom) {
+    // The last one may be stolen at the same time.
+    int won = __atomic_compare_exchange_n(&vm->eqDeque_top, &top, top + 1, 0,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+    __atomic_store_n(&vm->eqDeque_bottom, bottom + 1, __ATOMIC_RELAXED);
+    return won;
+  }
+
+  return 1;
+}
+
+int VM_EQStack_Steal(VirtualMachine *vm, VALUE *l, VALUE *r) {
+  long top = __atomic_load_n(&vm->eqDeque_top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  long bottom = __atomic_load_n(&vm->eqDeque_bottom, __ATOMIC_ACQUIRE);
+
+  if (top >= bottom) {
+    return 0;
+  }
+
+  EQDeque *q = __atomic_load_n(&vm->eqDeque, __ATOMIC_ACQUIRE);
+  VALUE stolen_l = q->buf[top & q->mask].l;
+  VALUE stolen_r = q->buf[top & q->mask].r;
+
+  if (!__atomic_compare_exchange_n(&vm->eqDeque_top, &top, top + 1, 0,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    // Lost the race with the owner or another thief.
+    return 0;
+  }
+
+  *l = stolen_l;
+  *r = stolen_r;
+  return 1;
+}
+
+void VM_EQStack_FreeRetired(VirtualMachine *vm) {
+  EQDeque *q = vm->eqDeque->retired;
+  vm->eqDeque->retired = NULL;
+
+  while (q != NULL) {
+    EQDeque *next = q->retired;
+    free(q);
+    q = next;
+  }
+}
+#endif
+
 void VMCode_puts(void **code, int n) {
   int line = 0;
 
   // puts("[PutsCode]");
-  if (n == -1)
-    n = MAX_VMCODE_SEQUENCE;
-
   printf("Line:Addr.\n");
   for (int i = 0; i < n; i++) {
     line++;
     printf("%04d:%04d: ", line, i);
 
-    if (code[i] == CodeAddr[OP_MKNAME]) {
+    void *op = code[i];
+#ifdef OPTIMISE_SUPERINSTRUCTION
+    {
+      // A superinstruction is shown with the first code of the pair.
+      Code        first;
+      const char *name = CmEnv_get_superinst(op, &first);
+      if (name != NULL) {
+        printf("[%s] ", name);
+        op = CodeAddr[first];
+      }
+    }
+#endif
+
+    if (op == CodeAddr[OP_MKNAME]) {
       printf("mkname reg%lu\n", (unsigned long)code[i + 1]);
       i += 1;
 
-    } else if (code[i] == CodeAddr[OP_MKGNAME]) {
+    } else if (op == CodeAddr[OP_MKGNAME]) {
       printf("mkgname id%lu reg%lu; \"%s\"\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2],
              IdTable_get_name((unsigned long)code[i + 1]));
       i += 2;
 
-    } else if (code[i] == CodeAddr[OP_MKAGENT]) {
+    } else if (op == CodeAddr[OP_MKAGENT]) {
       printf("mkagent id:%lu reg%lu\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2]);
 
       i += 2;
 
-    } else if (code[i] == CodeAddr[OP_PUSH]) {
+    } else if (op == CodeAddr[OP_PUSH]) {
       printf("push reg%lu reg%lu\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2]);
       i += 2;
 
-    } else if (code[i] == CodeAddr[OP_PUSHI]) {
+    } else if (op == CodeAddr[OP_PUSHI]) {
       printf("pushi reg%lu $%ld\n", (unsigned long)code[i + 1],
              FIX2INT((unsigned long)code[i + 2]));
       i += 2;
 
-    } else if (code[i] == CodeAddr[OP_MYPUSH]) {
+    } else if (op == CodeAddr[OP_MYPUSH]) {
       printf("mypush reg%lu reg%lu\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2]);
       i += 2;
 
-    } else if (code[i] == CodeAddr[OP_RET]) {
+    } else if (op == CodeAddr[OP_RET]) {
       puts("ret");
 
-    } else if (code[i] == CodeAddr[OP_RET_FREE_L]) {
+    } else if (op == CodeAddr[OP_RET_FREE_L]) {
       puts("ret_free_l");
 
-    } else if (code[i] == CodeAddr[OP_RET_FREE_R]) {
+    } else if (op == CodeAddr[OP_RET_FREE_R]) {
       puts("ret_free_r");
 
-    } else if (code[i] == CodeAddr[OP_RET_FREE_LR]) {
+    } else if (op == CodeAddr[OP_RET_FREE_LR]) {
       puts("ret_free_lr");
 
-    } else if (code[i] == CodeAddr[OP_LOADI]) {
+    } else if (op == CodeAddr[OP_LOADI]) {
       printf("loadi $%ld reg%lu\n", FIX2INT((unsigned long)code[i + 1]),
              (unsigned long)code[i + 2]);
       i += 2;
 
-    } else if (code[i] == CodeAddr[OP_LOADP]) {
+    } else if (op == CodeAddr[OP_LOADP]) {
       printf("loadp reg%lu $%ld reg%lu\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2], (unsigned long)code[i + 3]);
       i += 3;
 
-    } else if (code[i] == CodeAddr[OP_LOADP_L]) {
+    } else if (op == CodeAddr[OP_LOADP_L]) {
       printf("loadp_l reg%lu $%ld\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2]);
       i += 2;
 
-    } else if (code[i] == CodeAddr[OP_LOADP_R]) {
+    } else if (op == CodeAddr[OP_LOADP_R]) {
       printf("loadp_r reg%lu $%ld\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2]);
       i += 2;
 
-    } else if (code[i] == CodeAddr[OP_CHID_L]) {
+    } else if (op == CodeAddr[OP_CHID_L]) {
       printf("chgid_l id:%ld\n", (unsigned long)code[i + 1]);
       i += 1;
 
-    } else if (code[i] == CodeAddr[OP_CHID_R]) {
+    } else if (op == CodeAddr[OP_CHID_R]) {
       printf("chgid_r id:%ld\n", (unsigned long)code[i + 1]);
       i += 1;
 
-    } else if (code[i] == CodeAddr[OP_LOOP]) {
+    } else if (op == CodeAddr[OP_LOOP]) {
       puts("loop");
 
-    } else if (code[i] == CodeAddr[OP_LOOP_RREC]) {
+    } else if (op == CodeAddr[OP_LOOP_RREC]) {
       printf("loop_rrec reg%lu $%lu\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2]);
       i += 2;
 
-    } else if (code[i] == CodeAddr[OP_LOOP_RREC_FREE_R]) {
+    } else if (op == CodeAddr[OP_LOOP_RREC_FREE_R]) {
       printf("loop_rrec_free_r reg%lu $%lu\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2]);
       i += 2;
 
-    } else if (code[i] == CodeAddr[OP_LOOP_RREC1]) {
+    } else if (op == CodeAddr[OP_LOOP_RREC1]) {
       printf("loop_rrec1 reg%lu\n", (unsigned long)code[i + 1]);
       i += 1;
 
-    } else if (code[i] == CodeAddr[OP_LOOP_RREC1_FREE_R]) {
+    } else if (op == CodeAddr[OP_LOOP_RREC1_FREE_R]) {
       printf("loop_rrec1_free_r reg%lu\n", (unsigned long)code[i + 1]);
       i += 1;
 
-    } else if (code[i] == CodeAddr[OP_LOOP_RREC2]) {
+    } else if (op == CodeAddr[OP_LOOP_RREC2]) {
       printf("loop_rrec2 reg%lu\n", (unsigned long)code[i + 1]);
       i += 1;
 
-    } else if (code[i] == CodeAddr[OP_LOOP_RREC2_FREE_R]) {
+    } else if (op == CodeAddr[OP_LOOP_RREC2_FREE_R]) {
       printf("loop_rrec2_free_r reg%lu\n", (unsigned long)code[i + 1]);
       i += 1;
 
-    } else if (code[i] == CodeAddr[OP_LOAD]) {
+    } else if (op == CodeAddr[OP_LOAD]) {
       printf("load reg%lu reg%lu\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2]);
       i += 2;
 
-    } else if (code[i] == CodeAddr[OP_ADD]) {
+    } else if (op == CodeAddr[OP_ADD]) {
       printf("add reg%lu reg%lu reg%lu\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2], (unsigned long)code[i + 3]);
       i += 3;
 
-    } else if (code[i] == CodeAddr[OP_SUB]) {
+    } else if (op == CodeAddr[OP_SUB]) {
       printf("sub reg%lu reg%lu reg%lu\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2], (unsigned long)code[i + 3]);
       i += 3;
 
-    } else if (code[i] == CodeAddr[OP_ADDI]) {
+    } else if (op == CodeAddr[OP_ADDI]) {
       printf("addi reg%lu $%lu reg%lu\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2], (unsigned long)code[i + 3]);
       i += 3;
-    } else if (code[i] == CodeAddr[OP_SUBI]) {
+    } else if (op == CodeAddr[OP_SUBI]) {
       printf("subi reg%lu $%lu reg%lu\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2], (unsigned long)code[i + 3]);
       i += 3;
 
-    } else if (code[i] == CodeAddr[OP_MUL]) {
+    } else if (op == CodeAddr[OP_MUL]) {
       printf("mul reg%lu reg%lu reg%lu\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2], (unsigned long)code[i + 3]);
       i += 3;
 
-    } else if (code[i] == CodeAddr[OP_DIV]) {
+    } else if (op == CodeAddr[OP_DIV]) {
       printf("div reg%lu reg%lu reg%lu\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2], (unsigned long)code[i + 3]);
       i += 3;
 
-    } else if (code[i] == CodeAddr[OP_MOD]) {
+    } else if (op == CodeAddr[OP_MOD]) {
       printf("mod reg%lu reg%lu reg%lu\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2], (unsigned long)code[i + 3]);
       i += 3;
 
-    } else if (code[i] == CodeAddr[OP_LT]) {
+    } else if (op == CodeAddr[OP_LT]) {
       printf("lt reg%lu reg%lu reg%lu\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2], (unsigned long)code[i + 3]);
       i += 3;
 
-    } else if (code[i] == CodeAddr[OP_EQ]) {
+    } else if (op == CodeAddr[OP_EQ]) {
       printf("eq reg%lu reg%lu reg%lu\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2], (unsigned long)code[i + 3]);
       i += 3;
 
-    } else if (code[i] == CodeAddr[OP_EQI]) {
+    } else if (op == CodeAddr[OP_EQI]) {
       printf("eqi reg%lu $%ld reg%lu\n", (unsigned long)code[i + 1],
              FIX2INT((unsigned long)code[i + 2]), (unsigned long)code[i + 3]);
       i += 3;
 
-    } else if (code[i] == CodeAddr[OP_NE]) {
+    } else if (op == CodeAddr[OP_NE]) {
       printf("ne reg%lu reg%lu reg%lu\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2], (unsigned long)code[i + 3]);
       i += 3;
 
-    } else if (code[i] == CodeAddr[OP_LT_R0]) {
+    } else if (op == CodeAddr[OP_LT_R0]) {
       printf("lt_r0 reg%lu reg%lu\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2]);
       i += 2;
 
-    } else if (code[i] == CodeAddr[OP_LE_R0]) {
+    } else if (op == CodeAddr[OP_LE_R0]) {
       printf("le_r0 reg%lu reg%lu\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2]);
       i += 2;
 
-    } else if (code[i] == CodeAddr[OP_EQ_R0]) {
+    } else if (op == CodeAddr[OP_EQ_R0]) {
       printf("eq_r0 reg%lu reg%lu\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2]);
       i += 2;
 
-    } else if (code[i] == CodeAddr[OP_EQI_R0]) {
+    } else if (op == CodeAddr[OP_EQI_R0]) {
       printf("eqi_r0 reg%lu $%ld\n", (unsigned long)code[i + 1],
              FIX2INT((unsigned long)code[i + 2]));
       i += 2;
 
-    } else if (code[i] == CodeAddr[OP_NE_R0]) {
+    } else if (op == CodeAddr[OP_NE_R0]) {
       printf("ne_r0 reg%lu reg%lu\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2]);
       i += 2;
 
-    } else if (code[i] == CodeAddr[OP_JMPNEQ0]) {
+    } else if (op == CodeAddr[OP_JMPNEQ0]) {
       printf("jmpneq0 reg%lu $%lu\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2]);
       i += 2;
 
-    } else if (code[i] == CodeAddr[OP_JMPEQ0]) {
+    } else if (op == CodeAddr[OP_JMPEQ0]) {
       printf("jmpeq0 reg%lu $%lu\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2]);
       i += 2;
 
-    } else if (code[i] == CodeAddr[OP_JMPEQ0_R0]) {
+    } else if (op == CodeAddr[OP_JMPEQ0_R0]) {
       printf("jmpeq0_r0 $%lu\n", (unsigned long)code[i + 1]);
       i += 1;
 
-    } else if (code[i] == CodeAddr[OP_JMPCNCT_CONS]) {
+    } else if (op == CodeAddr[OP_JMPCNCT_CONS]) {
       printf("jmpcnct_cons reg%lu $%lu\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2]);
       i += 2;
 
-    } else if (code[i] == CodeAddr[OP_JMPCNCT]) {
+    } else if (op == CodeAddr[OP_JMPCNCT]) {
       printf("jmpcnct reg%lu id%lu $%lu\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2], (unsigned long)code[i + 3]);
       i += 3;
 
-    } else if (code[i] == CodeAddr[OP_JMP]) {
+    } else if (op == CodeAddr[OP_JMPCNCT_RULE]) {
+      printf("jmpcnct_rule reg%lu id%lu $%lu\n", (unsigned long)code[i + 1],
+             (unsigned long)code[i + 2], (unsigned long)code[i + 3]);
+      i += 3;
+
+    } else if (op == CodeAddr[OP_TAILCALL]) {
+      printf("tailcall reg%lu id%lu\n", (unsigned long)code[i + 1],
+             (unsigned long)code[i + 2]);
+      i += 2;
+
+    } else if (op == CodeAddr[OP_TAILCALL_FREE_R]) {
+      printf("tailcall_free_r reg%lu id%lu\n", (unsigned long)code[i + 1],
+             (unsigned long)code[i + 2]);
+      i += 2;
+
+    } else if (op == CodeAddr[OP_JMP]) {
       printf("jmp $%lu\n", (unsigned long)code[i + 1]);
       i += 1;
 
-    } else if (code[i] == CodeAddr[OP_UNM]) {
+    } else if (op == CodeAddr[OP_UNM]) {
 #if !defined(OPTIMISE_TWO_ADDRESS) || !defined(OPTIMISE_TWO_ADDRESS_UNARY)
       printf("unm reg%lu reg%lu\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2]);
@@ -495,7 +782,7 @@ void VMCode_puts(void **code, int n) {
       i += 1;
 #endif
 
-    } else if (code[i] == CodeAddr[OP_INC]) {
+    } else if (op == CodeAddr[OP_INC]) {
 #if !defined(OPTIMISE_TWO_ADDRESS) || !defined(OPTIMISE_TWO_ADDRESS_UNARY)
       printf("inc reg%lu reg%lu\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2]);
@@ -505,7 +792,7 @@ void VMCode_puts(void **code, int n) {
       i += 1;
 #endif
 
-    } else if (code[i] == CodeAddr[OP_DEC]) {
+    } else if (op == CodeAddr[OP_DEC]) {
 #if !defined(OPTIMISE_TWO_ADDRESS) || !defined(OPTIMISE_TWO_ADDRESS_UNARY)
       printf("dec reg%lu reg%lu\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2]);
@@ -515,7 +802,7 @@ void VMCode_puts(void **code, int n) {
       i += 1;
 #endif
 
-    } else if (code[i] == CodeAddr[OP_RAND]) {
+    } else if (op == CodeAddr[OP_RAND]) {
 #if !defined(OPTIMISE_TWO_ADDRESS) || !defined(OPTIMISE_TWO_ADDRESS_UNARY)
       printf("rnd reg%lu reg%lu\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2]);
@@ -525,25 +812,159 @@ void VMCode_puts(void **code, int n) {
       i += 1;
 #endif
 
-    } else if (code[i] == CodeAddr[OP_CNCTGN]) {
+    } else if (op == CodeAddr[OP_CNCTGN]) {
       printf("cnctgn reg%lu reg%lu\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2]);
       i += 2;
 
-    } else if (code[i] == CodeAddr[OP_SUBSTGN]) {
+    } else if (op == CodeAddr[OP_SUBSTGN]) {
       printf("substgn reg%lu reg%lu\n", (unsigned long)code[i + 1],
              (unsigned long)code[i + 2]);
       i += 2;
 
-    } else if (code[i] == CodeAddr[OP_NOP]) {
+    } else if (op == CodeAddr[OP_NATIVE]) {
+      printf("native %p\n", code[i + 1]);
+      i += 1;
+
+    } else if (op == CodeAddr[OP_NOP]) {
       puts("nop");
 
     } else {
-      printf("code %lu\n", (unsigned long)code[i]);
+      printf("code %lu\n", (unsigned long)op);
     }
   }
 }
 
+// ------------------------------------------------------
+//  Chains of names, shortcut by PUSH
+// ------------------------------------------------------
+
+VALUE VM_Shortcut_Name(VirtualMachine *vm, VALUE a) {
+  do {
+    VALUE next = NAME(a)->port;
+    myfree(a);
+    a = next;
+    vm->name_shortcuts++;
+  } while ((!IS_FIXNUM(a)) && (IS_LOCAL_NAMEID(BASIC(a)->id)) &&
+           (NAME(a)->port != VALUE_NULL));
+  return a;
+}
+
+// ------------------------------------------------------
+//  Run statistics for each top-level net
+// ------------------------------------------------------
+
+void VM_Clear_RunStats(VirtualMachine *vm) {
+  vm->eqStack_high_water = VM_EQStack_Num(vm);
+  vm->name_chains = vm->name_shortcuts = 0;
+#if defined(EXPANDABLE_HEAP) || defined(FLEX_EXPANDABLE_HEAP)
+  vm->agentHeap.expansions = vm->nameHeap.expansions = 0;
+#  ifdef AGENT_SIZE_CLASS
+  vm->smallAgentHeap.expansions = 0;
+#  endif
+#endif
+}
+
+// Cells may be freed by a VM other than the one that allocated them,
+// so allocations and frees are summed up over all VMs before subtraction.
+void VM_Get_MemoryUsage(VirtualMachine **vms, int n, MemoryUsage *usage) {
+  unsigned long agent_allocs = 0, agent_frees = 0;
+  unsigned long name_allocs = 0, name_frees = 0;
+
+  usage->agent_capacity = usage->name_capacity = 0;
+  for (int i = 0; i < n; i++) {
+    agent_allocs += vms[i]->agentHeap.allocs;
+    agent_frees += vms[i]->agentHeap.frees;
+    usage->agent_capacity += vms[i]->agentHeap.capacity;
+#ifdef AGENT_SIZE_CLASS
+    agent_allocs += vms[i]->smallAgentHeap.allocs;
+    agent_frees += vms[i]->smallAgentHeap.frees;
+    usage->agent_capacity += vms[i]->smallAgentHeap.capacity;
+#endif
+    name_allocs += vms[i]->nameHeap.allocs;
+    name_frees += vms[i]->nameHeap.frees;
+    usage->name_capacity += vms[i]->nameHeap.capacity;
+  }
+
+  // Counters of other running VMs may be read in the middle of updates.
+  usage->agents = (agent_allocs > agent_frees) ? agent_allocs - agent_frees : 0;
+  usage->names = (name_allocs > name_frees) ? name_allocs - name_frees : 0;
+}
+
+#ifdef REMOTE_FREE
+void VM_Drain_RemoteFree(VirtualMachine *vm) {
+  Heap_Drain_RemoteFree_forAgent(&vm->agentHeap);
+  Heap_Drain_RemoteFree_forName(&vm->nameHeap);
+#  ifdef AGENT_SIZE_CLASS
+  Heap_Drain_RemoteFree_forSmallAgent(&vm->smallAgentHeap);
+#  endif
+}
+#endif
+
+#ifdef FLEX_EXPANDABLE_HEAP
+// Hoops are scanned only when most of their cells are free,
+// since a free hoop is rare otherwise.
+#  define HEAP_SHRINK_RATIO 4
+
+void VM_Shrink_Heaps(VirtualMachine **vms, int n) {
+  MemoryUsage usage;
+  VM_Get_MemoryUsage(vms, n, &usage);
+
+#  ifdef REMOTE_FREE
+  // Cells waiting in remote-free lists would keep their hoops.
+  for (int i = 0; i < n; i++) {
+    VM_Drain_RemoteFree(vms[i]);
+  }
+#  endif
+
+  if (usage.agent_capacity > (unsigned long)n * Hoop_retained_size &&
+      usage.agents * HEAP_SHRINK_RATIO < usage.agent_capacity) {
+    unsigned long released = 0;
+    for (int i = 0; i < n; i++) {
+      released += Heap_Shrink_forAgent(&vms[i]->agentHeap);
+#  ifdef AGENT_SIZE_CLASS
+      released += Heap_Shrink_forSmallAgent(&vms[i]->smallAgentHeap);
+#  endif
+    }
+
+#  ifdef VERBOSE_HOOP_EXPANSION
+    if (released > 0) {
+      printf("(%lu agent hoops are released)\n", released);
+    }
+#  endif
+#  ifdef HEAP_FREELIST
+    // Free lists of any VM may have cells in the released hoops,
+    // and the cells of the kept hoops are put first.
+    for (int i = 0; i < n; i++) {
+      Heap_Rebuild_FreeList_forAgent(&vms[i]->agentHeap);
+#    ifdef AGENT_SIZE_CLASS
+      Heap_Rebuild_FreeList_forSmallAgent(&vms[i]->smallAgentHeap);
+#    endif
+    }
+#  endif
+  }
+
+  if (usage.name_capacity > (unsigned long)n * Hoop_retained_size &&
+      usage.names * HEAP_SHRINK_RATIO < usage.name_capacity) {
+    unsigned long released = 0;
+    for (int i = 0; i < n; i++) {
+      released += Heap_Shrink_forName(&vms[i]->nameHeap);
+    }
+
+#  ifdef VERBOSE_HOOP_EXPANSION
+    if (released > 0) {
+      printf("(%lu name hoops are released)\n", released);
+    }
+#  endif
+#  ifdef HEAP_FREELIST
+    for (int i = 0; i < n; i++) {
+      Heap_Rebuild_FreeList_forName(&vms[i]->nameHeap);
+    }
+#  endif
+  }
+}
+#endif
+
 #ifdef COUNT_INTERACTION
 // ------------------------------------------------------
 //  Count for Interaction operation
@@ -556,4 +977,114 @@ unsigned long VM_Get_InteractionCount(VirtualMachine *vm) {
 void VM_Clear_InteractionCount(VirtualMachine *vm) {
   vm->count_interaction = 0;
 }
-#endif
\ No newline at end of file
+#endif
+#ifdef PROFILE_RULES
+// ------------------------------------------------------
+//  Profile of active pairs: -fprofile-rules
+// ------------------------------------------------------
+
+#  define PROFILE_DUMP_FILE "inpla.prof"
+
+void VM_Profile_init(VirtualMachine *vm) {
+  vm->profile = calloc((NUM_AGENTS) * (NUM_AGENTS), sizeof(ProfileEntry));
+  if (vm->profile == NULL) {
+    printf("[ProfileTable] Malloc error\n");
+    exit(-1);
+  }
+  vm->profile_current = NULL;
+}
+
+typedef struct {
+  int idL, idR;
+  ProfileEntry e;
+} ProfileRecord;
+
+static int cmp_ProfileRecord(const void *a, const void *b) {
+  const ProfileRecord *p = a, *q = b;
+  if (p->e.cycles != q->e.cycles)
+    return (p->e.cycles < q->e.cycles) ? 1 : -1;
+  if (p->e.count != q->e.count)
+    return (p->e.count < q->e.count) ? 1 : -1;
+  return 0;
+}
+
+static char *Profile_get_name(int id) {
+  char *name = IdTable_get_name(id);
+  return (name == NULL) ? "?" : name;
+}
+
+// The counters of the given VMs are merged,
+// then put as a table sorted by cycles, and dumped into `inpla.prof'.
+void VM_Profile_puts(VirtualMachine **vms, int n) {
+  ProfileRecord *records = NULL;
+  int records_num = 0, records_size = 0;
+  unsigned long total_count = 0;
+  unsigned long long total_cycles = 0;
+
+  for (int i = 0; i < (NUM_AGENTS) * (NUM_AGENTS); i++) {
+    ProfileEntry e = {0, 0, 0, 0};
+    for (int j = 0; j < n; j++) {
+      if (vms[j]->profile == NULL)
+        continue;
+      e.count += vms[j]->profile[i].count;
+      e.agents += vms[j]->profile[i].agents;
+      e.names += vms[j]->profile[i].names;
+      e.cycles += vms[j]->profile[i].cycles;
+    }
+    if (e.count == 0)
+      continue;
+
+    if (records_num == records_size) {
+      records_size = (records_size == 0) ? 64 : records_size * 2;
+      records = realloc(records, sizeof(ProfileRecord) * records_size);
+      if (records == NULL) {
+        printf("[ProfileTable] Malloc error\n");
+        exit(-1);
+      }
+    }
+    records[records_num].idL = i / (NUM_AGENTS);
+    records[records_num].idR = i % (NUM_AGENTS);
+    records[records_num].e = e;
+    records_num++;
+
+    total_count += e.count;
+    total_cycles += e.cycles;
+  }
+
+  if (records_num > 0) {
+    qsort(records, records_num, sizeof(ProfileRecord), cmp_ProfileRecord);
+  }
+
+  printf("\nProfile of active pairs (sorted by cycles):\n");
+  printf("%12s %12s %12s %16s %6s  %s\n", "interactions", "agents", "names",
+         "cycles", "%", "active pair");
+  for (int i = 0; i < records_num; i++) {
+    ProfileRecord *r = &records[i];
+    printf("%12lu %12lu %12lu %16llu %6.2f  %s >< %s\n", r->e.count,
+           r->e.agents, r->e.names, r->e.cycles,
+           (total_cycles == 0) ? 0.0 : 100.0 * r->e.cycles / total_cycles,
+           Profile_get_name(r->idL), Profile_get_name(r->idR));
+  }
+  printf("%12lu %12s %12s %16llu %6s  total\n", total_count, "", "",
+         total_cycles, "");
+
+  FILE *fp = fopen(PROFILE_DUMP_FILE, "w");
+  if (fp == NULL) {
+    printf("Error: The profile could not be written into `%s'.\n",
+           PROFILE_DUMP_FILE);
+    free(records);
+    return;
+  }
+  fprintf(fp, "# idL\tnameL\tidR\tnameR\tinteractions\tagents\tnames\tcycles\n");
+  for (int i = 0; i < records_num; i++) {
+    ProfileRecord *r = &records[i];
+    fprintf(fp, "%d\t%s\t%d\t%s\t%lu\t%lu\t%lu\t%llu\n", r->idL,
+            Profile_get_name(r->idL), r->idR, Profile_get_name(r->idR),
+            r->e.count, r->e.agents, r->e.names, r->e.cycles);
+  }
+  fclose(fp);
+  printf("(The profile is also written into `%s'.)\n", PROFILE_DUMP_FILE);
+
+  free(records);
+}
+#endif
@@ -5,10 +5,10 @@
 #include "name_table.h"
 #include "types.h"
 
+// The first number of registers of each VM.
+// It is enlarged to VM_RegSize when compiled codes use more registers.
 #define VM_REG_SIZE 64
 
-#define MAX_VMCODE_SEQUENCE 1024
-
 // reg0 is used to store comparison results
 // so, others have to be used from reg1
 /*
@@ -26,26 +26,84 @@
 #define VM_OFFSET_ANNOTATE_R   (1 + MAX_PORT * 2 + 1)
 #define VM_OFFSET_LOCALVAR     (VM_OFFSET_ANNOTATE_R + 1)
 
+#ifdef PROFILE_RULES
+// Counters of an active pair for -fprofile-rules
+typedef struct {
+  unsigned long count;         // interactions
+  unsigned long agents, names; // allocated by the interactions
+  unsigned long long cycles;   // approximately, until the next pair
+} ProfileEntry;
+#endif
+
+#ifdef THREAD
+// Circular buffer of a work-stealing deque.
+// Buffers replaced by expansion are kept in `retired' because stealing VMs
+// may still read them. They are freed after each net by
+// VM_EQStack_FreeRetired.
+typedef struct EQDeque_tag {
+  long mask; // size-1, where the size is a power of two
+  struct EQDeque_tag *retired;
+  EQ buf[];
+} EQDeque;
+#endif
+
 typedef struct {
   // Heaps for agents and names
   Heap agentHeap, nameHeap;
+#ifdef AGENT_SIZE_CLASS
+  Heap smallAgentHeap;
+#endif
 
+#ifndef THREAD
   // EQStack
   EQ *eqStack;
   int nextPtr_eqStack;
   int eqStack_size;
+#else
+  // EQStack as a Chase-Lev work-stealing deque:
+  // the owner pushes and pops equations at the bottom,
+  // and the other VMs steal them from the top.
+  EQDeque *volatile eqDeque;
+  volatile long eqDeque_bottom;
+  volatile long eqDeque_top __attribute__((aligned(64)));
+#endif
+
+  // For run statistics (--stats=json), cleared by VM_Clear_RunStats.
+  // They are written only by the owner, so they start a new cache line
+  // apart from eqDeque_top, which the other VMs update by CAS.
+  long eqStack_high_water // the maximum number of equations in the EQStack
+      __attribute__((aligned(64)));
+  unsigned long name_chains;    // E_JMPCNCT followed two names or more
+  unsigned long name_shortcuts; // bound names collapsed by SHORTCUT_NAME
 
 #ifdef COUNT_INTERACTION
   unsigned long count_interaction;
 #endif
 
+#ifdef PROFILE_RULES
+  // NUM_AGENTS x NUM_AGENTS entries, or NULL when -fprofile-rules is not given
+  ProfileEntry *profile;
+  ProfileEntry *profile_current; // the pair being reduced now
+  unsigned long long profile_start;
+#endif
+
   // register
   //  VALUE reg[VM_REG_SIZE+(MAX_PORT*2 + 2)];
   //  VALUE reg[VM_REG_SIZE];
   VALUE *reg;
+  int    reg_size;
 
 #ifdef THREAD
   unsigned int id;
+
+  // Placement by -Xplace, and the other VMs in the order to steal from:
+  // those on the same node first.
+  int  cpu, node;
+  int *victims;
+
+  // Idle time in usec: spinning (and yielding) and parked
+  unsigned long long spin_time, park_time;
+  unsigned long long park_start;
 #endif
 
 } VirtualMachine;
@@ -114,12 +172,34 @@ typedef enum {
   OP_LOOP_RREC_FREE_R,
   OP_LOOP_RREC1_FREE_R,
   OP_LOOP_RREC2_FREE_R,
+  OP_JMPCNCT_RULE,
+  OP_TAILCALL,
+  OP_TAILCALL_FREE_R,
 
   // Connection operation for global names of given nets in the interactive
   // mode.
   OP_CNCTGN,
   OP_SUBSTGN,
 
+  // Call of a rule translated into C by `--emit-c'.
+  OP_NATIVE,
+
+  // Superinstructions made by CmEnv_fuse_VMCode.
+  // Each replaces the first opcode of a frequent pair, e.g. LOADP+LOADP.
+  // The second opcode stays in place, so jumps to it work as before.
+  OP_LOADP_LOADP,
+  OP_MKAGENT_LOADP,
+  OP_MKNAME_LOADP,
+  OP_LOADP_PUSH,
+  OP_LOADP_L_PUSH,
+  OP_LOADP_R_PUSH,
+  OP_PUSH_RET_FREE_LR,
+  OP_LT_R0_JMPEQ0_R0,
+  OP_LE_R0_JMPEQ0_R0,
+  OP_EQ_R0_JMPEQ0_R0,
+  OP_EQI_R0_JMPEQ0_R0,
+  OP_NE_R0_JMPEQ0_R0,
+
   // This corresponds to the last code in CodeAddr.
   // So ones after this are not used for execution by virtual machines.
   OP_NOP,
@@ -139,6 +219,65 @@ typedef enum {
 #  define COUNTUP_INTERACTION(vm)
 #endif
 
+#ifdef PROFILE_RULES
+#  if defined(__x86_64__) || defined(__i386__)
+#    include <x86intrin.h>
+#    define PROFILE_CLOCK() __rdtsc()
+#  else
+#    include <time.h>
+static inline unsigned long long PROFILE_CLOCK(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#  endif
+
+// Cycles until the next active pair are attributed to the current one.
+static inline void VM_Profile_pair(VirtualMachine *restrict vm, int idL,
+                                   int idR) {
+  unsigned long long now = PROFILE_CLOCK();
+  if (vm->profile_current != NULL) {
+    vm->profile_current->cycles += now - vm->profile_start;
+  }
+  vm->profile_current = &vm->profile[idL * (NUM_AGENTS) + idR];
+  vm->profile_current->count++;
+  vm->profile_start = now;
+}
+
+static inline void VM_Profile_stop(VirtualMachine *restrict vm) {
+  if (vm->profile_current != NULL) {
+    vm->profile_current->cycles += PROFILE_CLOCK() - vm->profile_start;
+    vm->profile_current = NULL;
+  }
+}
+
+#  define PROFILE_PAIR(vm, idL, idR)                                           \
+    do {                                                                       \
+      if (vm->profile != NULL) {                                               \
+        VM_Profile_pair(vm, idL, idR);                                         \
+      }                                                                        \
+    } while (0)
+#  define PROFILE_STOP(vm)                                                     \
+    do {                                                                       \
+      if (vm->profile != NULL) {                                               \
+        VM_Profile_stop(vm);                                                   \
+      }                                                                        \
+    } while (0)
+#  define PROFILE_COUNTUP(vm, field)                                           \
+    do {                                                                       \
+      if (vm->profile_current != NULL) {                                       \
+        vm->profile_current->field++;                                          \
+      }                                                                        \
+    } while (0)
+
+void VM_Profile_init(VirtualMachine *vm);
+void VM_Profile_puts(VirtualMachine **vms, int n);
+#else
+#  define PROFILE_PAIR(vm, idL, idR) do {} while (0)
+#  define PROFILE_STOP(vm)           do {} while (0)
+#  define PROFILE_COUNTUP(vm, field) do {} while (0)
+#endif
+
 #ifdef COUNT_MKAGENT
 unsigned int NumberOfMkAgent;
 #endif
@@ -153,6 +292,9 @@ extern VirtualMachine VM;
 #ifndef THREAD
 void sweep_AgentHeap(Heap *hp);
 void sweep_NameHeap(Heap *hp);
+#  ifdef AGENT_SIZE_CLASS
+void sweep_SmallAgentHeap(Heap *hp);
+#  endif
 void mark_and_sweep(void);
 #endif
 
@@ -165,8 +307,184 @@ void VM_InitBuffer(VirtualMachine *restrict vm, int size);
 void VM_EQStack_Init(VirtualMachine *restrict vm, int size);
 void VM_EQStack_Push(VirtualMachine *restrict vm, VALUE l, VALUE r);
 int  VM_EQStack_Pop(VirtualMachine *restrict vm, VALUE *l, VALUE *r);
+#ifdef THREAD
+int VM_EQStack_Steal(VirtualMachine *restrict vm, VALUE *l, VALUE *r);
+
+// Frees the buffers replaced by expansion.
+// It must be called while no VM is running.
+void VM_EQStack_FreeRetired(VirtualMachine *vm);
+
+static inline long VM_EQStack_Num(VirtualMachine *vm) {
+  return vm->eqDeque_bottom - vm->eqDeque_top;
+}
+#else
+static inline long VM_EQStack_Num(VirtualMachine *vm) {
+  return vm->nextPtr_eqStack + 1;
+}
+#endif
+
+void VM_Clear_RunStats(VirtualMachine *vm);
+
+// Memory usage merged over VMs, from the counters of the heaps.
+// It can be taken during execution, then the numbers are approximate.
+typedef struct {
+  unsigned long agents, names;                 // cells in use
+  unsigned long agent_capacity, name_capacity; // cells in the hoops
+} MemoryUsage;
+
+void VM_Get_MemoryUsage(VirtualMachine **vms, int n, MemoryUsage *usage);
+
+#ifdef REMOTE_FREE
+// Takes back the cells of the VM freed by the other threads.
+// It is called by the thread of the VM, or while no VM is running.
+void VM_Drain_RemoteFree(VirtualMachine *vm);
+#endif
+
+#ifdef FLEX_EXPANDABLE_HEAP
+// Gives hoops that became free back to the OS after a net is reduced.
+// It must be called while no VM is running.
+void VM_Shrink_Heaps(VirtualMachine **vms, int n);
+#endif
+
+// Follows local names bound already from the given one, freeing them,
+// and returns the term at the end.
+VALUE VM_Shortcut_Name(VirtualMachine *vm, VALUE a);
+
+// A local name that is bound already is not connected as it is,
+// but replaced with the term it is bound to and freed, so that connections
+// make fewer chains of names to be followed by E_JMPCNCT and eval_equation.
+// Global names are kept for eval_equation, which erases them from NameTable.
+#define SHORTCUT_NAME(vm, a)                                                   \
+  if ((!IS_FIXNUM(a)) && (IS_LOCAL_NAMEID(BASIC(a)->id)) &&                    \
+      (NAME(a)->port != VALUE_NULL)) {                                         \
+    a = VM_Shortcut_Name(vm, a);                                               \
+  }
+
+// The same as SHORTCUT_NAME for a name known to be bound.
+#define SHORTCUT_BOUND_NAME(vm, a)                                             \
+  if (IS_LOCAL_NAMEID(BASIC(a)->id)) {                                         \
+    a = VM_Shortcut_Name(vm, a);                                               \
+  }
+
+// Connection of two terms, used by rule codes
+// in exec_code and the translated ones by `--emit-c'.
+#ifndef THREAD
+#  define MYPUSH(vm, a1, a2)                                                   \
+    do {                                                                       \
+      VALUE push_a1 = (a1), push_a2 = (a2);                                    \
+      if ((!IS_FIXNUM(push_a1)) && (IS_NAMEID(BASIC(push_a1)->id))) {          \
+        if (NAME(push_a1)->port == VALUE_NULL) {                               \
+          NAME(push_a1)->port = push_a2;                                       \
+          break;                                                               \
+        }                                                                      \
+        SHORTCUT_BOUND_NAME(vm, push_a1);                                      \
+      }                                                                        \
+      if ((!IS_FIXNUM(push_a2)) && (IS_LOCAL_NAMEID(BASIC(push_a2)->id))) {    \
+        if (NAME(push_a2)->port == VALUE_NULL) {                               \
+          NAME(push_a2)->port = push_a1;                                       \
+          break;                                                               \
+        }                                                                      \
+        SHORTCUT_BOUND_NAME(vm, push_a2);                                      \
+      }                                                                        \
+      VM_EQStack_Push(vm, push_a1, push_a2);                                   \
+    } while (0)
+#else
+#  define MYPUSH(vm, a1, a2)                                                   \
+    do {                                                                       \
+      VALUE push_a1 = (a1), push_a2 = (a2);                                    \
+      if ((!IS_FIXNUM(push_a1)) && (IS_NAMEID(BASIC(push_a1)->id))) {          \
+        if (NAME(push_a1)->port == VALUE_NULL) {                               \
+          if (!(__sync_bool_compare_and_swap(&(NAME(push_a1)->port), NULL,     \
+                                             push_a2))) {                      \
+            VM_EQStack_Push(vm, push_a1, push_a2);                             \
+          }                                                                    \
+          break;                                                               \
+        }                                                                      \
+        SHORTCUT_BOUND_NAME(vm, push_a1);                                      \
+      }                                                                        \
+      if ((!IS_FIXNUM(push_a2)) && (IS_NAMEID(BASIC(push_a2)->id))) {          \
+        if (NAME(push_a2)->port == VALUE_NULL) {                               \
+          if (!(__sync_bool_compare_and_swap(&(NAME(push_a2)->port), NULL,     \
+                                             push_a1))) {                      \
+            VM_EQStack_Push(vm, push_a1, push_a2);                             \
+          }                                                                    \
+          break;                                                               \
+        }                                                                      \
+        SHORTCUT_BOUND_NAME(vm, push_a2);                                      \
+      }                                                                        \
+      VM_EQStack_Push(vm, push_a1, push_a2);                                   \
+    } while (0)
+#endif
+
+/*
+  ===TODO===
+  2021/9/18
+  a2->t であるところに a1->a2 が与えられても a2->t, a1->a2 のままにしてある。
+  a2 がここで解放できればメモリ利用が助かるのでは？
+  仮に助からないとしても、グローバル環境で与えられたネットの場合には
+  単純に eval_equation へ持ち込んだ方が、indirection を生成しなくて済むのでは？
+
+  ==>
+  DONE 21 September 2021
+  誤差程度しか変わらない。
+
+ */
+#ifndef THREAD
+#  define PUSH(vm, a1, a2)                                                     \
+    do {                                                                       \
+      VALUE push_a1 = (a1), push_a2 = (a2);                                    \
+      if ((!IS_FIXNUM(push_a1)) && (IS_NAMEID(BASIC(push_a1)->id))) {          \
+        if (NAME(push_a1)->port == VALUE_NULL) {                               \
+          NAME(push_a1)->port = push_a2;                                       \
+          break;                                                               \
+        }                                                                      \
+        SHORTCUT_BOUND_NAME(vm, push_a1);                                      \
+      }                                                                        \
+      if ((!IS_FIXNUM(push_a2)) && (IS_NAMEID(BASIC(push_a2)->id))) {          \
+        if (NAME(push_a2)->port == VALUE_NULL) {                               \
+          NAME(push_a2)->port = push_a1;                                       \
+          break;                                                               \
+        }                                                                      \
+        SHORTCUT_BOUND_NAME(vm, push_a2);                                      \
+      }                                                                        \
+      VM_EQStack_Push(vm, push_a1, push_a2);                                   \
+    } while (0)
+#else
+#  define PUSH(vm, a1, a2)                                                     \
+    do {                                                                       \
+      VALUE push_a1 = (a1), push_a2 = (a2);                                    \
+      if ((!IS_FIXNUM(push_a1)) && (IS_NAMEID(BASIC(push_a1)->id))) {          \
+        if (NAME(push_a1)->port == VALUE_NULL) {                               \
+          if (!(__sync_bool_compare_and_swap(&(NAME(push_a1)->port), NULL,     \
+                                             push_a2))) {                      \
+            VM_EQStack_Push(vm, NAME(push_a1)->port, push_a2);                 \
+            free_Name(push_a1);                                                \
+          }                                                                    \
+          break;                                                               \
+        }                                                                      \
+        SHORTCUT_BOUND_NAME(vm, push_a1);                                      \
+      }                                                                        \
+      if ((!IS_FIXNUM(push_a2)) && (IS_NAMEID(BASIC(push_a2)->id))) {          \
+        if (NAME(push_a2)->port == VALUE_NULL) {                               \
+          if (!(__sync_bool_compare_and_swap(&(NAME(push_a2)->port), NULL,     \
+                                             push_a1))) {                      \
+            VM_EQStack_Push(vm, push_a1, NAME(push_a2)->port);                 \
+            free_Name(push_a2);                                                \
+          }                                                                    \
+          break;                                                               \
+        }                                                                      \
+        SHORTCUT_BOUND_NAME(vm, push_a2);                                      \
+      }                                                                        \
+      VM_EQStack_Push(vm, push_a1, push_a2);                                   \
+    } while (0)
+#endif
+
 void VMCode_puts(void **code, int n);
 
+extern int VM_RegSize;
+void       VM_Reg_Reserve(int size);
+void       VM_Reg_Fit(VirtualMachine *vm);
+
 #ifdef COUNT_INTERACTION
 unsigned long VM_Get_InteractionCount(VirtualMachine *vm);
 void          VM_Clear_InteractionCount(VirtualMachine *vm);
@@ -176,12 +494,18 @@ void          VM_Clear_InteractionCount(VirtualMachine *vm);
 inline void VM_Init(VirtualMachine *restrict vm, unsigned int eqStackSize) {
   VM_Buffer_Init(vm);
   VM_EQStack_Init(vm, eqStackSize);
+#  ifdef PROFILE_RULES
+  vm->profile = vm->profile_current = NULL;
+#  endif
 }
 #else
 inline void VM_Init(VirtualMachine *restrict vm, unsigned int agentBufferSize,
                     unsigned int eqStackSize) {
   VM_InitBuffer(vm, agentBufferSize);
   VM_EQStack_Init(vm, eqStackSize);
+#  ifdef PROFILE_RULES
+  vm->profile = vm->profile_current = NULL;
+#  endif
 }
 #endif
 
@@ -0,0 +1,30 @@
+#!/usr/bin/env python3
+# Checks that hoops are given back after a large net is freed.
+#
+# usage: heap_shrink.py INPLA heap_shrink.in
+#
+# The program puts `memstat' after the large net, after freeing it, and
+# after small nets. The capacities of agents and names must go down by
+# the free, and must not grow again by the small nets.
+
+import re
+import subprocess
+import sys
+
+CAPACITY = re.compile(r"\(capacity: (\d+) and (\d+)\)")
+
+inpla, prog = sys.argv[1], sys.argv[2]
+proc = subprocess.run([inpla, "-Xkeep", "12", "-f", prog],
+                      stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+out = proc.stdout.decode(errors="replace")
+caps = [(int(a), int(n)) for a, n in CAPACITY.findall(out)]
+
+if proc.returncode != 0 or len(caps) < 3:
+    sys.exit(out)
+
+large, freed = caps[0], caps[1]
+if not (freed[0] < large[0] and freed[1] < large[1]):
+    sys.exit("The capacity did not go down after free:\n" + out)
+for cap in caps[2:]:
+    if cap != freed:
+        sys.exit("The capacity changed after small nets:\n" + out)
@@ -0,0 +1,29 @@
+#!/usr/bin/env python3
+# Checks that -finline-rules does not change the results
+# when inlined rules are redefined.
+#
+# usage: inline_redefine.py INPLA inline_redefine.in
+#
+# The lines of interactions differ by the inlining, so they are ignored.
+
+import subprocess
+import sys
+
+inpla, prog = sys.argv[1], sys.argv[2]
+
+
+def run(*opts):
+    proc = subprocess.run([inpla, *opts, "-f", prog],
+                          stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    out = proc.stdout.decode(errors="replace")
+    if proc.returncode != 0:
+        sys.exit(out)
+    return [line for line in out.splitlines()[1:]
+            if "interactions" not in line]
+
+
+expected = run()
+actual = run("-finline-rules")
+if actual != expected:
+    sys.exit("Expected:\n" + "\n".join(expected) +
+             "\nbut -finline-rules gave:\n" + "\n".join(actual))
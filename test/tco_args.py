@@ -0,0 +1,28 @@
+#!/usr/bin/env python3
+# Checks that -foptimise-tail-calls does not change the results.
+#
+# usage: tco_args.py INPLA tco_args.in
+#
+# The lines of interactions differ by the optimisation, so they are ignored.
+
+import subprocess
+import sys
+
+inpla, prog = sys.argv[1], sys.argv[2]
+
+
+def run(*opts):
+    proc = subprocess.run([inpla, *opts, "-f", prog],
+                          stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    out = proc.stdout.decode(errors="replace")
+    if proc.returncode != 0:
+        sys.exit(out)
+    return [line for line in out.splitlines()[1:]
+            if "interactions" not in line]
+
+
+expected = run()
+actual = run("-foptimise-tail-calls")
+if actual != expected:
+    sys.exit("Expected:\n" + "\n".join(expected) +
+             "\nbut -foptimise-tail-calls gave:\n" + "\n".join(actual))
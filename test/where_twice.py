@@ -0,0 +1,24 @@
+#!/usr/bin/env python3
+# Checks the values of `where' bindings read more than once in a net.
+#
+# usage: where_twice.py INPLA where_twice.in
+#
+# The lines of interactions are ignored.
+
+import subprocess
+import sys
+
+EXPECTED = ["8", "8", "6", "4", "10", "4", "4", "4"]
+
+inpla, prog = sys.argv[1], sys.argv[2]
+proc = subprocess.run([inpla, "-f", prog],
+                      stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+out = proc.stdout.decode(errors="replace")
+if proc.returncode != 0:
+    sys.exit(out)
+
+actual = [line for line in out.splitlines()[1:]
+          if "interactions" not in line]
+if actual != EXPECTED:
+    sys.exit("Expected:\n" + "\n".join(EXPECTED) + "\nbut got:\n" +
+             "\n".join(actual))